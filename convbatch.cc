@@ -0,0 +1,555 @@
+/***********************************************************************************
+ * FILENAME:        convbatch.cc
+ *
+ * DESCRIPTION:     Filters every matrix named in a manifest in one process,
+ *                  on one warm worker_pool.
+ *
+ *                  The work is a pipeline of three threads. A reader reads
+ *                  the files ahead in manifest order, the main thread
+ *                  filters each one once it has been read, and a writer
+ *                  writes or prints the results in manifest order. Each
+ *                  matrix is charged the memory of its values and its
+ *                  result from when the reader starts on it until the writer
+ *                  is done with it, and the reader waits while starting the
+ *                  next one would go over the limit. A matrix larger than
+ *                  the limit is still filtered, alone.
+ *
+ * ARGUMENTS:       manifest    - the file listing the matrices to filter
+ *                  numThreads  - the number of threads in the pool
+ *
+ * OPTIONS:         --memory-mb n - the most matrix data in flight, 1024 by
+ *                                default
+ *                  --cache dir - the result cache of resultcache.h, shared
+ *                                with convolution. The reader hashes each
+ *                                matrix as it reads it, and a matrix filtered
+ *                                the same way before takes its result from
+ *                                the cache. $CONVOLUTION_CACHE by default
+ *                  --cache-mb n - the most the cache may hold, 1024 by default
+ *
+ * MANIFEST:        One matrix per line, in the request format of serve.h:
+ *                  tab separated words, the binary matrix file and the depth
+ *                  followed by any of
+ *                      mode=name border=name engine=name sigma=x threads=n
+ *                      output=file
+ *                  Results without an output file are printed. Blank lines
+ *                  and lines starting with # are skipped, and relative paths
+ *                  are relative to the manifest's directory.
+ *
+ * USAGE:           Compile the program using the makefile
+ *                      > make convbatch
+ *
+ *                  You can then run it with
+ *                      > ./convbatch [options] [manifest] [numThreads]
+***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <fstream>      // Used for reading the manifest
+#include <string>       // Strings
+#include <vector>       // Used for the manifest items
+#include <fcntl.h>      // Used for file reading
+#include <getopt.h>     // Used for option parsing
+#include "matrix.h"     // Used for matrix operations
+#include "engine.h"     // Used for the threaded filter engine
+#include "matrixfile.h" // Used for reading and writing matrix files
+#include "serve.h"      // Used for the manifest line format
+#include "resultcache.h" // Used for caching results
+
+using namespace std;
+
+// One manifest line and what has become of it
+struct batch_item {
+    int line;                   // Its line in the manifest
+    serve_request request;
+    matrix_header header;
+    void* matrix;               // A T** of the file's values, once read
+    void* result;               // A T** of the filtered values, once computed
+    double minValue;
+    double maxValue;
+    size_t bytes;               // The size of the values, and of the result
+    result_key key;             // What its result is cached under, once read
+    bool cached;                // Whether its result came from the cache
+    double seconds;             // Time spent filtering
+    string error;               // Why it failed, empty if it hasn't
+};
+
+// What the three stages share
+struct batch_pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     // Broadcast whenever a stage moves on
+    vector<batch_item> items;
+    size_t read;                // Items through each stage, in order
+    size_t computed;
+    size_t written;
+    size_t inFlight;            // Bytes charged to items not yet written
+    size_t limit;
+    size_t peak;
+    worker_pool pool;
+    result_cache cache;
+};
+
+/***********************************************************************************
+ * NAME:            PrintUsage
+ *
+ * DESCRIPTION:     Prints the command line usage of the program
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvbatch [options] [manifest] [numThreads]" << endl;
+    cout << "Options:" << endl;
+    cout << "\t--memory-mb n\tthe most matrix data in flight, 1024 by default" << endl;
+    cout << "\t--cache dir\treuse results filtered before, $CONVOLUTION_CACHE by";
+    cout << " default" << endl;
+    cout << "\t--cache-mb n\tthe most the cache may hold, 1024 by default" << endl;
+    cout << "Manifest lines are tab separated: file depth [mode=name] [border=name]";
+    cout << endl << "\t[engine=name] [sigma=x] [threads=n] [output=file]" << endl;
+}
+
+/***********************************************************************************
+ * NAME:            ProcessArguments
+ *
+ * DESCRIPTION:     Used to process and check the validity of the programs
+ *                  command line arguments.
+ *
+ * PARAMETERS:      int     :   argc    -   number of command line arguments
+ *                  char**  :   argv    -   the command line arguments
+ *                  string* :   manifest    -   variable to store the manifest
+ *                  int*    :   nTh     -   variable to store number of threads
+ *                  size_t* :   memoryBytes -   variable to store the memory limit
+ *                  result_cache*   :   cache   -   variable to store the result
+ *                                                  cache and its size cap
+ *
+ * RETURNS:         Void, but exits the program if incorrect values have been
+ *                  given
+ **********************************************************************************/
+void ProcessArguments (int argc, char** argv, string* manifest, int* nTh,
+                       size_t* memoryBytes, result_cache* cache) {
+    static struct option longOptions[] = {
+        {"memory-mb", required_argument, 0, 'M'},
+        {"cache", required_argument, 0, 'K'},
+        {"cache-mb", required_argument, 0, 'C'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    *memoryBytes = (size_t) 1024 << 20;
+    cache->dir = DefaultResultCache();
+    cache->limit = (size_t) RESULT_CACHE_MB << 20;
+
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'M':
+                if (atol(optarg) <= 0) {
+                    cout << "[ERROR] --memory-mb takes a positive number, not '" << optarg;
+                    cout << "'" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                *memoryBytes = (size_t) atol(optarg) << 20;
+                break;
+            case 'K':
+                cache->dir = optarg;
+                break;
+            case 'C':
+                if (atol(optarg) <= 0) {
+                    cout << "[ERROR] --cache-mb takes a positive number, not '" << optarg;
+                    cout << "'" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                cache->limit = (size_t) atol(optarg) << 20;
+                break;
+            default:
+                PrintUsage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 2) {
+        cout << "[ERROR] Invalid number of arguments given." << endl;
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+    if (atoi(argv[optind + 1]) <= 0) {
+        cout << "[ERROR] numThreads must be an int > 0" << endl;
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    *manifest = argv[optind];
+    *nTh = atoi(argv[optind + 1]);
+}
+
+/***********************************************************************************
+ * NAME:            ReadManifest
+ *
+ * DESCRIPTION:     Reads every item of a manifest
+ *
+ * PARAMETERS:      const string&   :   manifest    -   the manifest file
+ *                  vector<batch_item>* :   items   -   variable to store the items
+ *
+ * RETURNS:         Void, but exits the program if the manifest can't be read
+ *                  or has a bad line
+ **********************************************************************************/
+void ReadManifest (const string& manifest, vector<batch_item>* items) {
+    ifstream in(manifest.c_str());
+    string line, error;
+    int number = 0;
+
+    if (!in) {
+        printf("[ERROR] Could not open manifest '%s'\n", manifest.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    while (getline(in, line)) {
+        batch_item item;
+
+        number++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        if (ParseRequest(line, &item.request, &error) != 0) {
+            printf("[ERROR] %s line %d: %s\n", manifest.c_str(), number, error.c_str());
+            exit(EXIT_FAILURE);
+        }
+        ResolveRequestPaths(&item.request, manifest);
+        item.line = number;
+        item.matrix = NULL;
+        item.result = NULL;
+        item.bytes = 0;
+        item.cached = false;
+        item.seconds = 0;
+        items->push_back(item);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            Charge
+ *
+ * DESCRIPTION:     Changes the bytes in flight and wakes any stage waiting
+ *                  for them. The lock must be held.
+ *
+ * PARAMETERS:      batch_pipeline* :   batch   -   the pipeline
+ *                  size_t  :   add     -   bytes taken on
+ *                  size_t  :   release -   bytes given back
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void Charge (batch_pipeline* batch, size_t add, size_t release) {
+    batch->inFlight += add;
+    batch->inFlight -= release;
+    batch->peak = batch->inFlight > batch->peak ? batch->inFlight : batch->peak;
+    pthread_cond_broadcast(&batch->changed);
+}
+
+/***********************************************************************************
+ * NAME:            ReadItem
+ *
+ * DESCRIPTION:     Reads an item's matrix with ReadMatrixRows, hashing it for
+ *                  its cache key when there is a cache
+ *
+ * PARAMETERS:      batch_pipeline* :   batch   -   the pipeline
+ *                  batch_item* :   item    -   the item to read
+ *                  int     :   fd      -   the open matrix file
+ *
+ * RETURNS:         Void, but sets item->error on failure
+ **********************************************************************************/
+template <typename T>
+void ReadItem (batch_pipeline* batch, batch_item* item, int fd) {
+    content_hash hash;
+    bool hashing = !batch->cache.dir.empty();
+
+    InitHash(&hash);
+    item->matrix = ReadMatrixRows<T>(fd, item->header, &item->minValue, &item->maxValue,
+                                     hashing ? &hash : NULL);
+    if (item->matrix == NULL) {
+        item->error = "could not read '" + item->request.file + "'";
+    } else if (hashing) {
+        item->key = MakeResultKey(FinishHash(&hash), item->header.type, item->header.rows,
+                                  item->header.cols, item->request.settings);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            ReadAhead
+ *
+ * DESCRIPTION:     Thread entry point for the reader. Reads each item in turn,
+ *                  waiting first while its memory would go over the limit.
+ *
+ * PARAMETERS:      void*   :   arguments   -   the batch_pipeline
+ *
+ * RETURNS:         void* - NULL
+ **********************************************************************************/
+void* ReadAhead (void* arguments) {
+    batch_pipeline* batch = (batch_pipeline*) arguments;
+
+    for (size_t i = 0; i < batch->items.size(); i++) {
+        batch_item* item = &batch->items[i];
+        int fd = open(item->request.file.c_str(), O_RDONLY);
+
+        if (fd == -1) {
+            item->error = "could not open '" + item->request.file + "'";
+        } else if (get_header(fd, &item->header) != 0) {
+            item->error = "could not get dimensions for '" + item->request.file + "'";
+        } else if (item->header.rows == 0 || item->header.cols == 0) {
+            item->error = "'" + item->request.file + "' does not hold any values";
+        } else {
+            item->bytes = (size_t) item->header.rows * item->header.cols *
+                          matrix_type_size(item->header.type);
+        }
+
+        // Only wait for memory when something else holds some
+        pthread_mutex_lock(&batch->lock);
+        while (batch->inFlight > 0 && batch->inFlight + 2 * item->bytes > batch->limit) {
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        }
+        Charge(batch, 2 * item->bytes, 0);
+        pthread_mutex_unlock(&batch->lock);
+
+        if (item->error.empty()) {
+            switch (item->header.type) {
+                case MATRIX_UINT8:  ReadItem<uint8_t>(batch, item, fd);    break;
+                case MATRIX_INT16:  ReadItem<int16_t>(batch, item, fd);    break;
+                case MATRIX_INT32:  ReadItem<int32_t>(batch, item, fd);    break;
+                case MATRIX_FLOAT:  ReadItem<float>(batch, item, fd);      break;
+                case MATRIX_DOUBLE: ReadItem<double>(batch, item, fd);     break;
+                default:
+                    item->error = "'" + item->request.file + "' holds values of an unknown";
+                    item->error += " type";
+            }
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+
+        pthread_mutex_lock(&batch->lock);
+        batch->read = i + 1;
+        pthread_cond_broadcast(&batch->changed);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            FilterItem
+ *
+ * DESCRIPTION:     Filters an item's matrix on the pool into a new result and
+ *                  frees the matrix. A result in the cache is read instead,
+ *                  if it was stored in the same type; convolution may have
+ *                  stored it narrowed.
+ *
+ * PARAMETERS:      batch_pipeline* :   batch   -   the pipeline
+ *                  batch_item* :   item    -   the item to filter
+ *
+ * RETURNS:         Void, but sets item->error on failure
+ **********************************************************************************/
+template <typename T>
+void FilterItem (batch_pipeline* batch, batch_item* item) {
+    T** matrix = (T**) item->matrix;
+    long rows = item->header.rows;
+    long cols = item->header.cols;
+    int threads = item->request.threads == 0 || item->request.threads > batch->pool.size ?
+                  batch->pool.size : item->request.threads;
+    filter_workspace<T> ws;
+    matrix_header cachedHeader;
+    int cachedFd;
+    T** result;
+
+    double start = MonotonicSeconds();
+    if ((cachedFd = FindResult(batch->cache, item->key, &cachedHeader)) != -1) {
+        double minValue, maxValue;
+
+        result = cachedHeader.type == item->header.type ?
+                 ReadMatrixRows<T>(cachedFd, cachedHeader, &minValue, &maxValue) : NULL;
+        close(cachedFd);
+        if (result != NULL) {
+            item->cached = true;
+            item->seconds = MonotonicSeconds() - start;
+            CleanupMatrix(matrix, rows);
+            item->matrix = NULL;
+            item->result = result;
+            return;
+        }
+    }
+
+    result = AllocateMatrix<T>(rows, cols);
+    InitWorkspace(&ws, rows, cols, item->request.settings, threads, item->minValue,
+                  item->maxValue);
+    ws.pool = &batch->pool;
+
+    if (FilterWithWorkspace(&ws, matrix, result, NULL, NULL, NULL) != 0) {
+        item->error = "the filter failed";
+    }
+    item->seconds = MonotonicSeconds() - start;
+    FreeWorkspace(&ws);
+
+    CleanupMatrix(matrix, rows);
+    item->matrix = NULL;
+    item->result = result;
+}
+
+/***********************************************************************************
+ * NAME:            WriteItem
+ *
+ * DESCRIPTION:     Writes an item's result to its output file, or prints it,
+ *                  adds it to the cache if it is new there and frees it. The
+ *                  result of a failed filter is only freed.
+ *
+ * PARAMETERS:      batch_pipeline* :   batch   -   the pipeline
+ *                  batch_item* :   item    -   the item to write
+ *
+ * RETURNS:         Void, but sets item->error on failure
+ **********************************************************************************/
+template <typename T>
+void WriteItem (batch_pipeline* batch, batch_item* item) {
+    T** result = (T**) item->result;
+    long rows = item->header.rows;
+    long cols = item->header.cols;
+
+    if (!item->error.empty()) {
+        // Nothing worth keeping
+    } else if (item->request.output.empty()) {
+        cout << "\nFiltered Matrix for '" << item->request.file << "'" << endl;
+        PrettyPrintMatrix(result, rows, cols);
+    } else if (WriteMatrixFile(item->request.output, result, rows, cols) != 0) {
+        item->error = "could not write '" + item->request.output + "'";
+    }
+    if (item->error.empty() && !item->cached &&
+        StoreResult(batch->cache, item->key, result, rows, cols) != 0) {
+        printf("Could not cache the result for '%s' in '%s'\n",
+               item->request.file.c_str(), batch->cache.dir.c_str());
+    }
+
+    CleanupMatrix(result, rows);
+    item->result = NULL;
+}
+
+/***********************************************************************************
+ * NAME:            WriteBehind
+ *
+ * DESCRIPTION:     Thread entry point for the writer. Writes each item once it
+ *                  has been filtered, reports how it went and gives back its
+ *                  memory.
+ *
+ * PARAMETERS:      void*   :   arguments   -   the batch_pipeline
+ *
+ * RETURNS:         void* - NULL
+ **********************************************************************************/
+void* WriteBehind (void* arguments) {
+    batch_pipeline* batch = (batch_pipeline*) arguments;
+
+    for (size_t i = 0; i < batch->items.size(); i++) {
+        batch_item* item = &batch->items[i];
+
+        pthread_mutex_lock(&batch->lock);
+        while (batch->computed <= i) {
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        }
+        pthread_mutex_unlock(&batch->lock);
+
+        if (item->result != NULL) {
+            switch (item->header.type) {
+                case MATRIX_UINT8:  WriteItem<uint8_t>(batch, item);   break;
+                case MATRIX_INT16:  WriteItem<int16_t>(batch, item);   break;
+                case MATRIX_INT32:  WriteItem<int32_t>(batch, item);   break;
+                case MATRIX_FLOAT:  WriteItem<float>(batch, item);     break;
+                case MATRIX_DOUBLE: WriteItem<double>(batch, item);    break;
+            }
+        }
+
+        if (item->error.empty()) {
+            filter_settings* settings = &item->request.settings;
+            printf("'%s' depth %d %s: %ldx%ld %s, %.6fs%s\n", item->request.file.c_str(),
+                   settings->depth, FilterModeName(settings->mode),
+                   (long) item->header.rows, (long) item->header.cols,
+                   matrix_type_name(item->header.type), item->seconds,
+                   item->cached ? " cached" : "");
+        } else {
+            printf("[ERROR] line %d: %s\n", item->line, item->error.c_str());
+        }
+        fflush(stdout);
+
+        // The values were given back when they were filtered
+        pthread_mutex_lock(&batch->lock);
+        batch->written = i + 1;
+        Charge(batch, 0, item->bytes);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            main
+ * DESCRIPTION:     Entrypoint for the program.
+ * PARAMETERS:      None
+ * RETURNS:         0 if every matrix was filtered, an error status otherwise.
+ **********************************************************************************/
+int main (int argc, char** argv) {
+    string manifest;
+    int numThreads;
+    size_t memoryBytes;
+    batch_pipeline batch;
+    pthread_t reader, writer;
+
+    ProcessArguments(argc, argv, &manifest, &numThreads, &memoryBytes, &batch.cache);
+    ReadManifest(manifest, &batch.items);
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+    batch.read = 0;
+    batch.computed = 0;
+    batch.written = 0;
+    batch.inFlight = 0;
+    batch.limit = memoryBytes;
+    batch.peak = 0;
+
+    if (StartPool(&batch.pool, numThreads) != 0 ||
+        pthread_create(&reader, NULL, ReadAhead, &batch) ||
+        pthread_create(&writer, NULL, WriteBehind, &batch)) {
+        printf("[ERROR] Could not start the threads\n");
+        return -1;
+    }
+
+    double start = MonotonicSeconds();
+    for (size_t i = 0; i < batch.items.size(); i++) {
+        batch_item* item = &batch.items[i];
+
+        pthread_mutex_lock(&batch.lock);
+        while (batch.read <= i) {
+            pthread_cond_wait(&batch.changed, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        if (item->matrix != NULL) {
+            switch (item->header.type) {
+                case MATRIX_UINT8:  FilterItem<uint8_t>(&batch, item);     break;
+                case MATRIX_INT16:  FilterItem<int16_t>(&batch, item);     break;
+                case MATRIX_INT32:  FilterItem<int32_t>(&batch, item);     break;
+                case MATRIX_FLOAT:  FilterItem<float>(&batch, item);       break;
+                case MATRIX_DOUBLE: FilterItem<double>(&batch, item);      break;
+            }
+        }
+
+        pthread_mutex_lock(&batch.lock);
+        batch.computed = i + 1;
+        Charge(&batch, 0, item->bytes);
+        pthread_mutex_unlock(&batch.lock);
+    }
+
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    StopPool(&batch.pool);
+
+    int failed = 0;
+    for (size_t i = 0; i < batch.items.size(); i++) {
+        failed += batch.items[i].error.empty() ? 0 : 1;
+    }
+    printf("Filtered %zu of %zu matrices in %.3fs, at most %.1f MB in flight\n",
+           batch.items.size() - failed, batch.items.size(), MonotonicSeconds() - start,
+           batch.peak / (double) (1 << 20));
+
+    return failed == 0 ? 0 : -1;
+}
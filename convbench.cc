@@ -0,0 +1,597 @@
+/***********************************************************************************
+ * FILENAME:        convbench.cc
+ *
+ * DESCRIPTION:     Benchmark for the filter engine. Sweeps every combination
+ *                  of matrix size, depth, thread count, mode and engine over
+ *                  generated matrices, timing repeated runs of
+ *                  FilterWithWorkspace. Reading and printing are left out,
+ *                  and the workspace is allocated and the threads started in
+ *                  a worker_pool before the timing starts, so only the filter
+ *                  is measured. Each case reports the engine that ran, which
+ *                  the cost model picks for auto, the median and 95th
+ *                  percentile time, cells per second and GB/s, counting one
+ *                  read of the input and one write of the output.
+ *
+ * OPTIONS:         --sizes list    - matrix sizes n, each run as n x n
+ *                  --depths list   - neighbourhood depths
+ *                  --threads list  - thread counts
+ *                  --modes list    - filter modes, as for convolution
+ *                  --engines list  - engines, as for convolution
+ *                  --type name     - element type, int32 by default
+ *                  --border name   - border mode, zero by default
+ *                  --reps n        - timed runs per case, after one warm up
+ *                  --seed n        - seed for the generated matrices
+ *                  --csv           - print CSV rather than JSON
+ *                  --updates n     - time incremental refreshes instead.
+ *                                    Each run changes n random values and
+ *                                    refreshes the output with incremental.h,
+ *                                    which is checked against a full filter
+ *                                    afterwards. Cells per second then counts
+ *                                    the values changed.
+ *
+ *                  Lists are comma separated, e.g. --depths 1,4,16
+ *
+ * USAGE:           Compile the program using the makefile
+ *                      > make convbench
+ *
+ *                  You can then run it with
+ *                      > ./convbench [options] > results.json
+ *                  OR
+ *                      > make bench
+***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <string>       // Strings
+#include <vector>       // Used for the sweep lists and timings
+#include <algorithm>    // Used for sort
+#include <stdint.h>     // Fixed width types
+#include <stdlib.h>     // Used for atol
+#include <unistd.h>     // Used for sysconf
+#include <getopt.h>     // Used for option parsing
+#include "matrix.h"     // Used for matrix_type_name
+#include "engine.h"     // Used for the threaded filter engine
+#include "incremental.h" // Used for timing incremental refreshes
+#include "rng.h"        // Used for generating matrices
+
+using namespace std;
+
+// One sweep's worth of settings
+struct bench_options {
+    vector<long> sizes;
+    vector<long> depths;
+    vector<long> threads;
+    vector<int> modes;
+    vector<int> engines;
+    uint32_t type;
+    int border;
+    int reps;
+    uint64_t seed;
+    bool csv;
+    long updates;       // Values changed per incremental run, 0 for full runs
+};
+
+// Timings for one case
+struct bench_result {
+    double median;      // Seconds
+    double p95;         // Seconds
+    double cellsPerSec;
+    double gbPerSec;
+    int engine;         // The filter_engine that ran, with ENGINE_AUTO resolved
+};
+
+/***********************************************************************************
+ * NAME:            PrintUsage
+ *
+ * DESCRIPTION:     Prints the command line usage of the program
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvbench [options]" << endl;
+    cout << "Options:" << endl;
+    cout << "\t--sizes list\tmatrix sizes n, each run as n x n" << endl;
+    cout << "\t--depths list\tneighbourhood depths" << endl;
+    cout << "\t--threads list\tthread counts" << endl;
+    cout << "\t--modes list\tfilter modes: mean, median, min, max, open, close, gaussian";
+    cout << endl;
+    cout << "\t--engines list\tengines: auto, direct, histogram, running-sum, integral";
+    cout << endl;
+    cout << "\t--type name\telement type: uint8, int16, int32, float or double" << endl;
+    cout << "\t--border name\tborder mode: zero, clamp, reflect or wrap" << endl;
+    cout << "\t--reps n\ttimed runs per case" << endl;
+    cout << "\t--seed n\tseed for the generated matrices" << endl;
+    cout << "\t--csv\t\tprint CSV rather than JSON" << endl;
+    cout << "\t--updates n\ttime refreshing after n values change" << endl;
+}
+
+/***********************************************************************************
+ * NAME:            ParseNumbers
+ *
+ * DESCRIPTION:     Parses a comma separated list of positive numbers
+ *
+ * PARAMETERS:      const char* :   list    -   the list to parse
+ *                  const char* :   option  -   the option it came from
+ *
+ * RETURNS:         vector<long> - the numbers, exits the program if any are
+ *                                 not positive
+ **********************************************************************************/
+vector<long> ParseNumbers (const char* list, const char* option) {
+    vector<long> numbers;
+    string item;
+    string text(list);
+    size_t pos = 0;
+
+    while (pos <= text.size()) {
+        size_t comma = text.find(',', pos);
+        if (comma == string::npos) {
+            comma = text.size();
+        }
+        item = text.substr(pos, comma - pos);
+        if (atol(item.c_str()) <= 0) {
+            cout << "[ERROR] --" << option << " takes positive numbers, not '" << item;
+            cout << "'" << endl;
+            exit(EXIT_FAILURE);
+        }
+        numbers.push_back(atol(item.c_str()));
+        pos = comma + 1;
+    }
+
+    return numbers;
+}
+
+/***********************************************************************************
+ * NAME:            ParseNames
+ *
+ * DESCRIPTION:     Parses a comma separated list of names into the values
+ *                  whose names, given by nameOf, match them
+ *
+ * PARAMETERS:      const char* :   list    -   the list to parse
+ *                  const char* :   option  -   the option it came from
+ *                  int         :   count   -   number of values to try
+ *                  const char* (*)(int)    :   nameOf  -   gets a value's name
+ *
+ * RETURNS:         vector<int> - the values, exits the program if a name is
+ *                                not recognised
+ **********************************************************************************/
+vector<int> ParseNames (const char* list, const char* option, int count,
+                        const char* (*nameOf)(int)) {
+    vector<int> values;
+    string text(list);
+    size_t pos = 0;
+
+    while (pos <= text.size()) {
+        size_t comma = text.find(',', pos);
+        if (comma == string::npos) {
+            comma = text.size();
+        }
+        string item = text.substr(pos, comma - pos);
+        int found = -1;
+        for (int v = 0; v < count; v++) {
+            if (item == nameOf(v)) {
+                found = v;
+            }
+        }
+        if (found == -1) {
+            cout << "[ERROR] Unknown " << option << " '" << item << "'" << endl;
+            PrintUsage();
+            exit(EXIT_FAILURE);
+        }
+        values.push_back(found);
+        pos = comma + 1;
+    }
+
+    return values;
+}
+
+/***********************************************************************************
+ * NAME:            ProcessArguments
+ *
+ * DESCRIPTION:     Used to process and check the validity of the programs
+ *                  command line arguments, filling in defaults for any sweep
+ *                  that isn't given
+ *
+ * PARAMETERS:      int     :   argc    -   number of command line arguments
+ *                  char**  :   argv    -   the command line arguments
+ *                  bench_options*  :   options -   variable to store the sweep
+ *
+ * RETURNS:         Void, but exits the program if incorrect values have been
+ *                  given
+ **********************************************************************************/
+void ProcessArguments (int argc, char** argv, bench_options* options) {
+    static struct option longOptions[] = {
+        {"sizes", required_argument, 0, 'n'},
+        {"depths", required_argument, 0, 'd'},
+        {"threads", required_argument, 0, 'p'},
+        {"modes", required_argument, 0, 'm'},
+        {"engines", required_argument, 0, 'e'},
+        {"type", required_argument, 0, 'y'},
+        {"border", required_argument, 0, 'b'},
+        {"reps", required_argument, 0, 'r'},
+        {"seed", required_argument, 0, 's'},
+        {"csv", no_argument, 0, 'c'},
+        {"updates", required_argument, 0, 'u'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    options->type = MATRIX_INT32;
+    options->border = BORDER_ZERO;
+    options->reps = 9;
+    options->seed = 1;
+    options->csv = false;
+    options->updates = 0;
+
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                options->sizes = ParseNumbers(optarg, "sizes");
+                break;
+            case 'd':
+                options->depths = ParseNumbers(optarg, "depths");
+                break;
+            case 'p':
+                options->threads = ParseNumbers(optarg, "threads");
+                break;
+            case 'm':
+                options->modes = ParseNames(optarg, "mode", FILTER_MODES, FilterModeName);
+                break;
+            case 'e':
+                options->engines = ParseNames(optarg, "engine", FILTER_ENGINES, EngineName);
+                break;
+            case 'y':
+                options->type = 0;
+                for (uint32_t t = MATRIX_UINT8; t <= MATRIX_DOUBLE; t++) {
+                    if (string(optarg) == matrix_type_name(t)) {
+                        options->type = t;
+                    }
+                }
+                if (options->type == 0) {
+                    cout << "[ERROR] Unknown element type '" << optarg << "'" << endl;
+                    PrintUsage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                options->border = ParseNames(optarg, "border", BORDER_MODES,
+                                             BorderModeName)[0];
+                break;
+            case 'r':
+                options->reps = atoi(optarg);
+                if (options->reps < 1) {
+                    cout << "[ERROR] --reps must be at least 1" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                options->seed = strtoull(optarg, NULL, 10);
+                break;
+            case 'c':
+                options->csv = true;
+                break;
+            case 'u':
+                options->updates = atol(optarg);
+                if (options->updates < 1) {
+                    cout << "[ERROR] --updates must be at least 1" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                PrintUsage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->sizes.empty()) {
+        options->sizes.push_back(256);
+        options->sizes.push_back(1024);
+        options->sizes.push_back(2048);
+    }
+    if (options->depths.empty()) {
+        options->depths.push_back(1);
+        options->depths.push_back(4);
+        options->depths.push_back(16);
+    }
+    if (options->threads.empty()) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        options->threads.push_back(1);
+        if (cpus > 1) {
+            options->threads.push_back(cpus);
+        }
+    }
+    if (options->modes.empty()) {
+        options->modes.push_back(FILTER_MEAN);
+    }
+    if (options->engines.empty()) {
+        options->engines.push_back(ENGINE_AUTO);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            FillMatrix
+ *
+ * DESCRIPTION:     Fills a matrix with values in [0, 255] from the counter
+ *                  based generator, the same stream mkRandomMatrix -p uniform
+ *                  -h 255 writes, so the same seed always gives the same matrix
+ *
+ * PARAMETERS:      T**     :   matrix  -   the matrix to fill
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *                  uint64_t    :   seed    -   the seed
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void FillMatrix (T** matrix, long rows, long cols, uint64_t seed) {
+    for (long r = 0; r < rows; r++) {
+        for (long c = 0; c < cols; c++) {
+            matrix[r][c] = (T) (rng_hash(seed, (uint64_t) (r * cols + c)) >> 56);
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            TimeCase
+ *
+ * DESCRIPTION:     Times repeated runs of one filter over a matrix, after one
+ *                  untimed run to warm the caches and fault in the result.
+ *                  The workspace and the pool's threads are set up once,
+ *                  outside the timed runs.
+ *
+ * PARAMETERS:      T**     :   matrix      -   the matrix to filter
+ *                  T**     :   result      -   matrix to store the result in
+ *                  long    :   n           -   rows and columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  int     :   reps        -   the number of timed runs
+ *
+ * RETURNS:         bench_result - the timings, exits the program if the
+ *                                 filter fails
+ **********************************************************************************/
+template <typename T>
+bench_result TimeCase (T** matrix, T** result, long n, filter_settings settings,
+                       int numThreads, int reps) {
+    vector<double> times;
+    bench_result out;
+    filter_workspace<T> ws;
+    worker_pool pool;
+
+    InitWorkspace(&ws, n, n, settings, numThreads, 0.0, 255.0);
+    if (numThreads > 1) {
+        if (StartPool(&pool, numThreads) != 0) {
+            printf("[ERROR] Could not start %d threads\n", numThreads);
+            exit(1);
+        }
+        ws.pool = &pool;
+    }
+
+    for (int i = 0; i <= reps; i++) {
+        double start = MonotonicSeconds();
+        if (FilterWithWorkspace(&ws, matrix, result, NULL, NULL, NULL) != 0) {
+            printf("[ERROR] Filter failed\n");
+            exit(1);
+        }
+        if (i > 0) {
+            times.push_back(MonotonicSeconds() - start);
+        }
+    }
+
+    // A median whose values don't fit the histograms sorts its windows instead
+    out.engine = ws.args[0].settings.engine;
+    if (settings.mode == FILTER_MEDIAN && !ws.args[0].histogram) {
+        out.engine = ENGINE_DIRECT;
+    }
+    if (ws.pool != NULL) {
+        StopPool(&pool);
+    }
+    FreeWorkspace(&ws);
+    sort(times.begin(), times.end());
+
+    size_t middle = times.size() / 2;
+    size_t p95 = (size_t) ((times.size() * 95 + 99) / 100) - 1;
+    double cells = (double) n * n;
+
+    out.median = times.size() % 2 ? times[middle] : (times[middle - 1] + times[middle]) / 2;
+    out.p95 = times[p95];
+    out.cellsPerSec = cells / out.median;
+    out.gbPerSec = 2 * cells * sizeof(T) / out.median / 1e9;
+    return out;
+}
+
+/***********************************************************************************
+ * NAME:            TimeUpdates
+ *
+ * DESCRIPTION:     Times refreshing a filtered matrix after a number of its
+ *                  values change, then checks the refreshed output against
+ *                  filtering the changed matrix in full. Floating point
+ *                  means may round differently on the integral kernel.
+ *
+ * PARAMETERS:      T**     :   matrix      -   the matrix to change and filter
+ *                  T**     :   result      -   matrix to store the check in
+ *                  long    :   n           -   rows and columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  int     :   reps        -   the number of timed runs
+ *                  long    :   updates     -   values changed per run
+ *                  uint64_t    :   seed    -   seed for the changes
+ *
+ * RETURNS:         bench_result - the timings, exits the program if the
+ *                                 filter fails or the check does not match
+ **********************************************************************************/
+template <typename T>
+bench_result TimeUpdates (T** matrix, T** result, long n, filter_settings settings,
+                          int numThreads, int reps, long updates, uint64_t seed) {
+    incremental_filter<T> inc;
+    vector<double> times;
+    bench_result out;
+    uint64_t counter = 0;
+
+    if (InitIncremental(&inc, matrix, n, n, settings, numThreads, 0.0, 255.0) != 0) {
+        printf("[ERROR] Filter failed\n");
+        exit(1);
+    }
+
+    for (int i = 0; i <= reps; i++) {
+        double start = MonotonicSeconds();
+        for (long u = 0; u < updates; u++, counter += 3) {
+            long row = (long) (rng_hash(seed + 1, counter) % (uint64_t) n);
+            long col = (long) (rng_hash(seed + 1, counter + 1) % (uint64_t) n);
+            UpdateValue(&inc, row, col, (T) (rng_hash(seed + 1, counter + 2) >> 56));
+        }
+        if (RefreshIncremental(&inc, (vector<dirty_rect>*) NULL) != 0) {
+            printf("[ERROR] Filter failed\n");
+            exit(1);
+        }
+        if (i > 0) {
+            times.push_back(MonotonicSeconds() - start);
+        }
+    }
+
+    if (FilterMatrix(matrix, result, n, n, inc.settings, numThreads, 0.0, 255.0,
+                     NULL, NULL, NULL) != 0) {
+        printf("[ERROR] Filter failed\n");
+        exit(1);
+    }
+    for (long r = 0; r < n; r++) {
+        for (long c = 0; c < n; c++) {
+            double diff = (double) result[r][c] - (double) inc.output[r][c];
+            if (diff > 1e-3 || diff < -1e-3) {
+                printf("[ERROR] Refreshed value at %ld, %ld is %g, not %g\n", r, c,
+                       (double) inc.output[r][c], (double) result[r][c]);
+                exit(1);
+            }
+        }
+    }
+    out.engine = inc.settings.engine;
+    FreeIncremental(&inc);
+    sort(times.begin(), times.end());
+
+    size_t middle = times.size() / 2;
+    size_t p95 = (size_t) ((times.size() * 95 + 99) / 100) - 1;
+
+    out.median = times.size() % 2 ? times[middle] : (times[middle - 1] + times[middle]) / 2;
+    out.p95 = times[p95];
+    out.cellsPerSec = updates / out.median;
+    out.gbPerSec = 2.0 * updates * sizeof(T) / out.median / 1e9;
+    return out;
+}
+
+/***********************************************************************************
+ * NAME:            RunSweep
+ *
+ * DESCRIPTION:     Runs every case of the sweep on element type T, printing
+ *                  each result as soon as it is timed
+ *
+ * PARAMETERS:      bench_options   :   options -   the sweep to run
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void RunSweep (bench_options options) {
+    bool first = true;
+
+    if (options.csv) {
+        cout << "rows,cols,type,mode,engine,border,depth,threads,reps,updates,";
+        cout << "median_s,p95_s,cells_per_s,gb_per_s" << endl;
+    } else {
+        cout << "[" << endl;
+    }
+
+    for (size_t si = 0; si < options.sizes.size(); si++) {
+        long n = options.sizes[si];
+        T** matrix = AllocateMatrix<T>(n, n);
+        T** result = AllocateMatrix<T>(n, n);
+        FillMatrix(matrix, n, n, options.seed);
+
+        for (size_t di = 0; di < options.depths.size(); di++) {
+        for (size_t ti = 0; ti < options.threads.size(); ti++) {
+        for (size_t mi = 0; mi < options.modes.size(); mi++) {
+        for (size_t ei = 0; ei < options.engines.size(); ei++) {
+            filter_settings settings;
+            settings.mode = options.modes[mi];
+            settings.depth = (int) options.depths[di];
+            settings.sigma = settings.depth;
+            settings.border = options.border;
+            settings.engine = options.engines[ei];
+            int numThreads = (int) options.threads[ti];
+
+            bench_result res;
+            if (options.updates > 0) {
+                // Each case changes its own copy of the matrix
+                T** work = AllocateMatrix<T>(n, n);
+                copy(matrix[0], matrix[0] + (size_t) n * n, work[0]);
+                res = TimeUpdates(work, result, n, settings, numThreads, options.reps,
+                                  options.updates, options.seed);
+                CleanupMatrix(work, n);
+            } else {
+                res = TimeCase(matrix, result, n, settings, numThreads, options.reps);
+            }
+
+            const char* type = matrix_type_name(options.type);
+            const char* mode = FilterModeName(settings.mode);
+            const char* engine = EngineName(res.engine);
+            const char* border = BorderModeName(settings.border);
+            if (options.csv) {
+                printf("%ld,%ld,%s,%s,%s,%s,%d,%d,%d,%ld,%.9f,%.9f,%.6e,%.4f\n",
+                       n, n, type, mode, engine, border, settings.depth, numThreads,
+                       options.reps, options.updates, res.median, res.p95,
+                       res.cellsPerSec, res.gbPerSec);
+            } else {
+                printf("%s  {\"rows\": %ld, \"cols\": %ld, \"type\": \"%s\", "
+                       "\"mode\": \"%s\", \"engine\": \"%s\", \"border\": \"%s\", "
+                       "\"depth\": %d, \"threads\": %d, \"reps\": %d, \"updates\": %ld, "
+                       "\"median_s\": %.9f, \"p95_s\": %.9f, "
+                       "\"cells_per_s\": %.6e, \"gb_per_s\": %.4f}",
+                       first ? "" : ",\n", n, n, type, mode, engine, border,
+                       settings.depth, numThreads, options.reps, options.updates,
+                       res.median, res.p95, res.cellsPerSec, res.gbPerSec);
+            }
+            fflush(stdout);
+            first = false;
+        }
+        }
+        }
+        }
+
+        CleanupMatrix(matrix, n);
+        CleanupMatrix(result, n);
+    }
+
+    if (!options.csv) {
+        cout << endl << "]" << endl;
+    }
+}
+
+/***********************************************************************************
+ * NAME:            main
+ * DESCRIPTION:     Entrypoint for the program.
+ * PARAMETERS:      None
+ * RETURNS:         0 on success, an error status otherwise.
+ **********************************************************************************/
+int main (int argc, char** argv) {
+    bench_options options;
+
+    ProcessArguments(argc, argv, &options);
+
+    switch (options.type) {
+        case MATRIX_UINT8:
+            RunSweep<uint8_t>(options);
+            break;
+        case MATRIX_INT16:
+            RunSweep<int16_t>(options);
+            break;
+        case MATRIX_INT32:
+            RunSweep<int32_t>(options);
+            break;
+        case MATRIX_FLOAT:
+            RunSweep<float>(options);
+            break;
+        case MATRIX_DOUBLE:
+            RunSweep<double>(options);
+            break;
+    }
+
+    return 0;
+}
@@ -0,0 +1,583 @@
+/***********************************************************************************
+ * FILENAME:        convdist.cc
+ *
+ * DESCRIPTION:     Filters a binary matrix file too large for one host with
+ *                  several processes, each owning a band of rows.
+ *
+ *                  Ranks split the rows as GetMatrixWork splits them between
+ *                  threads, and each reads only its own band of the file.
+ *                  Before each pass a rank trades the depth rows at either
+ *                  edge of its band with its neighbours over a transport from
+ *                  halo.h, so the band and its halos hold every value its
+ *                  windows read. Rows beyond the matrix are filled through
+ *                  the border mode, and a wrapped border makes the first and
+ *                  last ranks neighbours. Open and close trade halos again
+ *                  between their passes. The smallest and largest values are
+ *                  passed down the ranks and back up, so every rank filters
+ *                  with the range of the whole matrix and picks the same
+ *                  engine. Each rank writes its rows of the output with
+ *                  positioned writes, into a file rank 0 sets up first.
+ *
+ *                  The recursive gaussian has no finite window, so it can't
+ *                  be split this way.
+ *
+ * ARGUMENTS:       matrixFile  - the binary matrix to filter
+ *                  outputFile  - where to write the filtered matrix, which
+ *                                every rank has to be able to reach
+ *                  depth       - the neighbourhood depth to use for the filter
+ *                  numThreads  - the number of threads each rank uses
+ *
+ * OPTIONS:         --mode, --border and --engine, as for convolution
+ *                  --ranks n   - the number of ranks, 1 by default. Each needs
+ *                                at least depth rows
+ *                  --rank r    - run rank r alone, to be started on each node
+ *                                with the same arguments. Without it, all
+ *                                the ranks are started here as processes
+ *                  --transport spec - how ranks reach each other, as in
+ *                                halo.h. Defaults to unix sockets in a
+ *                                temporary directory when the ranks are
+ *                                started here, and is needed with --rank
+ *
+ * USAGE:           Compile the program using the makefile
+ *                      > make convdist
+ *
+ *                  You can then run it with
+ *                      > ./convdist [options] [matrixFile] [outputFile] [depth]
+ *                                   [numThreads]
+***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <string>       // Strings
+#include <limits>       // Used for numeric_limits
+#include <vector>       // Used for the ranks started here
+#include <algorithm>    // Used for fill, copy, swap
+#include <fcntl.h>      // Used for file reading
+#include <unistd.h>     // Used for fork, ftruncate
+#include <getopt.h>     // Used for option parsing
+#include <sys/wait.h>   // Used for waiting on the ranks
+#include "matrix.h"     // Used for matrix operations
+#include "engine.h"     // Used for the threaded filter engine
+#include "halo.h"       // Used for trading halos
+
+using namespace std;
+
+// How a run is split between processes
+struct dist_options {
+    int ranks;
+    int rank;                   // -1 to start every rank here
+    string transport;
+};
+
+/***********************************************************************************
+ * NAME:            PrintUsage
+ *
+ * DESCRIPTION:     Prints the command line usage of the program
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvdist [options] [matrixFile] [outputFile] [filterDepth] [numThreads]";
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "\t--mode name\tfilter to run: mean (the default), median, min, max,";
+    cout << " open or close" << endl;
+    cout << "\t--border name\tvalues outside the matrix: zero (the default), clamp,";
+    cout << " reflect or wrap" << endl;
+    cout << "\t--engine name\tkernel to use: auto (the default), direct, histogram,";
+    cout << " running-sum or integral" << endl;
+    cout << "\t--ranks n\tprocesses to split the rows between, 1 by default" << endl;
+    cout << "\t--rank r\trun only rank r, started on each node" << endl;
+    cout << "\t--transport spec\tunix:dir, tcp:host:port[,host:port...] or shm:name";
+    cout << endl;
+}
+
+/***********************************************************************************
+ * NAME:            ProcessArguments
+ *
+ * DESCRIPTION:     Used to process and check the validity of the programs
+ *                  command line arguments.
+ *
+ * PARAMETERS:      int     :   argc    -   number of command line arguments
+ *                  char**  :   argv    -   the command line arguments
+ *                  string* :   files   -   variable to store the matrix and
+ *                                          output files
+ *                  filter_settings*    :   settings    -   variable to store
+ *                                                          the filter
+ *                  int*    :   nTh     -   variable to store number of threads
+ *                  dist_options*   :   dist    -   variable to store the ranks
+ *
+ * RETURNS:         Void, but exits the program if incorrect values have been
+ *                  given
+ **********************************************************************************/
+void ProcessArguments (int argc, char** argv, string* files, filter_settings* settings,
+                       int* nTh, dist_options* dist) {
+    static struct option longOptions[] = {
+        {"mode", required_argument, 0, 'm'},
+        {"border", required_argument, 0, 'b'},
+        {"engine", required_argument, 0, 'e'},
+        {"ranks", required_argument, 0, 'n'},
+        {"rank", required_argument, 0, 'r'},
+        {"transport", required_argument, 0, 't'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    settings->mode = FILTER_MEAN;
+    settings->sigma = 0;
+    settings->border = BORDER_ZERO;
+    settings->engine = ENGINE_AUTO;
+    dist->ranks = 1;
+    dist->rank = -1;
+
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        int found = -1;
+
+        switch (opt) {
+            case 'm':
+                found = settings->mode = ParseFilterMode(optarg);
+                break;
+            case 'b':
+                found = settings->border = ParseBorderMode(optarg);
+                break;
+            case 'e':
+                found = settings->engine = ParseEngine(optarg);
+                break;
+            case 'n':
+                dist->ranks = atoi(optarg);
+                found = dist->ranks > 0 ? 0 : -1;
+                break;
+            case 'r':
+                dist->rank = atoi(optarg);
+                found = dist->rank >= 0 && string(optarg) == to_string(dist->rank) ? 0 : -1;
+                break;
+            case 't':
+                dist->transport = optarg;
+                found = 0;
+                break;
+            default:
+                PrintUsage();
+                exit(EXIT_FAILURE);
+        }
+
+        if (found == -1) {
+            cout << "[ERROR] Bad value '" << optarg << "'" << endl;
+            PrintUsage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 4) {
+        cout << "[ERROR] Invalid number of arguments given." << endl;
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    char** positional = argv + optind;
+
+    if (atoi(positional[2]) <= 0 || atoi(positional[3]) <= 0) {
+        cout << "[ERROR] Invalid values given for depth or numThreads" << endl;
+        PrintUsage();
+        cout << "Where filterDepth and numThreads are ints > 0" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (settings->mode == FILTER_GAUSSIAN) {
+        cout << "[ERROR] gaussian has no finite window to split into bands" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (dist->rank >= dist->ranks) {
+        cout << "[ERROR] --rank must be below --ranks" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (dist->rank != -1 && dist->ranks > 1 && dist->transport.empty()) {
+        cout << "[ERROR] --rank needs a --transport to reach the other ranks" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    files[0] = positional[0];
+    files[1] = positional[1];
+    settings->depth = atoi(positional[2]);
+    *nTh = atoi(positional[3]);
+}
+
+/***********************************************************************************
+ * NAME:            ReduceRange
+ *
+ * DESCRIPTION:     Finds the smallest and largest values of the whole matrix
+ *                  from each rank's own, passing them down the ranks and the
+ *                  result back up. Only neighbours ever talk.
+ *
+ * PARAMETERS:      halo_transport* :   t   -   the transport
+ *                  double* :   minValue    -   this rank's minimum, replaced
+ *                                              by the matrix's
+ *                  double* :   maxValue    -   this rank's maximum, replaced
+ *                                              by the matrix's
+ *
+ * RETURNS:         0 on success, -1 if a neighbour went away
+ **********************************************************************************/
+int ReduceRange (halo_transport* t, double* minValue, double* maxValue) {
+    double range[2] = { *minValue, *maxValue };
+    double other[2];
+    const void* none[HALO_SIDES] = { NULL, NULL };
+    void* nowhere[HALO_SIDES] = { NULL, NULL };
+    bool first = t->rank == 0;
+    bool last = t->rank == t->ranks - 1;
+
+    if (!first) {
+        void* in[HALO_SIDES] = { other, NULL };
+        if (ExchangeHalos(t, none, in, sizeof(other)) != 0) {
+            return -1;
+        }
+        range[0] = other[0] < range[0] ? other[0] : range[0];
+        range[1] = other[1] > range[1] ? other[1] : range[1];
+    }
+    if (!last) {
+        const void* out[HALO_SIDES] = { NULL, range };
+        void* in[HALO_SIDES] = { NULL, range };
+        if (ExchangeHalos(t, out, nowhere, sizeof(range)) != 0 ||
+            ExchangeHalos(t, none, in, sizeof(range)) != 0) {
+            return -1;
+        }
+    }
+    if (!first) {
+        const void* out[HALO_SIDES] = { range, NULL };
+        if (ExchangeHalos(t, out, nowhere, sizeof(range)) != 0) {
+            return -1;
+        }
+    }
+
+    *minValue = range[0];
+    *maxValue = range[1];
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            FillHalos
+ *
+ * DESCRIPTION:     Fills the depth rows above and below a rank's band, trading
+ *                  them with the neighbours it has and finding the rest
+ *                  through the border mode
+ *
+ * PARAMETERS:      halo_transport* :   t   -   the transport
+ *                  T**     :   local   -   the band, with depth halo rows
+ *                                          either side of it
+ *                  long    :   start   -   the band's first row in the matrix
+ *                  long    :   band    -   the number of rows in the band
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter
+ *
+ * RETURNS:         0 on success, -1 if a neighbour went away
+ **********************************************************************************/
+template <typename T>
+int FillHalos (halo_transport* t, T** local, long start, long band, long rows, long cols,
+               filter_settings settings) {
+    long depth = settings.depth;
+    const void* out[HALO_SIDES] = { NULL, NULL };
+    void* in[HALO_SIDES] = { NULL, NULL };
+
+    // The band's top rows are the halo below the rank above, and so on
+    if (t->peers[HALO_ABOVE] != -1) {
+        out[HALO_ABOVE] = local[depth];
+        in[HALO_ABOVE] = local[0];
+    }
+    if (t->peers[HALO_BELOW] != -1) {
+        out[HALO_BELOW] = local[band];
+        in[HALO_BELOW] = local[band + depth];
+    }
+    if (ExchangeHalos(t, out, in, (size_t) depth * cols * sizeof(T)) != 0) {
+        return -1;
+    }
+
+    // Without a neighbour the rows stand for ones beyond the matrix, which
+    // every border but wrap finds within the band
+    for (int s = 0; s < HALO_SIDES; s++) {
+        if (in[s] != NULL) {
+            continue;
+        }
+        for (long i = 0; i < depth; i++) {
+            long row = s == HALO_ABOVE ? i : band + depth + i;
+            long src = BorderIndex(start - depth + row, rows, settings.border);
+            if (src == -1) {
+                fill(local[row], local[row] + cols, (T) 0);
+            } else {
+                copy(local[src - start + depth], local[src - start + depth] + cols,
+                     local[row]);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            CreateOutput
+ *
+ * DESCRIPTION:     Makes the output file at its full size, for the ranks to
+ *                  write their bands into
+ *
+ * PARAMETERS:      const string&   :   file    -   the output file
+ *                  uint32_t    :   type    -   its matrix_type
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *
+ * RETURNS:         0 on success, -1 if the file could not be made
+ **********************************************************************************/
+int CreateOutput (const string& file, uint32_t type, long rows, long cols) {
+    matrix_header header;
+    int fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1) {
+        return -1;
+    }
+    make_header(&header, type, rows, cols);
+    size_t bytes = header.data_offset + rows * cols * matrix_type_size(type);
+    int status = set_header(fd, &header) == 0 && ftruncate(fd, bytes) == 0 ? 0 : -1;
+    if (close(fd) != 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            FilterBand
+ *
+ * DESCRIPTION:     Runs one rank of a distributed filter on its band
+ *
+ * PARAMETERS:      string* :   files   -   the matrix and output files
+ *                  const matrix_header&    :   header  -   the matrix's header
+ *                  filter_settings :   settings    -   the filter
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  const dist_options& :   dist    -   the ranks, with this
+ *                                                      rank and the transport
+ *
+ * RETURNS:         0 on success, -1 if the band could not be read, traded or
+ *                  written
+ **********************************************************************************/
+template <typename T>
+int FilterBand (string* files, const matrix_header& header, filter_settings settings,
+                int numThreads, const dist_options& dist) {
+    long rows = header.rows;
+    long cols = header.cols;
+    long depth = settings.depth;
+    long start, end;
+    halo_transport t;
+    double began = MonotonicSeconds();
+    double traded = 0;
+
+    GetMatrixWork(rows, dist.ranks, dist.rank, &start, &end);
+    long band = end - start;
+    long height = band + 2 * depth;
+    T** local = AllocateMatrix<T>(height, cols);
+    T** filtered = AllocateMatrix<T>(height, cols);
+
+    // Only this rank's rows are read, the halos come from the neighbours
+    int fd = open(files[0].c_str(), O_RDONLY);
+    if (fd == -1 || get_rows(fd, &header, start + 1, band, local[depth]) != 0) {
+        printf("[ERROR] Rank %d could not read rows %ld to %ld of '%s'\n", dist.rank,
+               start, end, files[0].c_str());
+        return -1;
+    }
+    close(fd);
+
+    T low = numeric_limits<T>::max();
+    T high = numeric_limits<T>::lowest();
+    ScanRange(local[depth], (size_t) band * cols, &low, &high);
+    double minValue = low, maxValue = high;
+
+    // The largest message is a halo, or the range when the halos are tiny
+    size_t capacity = (size_t) depth * cols * sizeof(T);
+    capacity = capacity > 2 * sizeof(double) ? capacity : 2 * sizeof(double);
+    if (OpenTransport(&t, dist.transport.empty() ? "unix:." : dist.transport, dist.rank,
+                      dist.ranks, settings.border == BORDER_WRAP, capacity) != 0) {
+        printf("[ERROR] Rank %d could not reach its neighbours over '%s'\n", dist.rank,
+               dist.transport.c_str());
+        CloseTransport(&t);
+        return -1;
+    }
+
+    // The output is made before the range is passed back up, so it exists
+    // by the time any rank has the range
+    if (dist.rank == 0 && CreateOutput(files[1], header.type, rows, cols) != 0) {
+        printf("[ERROR] Could not make output '%s'\n", files[1].c_str());
+        CloseTransport(&t);
+        return -1;
+    }
+    double tradeStart = MonotonicSeconds();
+    if (ReduceRange(&t, &minValue, &maxValue) != 0) {
+        printf("[ERROR] Rank %d lost a neighbour\n", dist.rank);
+        CloseTransport(&t);
+        return -1;
+    }
+    traded += MonotonicSeconds() - tradeStart;
+
+    // Every rank resolves the engine for the same shape and range, as the
+    // mean's engines round floats differently
+    if (settings.mode == FILTER_MEAN || settings.mode == FILTER_MEDIAN) {
+        filter_workspace<T> ws;
+        InitWorkspace(&ws, rows / dist.ranks + 2 * depth, cols, settings, numThreads,
+                      minValue, maxValue);
+        settings.engine = ws.args[0].settings.engine;
+        FreeWorkspace(&ws);
+    }
+
+    filter_settings passes[2] = { settings, settings };
+    int count = 1;
+    if (settings.mode == FILTER_OPEN || settings.mode == FILTER_CLOSE) {
+        passes[0].mode = settings.mode == FILTER_OPEN ? FILTER_MIN : FILTER_MAX;
+        passes[1].mode = settings.mode == FILTER_OPEN ? FILTER_MAX : FILTER_MIN;
+        count = 2;
+    }
+
+    int status = 0;
+    for (int p = 0; p < count && status == 0; p++) {
+        tradeStart = MonotonicSeconds();
+        status = FillHalos(&t, local, start, band, rows, cols, passes[p]);
+        traded += MonotonicSeconds() - tradeStart;
+        if (status == 0) {
+            status = FilterMatrix(local, filtered, height, cols, passes[p], numThreads,
+                                  minValue, maxValue, NULL, NULL, NULL);
+            swap(local, filtered);
+        }
+    }
+    CloseTransport(&t);
+
+    matrix_header outputHeader;
+    make_header(&outputHeader, header.type, rows, cols);
+    if (status == 0 && ((fd = open(files[1].c_str(), O_WRONLY)) == -1 ||
+                        set_rows(fd, &outputHeader, start + 1, band, local[depth]) != 0 ||
+                        close(fd) != 0)) {
+        status = -1;
+    }
+    if (status == 0) {
+        printf("Rank %d: rows %ld to %ld filtered in %.6fs, %.6fs trading halos\n",
+               dist.rank, start, end, MonotonicSeconds() - began, traded);
+    } else {
+        printf("[ERROR] Rank %d could not filter rows %ld to %ld\n", dist.rank, start, end);
+    }
+    fflush(stdout);
+
+    CleanupMatrix(local, height);
+    CleanupMatrix(filtered, height);
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            RunRank
+ *
+ * DESCRIPTION:     Runs one rank on a matrix of whatever element type it holds
+ *
+ * PARAMETERS:      string* :   files   -   the matrix and output files
+ *                  const matrix_header&    :   header  -   the matrix's header
+ *                  filter_settings :   settings    -   the filter
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  const dist_options& :   dist    -   the ranks, with this
+ *                                                      rank and the transport
+ *
+ * RETURNS:         0 on success, -1 otherwise
+ **********************************************************************************/
+int RunRank (string* files, const matrix_header& header, filter_settings settings,
+             int numThreads, const dist_options& dist) {
+    switch (header.type) {
+        case MATRIX_UINT8:
+            return FilterBand<uint8_t>(files, header, settings, numThreads, dist);
+        case MATRIX_INT16:
+            return FilterBand<int16_t>(files, header, settings, numThreads, dist);
+        case MATRIX_INT32:
+            return FilterBand<int32_t>(files, header, settings, numThreads, dist);
+        case MATRIX_FLOAT:
+            return FilterBand<float>(files, header, settings, numThreads, dist);
+        case MATRIX_DOUBLE:
+            return FilterBand<double>(files, header, settings, numThreads, dist);
+        default:
+            printf("[ERROR] '%s' holds values of an unknown type\n", files[0].c_str());
+            return -1;
+    }
+}
+
+/***********************************************************************************
+ * NAME:            main
+ * DESCRIPTION:     Entrypoint for the program.
+ * PARAMETERS:      None
+ * RETURNS:         0 on success, an error status otherwise.
+ **********************************************************************************/
+int main (int argc, char** argv) {
+    string files[2];
+    filter_settings settings;
+    int numThreads;
+    dist_options dist;
+    matrix_header header;
+    int fd;
+
+    ProcessArguments(argc, argv, files, &settings, &numThreads, &dist);
+
+    if ((fd = open(files[0].c_str(), O_RDONLY)) == -1 || get_header(fd, &header) != 0) {
+        printf("[ERROR] Could not open matrix '%s'\n", files[0].c_str());
+        return -1;
+    }
+    close(fd);
+
+    if (header.rows == 0 || header.cols == 0) {
+        printf("[ERROR] '%s' does not hold any values\n", files[0].c_str());
+        return -1;
+    }
+    // A halo has to come from the neighbour alone
+    if (dist.ranks > 1 && (long) header.rows / dist.ranks < settings.depth) {
+        printf("[ERROR] %lu rows can't give %d ranks %d rows each\n",
+               (unsigned long) header.rows, dist.ranks, settings.depth);
+        return -1;
+    }
+
+    if (dist.rank != -1) {
+        return RunRank(files, header, settings, numThreads, dist);
+    }
+
+    // Every rank runs here, linked by unix sockets unless told otherwise
+    char temporary[] = "/tmp/convdist.XXXXXX";
+    bool madeDir = false;
+    if (dist.transport.empty()) {
+        if (mkdtemp(temporary) == NULL) {
+            printf("[ERROR] Could not make a directory for the ranks' sockets\n");
+            return -1;
+        }
+        dist.transport = string("unix:") + temporary;
+        madeDir = true;
+    }
+
+    fflush(stdout);
+    vector<pid_t> children;
+    for (int r = 0; r < dist.ranks; r++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            dist.rank = r;
+            exit(RunRank(files, header, settings, numThreads, dist) == 0 ? EXIT_SUCCESS :
+                                                                        EXIT_FAILURE);
+        }
+        if (pid == -1) {
+            printf("[ERROR] Could not start rank %d\n", r);
+            break;
+        }
+        children.push_back(pid);
+    }
+
+    int status = (int) children.size() == dist.ranks ? 0 : -1;
+    for (size_t i = 0; i < children.size(); i++) {
+        int exited;
+        if (waitpid(children[i], &exited, 0) == -1 || !WIFEXITED(exited) ||
+            WEXITSTATUS(exited) != EXIT_SUCCESS) {
+            status = -1;
+        }
+    }
+    if (madeDir) {
+        rmdir(temporary);
+    }
+    if (status == 0) {
+        printf("Filtered '%s' into '%s' with %d ranks\n", files[0].c_str(),
+               files[1].c_str(), dist.ranks);
+    }
+
+    return status;
+}
@@ -0,0 +1,345 @@
+/***********************************************************************************
+ * FILENAME:        convfilter.cc
+ *
+ * DESCRIPTION:     libconvfilter, the plan and execute interface of
+ *                  convfilter.h over the engine of engine.h. A plan holds a
+ *                  filter_workspace for its element type, together with the
+ *                  row pointer arrays the engine reads and writes through.
+ *                  Executing a plan points those rows into the caller's
+ *                  buffers and runs the workspace, so the values themselves
+ *                  are never copied.
+ *
+ *                  No exception leaves the library: running out of memory
+ *                  while making a plan is returned as CONVFILTER_NO_MEMORY.
+ *
+ * USAGE:           Compile the libraries using the makefile
+ *                      > make libconvfilter.a libconvfilter.so
+ *
+ *                  and link against either with -lconvfilter -pthread, adding
+ *                  -lstdc++ -lm for the static archive from a C program
+ ***********************************************************************************/
+
+#include <new>          // Used for bad_alloc
+#include <limits>       // Used for numeric_limits
+#include <vector>       // Used for the row pointers
+#include "convfilter.h"
+#include "engine.h"     // Used for the threaded filter engine
+
+using namespace std;
+
+// The public enums are the engine's, under names of their own
+static_assert((int) CONVFILTER_MEAN == FILTER_MEAN &&
+              (int) CONVFILTER_MEDIAN == FILTER_MEDIAN &&
+              (int) CONVFILTER_MIN == FILTER_MIN && (int) CONVFILTER_MAX == FILTER_MAX &&
+              (int) CONVFILTER_OPEN == FILTER_OPEN &&
+              (int) CONVFILTER_CLOSE == FILTER_CLOSE &&
+              (int) CONVFILTER_GAUSSIAN == FILTER_GAUSSIAN,
+              "convfilter_mode is filter_mode");
+static_assert((int) CONVFILTER_BORDER_ZERO == BORDER_ZERO &&
+              (int) CONVFILTER_BORDER_CLAMP == BORDER_CLAMP &&
+              (int) CONVFILTER_BORDER_REFLECT == BORDER_REFLECT &&
+              (int) CONVFILTER_BORDER_WRAP == BORDER_WRAP,
+              "convfilter_border is border_mode");
+static_assert((int) CONVFILTER_ENGINE_AUTO == ENGINE_AUTO &&
+              (int) CONVFILTER_ENGINE_DIRECT == ENGINE_DIRECT &&
+              (int) CONVFILTER_ENGINE_HISTOGRAM == ENGINE_HISTOGRAM &&
+              (int) CONVFILTER_ENGINE_RUNNING_SUM == ENGINE_RUNNING_SUM &&
+              (int) CONVFILTER_ENGINE_INTEGRAL == ENGINE_INTEGRAL,
+              "convfilter_engine is filter_engine");
+static_assert((int) CONVFILTER_UINT8 == MATRIX_UINT8 &&
+              (int) CONVFILTER_INT16 == MATRIX_INT16 &&
+              (int) CONVFILTER_INT32 == MATRIX_INT32 &&
+              (int) CONVFILTER_FLOAT == MATRIX_FLOAT &&
+              (int) CONVFILTER_DOUBLE == MATRIX_DOUBLE, "convfilter_type is matrix_type");
+
+// The part of a plan that depends on its element type
+template <typename T>
+struct typed_plan {
+    filter_workspace<T> ws;
+    vector<T*> in;      // Rows of the input, pointed into the caller's buffer
+    vector<T*> out;     // Rows of the output, likewise
+};
+
+struct convfilter_plan {
+    convfilter_options options;
+    void* typed;        // A typed_plan of the options' type
+};
+
+/***********************************************************************************
+ * NAME:            CreateTypedPlan
+ *
+ * DESCRIPTION:     Allocates the typed part of a plan and its workspace
+ *
+ * PARAMETERS:      const convfilter_options*   :   o   -   checked options
+ *                  filter_settings :   settings    -   the filter to run
+ *
+ * RETURNS:         void* - the typed_plan, throws bad_alloc if out of memory
+ **********************************************************************************/
+template <typename T>
+void* CreateTypedPlan (const convfilter_options* o, filter_settings settings) {
+    typed_plan<T>* typed = new typed_plan<T>();
+    double low = o->ranged ? o->low : (double) numeric_limits<T>::lowest();
+    double high = o->ranged ? o->high : (double) numeric_limits<T>::max();
+
+    try {
+        InitWorkspace(&typed->ws, o->rows, o->cols, settings, o->threads, low, high);
+        typed->in.resize(o->rows);
+        typed->out.resize(o->rows);
+    } catch (const bad_alloc&) {
+        FreeWorkspace(&typed->ws);
+        delete typed;
+        throw;
+    }
+    return typed;
+}
+
+/***********************************************************************************
+ * NAME:            ExecuteTypedPlan
+ *
+ * DESCRIPTION:     Points a plan's rows into the caller's buffers and runs it
+ *
+ * PARAMETERS:      convfilter_plan*    :   plan    -   the plan to run
+ *                  const void* :   in          -   the matrix to filter
+ *                  long        :   inStride    -   elements between rows of in
+ *                  void*       :   out         -   where to put the result
+ *                  long        :   outStride   -   elements between rows of out
+ *
+ * RETURNS:         int - a convfilter_status
+ **********************************************************************************/
+template <typename T>
+int ExecuteTypedPlan (convfilter_plan* plan, const void* in, long inStride, void* out,
+                      long outStride) {
+    typed_plan<T>* typed = (typed_plan<T>*) plan->typed;
+
+    // The engine takes non-const rows, but never writes through the input ones
+    T* inBase = (T*) in;
+    T* outBase = (T*) out;
+    for (long i = 0; i < plan->options.rows; i++) {
+        typed->in[i] = inBase + i * inStride;
+        typed->out[i] = outBase + i * outStride;
+    }
+
+    if (FilterWithWorkspace(&typed->ws, typed->in.data(), typed->out.data(), NULL, NULL,
+                            NULL) != 0) {
+        return CONVFILTER_NO_THREADS;
+    }
+    return CONVFILTER_OK;
+}
+
+/***********************************************************************************
+ * NAME:            DestroyTypedPlan
+ *
+ * DESCRIPTION:     Frees the typed part of a plan
+ *
+ * PARAMETERS:      void*   :   typed   -   a typed_plan<T>
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void DestroyTypedPlan (void* typed) {
+    typed_plan<T>* p = (typed_plan<T>*) typed;
+
+    FreeWorkspace(&p->ws);
+    delete p;
+}
+
+/***********************************************************************************
+ * NAME:            CheckOptions
+ *
+ * DESCRIPTION:     Checks every option of a plan lies in its range
+ *
+ * PARAMETERS:      const convfilter_options*   :   o   -   the options to check
+ *
+ * RETURNS:         int - a convfilter_status
+ **********************************************************************************/
+static int CheckOptions (const convfilter_options* o) {
+    if (o->type < CONVFILTER_UINT8 || o->type > CONVFILTER_DOUBLE) {
+        return CONVFILTER_BAD_TYPE;
+    }
+    if (o->rows <= 0 || o->cols <= 0 || o->depth <= 0 || o->threads <= 0 ||
+        o->mode < 0 || o->mode >= FILTER_MODES || o->border < 0 ||
+        o->border >= BORDER_MODES || o->engine < 0 || o->engine >= FILTER_ENGINES ||
+        (o->ranged && o->low > o->high)) {
+        return CONVFILTER_BAD_OPTIONS;
+    }
+    if (o->mode == FILTER_GAUSSIAN && o->sigma != 0 && o->sigma < GAUSSIAN_MIN_SIGMA) {
+        return CONVFILTER_BAD_OPTIONS;
+    }
+    return CONVFILTER_OK;
+}
+
+/***********************************************************************************
+ * NAME:            convfilter_default_options
+ *
+ * DESCRIPTION:     Fills in the default options, leaving the shape 0 x 0
+ *
+ * PARAMETERS:      convfilter_options* :   options -   the options to fill in
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+extern "C" void convfilter_default_options (convfilter_options* options) {
+    options->type = CONVFILTER_INT32;
+    options->rows = 0;
+    options->cols = 0;
+    options->mode = CONVFILTER_MEAN;
+    options->depth = 1;
+    options->sigma = 0;
+    options->border = CONVFILTER_BORDER_ZERO;
+    options->engine = CONVFILTER_ENGINE_AUTO;
+    options->threads = 1;
+    options->ranged = 0;
+    options->low = 0;
+    options->high = 0;
+}
+
+/***********************************************************************************
+ * NAME:            convfilter_plan_create
+ *
+ * DESCRIPTION:     Makes a plan, allocating everything its executions need
+ *
+ * PARAMETERS:      const convfilter_options*   :   options -   the plan to make
+ *                  convfilter_plan**   :   plan    -   where to store the plan,
+ *                                                      NULL if it failed
+ *
+ * RETURNS:         int - a convfilter_status
+ **********************************************************************************/
+extern "C" int convfilter_plan_create (const convfilter_options* options,
+                                       convfilter_plan** plan) {
+    if (plan == NULL) {
+        return CONVFILTER_BAD_OPTIONS;
+    }
+    *plan = NULL;
+    if (options == NULL) {
+        return CONVFILTER_BAD_OPTIONS;
+    }
+
+    int status = CheckOptions(options);
+    if (status != CONVFILTER_OK) {
+        return status;
+    }
+
+    filter_settings settings;
+    settings.mode = options->mode;
+    settings.depth = options->depth;
+    settings.sigma = options->sigma != 0 ? options->sigma : options->depth;
+    settings.border = options->border;
+    settings.engine = options->engine;
+
+    convfilter_plan* p = new (nothrow) convfilter_plan;
+    if (p == NULL) {
+        return CONVFILTER_NO_MEMORY;
+    }
+    p->options = *options;
+
+    try {
+        switch (options->type) {
+            case CONVFILTER_UINT8:
+                p->typed = CreateTypedPlan<uint8_t>(options, settings);
+                break;
+            case CONVFILTER_INT16:
+                p->typed = CreateTypedPlan<int16_t>(options, settings);
+                break;
+            case CONVFILTER_INT32:
+                p->typed = CreateTypedPlan<int32_t>(options, settings);
+                break;
+            case CONVFILTER_FLOAT:
+                p->typed = CreateTypedPlan<float>(options, settings);
+                break;
+            default:
+                p->typed = CreateTypedPlan<double>(options, settings);
+                break;
+        }
+    } catch (const bad_alloc&) {
+        delete p;
+        return CONVFILTER_NO_MEMORY;
+    }
+
+    *plan = p;
+    return CONVFILTER_OK;
+}
+
+/***********************************************************************************
+ * NAME:            convfilter_execute
+ *
+ * DESCRIPTION:     Filters in into out with a plan. Both are row major
+ *                  buffers of the plan's type and shape, and must not overlap.
+ *
+ * PARAMETERS:      convfilter_plan*    :   plan    -   the plan to run
+ *                  const void* :   in          -   the matrix to filter
+ *                  long        :   in_stride   -   elements between rows of in,
+ *                                                  0 for the column count
+ *                  void*       :   out         -   where to put the result
+ *                  long        :   out_stride  -   the same for out
+ *
+ * RETURNS:         int - a convfilter_status
+ **********************************************************************************/
+extern "C" int convfilter_execute (convfilter_plan* plan, const void* in, long in_stride,
+                                   void* out, long out_stride) {
+    if (plan == NULL || in == NULL || out == NULL) {
+        return CONVFILTER_BAD_OPTIONS;
+    }
+
+    long cols = plan->options.cols;
+    in_stride = in_stride == 0 ? cols : in_stride;
+    out_stride = out_stride == 0 ? cols : out_stride;
+    if (in_stride < cols || out_stride < cols) {
+        return CONVFILTER_BAD_OPTIONS;
+    }
+
+    switch (plan->options.type) {
+        case CONVFILTER_UINT8:
+            return ExecuteTypedPlan<uint8_t>(plan, in, in_stride, out, out_stride);
+        case CONVFILTER_INT16:
+            return ExecuteTypedPlan<int16_t>(plan, in, in_stride, out, out_stride);
+        case CONVFILTER_INT32:
+            return ExecuteTypedPlan<int32_t>(plan, in, in_stride, out, out_stride);
+        case CONVFILTER_FLOAT:
+            return ExecuteTypedPlan<float>(plan, in, in_stride, out, out_stride);
+        default:
+            return ExecuteTypedPlan<double>(plan, in, in_stride, out, out_stride);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            convfilter_plan_destroy
+ *
+ * DESCRIPTION:     Frees a plan and everything it allocated
+ *
+ * PARAMETERS:      convfilter_plan*    :   plan    -   the plan, may be NULL
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+extern "C" void convfilter_plan_destroy (convfilter_plan* plan) {
+    if (plan == NULL) {
+        return;
+    }
+
+    switch (plan->options.type) {
+        case CONVFILTER_UINT8:  DestroyTypedPlan<uint8_t>(plan->typed);  break;
+        case CONVFILTER_INT16:  DestroyTypedPlan<int16_t>(plan->typed);  break;
+        case CONVFILTER_INT32:  DestroyTypedPlan<int32_t>(plan->typed);  break;
+        case CONVFILTER_FLOAT:  DestroyTypedPlan<float>(plan->typed);    break;
+        default:                DestroyTypedPlan<double>(plan->typed);   break;
+    }
+    delete plan;
+}
+
+/***********************************************************************************
+ * NAME:            convfilter_status_name
+ *
+ * DESCRIPTION:     Describes a status code
+ *
+ * PARAMETERS:      int     :   status  -   a convfilter_status
+ *
+ * RETURNS:         const char* - the description, or "unknown status"
+ **********************************************************************************/
+extern "C" const char* convfilter_status_name (int status) {
+    switch (status) {
+        case CONVFILTER_OK:             return "ok";
+        case CONVFILTER_BAD_OPTIONS:    return "bad options";
+        case CONVFILTER_BAD_TYPE:       return "bad element type";
+        case CONVFILTER_NO_MEMORY:      return "out of memory";
+        case CONVFILTER_NO_THREADS:     return "could not start threads";
+        default:                        return "unknown status";
+    }
+}
@@ -0,0 +1,156 @@
+/***********************************************************************************
+ * FILENAME:        convfilter.h
+ *
+ * DESCRIPTION:     The public interface of libconvfilter, the filter engine
+ *                  of convolution as a library. It is usable from C and C++.
+ *
+ *                  A plan is made once for a matrix shape, element type and
+ *                  filter. Making it allocates every buffer and scratch
+ *                  matrix the filter will need. Executing it filters a
+ *                  caller's row major buffer into another of the caller's
+ *                  buffers. Nothing is copied and nothing is allocated, so a
+ *                  plan can be executed as often as needed. A plan may be
+ *                  executed by one thread at a time.
+ *
+ *                  C callers use the convfilter_ functions. C++ callers can
+ *                  use FilterPlan, which owns a plan and checks the element
+ *                  type of the buffers it is given.
+ *
+ *                  The library is C++ inside. Link libconvfilter.so with
+ *                      -lconvfilter -pthread
+ *                  and libconvfilter.a, which does not bring the C++
+ *                  runtime along, with
+ *                      libconvfilter.a -lstdc++ -pthread -lm
+ *                  when the program is linked by a C compiler.
+ ***********************************************************************************/
+
+#ifndef CONVFILTER_H
+#define CONVFILTER_H
+
+#include <stddef.h>     // Used for NULL
+#include <stdint.h>     // Fixed width types
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Element types of a plan, the same codes as a matrix file's matrix_type     */
+enum convfilter_type { CONVFILTER_UINT8 = 1, CONVFILTER_INT16 = 2, CONVFILTER_INT32 = 3,
+                       CONVFILTER_FLOAT = 4, CONVFILTER_DOUBLE = 5 };
+
+/* Filters a plan can run, the same as convolution's --mode                    */
+enum convfilter_mode { CONVFILTER_MEAN, CONVFILTER_MEDIAN, CONVFILTER_MIN,
+                       CONVFILTER_MAX, CONVFILTER_OPEN, CONVFILTER_CLOSE,
+                       CONVFILTER_GAUSSIAN };
+
+/* Values outside the matrix, the same as convolution's --border               */
+enum convfilter_border { CONVFILTER_BORDER_ZERO, CONVFILTER_BORDER_CLAMP,
+                         CONVFILTER_BORDER_REFLECT, CONVFILTER_BORDER_WRAP };
+
+/* Kernels, the same as convolution's --engine                                 */
+enum convfilter_engine { CONVFILTER_ENGINE_AUTO, CONVFILTER_ENGINE_DIRECT,
+                         CONVFILTER_ENGINE_HISTOGRAM, CONVFILTER_ENGINE_RUNNING_SUM,
+                         CONVFILTER_ENGINE_INTEGRAL };
+
+/* Status codes returned by the convfilter_ functions                          */
+enum convfilter_status { CONVFILTER_OK = 0, CONVFILTER_BAD_OPTIONS = -1,
+                         CONVFILTER_BAD_TYPE = -2, CONVFILTER_NO_MEMORY = -3,
+                         CONVFILTER_NO_THREADS = -4 };
+
+/* What a plan is made for. convfilter_default_options fills in everything    */
+/* but the shape.                                                              */
+struct convfilter_options {
+    uint32_t type;      /* a convfilter_type, CONVFILTER_INT32 by default      */
+    long rows;
+    long cols;
+    int mode;           /* a convfilter_mode, CONVFILTER_MEAN by default       */
+    int depth;          /* neighbourhood depth, 1 by default                   */
+    double sigma;       /* gaussian standard deviation, 0 for the depth        */
+    int border;         /* a convfilter_border, zero by default                */
+    int engine;         /* a convfilter_engine, automatic by default           */
+    int threads;        /* worker threads, 1 by default                        */
+    int ranged;         /* non-zero when every input value lies in             */
+    double low;         /* [low, high]. Otherwise the type's whole range is    */
+    double high;        /* assumed, which can rule out the histogram median.   */
+};
+
+typedef struct convfilter_plan convfilter_plan;
+
+void convfilter_default_options(struct convfilter_options *options);
+int convfilter_plan_create(const struct convfilter_options *options,
+                           convfilter_plan **plan);
+int convfilter_execute(convfilter_plan *plan, const void *in, long in_stride,
+                       void *out, long out_stride);
+void convfilter_plan_destroy(convfilter_plan *plan);
+const char *convfilter_status_name(int status);
+
+#ifdef __cplusplus
+}
+
+// Owns a plan for C++ callers. The buffers given to Execute must hold the
+// element type the plan was made for.
+class FilterPlan {
+public:
+    /*******************************************************************************
+     * NAME:            FilterPlan
+     *
+     * DESCRIPTION:     Makes a plan, check Status afterwards to see if it worked
+     *
+     * PARAMETERS:      const convfilter_options&   :   options -   the plan to make
+     *******************************************************************************/
+    explicit FilterPlan (const convfilter_options& options)
+        : plan(NULL), type(options.type) {
+        status = convfilter_plan_create(&options, &plan);
+    }
+
+    ~FilterPlan () {
+        convfilter_plan_destroy(plan);
+    }
+
+    // The status of making the plan, CONVFILTER_OK if it can be executed
+    int Status () const {
+        return status;
+    }
+
+    /*******************************************************************************
+     * NAME:            Execute
+     *
+     * DESCRIPTION:     Filters in into out, which must not overlap
+     *
+     * PARAMETERS:      const T*    :   in          -   the matrix to filter
+     *                  T*          :   out         -   where to put the result
+     *                  long        :   inStride    -   elements between rows of
+     *                                                  in, 0 for the column count
+     *                  long        :   outStride   -   the same for out
+     *
+     * RETURNS:         int - a convfilter_status
+     *******************************************************************************/
+    template <typename T>
+    int Execute (const T* in, T* out, long inStride = 0, long outStride = 0) {
+        if (status != CONVFILTER_OK) {
+            return status;
+        }
+        if (TypeOf((T*) NULL) != type) {
+            return CONVFILTER_BAD_TYPE;
+        }
+        return convfilter_execute(plan, in, inStride, out, outStride);
+    }
+
+private:
+    static uint32_t TypeOf (uint8_t*) { return CONVFILTER_UINT8; }
+    static uint32_t TypeOf (int16_t*) { return CONVFILTER_INT16; }
+    static uint32_t TypeOf (int32_t*) { return CONVFILTER_INT32; }
+    static uint32_t TypeOf (float*) { return CONVFILTER_FLOAT; }
+    static uint32_t TypeOf (double*) { return CONVFILTER_DOUBLE; }
+
+    FilterPlan (const FilterPlan&);
+    FilterPlan& operator= (const FilterPlan&);
+
+    convfilter_plan* plan;
+    uint32_t type;
+    int status;
+};
+
+#endif
+
+#endif
@@ -4,11 +4,71 @@
  * AUTHOR:          Henry Campbell
  * 
  * DESCRIPTION:     A simple threaded implementation of a convolution filter
- *                  for a given square matrix.
+ *                  for a given matrix.
  * 
  * ARGUMENTS:       matrixFile  - the filename of the file containing a matrix
  *                  depth       - the neighbourhood depth to use for the filter
  *                  numThreads  - the number of threads to use for the program 
+ *
+ * OPTIONS:         --text      - matrixFile holds one row per line of whitespace
+ *                                or comma separated values rather than binary
+ *                  --type name - element type of a text matrix, one of uint8,
+ *                                int16, int32 (the default), float or double.
+ *                                Binary matrices take their type from their
+ *                                header, or are int32 when they have none
+ *                  --mode name - filter to run, mean (the default), median,
+ *                                min, max, open (min then max), close (max
+ *                                then min) or gaussian
+ *                  --sigma x   - standard deviation of the gaussian mode, at
+ *                                least 0.5. Defaults to the depth, which the
+ *                                gaussian mode otherwise ignores
+ *                  --border name - how values outside the matrix are found,
+ *                                zero (the default), clamp, reflect or wrap
+ *                  --engine name - kernel to use where a mode has more than
+ *                                one: auto (the default, chosen by the cost
+ *                                model), direct, histogram (median),
+ *                                running-sum or integral (mean)
+ *                  --stats[=json] - time every phase and worker band and print
+ *                                a throughput report at exit, as text or JSON
+ *                  --counters  - add each worker's hardware counters to the
+ *                                stats, implies --stats
+ *                  --trace file - write a Chrome trace event timeline of the
+ *                                phases, worker bands and barrier waits
+ *                  --verbose n - worker messages, 0 for none, 1 for start and
+ *                                finish (the default), 2 for rows and kernels
+ *                  --quiet     - the same as --verbose 0
+ *                  --tune      - time every engine and thread count up to
+ *                                numThreads on this matrix, filter with the
+ *                                fastest and remember it in the wisdom file
+ *                  --wisdom file - the wisdom file, $CONVOLUTION_WISDOM or
+ *                                ~/.convolution_wisdom by default. Without
+ *                                --tune or --engine, a problem found in it is
+ *                                filtered with the engine and thread count
+ *                                stored, never more than numThreads
+ *                  --server socket - send the request to the convserver
+ *                                listening on socket and print its reply,
+ *                                rather than filtering here. Only binary
+ *                                matrices can be served, and only the mode,
+ *                                sigma, border and engine are passed on
+ *                  --cache dir - keep filtered matrices in dir, keyed by a hash
+ *                                of the input's values and the filter, and
+ *                                print a cached one rather than filtering
+ *                                the same matrix the same way again.
+ *                                $CONVOLUTION_CACHE by default, off if unset
+ *                  --cache-mb n - the most the cache may hold, 1024 by default.
+ *                                The results used longest ago are evicted
+ *                  --output file - write the filtered matrix to file as a
+ *                                binary matrix of matrixFile's element type,
+ *                                rather than printing it. With --server the
+ *                                server writes it
+ *                  --watch out - keep running, filtering matrixFile into the
+ *                                binary matrix file out and refiltering only
+ *                                the bands that changed each time matrixFile
+ *                                is written. If matrixFile is a directory,
+ *                                every binary matrix file in it is filtered
+ *                                into the directory out under its own name.
+ *                                Only --mode, --sigma, --border and --engine
+ *                                apply
  * 
  * USAGE:           Compile the program using either g++ or makefile
  *                      > g++ -pthread convolution.cc -o convolution
@@ -16,55 +76,84 @@
  *                      > make
  * 
  *                  You can then run the program using either of the following
- *                      > ./convolution [matrixFile] [depth] [numThreads]
+ *                      > ./convolution [options] [matrixFile] [depth] [numThreads]
  *                  OR
  *                      > make run
 ***********************************************************************************/
 
-// TODO:    
-//          Pad matrix with 0's so we can more easily work with it
-//          Have threads calculate their the new values for their given row(s)
-//          Have threads insert their new rows into a new 2D array
-//          Display the new array, and we're done
-
 #include <iostream>     // Basic IO
-#include <pthread.h>    // Threads
 #include <sys/types.h>  // Thread ID types  
 #include <string>       // Strings
 #include <math.h>       // Used for sqrt, ceil
 #include "matrix.h"     // Used for matrix operations
 #include <fcntl.h>      // Used for file reading
 #include <unistd.h>     // Used for O_RDONLY
+#include <sys/stat.h>   // Used for stat
+#include <getopt.h>     // Used for option parsing
+#include "matrixtext.h" // Used for reading text matrices
+#include "engine.h"     // Used for the threaded filter engine
+#include "wisdom.h"     // Used for tuning
+#include "serve.h"      // Used for sending requests to convserver
+#include "matrixfile.h" // Used for printing matrices
+#include "resultcache.h" // Used for caching results
+#include "watch.h"      // Used for watch mode
+#include <sys/inotify.h> // Used for watching files
+#include <dirent.h>     // Used for watching directories
+#include <map>          // Used for the watched files
+#include <errno.h>      // Used for EINTR
+#include <limits>       // Used for numeric_limits
+#include <algorithm>    // Used for copy
+#include <type_traits>  // Used for is_same
+#include <limits.h>     // Used for PATH_MAX
 
 using namespace std;
 
-// Structure used for passing arguments to thread entry functions
-struct argument_structure {
-    int** matrix;
-    int matrixDim;
-    int numT;
-    int tid;
+// Where the filtered matrix goes
+struct result_sink {
+    string file;                // The --output file, empty to print it
+    uint32_t type;              // The element type to write it as
 };
 
 /***********************************************************************************
- * NAME:            PrettyPrintMatrix
+ * NAME:            PrintUsage
  * 
- * DESCRIPTION:     Pretty prints a given square matrix (represented by a 2D array)
- *                  out to the console
+ * DESCRIPTION:     Prints the command line usage of the program
  * 
- * PARAMETERS:      int**   :   matrix      -   the matrix to print
- *                  int     :   matrixDim   -   the dimension of the matrix           
+ * PARAMETERS:      None
  *        
- * RETURNS:         Void, but exits the program if incorrect values have been
- *                  given
+ * RETURNS:         Void
  **********************************************************************************/ 
-void PrettyPrintMatrix (int** matrix, int matrixDim) {
-    for (int i = 0; i < matrixDim; i++) {
-        for (int j = 0; j < matrixDim; j++) {
-            cout << matrix[i][j] << "\t";
-        }
-        cout << endl;
-    }
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvolution [options] [matrixFile] [filterDepth] [numThreads]" << endl;
+    cout << "Options:" << endl;
+    cout << "\t--text\t\tmatrixFile is a text matrix, one row per line" << endl;
+    cout << "\t--type name\telement type of a text matrix: uint8, int16, int32,";
+    cout << " float or double" << endl;
+    cout << "\t--mode name\tfilter to run: mean (the default), median, min, max,";
+    cout << " open, close or gaussian" << endl;
+    cout << "\t--sigma x\tstandard deviation for gaussian, defaults to the depth";
+    cout << endl;
+    cout << "\t--border name\tvalues outside the matrix: zero (the default), clamp,";
+    cout << " reflect or wrap" << endl;
+    cout << "\t--engine name\tkernel to use: auto (the default), direct, histogram,";
+    cout << " running-sum or integral" << endl;
+    cout << "\t--stats[=json]\tprint phase and worker timings at exit" << endl;
+    cout << "\t--counters\tadd hardware counters per worker to the stats" << endl;
+    cout << "\t--trace file\twrite a Chrome trace event timeline to file" << endl;
+    cout << "\t--verbose n\tworker messages: 0 none, 1 start and finish (the";
+    cout << " default), 2 rows and kernels too" << endl;
+    cout << "\t--quiet\t\tthe same as --verbose 0" << endl;
+    cout << "\t--tune\t\tfind the fastest engine and thread count and remember it";
+    cout << endl;
+    cout << "\t--wisdom file\twhere tuning is remembered, $CONVOLUTION_WISDOM or";
+    cout << " ~/.convolution_wisdom by default" << endl;
+    cout << "\t--server socket\thave the convserver on socket filter the matrix" << endl;
+    cout << "\t--cache dir\treuse results filtered before, $CONVOLUTION_CACHE by";
+    cout << " default" << endl;
+    cout << "\t--cache-mb n\tthe most the cache may hold, 1024 by default" << endl;
+    cout << "\t--output file\twrite the filtered matrix to a binary file" << endl;
+    cout << "\t--watch out\tkeep filtering matrixFile into out as it changes" << endl;
 }
 
 /***********************************************************************************
@@ -76,93 +165,278 @@ void PrettyPrintMatrix (int** matrix, int matrixDim) {
  * PARAMETERS:      int     :   argc    -   number of command line arguments
  *                  char**  :   argv    -   the command line arguments
  *                  string* :   file    -   varible to store matrix filename
- *                  int*    :   dpth    -   variable to store the filter depth
+ *                  filter_settings*    :   settings    -   variable to store
+ *                                                          the depth and mode
  *                  int*    :   nTh     -   varible to store number of threads             
+ *                  bool*   :   text    -   variable to store if the file is text
+ *                  uint32_t*   :   type    -   variable to store the text type
+ *                  run_stats*  :   stats   -   records to enable if --stats is given
+ *                  string* :   traceFile   -   variable to store the --trace file,
+ *                                              left empty when not tracing
+ *                  int*    :   verbosity   -   variable to store the log_level of
+ *                                              the worker messages
+ *                  wisdom_options* :   wisdom  -   variable to store the wisdom
+ *                                                  file and whether to tune
+ *                  string* :   serverPath  -   variable to store the --server
+ *                                              socket, left empty to filter here
+ *                  result_cache*   :   cache   -   variable to store the result
+ *                                                  cache and its size cap
+ *                  string* :   watchPath   -   variable to store the --watch
+ *                                              output, left empty to run once
+ *                  string* :   output  -   variable to store the --output file,
+ *                                          left empty to print the result
  *        
  * RETURNS:         Void, but exits the program if incorrect values have been
  *                  given
  **********************************************************************************/ 
-void ProcessArguments (int argc, char** argv, string* file, int* dpth, int* nTh) {
+void ProcessArguments (int argc, char** argv, string* file, filter_settings* settings,
+                       int* nTh, bool* text, uint32_t* type, run_stats* stats,
+                       string* traceFile, int* verbosity, wisdom_options* wisdom,
+                       string* serverPath, result_cache* cache, string* watchPath,
+                       string* output) {
+    static struct option longOptions[] = {
+        {"text", no_argument, 0, 't'},
+        {"type", required_argument, 0, 'y'},
+        {"mode", required_argument, 0, 'm'},
+        {"sigma", required_argument, 0, 's'},
+        {"border", required_argument, 0, 'b'},
+        {"engine", required_argument, 0, 'e'},
+        {"stats", optional_argument, 0, 'S'},
+        {"counters", no_argument, 0, 'C'},
+        {"trace", required_argument, 0, 'T'},
+        {"verbose", required_argument, 0, 'v'},
+        {"quiet", no_argument, 0, 'q'},
+        {"tune", no_argument, 0, 'U'},
+        {"wisdom", required_argument, 0, 'W'},
+        {"server", required_argument, 0, 'D'},
+        {"cache", required_argument, 0, 'K'},
+        {"cache-mb", required_argument, 0, 'M'},
+        {"watch", required_argument, 0, 'w'},
+        {"output", required_argument, 0, 'o'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    *text = false;
+    *type = MATRIX_INT32;
+    settings->mode = -1;
+    settings->sigma = 0;
+    settings->border = -1;
+    settings->engine = ENGINE_AUTO;
+    *verbosity = LOG_INFO;
+    wisdom->file = DefaultWisdomFile();
+    wisdom->tune = false;
+    cache->dir = DefaultResultCache();
+    cache->limit = (size_t) RESULT_CACHE_MB << 20;
+    InitStats(stats, false, false);
+
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                *text = true;
+                break;
+            case 'y':
+                *type = 0;
+                for (uint32_t t = MATRIX_UINT8; t <= MATRIX_DOUBLE; t++) {
+                    if (string(optarg) == matrix_type_name(t)) {
+                        *type = t;
+                    }
+                }
+                if (*type == 0) {
+                    cout << "[ERROR] Unknown element type '" << optarg << "'" << endl;
+                    PrintUsage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                settings->mode = ParseFilterMode(optarg);
+                if (settings->mode == -1) {
+                    cout << "[ERROR] Unknown filter mode '" << optarg << "'" << endl;
+                    PrintUsage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                settings->sigma = atof(optarg);
+                if (settings->sigma < GAUSSIAN_MIN_SIGMA) {
+                    cout << "[ERROR] sigma must be at least " << GAUSSIAN_MIN_SIGMA << endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'b':
+                settings->border = ParseBorderMode(optarg);
+                if (settings->border == -1) {
+                    cout << "[ERROR] Unknown border mode '" << optarg << "'" << endl;
+                    PrintUsage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                settings->engine = ParseEngine(optarg);
+                if (settings->engine == -1) {
+                    cout << "[ERROR] Unknown engine '" << optarg << "'" << endl;
+                    PrintUsage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                if (optarg != NULL && string(optarg) != "json" &&
+                    string(optarg) != "text") {
+                    cout << "[ERROR] Unknown stats format '" << optarg << "'" << endl;
+                    PrintUsage();
+                    exit(EXIT_FAILURE);
+                }
+                stats->enabled = true;
+                stats->json = optarg != NULL && string(optarg) == "json";
+                break;
+            case 'C':
+                stats->enabled = true;
+                stats->counters = true;
+                break;
+            case 'T':
+                *traceFile = optarg;
+                break;
+            case 'v':
+                *verbosity = atoi(optarg);
+                if (*verbosity < LOG_QUIET || *verbosity >= LOG_LEVELS ||
+                    string(optarg) != to_string(*verbosity)) {
+                    cout << "[ERROR] --verbose takes 0, 1 or 2, not '" << optarg << "'"
+                         << endl;
+                    PrintUsage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                *verbosity = LOG_QUIET;
+                break;
+            case 'U':
+                wisdom->tune = true;
+                break;
+            case 'W':
+                wisdom->file = optarg;
+                break;
+            case 'D':
+                *serverPath = optarg;
+                break;
+            case 'K':
+                cache->dir = optarg;
+                break;
+            case 'M':
+                if (atol(optarg) <= 0) {
+                    cout << "[ERROR] --cache-mb takes a positive number, not '" << optarg;
+                    cout << "'" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                cache->limit = (size_t) atol(optarg) << 20;
+                break;
+            case 'w':
+                *watchPath = optarg;
+                break;
+            case 'o':
+                *output = optarg;
+                break;
+            default:
+                PrintUsage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
     // Check we've been given the correct number of arguments
-    if (argc < 4) {
+    if (argc - optind < 3) {
         cout << "[ERROR] Invalid number of arguments given." << endl;
-        cout << "Usage:" << endl;
-        cout << "\tconvolution [matrixFile] [filterDepth] [numThreads]" << endl;
+        PrintUsage();
         
         exit(EXIT_FAILURE);
     }
 
-    // Check we've been given numbers for depth and numThreads
-    if (atoi(argv[2]) == 0 || atoi(argv[3]) == 0) {
+    char** positional = argv + optind;
+
+    // Check we've been given positive numbers for depth and numThreads
+    if (atoi(positional[1]) <= 0 || atoi(positional[2]) <= 0) {
         cout << "[ERROR] Invalid values given for depth or numThreads" << endl;
-        cout << "Usage:" << endl;
-        cout << "\tconvolution [matrixFile] [filterDepth] [numThreads]" << endl;
+        PrintUsage();
         cout << "Where filterDepth and numThreads are ints > 0" << endl;
         
         exit(EXIT_FAILURE);
     }
 
-    *file = argv[1];
-    *dpth = atoi(argv[2]);
-    *nTh = atoi(argv[3]);
+    *file = positional[0];
+    settings->depth = atoi(positional[1]);
+    if (settings->mode == -1) {
+        settings->mode = FILTER_MEAN;
+    }
+    if (settings->border == -1) {
+        settings->border = BORDER_ZERO;
+    }
+    if (settings->sigma == 0) {
+        settings->sigma = settings->depth;
+    }
+    *nTh = atoi(positional[2]);
+
+    // The server reads the matrix itself and keeps its own records
+    if (!serverPath->empty() && (*text || wisdom->tune || stats->enabled ||
+                                 !traceFile->empty())) {
+        cout << "[ERROR] --server can't be used with --text, --tune, --stats,";
+        cout << " --counters or --trace" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!watchPath->empty() && (*text || wisdom->tune || stats->enabled ||
+                                !traceFile->empty() || !serverPath->empty())) {
+        cout << "[ERROR] --watch can't be used with --text, --tune, --stats, --counters,";
+        cout << " --trace or --server" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (!output->empty() && !watchPath->empty()) {
+        cout << "[ERROR] --output can't be used with --watch" << endl;
+        exit(EXIT_FAILURE);
+    }
 }
 
 /***********************************************************************************
- * NAME:            GetMatrixDimension
+ * NAME:            GetMatrixHeader
  * 
- * DESCRIPTION:     Gets the dimension used in a given matrix file. Note that
- *                  this function will not work for files over 2 GB, and is
- *                  only applicable to square matrixes e.g. a 4x4 matrix
+ * DESCRIPTION:     Gets the shape, element type and layout of a given matrix
+ *                  file. Files starting with a matrix_header describe
+ *                  themselves, anything else is taken to be a raw square
+ *                  matrix of ints whose dimension follows from the file size.
  * 
  * PARAMETERS:      string  :   filenameStr    -   the name of the matrix file
  * 
- * RETURNS:         int - the dimension of the matrix e.g. 5 for a 5x5 matrix
+ * RETURNS:         matrix_header - the description of the matrix, exits the
+ *                                  program if the file can't be described
  **********************************************************************************/
-int GetMatrixDimension (string filenameStr) {
-    int size;
-    int dimension;
+matrix_header GetMatrixHeader (string filenameStr) {
+    int fd;
+    matrix_header header;
 
     const char* filename = filenameStr.c_str();
 
-    FILE* file = fopen(filename, "r");
-
-    if (file == NULL) {
+    if ((fd = open(filename, O_RDONLY)) == -1) {
         printf("[ERROR] Could not open file '%s'\n", filename);
         exit(1);
     }
 
-    if (fseek(file, 0, SEEK_END) != 0) {
-        printf("[ERROR] Could not get dimension for file '%s'\n", filename);
+    if (get_header(fd, &header) != 0) {
+        printf("\n[ERROR] Could not get dimensions for file '%s'\n", filename);
         exit(1);
     }
 
-    size = ftell(file);
-    if (size == -1) {
-        printf("[ERROR] Could not get dimension for file '%s'\n", filename);
-        exit(1);
-    }
+    close(fd);
 
-    fclose(file);
-
-    dimension = size / 4;
-    return sqrt(dimension);
+    return header;
 }
 
 /***********************************************************************************
- * NAME:            ReadMatrixFile
+ * NAME:            OpenMatrixFile
  * 
- * DESCRIPTION:     Reads in a matrix from a given file
+ * DESCRIPTION:     Opens a matrix file for reading
  * 
  * PARAMETERS:      string  :   filenameStr -   the name of the matrix file
- *                  int     :   matDim      -   dimension of square matrix
  * 
- * RETURNS:         int**   : matrix2D      -   a pointer to the 2D array
+ * RETURNS:         int - the file descriptor, exits the program on failure
  **********************************************************************************/
-int** ReadMatrixFile (string filenameStr, int matDim) {
+int OpenMatrixFile (string filenameStr) {
     int fd;
-    int **matrix2D = 0;
-    matrix2D = new int*[matDim];
-
     const char* filename = filenameStr.c_str();
 
     printf("Reading matrix from file '%s'\n", filename);
@@ -172,114 +446,752 @@ int** ReadMatrixFile (string filenameStr, int matDim) {
         exit(1); 
     }
 
-    for (int i = 0; i < matDim; i++) {
-        matrix2D[i] = new int[matDim];
-        get_row(fd, matDim, i+1, matrix2D[i]);
+    return fd;
+}
+
+/***********************************************************************************
+ * NAME:            ReadMatrixFile
+ * 
+ * DESCRIPTION:     Reads in a matrix from a given file, a band of rows at a
+ *                  time, finding its smallest and largest values and feeding
+ *                  them to the hash as it goes. The rows of the returned
+ *                  matrix all point into one contiguous block.
+ * 
+ * PARAMETERS:      string          :   filenameStr -   the name of the matrix file
+ *                  matrix_header   :   header      -   description of the file
+ *                  T*              :   minValue    -   variable to store the minimum
+ *                  T*              :   maxValue    -   variable to store the maximum
+ *                  content_hash*   :   hash        -   hash to feed, or NULL
+ * 
+ * RETURNS:         T**     : matrix2D      -   a pointer to the 2D array
+ **********************************************************************************/
+template <typename T>
+T** ReadMatrixFile (string filenameStr, matrix_header header, T* minValue, T* maxValue,
+                    content_hash* hash) {
+    long rows = header.rows;
+    long cols = header.cols;
+    long band = BandRows(header);
+    T **matrix2D = AllocateMatrix<T>(rows, cols);
+    int fd = OpenMatrixFile(filenameStr);
+
+    *minValue = numeric_limits<T>::max();
+    *maxValue = numeric_limits<T>::lowest();
+
+    for (long row = 0; row < rows; row += band) {
+        long count = rows - row < band ? rows - row : band;
+
+        if (get_rows(fd, &header, row + 1, count, matrix2D[row]) != 0) {
+            printf("\n[ERROR] Could not read matrix from file '%s'\n", filenameStr.c_str());
+            exit(1);
+        }
+        ScanRange(matrix2D[row], (size_t) count * cols, minValue, maxValue);
+        if (hash != NULL) {
+            UpdateHash(hash, matrix2D[row], (size_t) count * cols * sizeof(T));
+        }
+    }
+
+    close(fd);
+
+    return matrix2D;
+}
+
+/***********************************************************************************
+ * NAME:            ReadMatrixFileNarrowed
+ * 
+ * DESCRIPTION:     Reads in a matrix of type T from a given file, storing it as
+ *                  the narrower type N for as long as every value fits. Each
+ *                  band is read into a small T buffer, scanned, hashed at its
+ *                  full width and narrowed.
+ *                  If a value turns out not to fit, the bands already stored
+ *                  are widened into a T matrix and the rest is read into that
+ *                  directly, so the file is still only read once.
+ * 
+ * PARAMETERS:      string          :   filenameStr -   the name of the matrix file
+ *                  matrix_header   :   header      -   description of the file
+ *                  N***            :   narrowP     -   variable to store a narrow matrix
+ *                  T***            :   wideP       -   variable to store a wide matrix
+ *                  T*              :   minValue    -   variable to store the minimum
+ *                  T*              :   maxValue    -   variable to store the maximum
+ *                  content_hash*   :   hash        -   hash to feed, or NULL
+ * 
+ * RETURNS:         bool - true if the matrix was stored in *narrowP, false if
+ *                         it needed the full width and was stored in *wideP
+ **********************************************************************************/
+template <typename T, typename N>
+bool ReadMatrixFileNarrowed (string filenameStr, matrix_header header, N*** narrowP,
+                             T*** wideP, T* minValue, T* maxValue, content_hash* hash) {
+    long rows = header.rows;
+    long cols = header.cols;
+    long band = BandRows(header);
+    N **narrow = AllocateMatrix<N>(rows, cols);
+    T *buffer = new T[(size_t) band * cols];
+    int fd = OpenMatrixFile(filenameStr);
+    long row;
+
+    *minValue = numeric_limits<T>::max();
+    *maxValue = numeric_limits<T>::lowest();
+
+    for (row = 0; row < rows; row += band) {
+        long count = rows - row < band ? rows - row : band;
+        size_t values = (size_t) count * cols;
+
+        if (get_rows(fd, &header, row + 1, count, buffer) != 0) {
+            printf("\n[ERROR] Could not read matrix from file '%s'\n", filenameStr.c_str());
+            exit(1);
+        }
+        ScanRange(buffer, values, minValue, maxValue);
+        if (hash != NULL) {
+            UpdateHash(hash, buffer, values * sizeof(T));
+        }
+
+        if (*minValue < numeric_limits<N>::lowest() ||
+            *maxValue > numeric_limits<N>::max()) {
+            break;
+        }
+
+        N* dest = narrow[row];
+        for (size_t i = 0; i < values; i++) {
+            dest[i] = (N) buffer[i];
+        }
+    }
+
+    if (row >= rows) {
+        delete[] buffer;
+        close(fd);
+        *narrowP = narrow;
+        return true;
+    }
+
+    // Something didn't fit, so widen what we have and carry on at full width
+    T **wide = AllocateMatrix<T>(rows, cols);
+    size_t stored = (size_t) row * cols;
+    long count = rows - row < band ? rows - row : band;
+
+    for (size_t i = 0; i < stored; i++) {
+        wide[0][i] = narrow[0][i];
+    }
+    copy(buffer, buffer + (size_t) count * cols, wide[row]);
+    CleanupMatrix(narrow, rows);
+    delete[] buffer;
+
+    for (row += count; row < rows; row += band) {
+        count = rows - row < band ? rows - row : band;
+
+        if (get_rows(fd, &header, row + 1, count, wide[row]) != 0) {
+            printf("\n[ERROR] Could not read matrix from file '%s'\n", filenameStr.c_str());
+            exit(1);
+        }
+        ScanRange(wide[row], (size_t) count * cols, minValue, maxValue);
+        if (hash != NULL) {
+            UpdateHash(hash, wide[row], (size_t) count * cols * sizeof(T));
+        }
+    }
+
+    close(fd);
+    *wideP = wide;
+    return false;
+}
+
+
+/***********************************************************************************
+ * NAME:            UseWisdom
+ * 
+ * DESCRIPTION:     Tunes the filter on this matrix and remembers the winner
+ *                  when --tune is given. Otherwise looks for an earlier
+ *                  winner for the same problem, unless an engine was named.
+ *                  A winner found either way replaces the engine and lowers
+ *                  the thread count to the one it used.
+ * 
+ * PARAMETERS:      T**     :   matrix      -   the matrix to filter
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings*    :   settings    -   the filter to run
+ *                  int*    :   numThreads  -   the most threads to use
+ *                  double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *                  const wisdom_options*   :   wisdom  -   the wisdom file and
+ *                                                          whether to tune
+ *                  run_stats*  :   stats   -   records for the tune phase
+ * 
+ * RETURNS:         0 on success, -1 if tuning failed or couldn't be saved
+ **********************************************************************************/ 
+template <typename T>
+int UseWisdom (T** matrix, long rows, long cols, filter_settings* settings,
+               int* numThreads, double minValue, double maxValue,
+               const wisdom_options* wisdom, run_stats* stats) {
+    vector<wisdom_entry> entries;
+    wisdom_entry best;
+
+    if (!wisdom->tune && (wisdom->file.empty() || settings->engine != ENGINE_AUTO)) {
+        return 0;
+    }
+
+    best.key = MakeWisdomKey(ElementTraits<T>::type, rows, cols, *settings);
+    if (!wisdom->file.empty()) {
+        ReadWisdom(wisdom->file, &entries);
+    }
+
+    if (wisdom->tune) {
+        BeginPhase(stats);
+        if (TuneFilter(matrix, rows, cols, *settings, *numThreads, minValue, maxValue,
+                       &best) != 0) {
+            return -1;
+        }
+        EndPhase(stats, PHASE_TUNE);
+        printf("Tuned: %s engine with %d threads, %.6fs\n", EngineName(best.engine),
+               best.threads, best.seconds);
+
+        // Other runs may have tuned while this one did, so keep what they stored
+        entries.clear();
+        if (!wisdom->file.empty()) {
+            ReadWisdom(wisdom->file, &entries);
+        }
+        StoreWisdom(&entries, best);
+        if (!wisdom->file.empty() && WriteWisdom(wisdom->file, entries) != 0) {
+            return -1;
+        }
+    } else {
+        const wisdom_entry* found = FindWisdom(entries, best.key);
+        if (found == NULL) {
+            return 0;
+        }
+        best = *found;
+        printf("Wisdom: %s engine with %d threads\n", EngineName(best.engine),
+               best.threads);
+    }
+
+    settings->engine = best.engine;
+    *numThreads = best.threads < *numThreads ? best.threads : *numThreads;
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            WriteResult
+ * 
+ * DESCRIPTION:     Prints a filtered matrix, or writes it to the --output file
+ *                  as the element type of the matrix it was filtered from
+ * 
+ * PARAMETERS:      T**     :   result  -   the filtered matrix
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *                  const result_sink&  :   sink    -   where it goes
+ * 
+ * RETURNS:         0 on success, -1 if the file could not be written
+ **********************************************************************************/ 
+template <typename T>
+int WriteResult (T** result, long rows, long cols, const result_sink& sink) {
+    int status = -1;
+
+    if (sink.file.empty()) {
+        cout << "\nFiltered Matrix" << endl;
+        PrettyPrintMatrix(result, rows, cols);
+        return 0;
+    }
+
+    switch (sink.type) {
+        case MATRIX_UINT8:
+            status = WriteMatrixFileAs<uint8_t>(sink.file, result, rows, cols);
+            break;
+        case MATRIX_INT16:
+            status = WriteMatrixFileAs<int16_t>(sink.file, result, rows, cols);
+            break;
+        case MATRIX_INT32:
+            status = WriteMatrixFileAs<int32_t>(sink.file, result, rows, cols);
+            break;
+        case MATRIX_FLOAT:
+            status = WriteMatrixFileAs<float>(sink.file, result, rows, cols);
+            break;
+        case MATRIX_DOUBLE:
+            status = WriteMatrixFileAs<double>(sink.file, result, rows, cols);
+            break;
     }
+    if (status == 0) {
+        printf("\nFiltered matrix written to '%s'\n", sink.file.c_str());
+    } else {
+        printf("\n[ERROR] Could not write the filtered matrix to '%s'\n",
+               sink.file.c_str());
+    }
+
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            PrintResultFile
+ * 
+ * DESCRIPTION:     Reads a filtered matrix of element type T from an open
+ *                  file and prints or writes it. Nothing is printed if it
+ *                  can't be read.
+ * 
+ * PARAMETERS:      int     :   fd      -   the open matrix file
+ *                  const matrix_header&    :   header  -   the file's header
+ *                  const result_sink&  :   sink    -   where the matrix goes
+ * 
+ * RETURNS:         0 on success, -1 if the matrix could not be read or written
+ **********************************************************************************/ 
+template <typename T>
+int PrintResultFile (int fd, const matrix_header& header, const result_sink& sink) {
+    double minValue, maxValue;
+    T** result = ReadMatrixRows<T>(fd, header, &minValue, &maxValue);
 
-   return matrix2D;
+    if (result == NULL) {
+        return -1;
+    }
+    int status = WriteResult(result, header.rows, header.cols, sink);
+    CleanupMatrix(result, header.rows);
+    return status;
+}
 
+/***********************************************************************************
+ * NAME:            PrintCachedResult
+ * 
+ * DESCRIPTION:     Prints or writes a result found in the cache. It may have
+ *                  been stored narrowed, but printing and writing promote the
+ *                  values, so it comes out the same as filtering again would.
+ * 
+ * PARAMETERS:      int     :   fd      -   the open result file
+ *                  const matrix_header&    :   header  -   the file's header
+ *                  const result_sink&  :   sink    -   where the matrix goes
+ * 
+ * RETURNS:         0 on success, -1 if the result could not be read or written
+ **********************************************************************************/ 
+int PrintCachedResult (int fd, const matrix_header& header, const result_sink& sink) {
+    switch (header.type) {
+        case MATRIX_UINT8:
+            return PrintResultFile<uint8_t>(fd, header, sink);
+        case MATRIX_INT16:
+            return PrintResultFile<int16_t>(fd, header, sink);
+        case MATRIX_INT32:
+            return PrintResultFile<int32_t>(fd, header, sink);
+        case MATRIX_FLOAT:
+            return PrintResultFile<float>(fd, header, sink);
+        case MATRIX_DOUBLE:
+            return PrintResultFile<double>(fd, header, sink);
+        default:
+            return -1;
+    }
 }
 
 /***********************************************************************************
- * NAME:            CleanupMatrix
- * DESCRIPTION:     Cleans up the memory allocated for a 2D matrix
- * PARAMETERS:      int**   :   matrix      - the matrix to cleanup
- *                  int     ;   matrixDim   - the dimension of the matrix
- * RETURNS:         void
+ * NAME:            RunFilter
+ * 
+ * DESCRIPTION:     Runs the filter with FilterMatrix and prints or writes the
+ *                  filtered matrix, unless the cache already holds it. New
+ *                  results are added to the cache.
+ * 
+ * PARAMETERS:      T**     :   matrix      -   the matrix to filter
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *                  run_stats*  :   stats   -   records for the compute and
+ *                                              print phases
+ *                  int     :   verbosity   -   the log_level of worker messages
+ *                  const wisdom_options*   :   wisdom  -   the wisdom file and
+ *                                                          whether to tune
+ *                  const result_cache* :   cache   -   where results are cached
+ *                  const result_key&   :   key     -   what the result is
+ *                                                      cached under
+ *                  const result_sink&  :   sink    -   where the result goes
+ * 
+ * RETURNS:         0 on success, -1 if numThreads is less than 1, a thread
+ *                  could not be started, tuning failed or the result could
+ *                  not be written
  **********************************************************************************/ 
-void CleanupMatrix (int** matrix, int matrixDim) {
-    for (int i = 0; i < matrixDim; i++) {
-        delete[] matrix[i];
+template <typename T>
+int RunFilter (T** matrix, long rows, long cols, filter_settings settings, int numThreads,
+               double minValue, double maxValue, run_stats* stats, int verbosity,
+               const wisdom_options* wisdom, const result_cache* cache,
+               const result_key& key, const result_sink& sink) {
+    matrix_header cachedHeader;
+    int cachedFd;
+
+    // Every thread gets its own log ring and records, so there has to be one
+    if (numThreads < 1) {
+        printf("[ERROR] Invalid number of threads %d\n", numThreads);
+        return -1;
+    }
+
+    // Tuning has to time the filter, so it never takes a cached result
+    if (!wisdom->tune && (cachedFd = FindResult(*cache, key, &cachedHeader)) != -1) {
+        BeginPhase(stats);
+        int status = PrintCachedResult(cachedFd, cachedHeader, sink);
+        EndPhase(stats, PHASE_PRINT);
+        close(cachedFd);
+
+        // One that can't be read is simply filtered again and replaced
+        if (status == 0) {
+            printf("\nFiltered matrix was cached in '%s'\n",
+                   ResultPath(*cache, key).c_str());
+            CleanupMatrix(matrix, rows);
+            return 0;
+        }
+    }
+
+    if (UseWisdom(matrix, rows, cols, &settings, &numThreads, minValue, maxValue, wisdom,
+                  stats) != 0) {
+        return -1;
+    }
+
+    T** result = AllocateMatrix<T>(rows, cols);
+    log_ring* logs = new log_ring[numThreads];
+    worker_stats* workerStats = NULL;
+    trace_buffer* traces = NULL;
+
+    if (stats->enabled) {
+        stats->workers.assign(numThreads, worker_stats());
+        for (int i = 0; i < numThreads; i++) {
+            stats->workers[i].counting = stats->counters;
+        }
+        workerStats = &stats->workers[0];
+        stats->bytesWritten = (size_t) rows * cols * sizeof(T);
+    }
+    if (stats->trace != NULL) {
+        traces = InitTraceWorkers(stats->trace, numThreads);
+    }
+    for (int i = 0; i < numThreads; i++) {
+        InitLogRing(&logs[i], verbosity);
+    }
+
+    // The workers only write their messages into their own rings, so they are
+    // printed here once they have all finished
+    BeginPhase(stats);
+    int status = FilterMatrix(matrix, result, rows, cols, settings, numThreads, minValue,
+                              maxValue, logs, workerStats, traces);
+    EndPhase(stats, PHASE_COMPUTE);
+    DrainLogs(logs, numThreads, stdout);
+    delete[] logs;
+    if (status != 0) {
+        return -1;
     }
 
-    delete[] matrix;
-    matrix = 0;
+    BeginPhase(stats);
+    status = WriteResult(result, rows, cols, sink);
+    EndPhase(stats, PHASE_PRINT);
+
+    if (status == 0 && StoreResult(*cache, key, result, rows, cols) != 0) {
+        printf("\nCould not cache the filtered matrix in '%s'\n", cache->dir.c_str());
+    }
+
+    // Clean up before we exit, no memory leaks please
+    CleanupMatrix(result, rows);
+    CleanupMatrix(matrix, rows);
+    return status;
 }
 
 /***********************************************************************************
- * NAME:            GetMatrixWork
+ * NAME:            LoadAndRun
  * 
- * DESCRIPTION:     Determines the start and end point a given thread should 
- *                  perform calculations on
+ * DESCRIPTION:     Reads a matrix of element type T and runs the filter on it.
+ *                  Binary matrices whose values all fit the narrower type
+ *                  ElementTraits<T>::Narrower are stored and filtered in that
+ *                  type instead, which is safe because a neighbourhood mean
+ *                  never leaves the range of its inputs. Printing promotes the
+ *                  values again, so the output is the same either way. Every
+ *                  kernel keeps its results within the range of its inputs.
  * 
- * PARAMETERS:      int     :   matrixDim   -   the dimension of the matrix
- *                  int     :   numT        -   the number of threads being used
- *                  int     :   tid         -   the ID for this thread
- *                  int*    :   startP      -   variable to store start point
- *                  int*    :   endP        -   variable to store end point
+ * PARAMETERS:      string  :   filename    -   the name of the matrix file
+ *                  bool    :   textInput   -   whether the file is text
+ *                  matrix_header   :   header  -   description of a binary file
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  run_stats*  :   stats       -   records for the run
+ *                  int     :   verbosity   -   the log_level of worker messages
+ *                  const wisdom_options*   :   wisdom  -   the wisdom file and
+ *                                                          whether to tune
+ *                  const result_cache* :   cache   -   where results are cached
+ *                  const string&   :   output  -   the --output file, empty to
+ *                                                  print the result
  * 
- * RETURNS:         
+ * RETURNS:         0 on success, an error status otherwise.
  **********************************************************************************/ 
-void GetMatrixWork (int matrixDim, int numT, int tid, int* startP, int* endP) {
-    int remainder = 0;
-    int workload = 0;
-    int start;
-    int end;
-
-    // Determine the number of rows a thread has to perform work on, and how many
-    // rows are going to be left over after initial even distribution
-    if (numT >= matrixDim) {
-        workload = 1;
+template <typename T>
+int LoadAndRun (string filename, bool textInput, matrix_header header,
+                filter_settings settings, int numThreads, run_stats* stats,
+                int verbosity, const wisdom_options* wisdom, const result_cache* cache,
+                const string& output) {
+    typedef typename ElementTraits<T>::Narrower N;
+
+    long matrixRows;
+    long matrixCols;
+    T** matrix;
+    T minValue, maxValue;
+    content_hash hash;
+    content_hash* hashP = cache->dir.empty() ? NULL : &hash;
+    result_sink sink = { output, ElementTraits<T>::type };
+
+    InitHash(&hash);
+    BeginPhase(stats);
+    if (textInput) {
+        // Text matrices carry their dimensions in their shape, so parse them in one go
+        matrix = ReadMatrixTextFile<T>(filename, numThreads, &matrixRows, &matrixCols);
+        minValue = numeric_limits<T>::max();
+        maxValue = numeric_limits<T>::lowest();
+        if (matrixRows > 0) {
+            ScanRange(matrix[0], (size_t) matrixRows * matrixCols, &minValue, &maxValue);
+        }
+        if (hashP != NULL && matrixRows > 0) {
+            UpdateHash(hashP, matrix[0], (size_t) matrixRows * matrixCols * sizeof(T));
+        }
+        struct stat st;
+        stats->bytesRead = stat(filename.c_str(), &st) == 0 ? (size_t) st.st_size : 0;
     } else {
-        remainder = matrixDim % numT;
-        workload = floor(matrixDim / numT);
+        matrixRows = header.rows;
+        matrixCols = header.cols;
+        stats->bytesRead = (size_t) matrixRows * matrixCols * matrix_type_size(header.type);
+
+        // Read the matrix file itself, narrowing it if the type allows
+        N** narrowMatrix;
+        if (!is_same<N, T>::value &&
+            ReadMatrixFileNarrowed(filename, header, &narrowMatrix, &matrix,
+                                   &minValue, &maxValue, hashP)) {
+            EndPhase(stats, PHASE_READ);
+            stats->rows = matrixRows;
+            stats->cols = matrixCols;
+            printf("Matrix dimensions for '%s' were %ldx%ld %s, stored as %s\n",
+                   filename.c_str(), matrixRows, matrixCols,
+                   matrix_type_name(ElementTraits<T>::type),
+                   matrix_type_name(ElementTraits<N>::type));
+            cout << endl;
+
+            return RunFilter(narrowMatrix, matrixRows, matrixCols, settings, numThreads,
+                             (double) minValue, (double) maxValue, stats, verbosity,
+                             wisdom, cache, MakeResultKey(FinishHash(&hash),
+                                                          ElementTraits<T>::type,
+                                                          matrixRows, matrixCols,
+                                                          settings),
+                             sink);
+        } else if (is_same<N, T>::value) {
+            matrix = ReadMatrixFile<T>(filename, header, &minValue, &maxValue, hashP);
+        }
+    }
+    EndPhase(stats, PHASE_READ);
+    stats->rows = matrixRows;
+    stats->cols = matrixCols;
+    printf("Matrix dimensions for '%s' were %ldx%ld %s\n", filename.c_str(),
+           matrixRows, matrixCols, matrix_type_name(ElementTraits<T>::type));
+    cout << endl;
+
+    return RunFilter(matrix, matrixRows, matrixCols, settings, numThreads,
+                     (double) minValue, (double) maxValue, stats, verbosity, wisdom, cache,
+                     MakeResultKey(FinishHash(&hash), ElementTraits<T>::type, matrixRows,
+                                   matrixCols, settings), sink);
+}
+
+/***********************************************************************************
+ * NAME:            RunOnServer
+ * 
+ * DESCRIPTION:     Sends the filter to a convserver and prints the filtered
+ *                  matrix it sends back, the same way RunFilter would, or has
+ *                  the server write it to the --output file
+ * 
+ * PARAMETERS:      string  :   serverPath  -   the server's socket
+ *                  string  :   filename    -   the name of the matrix file
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  const string&   :   output  -   the --output file, empty to
+ *                                                  print the matrix
+ * 
+ * RETURNS:         0 on success, -1 if the server couldn't be reached or
+ *                  couldn't filter the matrix
+ **********************************************************************************/ 
+int RunOnServer (string serverPath, string filename, filter_settings settings,
+                 int numThreads, const string& output) {
+    char resolved[PATH_MAX];
+    serve_request request;
+    string line, rest;
+    int fd;
+
+    // The server doesn't share our working directory
+    if (realpath(filename.c_str(), resolved) == NULL) {
+        printf("[ERROR] Could not open file '%s'\n", filename.c_str());
+        return -1;
+    }
+    request.file = resolved;
+    request.settings = settings;
+    request.threads = numThreads;
+    request.output = output;
+    if (!output.empty() && output[0] != '/' && getcwd(resolved, sizeof(resolved)) != NULL) {
+        request.output = string(resolved) + "/" + output;
     }
 
-    // Determine the start and end rows that we should be working on
-    start = workload * tid;
-    end = workload * (tid + 1);
+    if ((fd = ConnectServer(serverPath)) == -1) {
+        printf("[ERROR] Could not connect to a server on '%s'\n", serverPath.c_str());
+        return -1;
+    }
 
-    // If we're the final thread handle any remainder
-    if (tid == numT - 1) {
-        end += remainder;
+    line = FormatRequest(request);
+    if (WriteAll(fd, line.c_str(), line.size()) != 0 || ReadLine(fd, &line, &rest) != 0) {
+        printf("[ERROR] The server on '%s' did not reply\n", serverPath.c_str());
+        close(fd);
+        return -1;
     }
 
-    // Special case for when we're supposed to make more threads than rows in matrix
-    if (tid >= matrixDim) {
-        start = -1;
-        end = -1;
+    vector<string> reply = SplitLine(line);
+    if (reply[0] != "ok" || reply.size() < 6) {
+        printf("[ERROR] Server: %s\n", reply.size() > 1 ? reply[1].c_str() : line.c_str());
+        close(fd);
+        return -1;
+    }
+    printf("Matrix dimensions for '%s' were %sx%s %s, %s by the server\n",
+           filename.c_str(), reply[1].c_str(), reply[2].c_str(), reply[3].c_str(),
+           reply[4].c_str());
+    printf("Filtered in %ss\n", reply[5].c_str());
+    if (!output.empty()) {
+        printf("\nFiltered matrix written to '%s'\n", output.c_str());
+        close(fd);
+        return 0;
     }
+    cout << "\nFiltered Matrix" << endl;
 
-    //cout << "Thread " << tid << " start " << start << " end " << end << endl;
-    *startP = start;
-    *endP = end;
+    // The rest of the reply is the matrix, already formatted
+    char buffer[1 << 16];
+    ssize_t got;
+    cout << rest;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0) {
+        cout.write(buffer, got);
+    }
+    close(fd);
+
+    return got == 0 ? 0 : -1;
 }
 
 /***********************************************************************************
- * NAME:            CalculateFilter
+ * NAME:            WatchFiles
  * 
- * DESCRIPTION:     Calculates the new convolution filter values for the matrix
+ * DESCRIPTION:     Filters a matrix file, or every binary matrix file in a
+ *                  directory, then keeps the outputs up to date as the files
+ *                  are written. The directory is watched rather than the
+ *                  files, so a file replaced by renaming another over it is
+ *                  seen as well as one written in place, and a file is only
+ *                  read again once its writer has closed it.
  * 
- * PARAMETERS:      void*   :   arguments   -   void pointer to argument_structure
+ * PARAMETERS:      string  :   filename    -   the matrix file or directory
+ *                  string  :   watchPath   -   the output file or directory
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
  * 
- * RETURNS:         None
+ * RETURNS:         -1 if watching could not start or stopped working, it
+ *                  doesn't return otherwise
  **********************************************************************************/ 
-void* CalculateFilter (void* arguments) {
-    int start, end;
-    struct argument_structure *args = (struct argument_structure *) arguments;
+int WatchFiles (string filename, string watchPath, filter_settings settings,
+                int numThreads) {
+    map<string, watched_file> files;
+    struct stat st;
+    bool directory = stat(filename.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+    string dir = filename;
+    char resolvedIn[PATH_MAX], resolvedOut[PATH_MAX];
+    int fd;
 
-    // Find our start and end points
-    GetMatrixWork(args->matrixDim, args->numT, args->tid, &start, &end);
+    if (directory) {
+        mkdir(watchPath.c_str(), 0755);
+        if (realpath(watchPath.c_str(), resolvedOut) == NULL ||
+            stat(resolvedOut, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            printf("[ERROR] --watch needs a directory for the outputs of '%s'\n",
+                   filename.c_str());
+            return -1;
+        }
+    } else {
+        size_t slash = filename.rfind('/');
+        dir = slash == string::npos ? "." : slash == 0 ? "/" : filename.substr(0, slash);
+        files[filename.substr(slash == string::npos ? 0 : slash + 1)] =
+            watched_file{filename, watchPath, 0, NULL};
+        if (realpath(watchPath.c_str(), resolvedOut) == NULL) {
+            resolvedOut[0] = '\0';
+        }
+    }
 
-    cout << "Hello from Thread " << args->tid << endl;
+    // Outputs written over the inputs would set off another refilter
+    if (realpath(filename.c_str(), resolvedIn) == NULL) {
+        printf("[ERROR] Could not open file '%s'\n", filename.c_str());
+        return -1;
+    }
+    if (string(resolvedIn) == resolvedOut) {
+        printf("[ERROR] --watch can't write over its input '%s'\n", filename.c_str());
+        return -1;
+    }
 
-    // If we have no work, break out
-    if (start == -1 && end == -1) {
-        cout << "No work for Thread " << args->tid << endl;
-        pthread_exit(0); 
+    // Watching starts before the first read, so no write is missed
+    if ((fd = inotify_init1(IN_CLOEXEC)) == -1 ||
+        inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+                                           IN_MOVED_FROM) == -1) {
+        printf("[ERROR] Could not watch '%s'\n", dir.c_str());
+        return -1;
     }
 
-    for (int row = start; row < end; row++) {
-        for (int i = 0; i < args->matrixDim; i++) {
-            cout << args->matrix[row][i] << "\t";
+    if (directory) {
+        DIR* listing = opendir(dir.c_str());
+        struct dirent* entry;
+        while (listing != NULL && (entry = readdir(listing)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                string name = entry->d_name;
+                files[name] = watched_file{dir + "/" + name, watchPath + "/" + name, 0,
+                                           NULL};
+            }
+        }
+        if (listing != NULL) {
+            closedir(listing);
         }
-        cout << endl;
     }
-    
 
-    cout << "Goodbye from thread " << args->tid << endl;
-    pthread_exit(0);
+    vector<string> pending;
+    for (map<string, watched_file>::iterator it = files.begin(); it != files.end(); it++) {
+        pending.push_back(it->first);
+    }
+
+    while (true) {
+        for (size_t i = 0; i < pending.size(); i++) {
+            watched_file* file = &files[pending[i]];
+            int status = UpdateWatchedFile(file, settings, numThreads);
+
+            if (status == -1) {
+                printf("[ERROR] Could not refilter '%s' into '%s'\n", file->input.c_str(),
+                       file->output.c_str());
+            } else if (status == 1 && !directory) {
+                printf("[ERROR] '%s' is not a binary matrix\n", file->input.c_str());
+            }
+        }
+        pending.clear();
+        fflush(stdout);
+
+        char buffer[1 << 14] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got <= 0) {
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            printf("[ERROR] Stopped watching '%s'\n", dir.c_str());
+            close(fd);
+            return -1;
+        }
+
+        // Events are taken in order, so a file deleted and written again
+        // within one read is still refiltered
+        for (char* p = buffer; p < buffer + got;
+             p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            string name = event->len > 0 ? event->name : "";
+            map<string, watched_file>::iterator it = files.find(name);
+
+            if (name.empty() || (!directory && it == files.end()) ||
+                (directory && name[0] == '.')) {
+                continue;
+            }
+            pending.erase(remove(pending.begin(), pending.end(), name), pending.end());
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (it != files.end()) {
+                    ForgetWatchedFile(&it->second);
+                }
+                continue;
+            }
+            if (it == files.end()) {
+                files[name] = watched_file{dir + "/" + name, watchPath + "/" + name, 0,
+                                           NULL};
+            }
+            pending.push_back(name);
+        }
+    }
 }
 
 /***********************************************************************************
@@ -290,58 +1202,88 @@ void* CalculateFilter (void* arguments) {
  **********************************************************************************/ 
 int main (int argc, char** argv) {
     string filename;
-    int filterDepth;
+    filter_settings settings;
     int numThreads;
-    int matrixDimension;
-    int** matrix;
+    bool textInput;
+    uint32_t type;
+    matrix_header header;
+    run_stats stats;
+    string traceFile;
+    trace_log trace;
+    int verbosity;
+    wisdom_options wisdom;
+    string serverPath;
+    result_cache cache;
+    string watchPath;
+    string output;
+    int status;
 
     // Check we've been given good arguments
-    ProcessArguments(argc, argv, &filename, &filterDepth, &numThreads);
+    ProcessArguments(argc, argv, &filename, &settings, &numThreads, &textInput, &type,
+                     &stats, &traceFile, &verbosity, &wisdom, &serverPath,
+                     &cache, &watchPath, &output);
 
-    cout << "\nfile: " << filename << " depth: " << filterDepth << " threads: ";
-    cout << numThreads << endl;
-
-    // Arrays for ID's of threads. Declared here so as to have access to numThreads.
-    pthread_t workers_tid[numThreads];  // Actual Thread ID's to join
-    int workers[numThreads];            // Int values for distribution logic
+    if (!traceFile.empty()) {
+        trace.origin = MonotonicSeconds();
+        InitTraceBuffer(&trace.main);
+        stats.trace = &trace;
+    }
 
-    // Get our matrix dimensions
-    matrixDimension = GetMatrixDimension(filename);
-    printf("Matrix dimension for '%s' was %d\n", filename.c_str(), matrixDimension);
+    cout << "\nfile: " << filename << " depth: " << settings.depth << " threads: ";
+    cout << numThreads << " mode: " << FilterModeName(settings.mode);
+    cout << " border: " << BorderModeName(settings.border) << endl;
 
-    // Read the matrix file itself
-    matrix = ReadMatrixFile(filename, matrixDimension);
-    cout << endl;
+    if (!serverPath.empty()) {
+        return RunOnServer(serverPath, filename, settings, numThreads, output);
+    }
+    if (!watchPath.empty()) {
+        return WatchFiles(filename, watchPath, settings, numThreads);
+    }
 
-    // Distribute the work to some threads
-    for (int i = 0; i < numThreads; i++) {
-        // Populate our struct to pass our arguments to our function
-        struct argument_structure threadArgs;
-        threadArgs.matrix = matrix;
-        threadArgs.matrixDim = matrixDimension;
-        threadArgs.numT = numThreads;
-        threadArgs.tid = i;
-
-        // Setting thread ID int
-        workers[i] = i;
-
-        // Create our worker thread
-        if (pthread_create(&workers_tid[i], NULL, CalculateFilter, (void *) &threadArgs)) {
-            printf("Failed to create worker thread %d\n", i);
-            return -1;
-        }
+    // Binary matrices describe their own element type
+    if (!textInput) {
+        BeginPhase(&stats);
+        header = GetMatrixHeader(filename);
+        type = header.type;
+        EndPhase(&stats, PHASE_HEADER);
+    }
 
-        // Join the worker thread we just created
-        if (pthread_join(workers_tid[i], NULL)) {
-            printf("Failed to join worker thread %d\n", i);
+    switch (type) {
+        case MATRIX_UINT8:
+            status = LoadAndRun<uint8_t>(filename, textInput, header, settings,
+                                         numThreads, &stats, verbosity, &wisdom, &cache,
+                                         output);
+            break;
+        case MATRIX_INT16:
+            status = LoadAndRun<int16_t>(filename, textInput, header, settings,
+                                         numThreads, &stats, verbosity, &wisdom, &cache,
+                                         output);
+            break;
+        case MATRIX_INT32:
+            status = LoadAndRun<int32_t>(filename, textInput, header, settings,
+                                         numThreads, &stats, verbosity, &wisdom, &cache,
+                                         output);
+            break;
+        case MATRIX_FLOAT:
+            status = LoadAndRun<float>(filename, textInput, header, settings,
+                                       numThreads, &stats, verbosity, &wisdom, &cache,
+                                       output);
+            break;
+        case MATRIX_DOUBLE:
+            status = LoadAndRun<double>(filename, textInput, header, settings,
+                                        numThreads, &stats, verbosity, &wisdom, &cache,
+                                        output);
+            break;
+        default:
+            printf("[ERROR] '%s' holds values of an unknown type\n", filename.c_str());
             return -1;
-        }
     }
-    
-    cout << "\nWhole Matrix" << endl;
-    PrettyPrintMatrix(matrix, matrixDimension);
 
-    // Clean up before we exit, no memory leaks please
-    CleanupMatrix(matrix, matrixDimension);
-	return 0;
+    if (status == 0 && stats.enabled) {
+        PrintStats(&stats);
+    }
+    if (status == 0 && stats.trace != NULL) {
+        status = WriteTrace(&trace, traceFile.c_str());
+    }
+    return status;
 }
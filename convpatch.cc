@@ -0,0 +1,542 @@
+/***********************************************************************************
+ * FILENAME:        convpatch.cc
+ *
+ * DESCRIPTION:     Applies a patch of single value changes to a binary matrix
+ *                  file and brings a filtered copy of it up to date, without
+ *                  reading or filtering either matrix in full.
+ *
+ *                  The matrix is mapped privately and patched in memory, and
+ *                  the output is mapped and refreshed in place from it by
+ *                  incremental.h, which only refilters the windows around
+ *                  the changes. Only the pages those windows cover are ever
+ *                  read. When the output file doesn't exist yet it is made by
+ *                  filtering the whole patched matrix. Only once the output
+ *                  is up to date does the patch go to the matrix file, with
+ *                  set_slots, which writes the changes in file order with
+ *                  one positioned write per run of neighbouring slots. So if
+ *                  anything fails the matrix is left as it was, and running
+ *                  the patch again finishes it.
+ *
+ *                  The output's header is stamped with the filter that made
+ *                  it, the filter key of resultcache.h, and an output made
+ *                  by any other filter is refused rather than refreshed.
+ *                  Outputs written by the other tools carry no stamp, so one
+ *                  of the right shape and type is taken to be the matrix
+ *                  filtered this way, and stamped once it is refreshed.
+ *
+ * ARGUMENTS:       matrixFile  - the row major binary matrix to patch
+ *                  patchFile   - the changes to make
+ *                  outputFile  - matrixFile filtered the same way before the
+ *                                patch, refreshed in place
+ *                  depth       - the neighbourhood depth to use for the filter
+ *                  numThreads  - the number of threads for full passes
+ *
+ * OPTIONS:         --mode, --sigma, --border and --engine, as for convolution
+ *
+ * PATCH:           One change per line, its row, column and new value,
+ *                  separated by whitespace or commas. Rows and columns count
+ *                  from 0. Blank lines and lines starting with # are skipped,
+ *                  and when a value is changed twice the later line wins.
+ *
+ * USAGE:           Compile the program using the makefile
+ *                      > make convpatch
+ *
+ *                  You can then run it with
+ *                      > ./convpatch [options] [matrixFile] [patchFile] [outputFile]
+ *                                    [depth] [numThreads]
+***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <fstream>      // Used for reading the patch
+#include <string>       // Strings
+#include <vector>       // Used for the patch
+#include <map>          // Used for finding the last value of each slot
+#include <limits>       // Used for numeric_limits
+#include <math.h>       // Used for floor
+#include <errno.h>      // Used for telling a missing output apart
+#include <fcntl.h>      // Used for file reading
+#include <unistd.h>     // Used for ftruncate
+#include <getopt.h>     // Used for option parsing
+#include <sys/mman.h>   // Used for mapping the matrices
+#include "matrix.h"     // Used for matrix operations
+#include "engine.h"     // Used for the threaded filter engine
+#include "incremental.h" // Used for refreshing the output
+#include "resultcache.h" // Used for stamping the output with its filter
+
+using namespace std;
+
+// The changes in a patch, in the order given
+struct matrix_patch {
+    vector<uint64_t> rows;      // Counting from 1, as set_slots does
+    vector<uint64_t> cols;
+    vector<double> values;
+};
+
+// A matrix file mapped into memory
+struct mapped_matrix {
+    void* map;
+    size_t length;
+};
+
+/***********************************************************************************
+ * NAME:            PrintUsage
+ *
+ * DESCRIPTION:     Prints the command line usage of the program
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvpatch [options] [matrixFile] [patchFile] [outputFile] [filterDepth]";
+    cout << " [numThreads]" << endl;
+    cout << "Options:" << endl;
+    cout << "\t--mode name\tfilter to run: mean (the default), median, min, max,";
+    cout << " open, close or gaussian" << endl;
+    cout << "\t--sigma x\tstandard deviation for gaussian, defaults to the depth";
+    cout << endl;
+    cout << "\t--border name\tvalues outside the matrix: zero (the default), clamp,";
+    cout << " reflect or wrap" << endl;
+    cout << "\t--engine name\tkernel to use: auto (the default), direct, histogram,";
+    cout << " running-sum or integral" << endl;
+    cout << "Patch lines hold a row, a column and a value, counting from 0" << endl;
+}
+
+/***********************************************************************************
+ * NAME:            ProcessArguments
+ *
+ * DESCRIPTION:     Used to process and check the validity of the programs
+ *                  command line arguments.
+ *
+ * PARAMETERS:      int     :   argc    -   number of command line arguments
+ *                  char**  :   argv    -   the command line arguments
+ *                  string* :   files   -   variable to store the matrix, patch
+ *                                          and output files
+ *                  filter_settings*    :   settings    -   variable to store
+ *                                                          the filter
+ *                  int*    :   nTh     -   variable to store number of threads
+ *
+ * RETURNS:         Void, but exits the program if incorrect values have been
+ *                  given
+ **********************************************************************************/
+void ProcessArguments (int argc, char** argv, string* files, filter_settings* settings,
+                       int* nTh) {
+    static struct option longOptions[] = {
+        {"mode", required_argument, 0, 'm'},
+        {"sigma", required_argument, 0, 's'},
+        {"border", required_argument, 0, 'b'},
+        {"engine", required_argument, 0, 'e'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    settings->mode = FILTER_MEAN;
+    settings->sigma = 0;
+    settings->border = BORDER_ZERO;
+    settings->engine = ENGINE_AUTO;
+
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        int found = -1;
+
+        switch (opt) {
+            case 'm':
+                found = settings->mode = ParseFilterMode(optarg);
+                break;
+            case 's':
+                settings->sigma = atof(optarg);
+                found = settings->sigma >= GAUSSIAN_MIN_SIGMA ? 0 : -1;
+                break;
+            case 'b':
+                found = settings->border = ParseBorderMode(optarg);
+                break;
+            case 'e':
+                found = settings->engine = ParseEngine(optarg);
+                break;
+            default:
+                PrintUsage();
+                exit(EXIT_FAILURE);
+        }
+
+        if (found == -1) {
+            cout << "[ERROR] Bad value '" << optarg << "'" << endl;
+            PrintUsage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 5) {
+        cout << "[ERROR] Invalid number of arguments given." << endl;
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    char** positional = argv + optind;
+
+    if (atoi(positional[3]) <= 0 || atoi(positional[4]) <= 0) {
+        cout << "[ERROR] Invalid values given for depth or numThreads" << endl;
+        PrintUsage();
+        cout << "Where filterDepth and numThreads are ints > 0" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    files[0] = positional[0];
+    files[1] = positional[1];
+    files[2] = positional[2];
+    settings->depth = atoi(positional[3]);
+    if (settings->sigma == 0) {
+        settings->sigma = settings->depth;
+    }
+    *nTh = atoi(positional[4]);
+}
+
+/***********************************************************************************
+ * NAME:            ReadPatch
+ *
+ * DESCRIPTION:     Reads every change in a patch, checking each one lies in
+ *                  the matrix
+ *
+ * PARAMETERS:      const string&   :   file    -   the patch file
+ *                  const matrix_header&    :   header  -   the matrix it patches
+ *                  matrix_patch*   :   patch   -   variable to store the changes
+ *
+ * RETURNS:         Void, but exits the program if the patch can't be read or
+ *                  has a bad line
+ **********************************************************************************/
+void ReadPatch (const string& file, const matrix_header& header, matrix_patch* patch) {
+    ifstream in(file.c_str());
+    string line;
+    int number = 0;
+
+    if (!in) {
+        printf("[ERROR] Could not open patch '%s'\n", file.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    while (getline(in, line)) {
+        char* p = (char*) line.c_str();
+        double fields[3];
+        int count = 0;
+
+        number++;
+        while (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        }
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        while (count < 3) {
+            char* end;
+            fields[count] = strtod(p, &end);
+            if (end == p) {
+                break;
+            }
+            count++;
+            for (p = end; *p == ' ' || *p == '\t' || *p == ',' || *p == '\r'; p++) {
+            }
+        }
+
+        if (count < 3 || *p != '\0' || fields[0] < 0 || fields[1] < 0 ||
+            fields[0] != floor(fields[0]) || fields[1] != floor(fields[1]) ||
+            fields[0] >= (double) header.rows || fields[1] >= (double) header.cols) {
+            printf("[ERROR] %s line %d: expected a row and column in the matrix and a",
+                   file.c_str(), number);
+            printf(" value\n");
+            exit(EXIT_FAILURE);
+        }
+        patch->rows.push_back((uint64_t) fields[0] + 1);
+        patch->cols.push_back((uint64_t) fields[1] + 1);
+        patch->values.push_back(fields[2]);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            MapMatrix
+ *
+ * DESCRIPTION:     Maps a row major matrix file and points a row array into it
+ *
+ * PARAMETERS:      int     :   fd      -   the open matrix file
+ *                  const matrix_header&    :   header  -   the file's header
+ *                  int     :   share   -   MAP_SHARED to write through to the
+ *                                              file, MAP_PRIVATE to keep writes
+ *                                              in memory
+ *                  mapped_matrix*  :   mapped  -   variable to store the mapping
+ *
+ * RETURNS:         T** - the rows, or NULL if it could not be mapped
+ **********************************************************************************/
+template <typename T>
+T** MapMatrix (int fd, const matrix_header& header, int share, mapped_matrix* mapped) {
+    long rows = header.rows;
+
+    if (header.layout != MATRIX_ROW_MAJOR || header.data_offset % sizeof(T) != 0 ||
+        rows == 0) {
+        return NULL;
+    }
+
+    mapped->length = header.data_offset +
+                     ((rows - 1) * header.stride + header.cols) * sizeof(T);
+    mapped->map = mmap(NULL, mapped->length, PROT_READ | PROT_WRITE, share, fd, 0);
+    if (mapped->map == MAP_FAILED) {
+        return NULL;
+    }
+
+    T* first = (T*) ((char*) mapped->map + header.data_offset);
+    T** matrix = new T*[rows];
+    for (long i = 0; i < rows; i++) {
+        matrix[i] = first + (size_t) i * header.stride;
+    }
+    return matrix;
+}
+
+/***********************************************************************************
+ * NAME:            OpenOutput
+ *
+ * DESCRIPTION:     Opens the output file, making it with a header of the
+ *                  matrix's shape and type and the filter's stamp if it
+ *                  doesn't exist yet
+ *
+ * PARAMETERS:      const string&   :   file    -   the output file
+ *                  const matrix_header&    :   input   -   the matrix's header
+ *                  filter_settings :   settings    -   the filter
+ *                  matrix_header*  :   header  -   variable to store its header
+ *                  bool*   :   created -   variable to store if it was made
+ *
+ * RETURNS:         int - the open file, exits the program if it can't be
+ *                        opened or doesn't match the matrix and filter. An
+ *                        output without a stamp is taken to match.
+ **********************************************************************************/
+int OpenOutput (const string& file, const matrix_header& input, filter_settings settings,
+                matrix_header* header, bool* created) {
+    uint64_t stamp = MakeResultKey(0, input.type, input.rows, input.cols, settings).filter;
+    int fd = open(file.c_str(), O_RDWR);
+
+    *created = false;
+    if (fd == -1 && errno == ENOENT) {
+        make_header(header, input.type, input.rows, input.cols);
+        header->reserved[1] = stamp;
+        if ((fd = open(file.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644)) == -1 ||
+            set_header(fd, header) != 0 ||
+            ftruncate(fd, header->data_offset + input.rows * input.cols *
+                          matrix_type_size(input.type)) != 0) {
+            printf("[ERROR] Could not make output '%s'\n", file.c_str());
+            exit(EXIT_FAILURE);
+        }
+        *created = true;
+        return fd;
+    }
+
+    if (fd == -1 || get_header(fd, header) != 0) {
+        printf("[ERROR] Could not open output '%s'\n", file.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if (header->type != input.type || header->rows != input.rows ||
+        header->cols != input.cols) {
+        printf("[ERROR] Output '%s' is not a %lux%lu %s matrix\n", file.c_str(),
+               (unsigned long) input.rows, (unsigned long) input.cols,
+               matrix_type_name(input.type));
+        exit(EXIT_FAILURE);
+    }
+    if (header->reserved[1] != 0 && header->reserved[1] != stamp) {
+        printf("[ERROR] Output '%s' was not made by this filter, remove it to filter",
+               file.c_str());
+        printf(" the matrix again\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/***********************************************************************************
+ * NAME:            PatchAndRefresh
+ *
+ * DESCRIPTION:     Refreshes the output around the patch's changes, then
+ *                  writes them to the matrix and stamps the output with the
+ *                  filter. Values already holding their new value are left
+ *                  alone. Without knowing the range of the whole matrix, the
+ *                  filter assumes the element type's full range.
+ *
+ * PARAMETERS:      string* :   files   -   the matrix, patch and output files
+ *                  int     :   fd      -   the matrix file, open for writing
+ *                  const matrix_header&    :   header  -   the matrix's header
+ *                  filter_settings :   settings    -   the filter
+ *                  int     :   numThreads  -   threads for full passes
+ *
+ * RETURNS:         0 on success, -1 if a file could not be written or mapped,
+ *                  leaving the matrix unpatched unless only its write failed
+ **********************************************************************************/
+template <typename T>
+int PatchAndRefresh (string* files, int fd, const matrix_header& header,
+                     filter_settings settings, int numThreads) {
+    long rows = header.rows;
+    long cols = header.cols;
+    double low = (double) numeric_limits<T>::lowest();
+    double high = (double) numeric_limits<T>::max();
+    matrix_patch patch, changes;
+    vector<T> values;
+    mapped_matrix input, output;
+    matrix_header outputHeader;
+    bool created;
+
+    ReadPatch(files[1], header, &patch);
+
+    // Changes to the private mapping stay in memory until the output is done
+    T** matrix = MapMatrix<T>(fd, header, MAP_PRIVATE, &input);
+    if (matrix == NULL) {
+        printf("[ERROR] '%s' must be a row major binary matrix\n", files[0].c_str());
+        return -1;
+    }
+
+    // A slot given more than once takes its last value
+    map<pair<uint64_t, uint64_t>, double> slots;
+    for (size_t i = 0; i < patch.values.size(); i++) {
+        double value = patch.values[i];
+        if (value < low || value > high ||
+            (numeric_limits<T>::is_integer && value != floor(value))) {
+            printf("[ERROR] %g does not fit a %s matrix\n", value,
+                   matrix_type_name(header.type));
+            return -1;
+        }
+        slots[make_pair(patch.rows[i], patch.cols[i])] = value;
+    }
+    for (map<pair<uint64_t, uint64_t>, double>::iterator it = slots.begin();
+         it != slots.end(); ++it) {
+        T value = (T) it->second;
+        T* slot = &matrix[it->first.first - 1][it->first.second - 1];
+        if (*slot != value) {
+            changes.rows.push_back(it->first.first);
+            changes.cols.push_back(it->first.second);
+            values.push_back(value);
+            *slot = value;
+        }
+    }
+
+    int outFd = OpenOutput(files[2], header, settings, &outputHeader, &created);
+
+    // Writes to the file show through the shared mapping
+    T** result = MapMatrix<T>(outFd, outputHeader, MAP_SHARED, &output);
+    if (result == NULL) {
+        printf("[ERROR] '%s' must be a row major binary matrix\n", files[2].c_str());
+        if (created) {
+            unlink(files[2].c_str());
+        }
+        return -1;
+    }
+
+    double start = MonotonicSeconds();
+    int status = 0;
+    if (created) {
+        status = FilterMatrix(matrix, result, rows, cols, settings, numThreads, low, high,
+                              NULL, NULL, NULL);
+        printf("Filtered all of '%s' into '%s' in %.6fs\n", files[0].c_str(),
+               files[2].c_str(), MonotonicSeconds() - start);
+    } else {
+        // Only the parts of the stage that are refreshed are ever touched
+        mapped_matrix stage = { NULL, 0 };
+        T** stageRows = NULL;
+        if (settings.mode == FILTER_OPEN || settings.mode == FILTER_CLOSE) {
+            stage.length = (size_t) rows * cols * sizeof(T);
+            stage.map = mmap(NULL, stage.length, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (stage.map == MAP_FAILED) {
+                printf("[ERROR] Could not map a %ldx%ld stage\n", rows, cols);
+                return -1;
+            }
+            stageRows = new T*[rows];
+            for (long i = 0; i < rows; i++) {
+                stageRows[i] = (T*) stage.map + (size_t) i * cols;
+            }
+        }
+
+        incremental_filter<T> inc;
+        vector<dirty_rect> refreshed;
+        AttachIncremental(&inc, matrix, result, stageRows, rows, cols, settings, numThreads,
+                          low, high);
+        for (size_t i = 0; i < values.size(); i++) {
+            long row = changes.rows[i] - 1;
+            long col = changes.cols[i] - 1;
+            MarkDirty(&inc, row, col, row + 1, col + 1);
+        }
+        status = RefreshIncremental(&inc, &refreshed);
+        printf("Refiltered %zu regions, %.0f values, of '%s' in %.6fs\n",
+               refreshed.size(), RegionArea(refreshed), files[2].c_str(),
+               MonotonicSeconds() - start);
+
+        if (stageRows != NULL) {
+            delete[] stageRows;
+            munmap(stage.map, stage.length);
+        }
+    }
+
+    delete[] matrix;
+    delete[] result;
+    munmap(input.map, input.length);
+    munmap(output.map, output.length);
+
+    // The output now matches the patched matrix and this filter
+    outputHeader.reserved[1] = MakeResultKey(0, header.type, rows, cols, settings).filter;
+    if (status != 0 || set_header(outFd, &outputHeader) != 0 || close(outFd) != 0) {
+        printf("[ERROR] Could not refresh '%s', '%s' was left unpatched\n",
+               files[2].c_str(), files[0].c_str());
+        // One that was only just made is no use half filtered
+        if (created) {
+            unlink(files[2].c_str());
+        }
+        return -1;
+    }
+
+    start = MonotonicSeconds();
+    if (set_slots(fd, &header, values.size(), changes.rows.data(), changes.cols.data(),
+                  values.data()) != 0) {
+        printf("[ERROR] Could not patch '%s', run the patch again to finish it\n",
+               files[0].c_str());
+        return -1;
+    }
+    printf("Patched %zu of %zu slots in '%s' in %.6fs\n", values.size(), slots.size(),
+           files[0].c_str(), MonotonicSeconds() - start);
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            main
+ * DESCRIPTION:     Entrypoint for the program.
+ * PARAMETERS:      None
+ * RETURNS:         0 on success, an error status otherwise.
+ **********************************************************************************/
+int main (int argc, char** argv) {
+    string files[3];
+    filter_settings settings;
+    int numThreads;
+    matrix_header header;
+    int fd;
+    int status = -1;
+
+    ProcessArguments(argc, argv, files, &settings, &numThreads);
+
+    if ((fd = open(files[0].c_str(), O_RDWR)) == -1 || get_header(fd, &header) != 0) {
+        printf("[ERROR] Could not open matrix '%s'\n", files[0].c_str());
+        return -1;
+    }
+
+    switch (header.type) {
+        case MATRIX_UINT8:
+            status = PatchAndRefresh<uint8_t>(files, fd, header, settings, numThreads);
+            break;
+        case MATRIX_INT16:
+            status = PatchAndRefresh<int16_t>(files, fd, header, settings, numThreads);
+            break;
+        case MATRIX_INT32:
+            status = PatchAndRefresh<int32_t>(files, fd, header, settings, numThreads);
+            break;
+        case MATRIX_FLOAT:
+            status = PatchAndRefresh<float>(files, fd, header, settings, numThreads);
+            break;
+        case MATRIX_DOUBLE:
+            status = PatchAndRefresh<double>(files, fd, header, settings, numThreads);
+            break;
+    }
+    close(fd);
+
+    return status;
+}
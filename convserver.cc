@@ -0,0 +1,873 @@
+/***********************************************************************************
+ * FILENAME:        convserver.cc
+ *
+ * DESCRIPTION:     A resident filter server. It listens on a Unix domain
+ *                  socket and filters binary matrix files for its clients,
+ *                  so they pay for neither starting a process, reading the
+ *                  matrix again nor starting threads. serve.h describes the
+ *                  requests and replies, and convolution --server is a client.
+ *
+ *                  Each connection is handled by a thread of its own. The
+ *                  filter itself runs on one warm worker_pool, one request at
+ *                  a time, with as many workers as the request asks for up to
+ *                  the pool's size. Requests to filter a matrix the same way
+ *                  as one already being filtered wait for its result rather
+ *                  than filtering it again.
+ *
+ *                  Matrices are kept in a cache until it grows past its limit
+ *                  and they are the least recently used. Each is read into
+ *                  the server's own memory, so a client rewriting the file
+ *                  can't change a matrix while it is being filtered. A file
+ *                  changed since it was loaded is loaded again, and one that
+ *                  changes while it is read fails that request. Requests for
+ *                  a matrix that is still being loaded wait for that load
+ *                  rather than starting their own.
+ *
+ * ARGUMENTS:       socketPath  - where to listen
+ *                  numThreads  - the number of threads in the pool
+ *
+ * OPTIONS:         --cache-mb n - the most matrix data to keep, 1024 by
+ *                                default. A matrix in use is never evicted.
+ *
+ * USAGE:           Compile the program using the makefile
+ *                      > make convserver
+ *
+ *                  You can then run it and send it requests with
+ *                      > ./convserver /tmp/convolution.sock 4 &
+ *                      > ./convolution --server /tmp/convolution.sock matrixFile 2 4
+ *
+ *                  SIGINT or SIGTERM stop it once the requests in progress
+ *                  have been answered.
+***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <sstream>      // Used for formatting results
+#include <string>       // Strings
+#include <map>          // Used for finding cached matrices
+#include <list>         // Used for the least recently used order
+#include <limits>       // Used for numeric_limits
+#include <signal.h>     // Used for stopping on signals
+#include <poll.h>       // Used for waiting on the socket and signals
+#include <fcntl.h>      // Used for file reading
+#include <getopt.h>     // Used for option parsing
+#include <sys/signalfd.h> // Used for stopping on signals
+#include <sys/stat.h>   // Used for stat
+#include "matrix.h"     // Used for matrix operations
+#include "engine.h"     // Used for the threaded filter engine
+#include "matrixfile.h" // Used for reading and writing matrix files
+#include "serve.h"      // Used for the request protocol
+
+using namespace std;
+
+// A filter of a cached matrix that requests for the same filter share
+struct shared_filter {
+    filter_settings settings;
+    void* result;                       // A T** for the element type
+    bool done;
+    int status;
+    double seconds;
+    int users;                          // Requests waiting for or using it
+};
+
+// A matrix file held in memory
+struct cached_matrix {
+    string file;
+    dev_t device;                       // The file's identity when it was loaded
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    uint32_t type;                      // A matrix_type
+    long rows;
+    long cols;
+    void* matrix;                       // A T** for the element type
+    double minValue;
+    double maxValue;
+    size_t bytes;                       // What the cache counts it as
+    bool ready;                         // Loaded, or failed to load
+    bool failed;
+    bool stale;                         // No longer in the cache, freed when unused
+    string error;                       // Why it failed to load
+    int users;                          // Requests holding it
+    list<shared_filter*> filters;       // Filters of it in progress or being sent
+};
+
+// The matrices the server holds
+struct matrix_cache {
+    pthread_mutex_t lock;
+    pthread_cond_t loaded;              // Broadcast whenever a load or filter finishes
+    map<string, cached_matrix*> files;
+    list<cached_matrix*> recent;        // Most recently used first
+    size_t bytes;
+    size_t limit;
+};
+
+// Everything the connection threads share
+struct server_state {
+    matrix_cache cache;
+    worker_pool pool;
+    pthread_mutex_t running;            // Held by the request using the pool
+    pthread_mutex_t lock;               // Guards active
+    pthread_cond_t idle;                // Signalled when active drops to 0
+    int active;                         // Connections being handled
+};
+
+// What a connection thread is given
+struct connection {
+    server_state* server;
+    int fd;
+};
+
+/***********************************************************************************
+ * NAME:            PrintUsage
+ *
+ * DESCRIPTION:     Prints the command line usage of the program
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvserver [options] [socketPath] [numThreads]" << endl;
+    cout << "Options:" << endl;
+    cout << "\t--cache-mb n\tthe most matrix data to keep cached, 1024 by default";
+    cout << endl;
+}
+
+/***********************************************************************************
+ * NAME:            ProcessArguments
+ *
+ * DESCRIPTION:     Used to process and check the validity of the programs
+ *                  command line arguments.
+ *
+ * PARAMETERS:      int     :   argc    -   number of command line arguments
+ *                  char**  :   argv    -   the command line arguments
+ *                  string* :   socketPath  -   variable to store the socket path
+ *                  int*    :   nTh     -   variable to store number of threads
+ *                  size_t* :   cacheBytes  -   variable to store the cache limit
+ *
+ * RETURNS:         Void, but exits the program if incorrect values have been
+ *                  given
+ **********************************************************************************/
+void ProcessArguments (int argc, char** argv, string* socketPath, int* nTh,
+                       size_t* cacheBytes) {
+    static struct option longOptions[] = {
+        {"cache-mb", required_argument, 0, 'c'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    *cacheBytes = (size_t) 1024 << 20;
+
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'c':
+                if (atol(optarg) <= 0) {
+                    cout << "[ERROR] --cache-mb takes a positive number, not '" << optarg;
+                    cout << "'" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                *cacheBytes = (size_t) atol(optarg) << 20;
+                break;
+            default:
+                PrintUsage();
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 2) {
+        cout << "[ERROR] Invalid number of arguments given." << endl;
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+    if (atoi(argv[optind + 1]) <= 0) {
+        cout << "[ERROR] numThreads must be an int > 0" << endl;
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    *socketPath = argv[optind];
+    *nTh = atoi(argv[optind + 1]);
+}
+
+/***********************************************************************************
+ * NAME:            LoadMatrix
+ *
+ * DESCRIPTION:     Reads a matrix file into a cache entry and finds its range
+ *
+ * PARAMETERS:      cached_matrix*  :   entry   -   the entry to fill in
+ *                  int     :   fd      -   the open matrix file
+ *                  const matrix_header&    :   header  -   the file's header
+ *
+ * RETURNS:         0 on success, -1 with entry->error set otherwise
+ **********************************************************************************/
+template <typename T>
+int LoadMatrix (cached_matrix* entry, int fd, const matrix_header& header) {
+    T** matrix = ReadMatrixRows<T>(fd, header, &entry->minValue, &entry->maxValue);
+
+    if (matrix == NULL) {
+        entry->error = "could not read '" + entry->file + "'";
+        return -1;
+    }
+
+    entry->matrix = matrix;
+    entry->bytes = (size_t) header.rows * header.cols * sizeof(T);
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            FreeMatrix
+ *
+ * DESCRIPTION:     Frees the matrix LoadMatrix gave an entry
+ *
+ * PARAMETERS:      cached_matrix*  :   entry   -   the entry to empty
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void FreeMatrix (cached_matrix* entry) {
+    CleanupMatrix((T**) entry->matrix, entry->rows);
+    entry->matrix = NULL;
+}
+
+/***********************************************************************************
+ * NAME:            LoadEntry
+ *
+ * DESCRIPTION:     Opens an entry's file and loads it with the LoadMatrix for
+ *                  its element type
+ *
+ * PARAMETERS:      cached_matrix*  :   entry   -   the entry to load
+ *
+ * RETURNS:         0 on success, -1 with entry->error set otherwise
+ **********************************************************************************/
+int LoadEntry (cached_matrix* entry) {
+    matrix_header header;
+    struct stat st;
+    int fd;
+    int status;
+
+    if ((fd = open(entry->file.c_str(), O_RDONLY)) == -1) {
+        entry->error = "could not open '" + entry->file + "'";
+        return -1;
+    }
+    if (get_header(fd, &header) != 0) {
+        close(fd);
+        entry->error = "could not get dimensions for '" + entry->file + "'";
+        return -1;
+    }
+    if (header.rows == 0 || header.cols == 0) {
+        close(fd);
+        entry->error = "'" + entry->file + "' does not hold any values";
+        return -1;
+    }
+
+    entry->type = header.type;
+    entry->rows = header.rows;
+    entry->cols = header.cols;
+
+    switch (header.type) {
+        case MATRIX_UINT8:  status = LoadMatrix<uint8_t>(entry, fd, header);   break;
+        case MATRIX_INT16:  status = LoadMatrix<int16_t>(entry, fd, header);   break;
+        case MATRIX_INT32:  status = LoadMatrix<int32_t>(entry, fd, header);   break;
+        case MATRIX_FLOAT:  status = LoadMatrix<float>(entry, fd, header);     break;
+        case MATRIX_DOUBLE: status = LoadMatrix<double>(entry, fd, header);    break;
+        default:
+            entry->error = "'" + entry->file + "' holds values of an unknown type";
+            status = -1;
+    }
+
+    // A file rewritten while it was read may have given a mix of old and new values
+    if (status == 0 && (fstat(fd, &st) != 0 || st.st_size != entry->size ||
+                        st.st_mtim.tv_sec != entry->modified.tv_sec ||
+                        st.st_mtim.tv_nsec != entry->modified.tv_nsec)) {
+        entry->error = "'" + entry->file + "' changed while it was read";
+        status = -1;
+    }
+    close(fd);
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            FreeEntry
+ *
+ * DESCRIPTION:     Frees an entry and its matrix, if it has one
+ *
+ * PARAMETERS:      cached_matrix*  :   entry   -   the entry to free
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void FreeEntry (cached_matrix* entry) {
+    if (entry->matrix != NULL) {
+        switch (entry->type) {
+            case MATRIX_UINT8:  FreeMatrix<uint8_t>(entry);    break;
+            case MATRIX_INT16:  FreeMatrix<int16_t>(entry);    break;
+            case MATRIX_INT32:  FreeMatrix<int32_t>(entry);    break;
+            case MATRIX_FLOAT:  FreeMatrix<float>(entry);      break;
+            case MATRIX_DOUBLE: FreeMatrix<double>(entry);     break;
+        }
+    }
+    delete entry;
+}
+
+/***********************************************************************************
+ * NAME:            DropEntry
+ *
+ * DESCRIPTION:     Takes an entry out of the cache, freeing it now if no
+ *                  request holds it and when the last one lets go otherwise.
+ *                  The cache lock must be held.
+ *
+ * PARAMETERS:      matrix_cache*   :   cache   -   the cache
+ *                  cached_matrix*  :   entry   -   the entry to drop
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void DropEntry (matrix_cache* cache, cached_matrix* entry) {
+    cache->files.erase(entry->file);
+    cache->recent.remove(entry);
+    if (entry->ready && !entry->failed) {
+        cache->bytes -= entry->bytes;
+    }
+    entry->stale = true;
+    if (entry->users == 0) {
+        FreeEntry(entry);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            AcquireMatrix
+ *
+ * DESCRIPTION:     Finds a matrix file in the cache, loading it if it isn't
+ *                  there or has changed since it was. A request that finds
+ *                  the file being loaded waits for that load. The entry is
+ *                  held until ReleaseMatrix.
+ *
+ * PARAMETERS:      matrix_cache*   :   cache   -   the cache
+ *                  const string&   :   file    -   the matrix file
+ *                  const char**    :   source  -   variable to store whether it
+ *                                                  was loaded, cached or shared
+ *                  string* :   error   -   variable to store why it failed
+ *
+ * RETURNS:         cached_matrix* - the loaded entry, or NULL on failure
+ **********************************************************************************/
+cached_matrix* AcquireMatrix (matrix_cache* cache, const string& file, const char** source,
+                              string* error) {
+    struct stat st;
+
+    if (stat(file.c_str(), &st) != 0) {
+        *error = "could not find '" + file + "'";
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    map<string, cached_matrix*>::iterator found = cache->files.find(file);
+    cached_matrix* entry = found == cache->files.end() ? NULL : found->second;
+
+    // A load in progress can't be checked against the file yet, so it is
+    // shared as it is
+    if (entry != NULL && entry->ready &&
+        (entry->device != st.st_dev || entry->inode != st.st_ino ||
+         entry->size != st.st_size || entry->modified.tv_sec != st.st_mtim.tv_sec ||
+         entry->modified.tv_nsec != st.st_mtim.tv_nsec)) {
+        DropEntry(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry != NULL) {
+        entry->users++;
+        cache->recent.remove(entry);
+        cache->recent.push_front(entry);
+        *source = entry->ready ? "cached" : "shared";
+        while (!entry->ready) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+    } else {
+        entry = new cached_matrix();
+        entry->file = file;
+        entry->device = st.st_dev;
+        entry->inode = st.st_ino;
+        entry->size = st.st_size;
+        entry->modified = st.st_mtim;
+        entry->users = 1;
+        cache->files[file] = entry;
+        cache->recent.push_front(entry);
+        *source = "loaded";
+
+        // Load without the lock, so other files can be found meanwhile
+        pthread_mutex_unlock(&cache->lock);
+        int status = LoadEntry(entry);
+        pthread_mutex_lock(&cache->lock);
+
+        entry->ready = true;
+        entry->failed = status != 0;
+        if (entry->failed) {
+            DropEntry(cache, entry);
+        } else {
+            cache->bytes += entry->bytes;
+        }
+        pthread_cond_broadcast(&cache->loaded);
+    }
+
+    if (entry->failed) {
+        *error = entry->error;
+        if (--entry->users == 0) {
+            FreeEntry(entry);
+        }
+        entry = NULL;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return entry;
+}
+
+/***********************************************************************************
+ * NAME:            ReleaseMatrix
+ *
+ * DESCRIPTION:     Lets go of an entry from AcquireMatrix, then evicts the
+ *                  least recently used matrices no request holds until the
+ *                  cache is back within its limit
+ *
+ * PARAMETERS:      matrix_cache*   :   cache   -   the cache
+ *                  cached_matrix*  :   entry   -   the entry to let go of
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void ReleaseMatrix (matrix_cache* cache, cached_matrix* entry) {
+    pthread_mutex_lock(&cache->lock);
+    if (--entry->users == 0 && entry->stale) {
+        FreeEntry(entry);
+    }
+
+    list<cached_matrix*>::iterator it = cache->recent.end();
+    while (cache->bytes > cache->limit && it != cache->recent.begin()) {
+        cached_matrix* oldest = *--it;
+        if (oldest->users == 0) {
+            printf("Evicting '%s'\n", oldest->file.c_str());
+            it = cache->recent.erase(it);
+            DropEntry(cache, oldest);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/***********************************************************************************
+ * NAME:            Reply
+ *
+ * DESCRIPTION:     Sends a reply line to a client
+ *
+ * PARAMETERS:      int     :   fd      -   the client's connection
+ *                  const string&   :   line    -   the line, without its newline
+ *
+ * RETURNS:         0 on success, -1 if the client has gone
+ **********************************************************************************/
+int Reply (int fd, const string& line) {
+    string text = line + "\n";
+    return WriteAll(fd, text.c_str(), text.size());
+}
+
+/***********************************************************************************
+ * NAME:            SendMatrix
+ *
+ * DESCRIPTION:     Sends a matrix to a client as text, in the same format
+ *                  convolution prints it, a band of rows at a time
+ *
+ * PARAMETERS:      int     :   fd      -   the client's connection
+ *                  T**     :   matrix  -   the matrix to send
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *
+ * RETURNS:         0 on success, -1 if the client has gone
+ **********************************************************************************/
+template <typename T>
+int SendMatrix (int fd, T** matrix, long rows, long cols) {
+    ostringstream text;
+
+    for (long i = 0; i < rows; i++) {
+        for (long j = 0; j < cols; j++) {
+            // Promote so 8 bit values print as numbers rather than characters
+            text << +matrix[i][j] << "\t";
+        }
+        text << "\n";
+
+        if (text.tellp() >= (1 << 16) || i == rows - 1) {
+            string band = text.str();
+            if (WriteAll(fd, band.c_str(), band.size()) != 0) {
+                return -1;
+            }
+            text.str("");
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            SameFilter
+ *
+ * DESCRIPTION:     Checks whether two filters give the same result
+ *
+ * PARAMETERS:      const filter_settings&  :   a   -   one filter
+ *                  const filter_settings&  :   b   -   the other
+ *
+ * RETURNS:         bool - true if they match in every setting
+ **********************************************************************************/
+bool SameFilter (const filter_settings& a, const filter_settings& b) {
+    return a.depth == b.depth && a.mode == b.mode && a.border == b.border &&
+           a.engine == b.engine && a.sigma == b.sigma;
+}
+
+/***********************************************************************************
+ * NAME:            AcquireFilter
+ *
+ * DESCRIPTION:     Finds the filter of a cached matrix that a request asks
+ *                  for, running it on the server's pool unless another
+ *                  request is already running it, in which case this one
+ *                  waits for that result. The filter is held until
+ *                  ReleaseFilter.
+ *
+ * PARAMETERS:      server_state*   :   server  -   the server
+ *                  cached_matrix*  :   entry   -   the matrix to filter
+ *                  const serve_request&    :   request -   the filter and threads
+ *                  bool*   :   shared  -   variable to store whether another
+ *                                          request ran it
+ *
+ * RETURNS:         shared_filter* - the finished filter, check its status
+ **********************************************************************************/
+template <typename T>
+shared_filter* AcquireFilter (server_state* server, cached_matrix* entry,
+                              const serve_request& request, bool* shared) {
+    matrix_cache* cache = &server->cache;
+    shared_filter* filter = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    for (list<shared_filter*>::iterator it = entry->filters.begin();
+         it != entry->filters.end() && filter == NULL; ++it) {
+        filter = SameFilter((*it)->settings, request.settings) ? *it : NULL;
+    }
+    *shared = filter != NULL;
+
+    if (filter != NULL) {
+        filter->users++;
+        while (!filter->done) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return filter;
+    }
+
+    filter = new shared_filter();
+    filter->settings = request.settings;
+    filter->users = 1;
+    entry->filters.push_back(filter);
+    pthread_mutex_unlock(&cache->lock);
+
+    long rows = entry->rows;
+    long cols = entry->cols;
+    int threads = request.threads == 0 || request.threads > server->pool.size ?
+                  server->pool.size : request.threads;
+    filter_workspace<T> ws;
+
+    T** result = AllocateMatrix<T>(rows, cols);
+    InitWorkspace(&ws, rows, cols, request.settings, threads, entry->minValue,
+                  entry->maxValue);
+    ws.pool = &server->pool;
+
+    pthread_mutex_lock(&server->running);
+    double start = MonotonicSeconds();
+    int status = FilterWithWorkspace(&ws, (T**) entry->matrix, result, NULL, NULL, NULL);
+    double seconds = MonotonicSeconds() - start;
+    pthread_mutex_unlock(&server->running);
+    FreeWorkspace(&ws);
+
+    pthread_mutex_lock(&cache->lock);
+    filter->result = result;
+    filter->status = status;
+    filter->seconds = seconds;
+    filter->done = true;
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+
+    return filter;
+}
+
+/***********************************************************************************
+ * NAME:            ReleaseFilter
+ *
+ * DESCRIPTION:     Lets go of a filter from AcquireFilter, freeing its result
+ *                  once no request needs it
+ *
+ * PARAMETERS:      matrix_cache*   :   cache   -   the cache
+ *                  cached_matrix*  :   entry   -   the matrix it filtered
+ *                  shared_filter*  :   filter  -   the filter to let go of
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void ReleaseFilter (matrix_cache* cache, cached_matrix* entry, shared_filter* filter) {
+    pthread_mutex_lock(&cache->lock);
+    bool last = --filter->users == 0;
+    if (last) {
+        entry->filters.remove(filter);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (last) {
+        CleanupMatrix((T**) filter->result, entry->rows);
+        delete filter;
+    }
+}
+
+/***********************************************************************************
+ * NAME:            ServeFilter
+ *
+ * DESCRIPTION:     Filters a cached matrix on the server's pool, or shares
+ *                  the result of the same filter already running, and replies
+ *                  with the result or where it was written
+ *
+ * PARAMETERS:      server_state*   :   server  -   the server
+ *                  cached_matrix*  :   entry   -   the matrix to filter
+ *                  const serve_request&    :   request -   what to do with it
+ *                  const char* :   source  -   where the matrix came from
+ *                  int     :   fd      -   the client's connection
+ *
+ * RETURNS:         0 on success, -1 if the filter failed or the client has gone
+ **********************************************************************************/
+template <typename T>
+int ServeFilter (server_state* server, cached_matrix* entry, const serve_request& request,
+                 const char* source, int fd) {
+    long rows = entry->rows;
+    long cols = entry->cols;
+    char line[256];
+    bool shared;
+
+    shared_filter* filter = AcquireFilter<T>(server, entry, request, &shared);
+    T** result = (T**) filter->result;
+    int status = filter->status;
+    double seconds = filter->seconds;
+
+    printf("'%s' depth %d %s: %s%s, %.6fs\n", entry->file.c_str(),
+           request.settings.depth, FilterModeName(request.settings.mode), source,
+           shared ? ", filter shared" : "", seconds);
+
+    if (status != 0) {
+        Reply(fd, "error\tthe filter failed");
+    } else if (!request.output.empty() &&
+               WriteMatrixFile(request.output, result, rows, cols) != 0) {
+        Reply(fd, "error\tcould not write '" + request.output + "'");
+        status = -1;
+    } else {
+        snprintf(line, sizeof(line), "ok\t%ld\t%ld\t%s\t%s\t%.6f", rows, cols,
+                 matrix_type_name(entry->type), source, seconds);
+        status = Reply(fd, line);
+        if (status == 0 && request.output.empty()) {
+            status = SendMatrix(fd, result, rows, cols);
+        }
+    }
+
+    ReleaseFilter<T>(&server->cache, entry, filter);
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            ServeConnection
+ *
+ * DESCRIPTION:     Thread entry point for a connection. Reads its request,
+ *                  answers it and closes the connection.
+ *
+ * PARAMETERS:      void*   :   arguments   -   the connection, freed here
+ *
+ * RETURNS:         void* - NULL
+ **********************************************************************************/
+void* ServeConnection (void* arguments) {
+    connection* client = (connection*) arguments;
+    server_state* server = client->server;
+    serve_request request;
+    string line, rest, error;
+    const char* source;
+    cached_matrix* entry;
+
+    if (ReadLine(client->fd, &line, &rest) != 0) {
+        Reply(client->fd, "error\tno request line");
+    } else if (ParseRequest(line, &request, &error) != 0) {
+        Reply(client->fd, "error\t" + error);
+    } else if ((entry = AcquireMatrix(&server->cache, request.file, &source,
+                                      &error)) == NULL) {
+        Reply(client->fd, "error\t" + error);
+    } else {
+        switch (entry->type) {
+            case MATRIX_UINT8:
+                ServeFilter<uint8_t>(server, entry, request, source, client->fd);
+                break;
+            case MATRIX_INT16:
+                ServeFilter<int16_t>(server, entry, request, source, client->fd);
+                break;
+            case MATRIX_INT32:
+                ServeFilter<int32_t>(server, entry, request, source, client->fd);
+                break;
+            case MATRIX_FLOAT:
+                ServeFilter<float>(server, entry, request, source, client->fd);
+                break;
+            case MATRIX_DOUBLE:
+                ServeFilter<double>(server, entry, request, source, client->fd);
+                break;
+        }
+        ReleaseMatrix(&server->cache, entry);
+    }
+
+    close(client->fd);
+    delete client;
+
+    pthread_mutex_lock(&server->lock);
+    if (--server->active == 0) {
+        pthread_cond_signal(&server->idle);
+    }
+    pthread_mutex_unlock(&server->lock);
+
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            Listen
+ *
+ * DESCRIPTION:     Makes the server's socket. A socket file left behind by a
+ *                  server that has gone is replaced, a live one is not.
+ *
+ * PARAMETERS:      const string&   :   path    -   where to listen
+ *
+ * RETURNS:         int - the listening socket, exits the program on failure
+ **********************************************************************************/
+int Listen (const string& path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if (path.size() >= sizeof(address.sun_path)) {
+        printf("[ERROR] Socket path '%s' is too long\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    if ((fd = ConnectServer(path)) != -1) {
+        close(fd);
+        printf("[ERROR] A server is already listening on '%s'\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+    unlink(path.c_str());
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        printf("[ERROR] Could not listen on '%s'\n", path.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/***********************************************************************************
+ * NAME:            main
+ * DESCRIPTION:     Entrypoint for the program.
+ * PARAMETERS:      None
+ * RETURNS:         0 on success, an error status otherwise.
+ **********************************************************************************/
+int main (int argc, char** argv) {
+    string socketPath;
+    int numThreads;
+    size_t cacheBytes;
+    server_state server;
+    sigset_t signals;
+
+    ProcessArguments(argc, argv, &socketPath, &numThreads, &cacheBytes);
+
+    // Each request is logged as a line, which should show as it happens
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    // Signals are read from a descriptor, so every thread blocks them and
+    // the accept loop can wait for them alongside new connections
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    signal(SIGPIPE, SIG_IGN);
+    int signalFd = -1;
+    if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0 ||
+        (signalFd = signalfd(-1, &signals, 0)) == -1) {
+        printf("[ERROR] Could not wait for SIGINT and SIGTERM\n");
+        return -1;
+    }
+
+    pthread_mutex_init(&server.cache.lock, NULL);
+    pthread_cond_init(&server.cache.loaded, NULL);
+    server.cache.bytes = 0;
+    server.cache.limit = cacheBytes;
+    pthread_mutex_init(&server.running, NULL);
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.idle, NULL);
+    server.active = 0;
+
+    if (StartPool(&server.pool, numThreads) != 0) {
+        printf("[ERROR] Could not start %d worker threads\n", numThreads);
+        return -1;
+    }
+
+    int listener = Listen(socketPath);
+    printf("Listening on '%s' with %d threads and a %zu MB cache\n", socketPath.c_str(),
+           numThreads, cacheBytes >> 20);
+
+    struct pollfd waits[2] = { { listener, POLLIN, 0 }, { signalFd, POLLIN, 0 } };
+    while (true) {
+        if (poll(waits, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (waits[1].revents != 0) {
+            break;
+        }
+        if (waits[0].revents == 0) {
+            continue;
+        }
+
+        int fd = accept(listener, NULL, NULL);
+        if (fd == -1) {
+            continue;
+        }
+
+        connection* client = new connection;
+        pthread_t tid;
+
+        client->server = &server;
+        client->fd = fd;
+        pthread_mutex_lock(&server.lock);
+        server.active++;
+        pthread_mutex_unlock(&server.lock);
+        if (pthread_create(&tid, NULL, ServeConnection, client)) {
+            Reply(fd, "error\tthe server is too busy");
+            close(fd);
+            delete client;
+            pthread_mutex_lock(&server.lock);
+            server.active--;
+            pthread_mutex_unlock(&server.lock);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    // Stop taking requests, then let the ones in progress finish
+    printf("Stopping\n");
+    close(listener);
+    unlink(socketPath.c_str());
+    pthread_mutex_lock(&server.lock);
+    while (server.active > 0) {
+        pthread_cond_wait(&server.idle, &server.lock);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    StopPool(&server.pool);
+    while (!server.cache.recent.empty()) {
+        DropEntry(&server.cache, server.cache.recent.front());
+    }
+    close(signalFd);
+
+    return 0;
+}
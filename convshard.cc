@@ -0,0 +1,319 @@
+/***********************************************************************************
+ * FILENAME:        convshard.cc
+ *
+ * DESCRIPTION:     Cuts a binary matrix file into shards that can be filtered
+ *                  apart, on one machine or many, and stitched back together
+ *                  by convstitch into the matrix filtering the whole file
+ *                  would have made.
+ *
+ *                  The matrix is split into numShards bands of rows, and each
+ *                  band is written to its own matrix file with the rows its
+ *                  filter windows reach either side, as shard.h describes.
+ *                  The shards are written by numThreads threads at once, each
+ *                  copying a few MB of rows per read and write. Next to them
+ *                  goes a manifest with one request per shard, which convbatch
+ *                  runs as it is:
+ *                      > ./convbatch dir/manifest numThreads
+ *                      > ./convstitch dir/manifest outputFile numThreads
+ *
+ * ARGUMENTS:       matrixFile  - the binary matrix to split
+ *                  depth       - the neighbourhood depth to use for the filter
+ *                  numShards   - the number of shards to cut it into
+ *                  dir         - the directory to write them to, made if need be
+ *                  numThreads  - the number of threads writing shards
+ *
+ * OPTIONS:         --mode, --border and --engine, as for convolution, are
+ *                  written into the manifest. gaussian has no finite window,
+ *                  so it can't be split.
+ *
+ * USAGE:           Compile the program using the makefile
+ *                      > make convshard
+ *
+ *                  You can then run it with
+ *                      > ./convshard [options] [matrixFile] [depth] [numShards] [dir]
+ *                                    [numThreads]
+***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <string>       // Strings
+#include <vector>       // Used for the row buffers
+#include <atomic>       // Used for handing out shards
+#include <errno.h>      // Used for telling an existing directory apart
+#include <fcntl.h>      // Used for file reading
+#include <unistd.h>     // Used for close
+#include <getopt.h>     // Used for option parsing
+#include <pthread.h>    // Used for the writer threads
+#include <sys/stat.h>   // Used for mkdir
+#include "matrix.h"     // Used for matrix operations
+#include "matrixfile.h" // Used for BandRows
+#include "shard.h"      // Used for the shard layout and manifest
+
+using namespace std;
+
+// What each writer thread needs
+struct split_args {
+    int fd;                         // The matrix, shared by every thread
+    const matrix_header* header;
+    const shard_plan* plan;
+    const string* dir;              // Where the shards go
+    int border;
+    atomic<size_t>* next;           // The next shard to write
+    int failed;                     // Set when a shard could not be written
+};
+
+/***********************************************************************************
+ * NAME:            PrintUsage
+ *
+ * DESCRIPTION:     Prints the command line usage of the program
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvshard [options] [matrixFile] [filterDepth] [numShards] [dir]";
+    cout << " [numThreads]" << endl;
+    cout << "Options:" << endl;
+    cout << "\t--mode name\tfilter to run: mean (the default), median, min, max,";
+    cout << " open or close" << endl;
+    cout << "\t--border name\tvalues outside the matrix: zero (the default), clamp,";
+    cout << " reflect or wrap" << endl;
+    cout << "\t--engine name\tkernel to use: auto (the default), direct, histogram,";
+    cout << " running-sum or integral" << endl;
+}
+
+/***********************************************************************************
+ * NAME:            ProcessArguments
+ *
+ * DESCRIPTION:     Used to process and check the validity of the programs
+ *                  command line arguments.
+ *
+ * PARAMETERS:      int     :   argc    -   number of command line arguments
+ *                  char**  :   argv    -   the command line arguments
+ *                  string* :   files   -   variable to store the matrix file
+ *                                          and the shard directory
+ *                  filter_settings*    :   settings    -   variable to store
+ *                                                          the filter
+ *                  int*    :   count   -   variable to store number of shards
+ *                  int*    :   nTh     -   variable to store number of threads
+ *
+ * RETURNS:         Void, but exits the program if incorrect values have been
+ *                  given
+ **********************************************************************************/
+void ProcessArguments (int argc, char** argv, string* files, filter_settings* settings,
+                       int* count, int* nTh) {
+    static struct option longOptions[] = {
+        {"mode", required_argument, 0, 'm'},
+        {"border", required_argument, 0, 'b'},
+        {"engine", required_argument, 0, 'e'},
+        {0, 0, 0, 0}
+    };
+    int opt;
+
+    settings->mode = FILTER_MEAN;
+    settings->border = BORDER_ZERO;
+    settings->engine = ENGINE_AUTO;
+
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1) {
+        int found = -1;
+
+        switch (opt) {
+            case 'm':
+                found = settings->mode = ParseFilterMode(optarg);
+                break;
+            case 'b':
+                found = settings->border = ParseBorderMode(optarg);
+                break;
+            case 'e':
+                found = settings->engine = ParseEngine(optarg);
+                break;
+            default:
+                PrintUsage();
+                exit(EXIT_FAILURE);
+        }
+
+        if (found == -1) {
+            cout << "[ERROR] Bad value '" << optarg << "'" << endl;
+            PrintUsage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 5) {
+        cout << "[ERROR] Invalid number of arguments given." << endl;
+        PrintUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    char** positional = argv + optind;
+
+    if (atoi(positional[1]) <= 0 || atoi(positional[2]) <= 0 || atoi(positional[4]) <= 0) {
+        cout << "[ERROR] Invalid values given for depth, numShards or numThreads" << endl;
+        PrintUsage();
+        cout << "Where filterDepth, numShards and numThreads are ints > 0" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (settings->mode == FILTER_GAUSSIAN) {
+        cout << "[ERROR] gaussian has no finite window to split into shards" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    files[0] = positional[0];
+    settings->depth = atoi(positional[1]);
+    settings->sigma = settings->depth;
+    *count = atoi(positional[2]);
+    files[1] = positional[3];
+    *nTh = atoi(positional[4]);
+}
+
+/***********************************************************************************
+ * NAME:            WriteShard
+ *
+ * DESCRIPTION:     Writes one shard, its band of the matrix and the halo
+ *                  around it. Rows are copied in runs that follow on in the
+ *                  matrix, so a wrapped halo takes its own reads.
+ *
+ * PARAMETERS:      int     :   fd      -   the open matrix file
+ *                  const matrix_header&    :   header  -   the matrix's header
+ *                  const shard_layout& :   shard   -   the shard to write
+ *                  const string&   :   file    -   where to write it
+ *                  int     :   border  -   the filter's border_mode
+ *
+ * RETURNS:         0 on success, -1 if the shard could not be written
+ **********************************************************************************/
+int WriteShard (int fd, const matrix_header& header, const shard_layout& shard,
+                const string& file, int border) {
+    long rows = header.rows;
+    long total = shard.above + shard.rows + shard.below;
+    long band = BandRows(header);
+    matrix_header out;
+    int outFd, status;
+
+    make_header(&out, header.type, total, header.cols);
+    outFd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd == -1) {
+        return -1;
+    }
+    vector<char> buffer((size_t) min(band, total) * header.cols *
+                        matrix_type_size(header.type));
+    status = set_header(outFd, &out);
+
+    for (long row = 0; row < total && status == 0; ) {
+        long source = BorderIndex(shard.first - shard.above + row, rows, border);
+        long count = 1;
+
+        while (row + count < total && count < band && source + count < rows &&
+               BorderIndex(shard.first - shard.above + row + count, rows, border) ==
+               source + count) {
+            count++;
+        }
+        status = get_rows(fd, &header, source + 1, count, buffer.data());
+        if (status == 0) {
+            status = set_rows(outFd, &out, row + 1, count, buffer.data());
+        }
+        row += count;
+    }
+    if (close(outFd) != 0) {
+        status = -1;
+    }
+
+    return status == 0 ? 0 : -1;
+}
+
+/***********************************************************************************
+ * NAME:            SplitWorker
+ *
+ * DESCRIPTION:     Writes shards until there are none left
+ *
+ * PARAMETERS:      void*   :   arg     -   the thread's split_args
+ *
+ * RETURNS:         void*   - NULL
+ **********************************************************************************/
+void* SplitWorker (void* arg) {
+    split_args* args = (split_args*) arg;
+    size_t i;
+
+    while ((i = (*args->next)++) < args->plan->shards.size()) {
+        const shard_layout& shard = args->plan->shards[i];
+        string file = *args->dir + "/" + shard.request.file;
+        if (WriteShard(args->fd, *args->header, shard, file, args->border) != 0) {
+            printf("[ERROR] Could not write shard '%s'\n", file.c_str());
+            args->failed = 1;
+        }
+    }
+
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            main
+ *
+ * DESCRIPTION:     Entrypoint for the program.
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         0 on success, an error status otherwise.
+ **********************************************************************************/
+int main (int argc, char** argv) {
+    string files[2];
+    filter_settings settings;
+    matrix_header header;
+    shard_plan plan;
+    int count, numThreads, fd;
+
+    ProcessArguments(argc, argv, files, &settings, &count, &numThreads);
+
+    if ((fd = open(files[0].c_str(), O_RDONLY)) == -1 || get_header(fd, &header) != 0) {
+        printf("[ERROR] Could not read matrix '%s'\n", files[0].c_str());
+        exit(EXIT_FAILURE);
+    }
+    if ((long) header.rows < count) {
+        printf("[ERROR] %lu rows can't be cut into %d shards\n",
+               (unsigned long) header.rows, count);
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(files[1].c_str(), 0755) != 0 && errno != EEXIST) {
+        printf("[ERROR] Could not make directory '%s'\n", files[1].c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    double start = MonotonicSeconds();
+    PlanShards(header, settings, count, &plan);
+
+    atomic<size_t> next(0);
+    numThreads = min(numThreads, count);
+    vector<pthread_t> threads(numThreads);
+    vector<split_args> args(numThreads);
+    int started = 0;
+    for (int t = 0; t < numThreads; t++, started++) {
+        args[t] = split_args{fd, &header, &plan, &files[1], settings.border, &next, 0};
+        if (pthread_create(&threads[t], NULL, SplitWorker, &args[t])) {
+            break;
+        }
+    }
+    int failed = 0;
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+        failed |= args[t].failed;
+    }
+    if (started < numThreads) {
+        printf("[ERROR] Could not start the threads\n");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    string manifest = files[1] + "/" + SHARD_MANIFEST;
+    if (failed || WriteShardManifest(manifest, plan, files[0]) != 0) {
+        printf("[ERROR] Could not write the shards of '%s'\n", files[0].c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Cut '%s' into %d shards in %.6fs, filter them with\n", files[0].c_str(),
+           count, MonotonicSeconds() - start);
+    printf("\t./convbatch %s %d\n", manifest.c_str(), numThreads);
+    printf("and put the results together with\n");
+    printf("\t./convstitch %s outputFile %d\n", manifest.c_str(), numThreads);
+
+    return 0;
+}
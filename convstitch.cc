@@ -0,0 +1,207 @@
+/***********************************************************************************
+ * FILENAME:        convstitch.cc
+ *
+ * DESCRIPTION:     Puts the filtered shards of a matrix cut up by convshard
+ *                  back together into one binary matrix file.
+ *
+ *                  The manifest gives each shard's output file and where its
+ *                  band sits in the matrix. The output is made at its full
+ *                  size first, and numThreads threads then copy the bands
+ *                  into it a few MB of rows at a time, each with positioned
+ *                  writes to its own part of the file, leaving the halo rows
+ *                  behind. Every shard output must be the filtered shard, of
+ *                  the matrix's type and width and the shard's height.
+ *
+ * ARGUMENTS:       manifest    - the manifest convshard wrote
+ *                  outputFile  - the matrix file to write
+ *                  numThreads  - the number of threads copying bands
+ *
+ * USAGE:           Compile the program using the makefile
+ *                      > make convstitch
+ *
+ *                  You can then run it with
+ *                      > ./convstitch [manifest] [outputFile] [numThreads]
+***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <string>       // Strings
+#include <vector>       // Used for the row buffers
+#include <atomic>       // Used for handing out shards
+#include <fcntl.h>      // Used for file reading
+#include <unistd.h>     // Used for ftruncate
+#include <pthread.h>    // Used for the copying threads
+#include "matrix.h"     // Used for matrix operations
+#include "matrixfile.h" // Used for BandRows
+#include "shard.h"      // Used for the shard layout and manifest
+
+using namespace std;
+
+// What each copying thread needs
+struct stitch_args {
+    int fd;                         // The output, shared by every thread
+    const matrix_header* header;
+    const shard_plan* plan;
+    atomic<size_t>* next;           // The next shard to copy
+    int failed;                     // Set when a shard could not be copied
+};
+
+/***********************************************************************************
+ * NAME:            PrintUsage
+ *
+ * DESCRIPTION:     Prints the command line usage of the program
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+void PrintUsage () {
+    cout << "Usage:" << endl;
+    cout << "\tconvstitch [manifest] [outputFile] [numThreads]" << endl;
+}
+
+/***********************************************************************************
+ * NAME:            CopyBand
+ *
+ * DESCRIPTION:     Copies the band of one filtered shard into the output
+ *
+ * PARAMETERS:      int     :   fd      -   the open output file
+ *                  const matrix_header&    :   header  -   the output's header
+ *                  const shard_layout& :   shard   -   the shard to copy
+ *
+ * RETURNS:         0 on success, -1 if the shard could not be read, is the
+ *                  wrong shape or the band could not be written
+ **********************************************************************************/
+int CopyBand (int fd, const matrix_header& header, const shard_layout& shard) {
+    const string& file = shard.request.output;
+    matrix_header in;
+    int inFd = open(file.c_str(), O_RDONLY);
+
+    if (inFd == -1 || get_header(inFd, &in) != 0) {
+        printf("[ERROR] Could not read shard output '%s'\n", file.c_str());
+        if (inFd != -1) {
+            close(inFd);
+        }
+        return -1;
+    }
+    if (in.type != header.type || in.cols != header.cols ||
+        (long) in.rows != shard.above + shard.rows + shard.below) {
+        printf("[ERROR] Shard output '%s' is not a %ldx%lu %s matrix\n", file.c_str(),
+               shard.above + shard.rows + shard.below, (unsigned long) header.cols,
+               matrix_type_name(header.type));
+        close(inFd);
+        return -1;
+    }
+
+    long band = BandRows(header);
+    vector<char> buffer((size_t) min(band, shard.rows) * header.cols *
+                        matrix_type_size(header.type));
+    int status = 0;
+
+    for (long row = 0; row < shard.rows && status == 0; row += band) {
+        long count = min(band, shard.rows - row);
+        status = get_rows(inFd, &in, shard.above + row + 1, count, buffer.data());
+        if (status == 0) {
+            status = set_rows(fd, &header, shard.first + row + 1, count, buffer.data());
+        }
+    }
+    close(inFd);
+
+    if (status != 0) {
+        printf("[ERROR] Could not copy shard output '%s'\n", file.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            StitchWorker
+ *
+ * DESCRIPTION:     Copies bands until there are none left
+ *
+ * PARAMETERS:      void*   :   arg     -   the thread's stitch_args
+ *
+ * RETURNS:         void*   - NULL
+ **********************************************************************************/
+void* StitchWorker (void* arg) {
+    stitch_args* args = (stitch_args*) arg;
+    size_t i;
+
+    while ((i = (*args->next)++) < args->plan->shards.size()) {
+        if (CopyBand(args->fd, *args->header, args->plan->shards[i]) != 0) {
+            args->failed = 1;
+        }
+    }
+
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            main
+ *
+ * DESCRIPTION:     Entrypoint for the program.
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         0 on success, an error status otherwise.
+ **********************************************************************************/
+int main (int argc, char** argv) {
+    shard_plan plan;
+    matrix_header header;
+    string error;
+    int numThreads, fd;
+
+    if (argc != 4 || atoi(argv[3]) <= 0) {
+        cout << "[ERROR] Invalid arguments given." << endl;
+        PrintUsage();
+        cout << "Where numThreads is an int > 0" << endl;
+        exit(EXIT_FAILURE);
+    }
+    numThreads = atoi(argv[3]);
+
+    if (ReadShardManifest(argv[1], &plan, &error) != 0) {
+        printf("[ERROR] Bad manifest '%s': %s\n", argv[1], error.c_str());
+        exit(EXIT_FAILURE);
+    }
+
+    double start = MonotonicSeconds();
+    make_header(&header, plan.type, plan.rows, plan.cols);
+    if ((fd = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1 ||
+        set_header(fd, &header) != 0 ||
+        ftruncate(fd, header.data_offset + plan.rows * plan.cols *
+                      matrix_type_size(plan.type)) != 0) {
+        printf("[ERROR] Could not make output '%s'\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    atomic<size_t> next(0);
+    numThreads = min((size_t) numThreads, plan.shards.size());
+    vector<pthread_t> threads(numThreads);
+    vector<stitch_args> args(numThreads);
+    int started = 0;
+    for (int t = 0; t < numThreads; t++, started++) {
+        args[t] = stitch_args{fd, &header, &plan, &next, 0};
+        if (pthread_create(&threads[t], NULL, StitchWorker, &args[t])) {
+            break;
+        }
+    }
+    int failed = 0;
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+        failed |= args[t].failed;
+    }
+    if (started < numThreads) {
+        printf("[ERROR] Could not start the threads\n");
+        unlink(argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (close(fd) != 0 || failed) {
+        printf("[ERROR] Could not stitch '%s' together\n", argv[2]);
+        unlink(argv[2]);
+        exit(EXIT_FAILURE);
+    }
+    printf("Stitched %zu shards into '%s' in %.6fs\n", plan.shards.size(), argv[2],
+           MonotonicSeconds() - start);
+
+    return 0;
+}
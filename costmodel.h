@@ -0,0 +1,262 @@
+/***********************************************************************************
+ * FILENAME:        costmodel.h
+ *
+ * DESCRIPTION:     The cost model ENGINE_AUTO uses to pick a kernel. Each
+ *                  engine that can run the filter is given an estimated cost
+ *                  per output value, and the cheapest one runs.
+ *
+ *                  An estimate has two parts. The arithmetic is counted in
+ *                  operations, with loops over contiguous values counting one
+ *                  operation per vector register of them. The memory traffic
+ *                  is counted in bytes, weighted by the cache level the data
+ *                  is expected to come from. That level comes from the
+ *                  working set and the data cache sizes read from sysfs.
+ *                  The weights were fitted to convbench runs, so they rank
+ *                  the kernels rather than predict times.
+ *
+ *                  Modes with a single kernel always run it.
+ ***********************************************************************************/
+
+#ifndef COSTMODEL_H
+#define COSTMODEL_H
+
+#include <stdio.h>      // Used for reading sysfs
+#include <stdlib.h>     // Used for strtol
+#include <string.h>     // Used for strcmp
+#include <string>       // Strings
+#include "filter.h"     // Used for the engines and modes
+#include "median.h"     // Used for the histogram sizes
+
+// Bytes in a vector register, for counting vectorised loops
+#define COST_VECTOR_BYTES 16
+
+// Cost of a byte from each level of the memory hierarchy, in operations
+#define COST_L1_BYTE 0.0
+#define COST_L2_BYTE 0.03
+#define COST_L3_BYTE 0.08
+#define COST_MEMORY_BYTE 0.25
+
+// Cost of an operation in a loop carried dependency chain, which can't be
+// vectorised or overlapped with its neighbours
+#define COST_SERIAL_OP 1.5
+
+// Cost of each comparison selecting the middle of a window
+#define COST_SELECT_OP 2.5
+
+// The data and unified cache sizes of a core in bytes, 0 where missing
+struct cache_sizes {
+    long l1;
+    long l2;
+    long l3;
+};
+
+/***********************************************************************************
+ * NAME:            ReadCacheSizes
+ *
+ * DESCRIPTION:     Reads the sizes of cpu0's data and unified caches from
+ *                  /sys/devices/system/cpu/cpu0/cache. Any level that isn't
+ *                  listed is assumed to have a typical size.
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         cache_sizes - the sizes of the three levels
+ **********************************************************************************/
+inline cache_sizes ReadCacheSizes () {
+    cache_sizes sizes = { 32L << 10, 1L << 20, 8L << 20 };
+    long* levels[4] = { NULL, &sizes.l1, &sizes.l2, &sizes.l3 };
+
+    for (int index = 0; index < 8; index++) {
+        char path[128];
+        char type[32] = "";
+        char size[32] = "";
+        int level = 0;
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/", index);
+        std::string dir = path;
+        FILE* in;
+
+        if ((in = fopen((dir + "level").c_str(), "r")) == NULL) {
+            break;
+        }
+        if (fscanf(in, "%d", &level) != 1) {
+            level = 0;
+        }
+        fclose(in);
+        if ((in = fopen((dir + "type").c_str(), "r")) != NULL) {
+            if (fscanf(in, "%31s", type) != 1) {
+                type[0] = '\0';
+            }
+            fclose(in);
+        }
+        if ((in = fopen((dir + "size").c_str(), "r")) != NULL) {
+            if (fscanf(in, "%31s", size) != 1) {
+                size[0] = '\0';
+            }
+            fclose(in);
+        }
+
+        // Sizes are written like 48K or 32M
+        char* unit;
+        long bytes = strtol(size, &unit, 10);
+        bytes <<= *unit == 'K' ? 10 : *unit == 'M' ? 20 : *unit == 'G' ? 30 : 0;
+        if (level >= 1 && level <= 3 && bytes > 0 && strcmp(type, "Instruction") != 0) {
+            *levels[level] = bytes;
+        }
+    }
+
+    return sizes;
+}
+
+/***********************************************************************************
+ * NAME:            CacheSizes
+ *
+ * DESCRIPTION:     Gets the cache sizes, reading them only the first time
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         const cache_sizes& - the sizes of the three levels
+ **********************************************************************************/
+inline const cache_sizes& CacheSizes () {
+    static const cache_sizes sizes = ReadCacheSizes();
+    return sizes;
+}
+
+/***********************************************************************************
+ * NAME:            ByteCost
+ *
+ * DESCRIPTION:     Gets the cost of a byte that is reused within a working set
+ *                  of some size, by the cache level that holds it
+ *
+ * PARAMETERS:      double  :   workingSet  -   bytes used between reuses
+ *                  const cache_sizes&  :   cache   -   the cache sizes
+ *
+ * RETURNS:         double - the cost of one byte, in operations
+ **********************************************************************************/
+inline double ByteCost (double workingSet, const cache_sizes& cache) {
+    if (workingSet <= cache.l1) {
+        return COST_L1_BYTE;
+    } else if (workingSet <= cache.l2) {
+        return COST_L2_BYTE;
+    } else if (workingSet <= cache.l3) {
+        return COST_L3_BYTE;
+    }
+    return COST_MEMORY_BYTE;
+}
+
+/***********************************************************************************
+ * NAME:            EngineCost
+ *
+ * DESCRIPTION:     Estimates the cost per output value of running a filter
+ *                  with an engine. Costs only compare engines for the same
+ *                  mode, and work common to all of them is left out.
+ *
+ * PARAMETERS:      int     :   engine      -   a filter_engine with a kernel for
+ *                                              the mode
+ *                  filter_settings :   settings    -   the filter to run
+ *                  long    :   rows        -   rows each thread filters
+ *                  long    :   cols        -   the number of columns
+ *                  size_t  :   valueSize   -   bytes in an element
+ *                  size_t  :   accSize     -   bytes in the accumulator
+ *                  long    :   bins        -   histogram bins the values need
+ *                  const cache_sizes&  :   cache   -   the cache sizes
+ *
+ * RETURNS:         double - the estimated cost, in operations
+ **********************************************************************************/
+inline double EngineCost (int engine, filter_settings settings, long rows, long cols,
+                          size_t valueSize, size_t accSize, long bins,
+                          const cache_sizes& cache) {
+    double width = 2.0 * settings.depth + 1;
+    double lanes = (double) COST_VECTOR_BYTES / accSize;
+    double rowBytes = (double) cols * valueSize;
+
+    if (settings.mode == FILTER_MEDIAN) {
+        if (engine == ENGINE_HISTOGRAM) {
+            // Sliding the 32 bit coarse histogram and searching it, then
+            // bringing the median's fine bucket up to date and searching
+            // that. The wider the values and the window, the further the
+            // median wanders between buckets and the more columns each
+            // catch up adds, up to a whole window of them. The 16 bit
+            // column histograms of a row are the working set.
+            int bits = 1;
+            while ((1L << bits) < bins) {
+                bits++;
+            }
+            double fine = (double) (1L << ((bits + 1) / 2));
+            double coarse = (double) (1L << bits) / fine;
+            double touched = 1.0 + width * width * coarse / 4096.0;
+            touched = touched < width ? touched : width;
+            double columns = (cols + 2.0 * settings.depth) * bins * 2.0;
+            return (coarse + touched * fine) / (COST_VECTOR_BYTES / 4) +
+                   0.25 * (coarse + fine) + 4.0 * COST_SERIAL_OP +
+                   (coarse + touched * fine) * 2.0 * ByteCost(columns, cache);
+        }
+
+        // Gathering the window, then selecting its middle
+        return width * width * (1.0 + COST_SELECT_OP) +
+               width * valueSize * ByteCost(width * rowBytes, cache);
+    }
+
+    if (engine == ENGINE_RUNNING_SUM) {
+        // A row in and a row out of the column sums, then one column sum in
+        // and one out along the row
+        return 2.0 / lanes + 2.0 * COST_SERIAL_OP +
+               2.0 * valueSize * ByteCost(width * rowBytes, cache);
+    }
+
+    if (engine == ENGINE_INTEGRAL) {
+        // A prefix sum over every padded value of each chunk, then four
+        // lookups. The table holds wide values and is the working set.
+        double chunk = 4.0 * width > INTEGRAL_MIN_CHUNK ? 4.0 * width : INTEGRAL_MIN_CHUNK;
+        chunk = chunk < rows ? chunk : (double) rows;
+        double padding = (chunk + width - 1) / chunk * (cols + width) / cols;
+        double table = (chunk + width) * (cols + width) * 8.0;
+        return padding * (COST_SERIAL_OP + 1.0) + 4.0 +
+               (padding * 16.0 + 32.0) * ByteCost(table, cache);
+    }
+
+    // Direct: every window row into the column sums, then every column sum
+    // of the window along the row, which is too short a loop to vectorise
+    return width / lanes + width +
+           width * valueSize * ByteCost(width * rowBytes, cache);
+}
+
+/***********************************************************************************
+ * NAME:            ChooseEngine
+ *
+ * DESCRIPTION:     Picks the engine the cost model expects to be fastest for
+ *                  a filter, among those with a kernel for its mode
+ *
+ * PARAMETERS:      filter_settings :   settings    -   the filter to run
+ *                  long    :   rows        -   rows each thread filters
+ *                  long    :   cols        -   the number of columns
+ *                  size_t  :   valueSize   -   bytes in an element
+ *                  size_t  :   accSize     -   bytes in the accumulator
+ *                  bool    :   histogram   -   whether the values fit the
+ *                                              histogram median
+ *                  long    :   bins        -   histogram bins the values need
+ *
+ * RETURNS:         int - the filter_engine to run
+ **********************************************************************************/
+inline int ChooseEngine (filter_settings settings, long rows, long cols, size_t valueSize,
+                         size_t accSize, bool histogram, long bins) {
+    const cache_sizes& cache = CacheSizes();
+    int best = ENGINE_DIRECT;
+    double bestCost = -1;
+
+    for (int engine = ENGINE_DIRECT; engine < FILTER_ENGINES; engine++) {
+        if (!EngineApplies(engine, settings.mode) ||
+            (engine == ENGINE_HISTOGRAM && !histogram)) {
+            continue;
+        }
+        double cost = EngineCost(engine, settings, rows, cols, valueSize, accSize, bins,
+                                 cache);
+        if (bestCost < 0 || cost < bestCost) {
+            best = engine;
+            bestCost = cost;
+        }
+    }
+
+    return best;
+}
+
+#endif
@@ -0,0 +1,156 @@
+/***********************************************************************************
+ * FILENAME:        counters.h
+ *
+ * DESCRIPTION:     Hardware performance counters for --counters, read with
+ *                  perf_event_open. Each worker opens its own set of counters
+ *                  for its own thread, so they count only the work of its
+ *                  band and are never shared.
+ *
+ *                  Every event is opened on its own rather than as a group,
+ *                  so one the CPU or the kernel refuses doesn't take the
+ *                  others with it. A refused event, or any event off Linux,
+ *                  reads as -1 and the report shows it as unavailable. When
+ *                  the kernel multiplexes counters, values are scaled up by
+ *                  the fraction of the time they were actually counting.
+ ***********************************************************************************/
+
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdint.h>     // Fixed width types
+#include <string.h>     // Used for memset
+#include <unistd.h>     // Used for read, close
+#ifdef __linux__
+#include <linux/perf_event.h>   // Used for perf_event_attr
+#include <sys/ioctl.h>          // Used for the counter controls
+#include <sys/syscall.h>        // Used for perf_event_open
+#endif
+
+// The events counted. COUNTER_EVENTS counts them.
+enum counter_event { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_LLC_MISSES,
+                     COUNTER_DTLB_MISSES, COUNTER_STALLED_CYCLES, COUNTER_EVENTS };
+
+// One thread's open counters
+struct perf_counters {
+    int fds[COUNTER_EVENTS];    // -1 for any event that couldn't be opened
+};
+
+/***********************************************************************************
+ * NAME:            CounterName
+ *
+ * DESCRIPTION:     Gets the printed name of a counter event
+ *
+ * PARAMETERS:      int     :   event   -   a counter_event
+ *
+ * RETURNS:         const char* - the name, or "unknown"
+ **********************************************************************************/
+inline const char* CounterName (int event) {
+    switch (event) {
+        case COUNTER_CYCLES:         return "cycles";
+        case COUNTER_INSTRUCTIONS:   return "instructions";
+        case COUNTER_LLC_MISSES:     return "llc_misses";
+        case COUNTER_DTLB_MISSES:    return "dtlb_misses";
+        case COUNTER_STALLED_CYCLES: return "stalled_cycles";
+        default:                     return "unknown";
+    }
+}
+
+/***********************************************************************************
+ * NAME:            OpenCounters
+ *
+ * DESCRIPTION:     Opens every counter event for the calling thread, stopped
+ *                  and counting user space only
+ *
+ * PARAMETERS:      perf_counters*  :   counters    -   where to keep the counters
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void OpenCounters (perf_counters* counters) {
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        counters->fds[e] = -1;
+    }
+
+#ifdef __linux__
+    const uint64_t llc = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint64_t dtlb = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                          (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    const uint32_t types[COUNTER_EVENTS] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE,
+                                             PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE,
+                                             PERF_TYPE_HARDWARE };
+    const uint64_t configs[COUNTER_EVENTS] = { PERF_COUNT_HW_CPU_CYCLES,
+                                               PERF_COUNT_HW_INSTRUCTIONS, llc, dtlb,
+                                               PERF_COUNT_HW_STALLED_CYCLES_BACKEND };
+
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = types[e];
+        attr.config = configs[e];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // This thread, any CPU, no group
+        counters->fds[e] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+/***********************************************************************************
+ * NAME:            StartCounters
+ *
+ * DESCRIPTION:     Zeroes and starts every open counter
+ *
+ * PARAMETERS:      perf_counters*  :   counters    -   the open counters
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void StartCounters (perf_counters* counters) {
+#ifdef __linux__
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        if (counters->fds[e] != -1) {
+            ioctl(counters->fds[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+/***********************************************************************************
+ * NAME:            StopCounters
+ *
+ * DESCRIPTION:     Stops every open counter, reads it and closes it
+ *
+ * PARAMETERS:      perf_counters*  :   counters    -   the open counters
+ *                  long long*      :   values      -   COUNTER_EVENTS values to
+ *                                                      store, -1 if unavailable
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void StopCounters (perf_counters* counters, long long* values) {
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        values[e] = -1;
+    }
+
+#ifdef __linux__
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        uint64_t data[3];   // Value, time enabled, time running
+
+        if (counters->fds[e] == -1) {
+            continue;
+        }
+        ioctl(counters->fds[e], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[e], data, sizeof(data)) == (ssize_t) sizeof(data) &&
+            data[2] > 0) {
+            values[e] = (long long) ((double) data[0] * data[1] / data[2]);
+        }
+        close(counters->fds[e]);
+        counters->fds[e] = -1;
+    }
+#endif
+}
+
+#endif
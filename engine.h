@@ -0,0 +1,696 @@
+/***********************************************************************************
+ * FILENAME:        engine.h
+ *
+ * DESCRIPTION:     The threaded filter engine shared by convolution,
+ *                  convbench and libconvfilter. The rows of a matrix are split
+ *                  between worker threads with GetMatrixWork, and each worker
+ *                  runs the kernel for its band from filter.h, median.h,
+ *                  morphology.h or gaussian.h. Nothing here reads or prints a
+ *                  matrix, so the engine can be timed on its own.
+ *
+ *                  Every buffer a run needs lives in a filter_workspace, set
+ *                  up once by InitWorkspace for a shape and filter, which
+ *                  is also when ENGINE_AUTO is resolved by the cost model. A
+ *                  workspace can run the filter over any number of matrices
+ *                  of that shape with FilterWithWorkspace and allocates
+ *                  nothing while doing so. FilterMatrix is the one-off
+ *                  version. Setting a workspace's pool runs its workers on
+ *                  the warm threads of a worker_pool from pool.h.
+ ***********************************************************************************/
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <pthread.h>    // Threads
+#include <stdio.h>      // Used for printf
+#include <stddef.h>     // Used for size_t
+#include <vector>       // Used for the worker buffers
+#include "filter.h"     // Used for the filter kernels
+#include "median.h"     // Used for the median kernels
+#include "morphology.h" // Used for the min and max kernels
+#include "gaussian.h"   // Used for the gaussian kernels
+#include "costmodel.h"  // Used for choosing an engine
+#include "stats.h"      // Used for the worker timings
+#include "log.h"        // Used for the worker messages
+#include "pool.h"       // Used for running on warm threads
+
+// Buffers one worker reuses on every run, sized for its band. Only the ones
+// the filter needs are ever allocated.
+template <typename T>
+struct worker_scratch {
+    std::vector<T> g;                   // Forward extremes for min and max
+    std::vector<T> h;                   // Backward extremes for min and max
+    std::vector<double> line;           // Padded row for the gaussian row pass
+    std::vector<double> strip;          // Column strips for the gaussian column pass
+    std::vector<T> window;              // Neighbourhood for the direct median
+    median_histograms hist;             // Histograms for the constant time median
+    std::vector<typename ElementTraits<T>::Accumulator> colSums;
+    std::vector<typename ElementTraits<T>::WideAccumulator> wideColSums;
+    std::vector<typename IntegralTraits<typename ElementTraits<T>::WideAccumulator>::Table>
+        table;                          // Summed area table for the integral mean
+};
+
+// Structure used for passing arguments to thread entry functions
+template <typename T>
+struct argument_structure {
+    T** matrix;
+    T** result;
+    T** scratch;                // Intermediate rows for two pass filters
+    typename ElementTraits<T>::Real** realScratch;  // Intermediate rows for the gaussian
+    pthread_barrier_t* barrier; // Shared by every thread with work
+    int workers;                // Number of threads with work
+    long rows;
+    long cols;
+    filter_settings settings;
+    bool wideAccumulator;
+    bool histogram;             // Whether the median uses the histogram kernel
+    double minValue;
+    double maxValue;
+    int numT;
+    int tid;
+    log_ring* log;              // Where to write this worker's messages, or NULL
+    worker_stats* stats;        // Where to record this worker's timings, or NULL
+    trace_buffer* trace;        // Where to record this worker's spans, or NULL
+    worker_scratch<T>* buffers; // This worker's own buffers
+};
+
+// Everything a run of the filter over a rows x cols matrix needs. The
+// workers keep pointers into it, so it must not be copied once set up.
+template <typename T>
+struct filter_workspace {
+    long rows;
+    long cols;
+    int numThreads;
+    bool twoPass;                           // Whether a barrier and scratch matrix are used
+    T** scratch;                            // Intermediate rows for two pass filters
+    typename ElementTraits<T>::Real** realScratch;  // Intermediate rows for the gaussian
+    pthread_barrier_t barrier;              // Shared by every thread with work
+    std::vector<worker_scratch<T> > buffers;
+    std::vector<argument_structure<T> > args;
+    std::vector<pthread_t> tids;
+    worker_pool* pool;                      // Warm threads to run on, or NULL to start some
+};
+
+/***********************************************************************************
+ * NAME:            AllocateMatrix
+ * 
+ * DESCRIPTION:     Allocates a 2D matrix whose rows all point into one
+ *                  contiguous block
+ * 
+ * PARAMETERS:      long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ * 
+ * RETURNS:         T**     : matrix2D      -   a pointer to the 2D array
+ **********************************************************************************/
+template <typename T>
+T** AllocateMatrix (long rows, long cols) {
+    T **matrix2D = new T*[rows];
+
+    if (rows > 0) {
+        matrix2D[0] = new T[(size_t) rows * cols];
+    }
+    for (long i = 1; i < rows; i++) {
+        matrix2D[i] = matrix2D[0] + (size_t) i * cols;
+    }
+
+    return matrix2D;
+}
+
+/***********************************************************************************
+ * NAME:            CleanupMatrix
+ * DESCRIPTION:     Cleans up the memory allocated for a 2D matrix whose rows
+ *                  share one contiguous block
+ * PARAMETERS:      T**     :   matrix      - the matrix to cleanup
+ *                  long    :   rows        - the number of rows in the matrix
+ * RETURNS:         void
+ **********************************************************************************/ 
+template <typename T>
+void CleanupMatrix (T** matrix, long rows) {
+    if (rows > 0) {
+        delete[] matrix[0];
+    }
+
+    delete[] matrix;
+    matrix = 0;
+}
+
+/***********************************************************************************
+ * NAME:            ScanRange
+ * 
+ * DESCRIPTION:     Widens a running minimum and maximum to cover some values
+ * 
+ * PARAMETERS:      const T*    :   values      -   the values to scan
+ *                  size_t      :   count       -   the number of values
+ *                  T*          :   minValue    -   running minimum to update
+ *                  T*          :   maxValue    -   running maximum to update
+ * 
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void ScanRange (const T* values, size_t count, T* minValue, T* maxValue) {
+    T low = *minValue;
+    T high = *maxValue;
+
+    for (size_t i = 0; i < count; i++) {
+        low = values[i] < low ? values[i] : low;
+        high = values[i] > high ? values[i] : high;
+    }
+
+    *minValue = low;
+    *maxValue = high;
+}
+
+
+/***********************************************************************************
+ * NAME:            GetMatrixWork
+ * 
+ * DESCRIPTION:     Determines the start and end point a given thread should 
+ *                  perform calculations on
+ * 
+ * PARAMETERS:      long    :   matrixRows  -   the number of rows in the matrix
+ *                  int     :   numT        -   the number of threads being used
+ *                  int     :   tid         -   the ID for this thread
+ *                  long*   :   startP      -   variable to store start point
+ *                  long*   :   endP        -   variable to store end point
+ * 
+ * RETURNS:         
+ **********************************************************************************/ 
+inline void GetMatrixWork (long matrixRows, int numT, int tid, long* startP, long* endP) {
+    long remainder = 0;
+    long workload = 0;
+    long start;
+    long end;
+
+    // Determine the number of rows a thread has to perform work on, and how many
+    // rows are going to be left over after initial even distribution
+    if (numT >= matrixRows) {
+        workload = 1;
+    } else {
+        remainder = matrixRows % numT;
+        workload = matrixRows / numT;
+    }
+
+    // Determine the start and end rows that we should be working on
+    start = workload * tid;
+    end = workload * (tid + 1);
+
+    // If we're the final thread handle any remainder
+    if (tid == numT - 1) {
+        end += remainder;
+    }
+
+    // Special case for when we're supposed to make more threads than rows in matrix
+    if (tid >= matrixRows) {
+        start = -1;
+        end = -1;
+    }
+
+    //cout << "Thread " << tid << " start " << start << " end " << end << endl;
+    *startP = start;
+    *endP = end;
+}
+
+/***********************************************************************************
+ * NAME:            TraceSince
+ * 
+ * DESCRIPTION:     Records a span from start until now in this worker's trace,
+ *                  if it has one, and gets the time it ended
+ * 
+ * PARAMETERS:      argument_structure<T>*  :   args    -   this thread's arguments
+ *                  const char* :   name        -   a string literal naming it
+ *                  double      :   start       -   when the span began
+ *                  long        :   first       -   first row or column, or -1
+ *                  long        :   last        -   one past the last, or -1
+ * 
+ * RETURNS:         double - now, or 0 when the worker isn't traced
+ **********************************************************************************/ 
+template <typename T>
+inline double TraceSince (struct argument_structure<T>* args, const char* name,
+                          double start, long first, long last) {
+    if (args->trace == NULL) {
+        return 0;
+    }
+    double now = MonotonicSeconds();
+    TraceSpan(args->trace, name, start, now, first, last);
+    return now;
+}
+
+/***********************************************************************************
+ * NAME:            WaitForWorkers
+ * 
+ * DESCRIPTION:     Waits at the barrier for every thread with work, tracing
+ *                  the time spent waiting
+ * 
+ * PARAMETERS:      argument_structure<T>*  :   args    -   this thread's arguments
+ * 
+ * RETURNS:         double - when the wait ended, or 0 when the worker isn't
+ *                           traced
+ **********************************************************************************/ 
+template <typename T>
+inline double WaitForWorkers (struct argument_structure<T>* args) {
+    double start = args->trace != NULL ? MonotonicSeconds() : 0;
+
+    pthread_barrier_wait(args->barrier);
+    return TraceSince(args, "barrier wait", start, -1, -1);
+}
+
+/***********************************************************************************
+ * NAME:            MorphologyPass
+ * 
+ * DESCRIPTION:     Runs a separable min or max over this thread's rows. The
+ *                  row pass goes into the shared scratch matrix, then every
+ *                  thread waits so the column pass can read the rows either
+ *                  side of its band.
+ * 
+ * PARAMETERS:      argument_structure<T>*  :   args    -   this thread's arguments
+ *                  T**     :   in          -   the matrix to filter
+ *                  T**     :   out         -   where to put the result
+ *                  long    :   start       -   first row to compute
+ *                  long    :   end         -   one past the last row
+ *                  T*      :   g           -   scratch for forward extremes
+ *                  T*      :   h           -   scratch for backward extremes
+ * 
+ * RETURNS:         Void
+ **********************************************************************************/ 
+template <typename Op, typename T>
+void MorphologyPass (struct argument_structure<T>* args, T** in, T** out, long start,
+                     long end, T* g, T* h) {
+    int depth = args->settings.depth;
+    int border = args->settings.border;
+    double t = args->trace != NULL ? MonotonicSeconds() : 0;
+
+    MorphologyRows<Op>(in, args->scratch, args->cols, depth, border, start, end, g, h);
+    TraceSince(args, "row pass", t, start, end);
+    t = WaitForWorkers(args);
+    MorphologyColumns<Op>(args->scratch, out, args->rows, args->cols, depth, border,
+                          start, end, g, h);
+    TraceSince(args, "column pass", t, start, end);
+}
+
+/***********************************************************************************
+ * NAME:            CalculateFilter
+ * 
+ * DESCRIPTION:     Calculates the new convolution filter values for this
+ *                  thread's rows of the matrix and stores them in the result
+ * 
+ * PARAMETERS:      void*   :   arguments   -   void pointer to argument_structure
+ * 
+ * RETURNS:         None
+ **********************************************************************************/ 
+template <typename T>
+void* CalculateFilter (void* arguments) {
+    typedef typename ElementTraits<T>::WideAccumulator WideAcc;
+
+    long start, end;
+    struct argument_structure<T> *args = (struct argument_structure<T> *) arguments;
+
+    // Find our start and end points
+    GetMatrixWork(args->rows, args->numT, args->tid, &start, &end);
+
+    double startWall = 0, startCpu = 0;
+    perf_counters counters;
+    if (args->stats != NULL) {
+        args->stats->start = start;
+        args->stats->end = end;
+        args->stats->wall = 0;
+        args->stats->cpu = 0;
+        for (int e = 0; e < COUNTER_EVENTS; e++) {
+            args->stats->counters[e] = -1;
+        }
+        if (args->stats->counting && start != -1) {
+            OpenCounters(&counters);
+            StartCounters(&counters);
+        }
+        startWall = MonotonicSeconds();
+        startCpu = CpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+    }
+    double bandStart = args->trace != NULL ? MonotonicSeconds() : 0;
+
+    Log(args->log, LOG_INFO, "Hello from Thread %d", args->tid);
+
+    // If we have no work, break out
+    if (start == -1 && end == -1) {
+        Log(args->log, LOG_INFO, "No work for Thread %d", args->tid);
+        return NULL;
+    }
+    Log(args->log, LOG_DEBUG, "Thread %d rows %ld to %ld", args->tid, start, end - 1);
+
+    int depth = args->settings.depth;
+    int mode = args->settings.mode;
+    int border = args->settings.border;
+
+    if (mode == FILTER_MIN || mode == FILTER_MAX ||
+        mode == FILTER_OPEN || mode == FILTER_CLOSE) {
+        T* g = args->buffers->g.data();
+        T* h = args->buffers->h.data();
+
+        // Opening and closing run a second pass over the first one's result,
+        // once every thread is done reading the scratch matrix
+        if (mode == FILTER_MIN || mode == FILTER_OPEN) {
+            MorphologyPass<min_op>(args, args->matrix, args->result, start, end, g, h);
+        } else {
+            MorphologyPass<max_op>(args, args->matrix, args->result, start, end, g, h);
+        }
+        if (mode == FILTER_OPEN) {
+            WaitForWorkers(args);
+            MorphologyPass<max_op>(args, args->result, args->result, start, end, g, h);
+        } else if (mode == FILTER_CLOSE) {
+            WaitForWorkers(args);
+            MorphologyPass<min_op>(args, args->result, args->result, start, end, g, h);
+        }
+    } else if (mode == FILTER_GAUSSIAN) {
+        gaussian_coefficients k = GaussianCoefficients(args->settings.sigma);
+        long first, last;
+
+        // Rows are split by band, but the column pass needs whole columns, so
+        // once every row is done the threads split the columns instead
+        GaussianRows(args->matrix, args->realScratch, args->cols, border, start, end, k,
+                     args->buffers->line.data());
+        TraceSince(args, "row pass", bandStart, start, end);
+
+        double t = WaitForWorkers(args);
+
+        GetMatrixWork(args->cols, args->workers, args->tid, &first, &last);
+        if (first != -1) {
+            GaussianColumns(args->realScratch, args->result, args->rows, border, first,
+                            last, k, args->buffers->strip.data());
+            TraceSince(args, "column pass", t, first, last);
+        }
+    } else if (mode == FILTER_MEDIAN) {
+        if (args->histogram) {
+            // Clearing the histograms again keeps their storage
+            median_histograms* hist = &args->buffers->hist;
+            InitMedianHistograms(hist, args->minValue, args->maxValue, args->cols, depth,
+                                 border);
+            Log(args->log, LOG_DEBUG, "Thread %d median by histogram", args->tid);
+            HistogramMedianRows(args->matrix, args->result, args->rows, args->cols, depth,
+                                border, start, end, hist);
+        } else {
+            Log(args->log, LOG_DEBUG, "Thread %d median by sorting", args->tid);
+            DirectMedianRows(args->matrix, args->result, args->rows, args->cols, depth,
+                             border, start, end, args->buffers->window.data());
+        }
+    } else if (args->settings.engine == ENGINE_INTEGRAL) {
+        Log(args->log, LOG_DEBUG, "Thread %d mean by integral table", args->tid);
+        IntegralMeanRows<WideAcc>(args->matrix, args->result, args->rows, args->cols, depth,
+                                  border, start, end, args->buffers->table.data());
+    } else if (args->settings.engine == ENGINE_RUNNING_SUM) {
+        Log(args->log, LOG_DEBUG, "Thread %d mean by running sums", args->tid);
+        if (args->wideAccumulator) {
+            RunningMeanRows(args->matrix, args->result, args->rows, args->cols, depth,
+                            border, start, end, args->buffers->wideColSums.data());
+        } else {
+            RunningMeanRows(args->matrix, args->result, args->rows, args->cols, depth,
+                            border, start, end, args->buffers->colSums.data());
+        }
+    } else if (args->wideAccumulator) {
+        BoxMeanRows(args->matrix, args->result, args->rows, args->cols, depth, border,
+                    start, end, args->buffers->wideColSums.data());
+    } else {
+        BoxMeanRows(args->matrix, args->result, args->rows, args->cols, depth, border,
+                    start, end, args->buffers->colSums.data());
+    }
+
+    TraceSince(args, "band", bandStart, start, end);
+
+    if (args->stats != NULL) {
+        args->stats->wall = MonotonicSeconds() - startWall;
+        args->stats->cpu = CpuSeconds(CLOCK_THREAD_CPUTIME_ID) - startCpu;
+        if (args->stats->counting) {
+            StopCounters(&counters, args->stats->counters);
+        }
+    }
+
+    // Return rather than exit the thread, which may be a pool's
+    Log(args->log, LOG_INFO, "Goodbye from thread %d", args->tid);
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            InitWorkspace
+ *
+ * DESCRIPTION:     Allocates everything the filter needs to run over a rows x
+ *                  cols matrix: the scratch matrix and barrier of a two pass
+ *                  filter, and each worker's buffers for its band. Which
+ *                  kernels run is fixed here too, from the settings and the
+ *                  range of values the matrices will hold. ENGINE_AUTO
+ *                  becomes the engine ChooseEngine expects to be fastest.
+ *
+ * PARAMETERS:      filter_workspace<T>*    :   ws  -   the workspace to set up
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  double  :   minValue    -   no value will be smaller than this
+ *                  double  :   maxValue    -   no value will be larger than this
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void InitWorkspace (filter_workspace<T>* ws, long rows, long cols, filter_settings settings,
+                    int numThreads, double minValue, double maxValue) {
+    typedef typename ElementTraits<T>::Accumulator Acc;
+
+    int depth = settings.depth;
+    int mode = settings.mode;
+    // An empty matrix still gets one worker, which finds no rows and returns
+    int workers = numThreads < rows ? numThreads : (int) rows;
+    workers = workers < 1 ? 1 : workers;
+
+    ws->rows = rows;
+    ws->cols = cols;
+    ws->numThreads = numThreads;
+    ws->twoPass = false;
+    ws->scratch = NULL;
+    ws->realScratch = NULL;
+    ws->pool = NULL;
+
+    // Two pass filters share a scratch matrix and wait for each other between
+    // passes, so the barrier counts only the threads GetMatrixWork gives rows
+    bool twoPass = mode == FILTER_MIN || mode == FILTER_MAX || mode == FILTER_OPEN ||
+                   mode == FILTER_CLOSE || mode == FILTER_GAUSSIAN;
+    if (mode == FILTER_GAUSSIAN) {
+        ws->realScratch = AllocateMatrix<typename ElementTraits<T>::Real>(rows, cols);
+    } else if (twoPass) {
+        ws->scratch = AllocateMatrix<T>(rows, cols);
+    }
+    if (twoPass && rows > 0) {
+        pthread_barrier_init(&ws->barrier, NULL, workers);
+        ws->twoPass = true;
+    }
+
+    // Only fall back to the wide accumulator when the window could overflow
+    // the narrow one
+    long window = (2 * (long) depth + 1) * (2 * (long) depth + 1);
+    bool wide = !AccumulatorFits<Acc>(RangeMagnitude(minValue, maxValue), window);
+    bool fits = UseHistogramMedian<T>(minValue, maxValue, depth, settings.border);
+    if (settings.engine == ENGINE_AUTO && rows > 0) {
+        long band = (rows + workers - 1) / workers;
+        size_t accSize = wide ? sizeof(typename ElementTraits<T>::WideAccumulator) :
+                                sizeof(Acc);
+        settings.engine = ChooseEngine(settings, band, cols, sizeof(T), accSize, fits,
+                                       MedianBins(minValue, maxValue, settings.border));
+    }
+    bool histogram = mode == FILTER_MEDIAN && settings.engine == ENGINE_HISTOGRAM && fits;
+
+    ws->buffers.resize(numThreads);
+    ws->args.resize(numThreads);
+    ws->tids.resize(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+        worker_scratch<T>* b = &ws->buffers[i];
+        struct argument_structure<T>* a = &ws->args[i];
+        long start, end;
+
+        a->matrix = NULL;
+        a->result = NULL;
+        a->scratch = ws->scratch;
+        a->realScratch = ws->realScratch;
+        a->barrier = &ws->barrier;
+        a->workers = workers;
+        a->rows = rows;
+        a->cols = cols;
+        a->settings = settings;
+        a->wideAccumulator = wide;
+        a->histogram = histogram;
+        a->minValue = minValue;
+        a->maxValue = maxValue;
+        a->numT = numThreads;
+        a->tid = i;
+        a->log = NULL;
+        a->stats = NULL;
+        a->trace = NULL;
+        a->buffers = b;
+
+        // Size this worker's buffers for the band it will be given
+        GetMatrixWork(rows, numThreads, i, &start, &end);
+        if (start == -1) {
+            continue;
+        }
+        if (twoPass && mode != FILTER_GAUSSIAN) {
+            long scratch = MorphologyScratch(cols, depth, start, end);
+            b->g.resize(scratch);
+            b->h.resize(scratch);
+        } else if (mode == FILTER_GAUSSIAN) {
+            gaussian_coefficients k = GaussianCoefficients(settings.sigma);
+            b->line.resize(cols + k.tail);
+            b->strip.resize((k.tail + 3) * GAUSSIAN_STRIP);
+        } else if (histogram) {
+            InitMedianHistograms(&b->hist, minValue, maxValue, cols, depth,
+                                 settings.border);
+        } else if (mode == FILTER_MEDIAN) {
+            b->window.resize(window);
+        } else if (settings.engine == ENGINE_INTEGRAL) {
+            b->table.resize(IntegralScratch(cols, depth, start, end));
+        } else if (wide) {
+            b->wideColSums.resize(cols);
+        } else {
+            b->colSums.resize(cols);
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            FreeWorkspace
+ *
+ * DESCRIPTION:     Frees everything InitWorkspace allocated, including when it
+ *                  ran out of memory part way
+ *
+ * PARAMETERS:      filter_workspace<T>*    :   ws  -   the workspace to free
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void FreeWorkspace (filter_workspace<T>* ws) {
+    if (ws->twoPass) {
+        pthread_barrier_destroy(&ws->barrier);
+    }
+    if (ws->scratch != NULL) {
+        CleanupMatrix(ws->scratch, ws->rows);
+    }
+    if (ws->realScratch != NULL) {
+        CleanupMatrix(ws->realScratch, ws->rows);
+    }
+    ws->scratch = NULL;
+    ws->realScratch = NULL;
+    ws->twoPass = false;
+    ws->buffers.clear();
+    ws->args.clear();
+    ws->tids.clear();
+}
+
+/***********************************************************************************
+ * NAME:            FilterWithWorkspace
+ *
+ * DESCRIPTION:     Spreads the filter over the workspace's worker threads and
+ *                  waits for them all, leaving the filtered values in result.
+ *                  The threads come from ws->pool when it is set, and are
+ *                  started for the run otherwise, unless there is only one
+ *                  worker to run.
+ *                  matrix and result must be distinct and of the workspace's
+ *                  shape, with values in the range it was set up for.
+ *
+ * PARAMETERS:      filter_workspace<T>*    :   ws  -   buffers from InitWorkspace
+ *                  T**     :   matrix      -   the matrix to filter
+ *                  T**     :   result      -   matrix to store the result in
+ *                  log_ring*       :   logs    -   numThreads rings for the
+ *                                                  workers' messages, or NULL
+ *                  worker_stats*   :   stats   -   numThreads records for the
+ *                                                  workers' timings, or NULL
+ *                  trace_buffer*   :   traces  -   numThreads buffers for the
+ *                                                  workers' spans, or NULL
+ *
+ * RETURNS:         0 on success, -1 if a thread could not be started or the
+ *                  pool is too small
+ **********************************************************************************/
+template <typename T>
+int FilterWithWorkspace (filter_workspace<T>* ws, T** matrix, T** result, log_ring* logs,
+                         worker_stats* stats, trace_buffer* traces) {
+    int status = 0;
+
+    for (int i = 0; i < ws->numThreads; i++) {
+        struct argument_structure<T>* a = &ws->args[i];
+
+        a->matrix = matrix;
+        a->result = result;
+        a->log = logs != NULL ? &logs[i] : NULL;
+        a->stats = stats != NULL ? &stats[i] : NULL;
+        a->trace = traces != NULL ? &traces[i] : NULL;
+    }
+
+    // Warm threads only need to be handed their arguments
+    if (ws->pool != NULL) {
+        if (RunPool(ws->pool, CalculateFilter<T>, &ws->args[0], sizeof(ws->args[0]),
+                    ws->numThreads) != 0) {
+            printf("Pool of %d threads is too small for %d workers\n", ws->pool->size,
+                   ws->numThreads);
+            status = -1;
+        }
+        return status;
+    }
+
+    // A lone worker runs in the calling thread, saving a thread start
+    if (ws->numThreads == 1) {
+        CalculateFilter<T>(&ws->args[0]);
+        return status;
+    }
+
+    // Distribute the work to some threads
+    int started = 0;
+    for (int i = 0; i < ws->numThreads; i++) {
+        // Create our worker thread
+        if (pthread_create(&ws->tids[i], NULL, CalculateFilter<T>, (void *) &ws->args[i])) {
+            printf("Failed to create worker thread %d\n", i);
+            status = -1;
+            break;
+        }
+        started++;
+    }
+
+    // Wait for every worker to finish its rows
+    for (int i = 0; i < started; i++) {
+        if (pthread_join(ws->tids[i], NULL)) {
+            printf("Failed to join worker thread %d\n", i);
+            status = -1;
+        }
+    }
+
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            FilterMatrix
+ *
+ * DESCRIPTION:     Runs the filter once over a matrix with a workspace of its
+ *                  own, leaving the filtered values in result
+ *
+ * PARAMETERS:      T**     :   matrix      -   the matrix to filter
+ *                  T**     :   result      -   matrix to store the result in
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *                  double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *                  log_ring*       :   logs    -   numThreads rings for the
+ *                                                  workers' messages, or NULL
+ *                  worker_stats*   :   stats   -   numThreads records for the
+ *                                                  workers' timings, or NULL
+ *                  trace_buffer*   :   traces  -   numThreads buffers for the
+ *                                                  workers' spans, or NULL
+ *
+ * RETURNS:         0 on success, -1 if a thread could not be started
+ **********************************************************************************/
+template <typename T>
+int FilterMatrix (T** matrix, T** result, long rows, long cols, filter_settings settings,
+                  int numThreads, double minValue, double maxValue, log_ring* logs,
+                  worker_stats* stats, trace_buffer* traces) {
+    filter_workspace<T> ws;
+
+    InitWorkspace(&ws, rows, cols, settings, numThreads, minValue, maxValue);
+    int status = FilterWithWorkspace(&ws, matrix, result, logs, stats, traces);
+    FreeWorkspace(&ws);
+
+    return status;
+}
+
+#endif
@@ -0,0 +1,610 @@
+/***********************************************************************************
+ * FILENAME:        filter.h
+ *
+ * DESCRIPTION:     Element type traits and the templated filter kernels run by
+ *                  the worker threads. Every kernel works on a band of output
+ *                  rows [start, end) so the threads can split a matrix between
+ *                  them without sharing any output.
+ *
+ *                  The convolution filter replaces every value with the mean
+ *                  of the (2*depth+1) x (2*depth+1) neighbourhood around it,
+ *                  with integer means truncated towards 0. The other modes
+ *                  have kernels of their own in median.h, morphology.h and
+ *                  gaussian.h.
+ *
+ *                  Neighbours that fall outside the matrix are found by the
+ *                  border mode: 0 (the default), the nearest edge value
+ *                  (clamp), the mirror image including the edge (reflect) or
+ *                  the opposite side (wrap). The matrix is never padded.
+ *                  Instead each kernel splits its band into an interior where
+ *                  every window is inside the matrix, run without any index
+ *                  checks, and thin border strips that map indices through
+ *                  BorderIndex.
+ ***********************************************************************************/
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>     // Fixed width types
+#include <string.h>     // Used for strcmp
+#include <limits>       // Used for numeric_limits
+#include <type_traits>  // Used for the integral table type
+#include "matrix.h"     // Used for matrix_type
+
+// The filters that can be run over a matrix. FILTER_MODES counts them.
+enum filter_mode { FILTER_MEAN, FILTER_MEDIAN, FILTER_MIN, FILTER_MAX,
+                   FILTER_OPEN, FILTER_CLOSE, FILTER_GAUSSIAN, FILTER_MODES };
+
+// How neighbours outside the matrix are found. BORDER_MODES counts them.
+enum border_mode { BORDER_ZERO, BORDER_CLAMP, BORDER_REFLECT, BORDER_WRAP,
+                   BORDER_MODES };
+
+// Which kernel runs a mode that has more than one. ENGINE_AUTO picks by the
+// cost model, ENGINE_HISTOGRAM is the constant time median, and
+// ENGINE_RUNNING_SUM and ENGINE_INTEGRAL are box means whose cost doesn't
+// grow with the depth. FILTER_ENGINES counts them.
+enum filter_engine { ENGINE_AUTO, ENGINE_DIRECT, ENGINE_HISTOGRAM, ENGINE_RUNNING_SUM,
+                     ENGINE_INTEGRAL, FILTER_ENGINES };
+
+// Fewest output rows each integral table is built for
+#define INTEGRAL_MIN_CHUNK 32
+
+// Everything that describes which filter to run
+struct filter_settings {
+    int mode;           // A filter_mode
+    int depth;          // Neighbourhood depth
+    double sigma;       // Standard deviation for FILTER_GAUSSIAN
+    int border;         // A border_mode
+    int engine;         // A filter_engine
+};
+
+/***********************************************************************************
+ * NAME:            FilterModeName
+ *
+ * DESCRIPTION:     Gets the command line name of a filter mode
+ *
+ * PARAMETERS:      int     :   mode    -   a filter_mode
+ *
+ * RETURNS:         const char* - the name, or "unknown"
+ **********************************************************************************/
+inline const char* FilterModeName (int mode) {
+    switch (mode) {
+        case FILTER_MEAN:   return "mean";
+        case FILTER_MEDIAN: return "median";
+        case FILTER_MIN:    return "min";
+        case FILTER_MAX:    return "max";
+        case FILTER_OPEN:   return "open";
+        case FILTER_CLOSE:  return "close";
+        case FILTER_GAUSSIAN: return "gaussian";
+        default:            return "unknown";
+    }
+}
+
+/***********************************************************************************
+ * NAME:            BorderModeName
+ *
+ * DESCRIPTION:     Gets the command line name of a border mode
+ *
+ * PARAMETERS:      int     :   border  -   a border_mode
+ *
+ * RETURNS:         const char* - the name, or "unknown"
+ **********************************************************************************/
+inline const char* BorderModeName (int border) {
+    switch (border) {
+        case BORDER_ZERO:    return "zero";
+        case BORDER_CLAMP:   return "clamp";
+        case BORDER_REFLECT: return "reflect";
+        case BORDER_WRAP:    return "wrap";
+        default:             return "unknown";
+    }
+}
+
+/***********************************************************************************
+ * NAME:            EngineName
+ *
+ * DESCRIPTION:     Gets the command line name of a filter engine
+ *
+ * PARAMETERS:      int     :   engine  -   a filter_engine
+ *
+ * RETURNS:         const char* - the name, or "unknown"
+ **********************************************************************************/
+inline const char* EngineName (int engine) {
+    switch (engine) {
+        case ENGINE_AUTO:          return "auto";
+        case ENGINE_DIRECT:        return "direct";
+        case ENGINE_HISTOGRAM:     return "histogram";
+        case ENGINE_RUNNING_SUM:   return "running-sum";
+        case ENGINE_INTEGRAL:      return "integral";
+        default:                   return "unknown";
+    }
+}
+
+/***********************************************************************************
+ * NAME:            ParseFilterMode
+ *
+ * DESCRIPTION:     Finds the filter mode with a command line name
+ *
+ * PARAMETERS:      const char* :   name    -   the name, as FilterModeName gives it
+ *
+ * RETURNS:         int - the filter_mode, or -1 if no mode has that name
+ **********************************************************************************/
+inline int ParseFilterMode (const char* name) {
+    for (int mode = 0; mode < FILTER_MODES; mode++) {
+        if (strcmp(name, FilterModeName(mode)) == 0) {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+/***********************************************************************************
+ * NAME:            ParseBorderMode
+ *
+ * DESCRIPTION:     Finds the border mode with a command line name
+ *
+ * PARAMETERS:      const char* :   name    -   the name, as BorderModeName gives it
+ *
+ * RETURNS:         int - the border_mode, or -1 if no border has that name
+ **********************************************************************************/
+inline int ParseBorderMode (const char* name) {
+    for (int border = 0; border < BORDER_MODES; border++) {
+        if (strcmp(name, BorderModeName(border)) == 0) {
+            return border;
+        }
+    }
+    return -1;
+}
+
+/***********************************************************************************
+ * NAME:            ParseEngine
+ *
+ * DESCRIPTION:     Finds the filter engine with a command line name
+ *
+ * PARAMETERS:      const char* :   name    -   the name, as EngineName gives it
+ *
+ * RETURNS:         int - the filter_engine, or -1 if no engine has that name
+ **********************************************************************************/
+inline int ParseEngine (const char* name) {
+    for (int engine = 0; engine < FILTER_ENGINES; engine++) {
+        if (strcmp(name, EngineName(engine)) == 0) {
+            return engine;
+        }
+    }
+    return -1;
+}
+
+/***********************************************************************************
+ * NAME:            EngineApplies
+ *
+ * DESCRIPTION:     Checks whether an engine has a kernel of its own for a mode.
+ *                  Any mode can be asked for any engine, but those without one
+ *                  run their only kernel, which is what ENGINE_DIRECT means.
+ *
+ * PARAMETERS:      int     :   engine  -   a filter_engine
+ *                  int     :   mode    -   a filter_mode
+ *
+ * RETURNS:         bool    - true if the engine runs the mode its own way
+ **********************************************************************************/
+inline bool EngineApplies (int engine, int mode) {
+    switch (engine) {
+        case ENGINE_DIRECT:        return true;
+        case ENGINE_HISTOGRAM:     return mode == FILTER_MEDIAN;
+        case ENGINE_RUNNING_SUM:   return mode == FILTER_MEAN;
+        case ENGINE_INTEGRAL:      return mode == FILTER_MEAN;
+        default:                   return false;
+    }
+}
+
+/***********************************************************************************
+ * NAME:            BorderIndex
+ *
+ * DESCRIPTION:     Maps an index that may be outside [0, n) to the index whose
+ *                  value stands in for it. Windows can be wider than the
+ *                  matrix, so reflect and wrap fold as many times as needed.
+ *
+ * PARAMETERS:      long    :   i       -   the index, may be out of range
+ *                  long    :   n       -   the length of the line
+ *                  int     :   border  -   a border_mode
+ *
+ * RETURNS:         long    - an index in [0, n), or -1 when the value is 0
+ **********************************************************************************/
+inline long BorderIndex (long i, long n, int border) {
+    if (i >= 0 && i < n) {
+        return i;
+    }
+
+    switch (border) {
+        case BORDER_CLAMP:
+            return i < 0 ? 0 : n - 1;
+        case BORDER_REFLECT: {
+            long period = 2 * n;
+            long m = ((i % period) + period) % period;
+            return m < n ? m : period - 1 - m;
+        }
+        case BORDER_WRAP:
+            return ((i % n) + n) % n;
+        default:
+            return -1;
+    }
+}
+
+/***********************************************************************************
+ * NAME:            ElementTraits
+ *
+ * DESCRIPTION:     Maps an element type to its matrix_type code and to the
+ *                  accumulators used when summing a neighbourhood of them.
+ *                  Accumulator is the narrow choice that keeps the most SIMD
+ *                  lanes, WideAccumulator is used when a window is big enough
+ *                  that Accumulator could overflow. Narrower is the type the
+ *                  loader tries to store values in when they all fit it, or T
+ *                  itself when there is nothing narrower worth trying. Real
+ *                  is the floating point type that holds every value of T
+ *                  exactly, which the gaussian keeps its intermediate rows in.
+ **********************************************************************************/
+template <typename T> struct ElementTraits;
+
+template <> struct ElementTraits<uint8_t> {
+    static const uint32_t type = MATRIX_UINT8;
+    typedef int32_t Accumulator;
+    typedef int64_t WideAccumulator;
+    typedef uint8_t Narrower;
+    typedef float Real;
+};
+
+template <> struct ElementTraits<int16_t> {
+    static const uint32_t type = MATRIX_INT16;
+    typedef int32_t Accumulator;
+    typedef int64_t WideAccumulator;
+    typedef int16_t Narrower;
+    typedef float Real;
+};
+
+template <> struct ElementTraits<int32_t> {
+    static const uint32_t type = MATRIX_INT32;
+    typedef int64_t Accumulator;
+    typedef int64_t WideAccumulator;
+    typedef int16_t Narrower;
+    typedef double Real;
+};
+
+template <> struct ElementTraits<float> {
+    static const uint32_t type = MATRIX_FLOAT;
+    typedef double Accumulator;
+    typedef double WideAccumulator;
+    typedef float Narrower;
+    typedef float Real;
+};
+
+template <> struct ElementTraits<double> {
+    static const uint32_t type = MATRIX_DOUBLE;
+    typedef double Accumulator;
+    typedef double WideAccumulator;
+    typedef double Narrower;
+    typedef double Real;
+};
+
+/***********************************************************************************
+ * NAME:            AccumulatorFits
+ *
+ * DESCRIPTION:     Checks whether summing window values, each no larger in
+ *                  magnitude than maxMagnitude, can overflow Acc
+ *
+ * PARAMETERS:      double  :   maxMagnitude    -   largest |value| to be summed
+ *                  long    :   window          -   number of values summed
+ *
+ * RETURNS:         bool    - true if the sum always fits in Acc
+ **********************************************************************************/
+template <typename Acc>
+inline bool AccumulatorFits (double maxMagnitude, long window) {
+    if (!std::numeric_limits<Acc>::is_integer) {
+        return true;
+    }
+    return maxMagnitude * (double) window <= (double) std::numeric_limits<Acc>::max();
+}
+
+/***********************************************************************************
+ * NAME:            RangeMagnitude
+ *
+ * DESCRIPTION:     Gets the largest magnitude of any value in [low, high]
+ *
+ * PARAMETERS:      T       :   low     -   the smallest value
+ *                  T       :   high    -   the largest value
+ *
+ * RETURNS:         double  - the larger of |low| and |high|
+ **********************************************************************************/
+template <typename T>
+inline double RangeMagnitude (T low, T high) {
+    double l = (double) low < 0 ? -(double) low : (double) low;
+    double h = (double) high < 0 ? -(double) high : (double) high;
+    return l > h ? l : h;
+}
+
+/***********************************************************************************
+ * NAME:            BorderSum
+ *
+ * DESCRIPTION:     Sums the 2*depth+1 values of a line centred on c, mapping
+ *                  any that fall outside the line by border mode
+ *
+ * PARAMETERS:      const Acc*  :   line    -   the line to sum
+ *                  long        :   n       -   length of the line
+ *                  long        :   c       -   centre of the window
+ *                  int         :   depth   -   the neighbourhood depth
+ *                  int         :   border  -   a border_mode
+ *
+ * RETURNS:         Acc     - the sum of the window
+ **********************************************************************************/
+template <typename Acc>
+inline Acc BorderSum (const Acc* line, long n, long c, int depth, int border) {
+    Acc sum = 0;
+
+    for (long k = c - depth; k <= c + depth; k++) {
+        long src = BorderIndex(k, n, border);
+        if (src != -1) {
+            sum += line[src];
+        }
+    }
+
+    return sum;
+}
+
+/***********************************************************************************
+ * NAME:            BoxMeanRows
+ *
+ * DESCRIPTION:     Direct box mean kernel. For each output row the window rows
+ *                  are summed column by column into colSums, then each output
+ *                  value sums 2*depth+1 of those column sums. Both inner loops
+ *                  run over contiguous memory so they vectorise. Rows and
+ *                  columns whose windows stay inside the matrix take the
+ *                  plain loops, the rest map their neighbours by border mode.
+ *
+ * PARAMETERS:      T**     :   in          -   the input matrix
+ *                  T**     :   out         -   the output matrix
+ *                  long    :   rows        -   rows in both matrices
+ *                  long    :   cols        -   columns in both matrices
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *                  long    :   start       -   first output row to compute
+ *                  long    :   end         -   one past the last output row
+ *                  Acc*    :   colSums     -   scratch space for cols values
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T, typename Acc>
+void BoxMeanRows (T** in, T** out, long rows, long cols, int depth, int border,
+                  long start, long end, Acc* colSums) {
+    Acc window = (Acc) (2 * (long) depth + 1) * (2 * (long) depth + 1);
+    long left = depth < cols ? depth : cols;
+    long right = cols - depth > left ? cols - depth : left;
+
+    for (long row = start; row < end; row++) {
+        for (long c = 0; c < cols; c++) {
+            colSums[c] = 0;
+        }
+        for (long r = row - depth; r <= row + depth; r++) {
+            long src = BorderIndex(r, rows, border);
+            if (src == -1) {
+                continue;
+            }
+            const T* line = in[src];
+            for (long c = 0; c < cols; c++) {
+                colSums[c] += line[c];
+            }
+        }
+
+        T* dest = out[row];
+
+        // Interior columns, whose windows lie inside the row
+        for (long c = left; c < right; c++) {
+            Acc sum = 0;
+            for (long k = c - depth; k <= c + depth; k++) {
+                sum += colSums[k];
+            }
+            dest[c] = (T) (sum / window);
+        }
+
+        // Border strips at either end of the row
+        for (long c = 0; c < left; c++) {
+            dest[c] = (T) (BorderSum(colSums, cols, c, depth, border) / window);
+        }
+        for (long c = right; c < cols; c++) {
+            dest[c] = (T) (BorderSum(colSums, cols, c, depth, border) / window);
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            RunningMeanRows
+ *
+ * DESCRIPTION:     Running sum box mean kernel. The column sums of the first
+ *                  output row are summed in full, then each following row
+ *                  adds the row entering the window and subtracts the one
+ *                  leaving it. Along each row the window sum likewise gains
+ *                  one column sum and loses another, so every output value
+ *                  costs a fixed four additions whatever the depth.
+ *
+ * PARAMETERS:      T**     :   in          -   the input matrix
+ *                  T**     :   out         -   the output matrix
+ *                  long    :   rows        -   rows in both matrices
+ *                  long    :   cols        -   columns in both matrices
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *                  long    :   start       -   first output row to compute
+ *                  long    :   end         -   one past the last output row
+ *                  Acc*    :   colSums     -   scratch space for cols values
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T, typename Acc>
+void RunningMeanRows (T** in, T** out, long rows, long cols, int depth, int border,
+                      long start, long end, Acc* colSums) {
+    Acc window = (Acc) (2 * (long) depth + 1) * (2 * (long) depth + 1);
+
+    for (long c = 0; c < cols; c++) {
+        colSums[c] = 0;
+    }
+    for (long r = start - depth; r <= start + depth; r++) {
+        long src = BorderIndex(r, rows, border);
+        if (src == -1) {
+            continue;
+        }
+        const T* line = in[src];
+        for (long c = 0; c < cols; c++) {
+            colSums[c] += line[c];
+        }
+    }
+
+    for (long row = start; row < end; row++) {
+        if (row > start) {
+            long enter = BorderIndex(row + depth, rows, border);
+            long leave = BorderIndex(row - depth - 1, rows, border);
+            if (enter != -1) {
+                const T* line = in[enter];
+                for (long c = 0; c < cols; c++) {
+                    colSums[c] += line[c];
+                }
+            }
+            if (leave != -1) {
+                const T* line = in[leave];
+                for (long c = 0; c < cols; c++) {
+                    colSums[c] -= line[c];
+                }
+            }
+        }
+
+        T* dest = out[row];
+        Acc sum = BorderSum(colSums, cols, 0, depth, border);
+        dest[0] = (T) (sum / window);
+        for (long c = 1; c < cols; c++) {
+            long enter = c + depth;
+            long leave = c - depth - 1;
+
+            if (leave >= 0 && enter < cols) {
+                sum += colSums[enter] - colSums[leave];
+            } else {
+                enter = BorderIndex(enter, cols, border);
+                leave = BorderIndex(leave, cols, border);
+                sum += enter != -1 ? colSums[enter] : 0;
+                sum -= leave != -1 ? colSums[leave] : 0;
+            }
+            dest[c] = (T) (sum / window);
+        }
+    }
+}
+
+// The type an integral table is kept in. Integer tables are unsigned so they
+// may wrap: a window's sum still comes out right from the differences, as
+// long as the sum itself fits.
+template <typename W>
+struct IntegralTraits {
+    typedef typename std::conditional<std::is_integral<W>::value, std::make_unsigned<W>,
+                                      std::common_type<W> >::type::type Table;
+};
+
+/***********************************************************************************
+ * NAME:            IntegralChunk
+ *
+ * DESCRIPTION:     Gets how many output rows IntegralMeanRows covers with each
+ *                  table it builds. Each table is rebuilt with 2*depth rows of
+ *                  overlap, so chunks are kept several windows tall.
+ *
+ * PARAMETERS:      int     :   depth       -   the neighbourhood depth
+ *                  long    :   start       -   first output row
+ *                  long    :   end         -   one past the last output row
+ *
+ * RETURNS:         long    - output rows per table
+ **********************************************************************************/
+inline long IntegralChunk (int depth, long start, long end) {
+    long chunk = 4 * (2 * (long) depth + 1);
+
+    chunk = chunk < INTEGRAL_MIN_CHUNK ? INTEGRAL_MIN_CHUNK : chunk;
+    return chunk < end - start ? chunk : end - start;
+}
+
+/***********************************************************************************
+ * NAME:            IntegralScratch
+ *
+ * DESCRIPTION:     Gets how many table values IntegralMeanRows needs for a
+ *                  thread filtering output rows [start, end)
+ *
+ * PARAMETERS:      long    :   cols        -   columns in the matrix
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  long    :   start       -   first output row
+ *                  long    :   end         -   one past the last output row
+ *
+ * RETURNS:         long    - number of values in the table
+ **********************************************************************************/
+inline long IntegralScratch (long cols, int depth, long start, long end) {
+    return (IntegralChunk(depth, start, end) + 2 * (long) depth + 1) *
+           (cols + 2 * (long) depth + 1);
+}
+
+/***********************************************************************************
+ * NAME:            IntegralMeanRows
+ *
+ * DESCRIPTION:     Integral table box mean kernel. For each chunk of output
+ *                  rows a summed area table is built over the rows and
+ *                  columns their windows cover, border values included. Any
+ *                  window's sum is then four lookups, whatever the depth.
+ *
+ * PARAMETERS:      T**     :   in          -   the input matrix
+ *                  T**     :   out         -   the output matrix
+ *                  long    :   rows        -   rows in both matrices
+ *                  long    :   cols        -   columns in both matrices
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *                  long    :   start       -   first output row to compute
+ *                  long    :   end         -   one past the last output row
+ *                  Table*  :   table       -   scratch space for IntegralScratch
+ *                                              values
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename W, typename T, typename Table>
+void IntegralMeanRows (T** in, T** out, long rows, long cols, int depth, int border,
+                       long start, long end, Table* table) {
+    W window = (W) (2 * (long) depth + 1) * (2 * (long) depth + 1);
+    long width = cols + 2 * (long) depth + 1;
+    long chunk = IntegralChunk(depth, start, end);
+    long span = 2 * (long) depth + 1;
+
+    for (long c = 0; c < width; c++) {
+        table[c] = 0;
+    }
+
+    for (long first = start; first < end; first += chunk) {
+        long last = first + chunk < end ? first + chunk : end;
+        long height = last - first + 2 * (long) depth;
+
+        // Row i + 1 of the table sums padded rows [0, i] from first - depth
+        for (long i = 0; i < height; i++) {
+            long src = BorderIndex(first - depth + i, rows, border);
+            const Table* above = table + i * width;
+            Table* here = table + (i + 1) * width;
+            Table run = 0;
+
+            here[0] = 0;
+            for (long j = 0; j < width - 1; j++) {
+                long c = j - depth;
+                if (src != -1 && (c < 0 || c >= cols)) {
+                    c = BorderIndex(c, cols, border);
+                }
+                if (src != -1 && c != -1) {
+                    run += (Table) in[src][c];
+                }
+                here[j + 1] = above[j + 1] + run;
+            }
+        }
+
+        for (long row = first; row < last; row++) {
+            const Table* top = table + (row - first) * width;
+            const Table* bottom = top + span * width;
+            T* dest = out[row];
+            for (long c = 0; c < cols; c++) {
+                Table sum = bottom[c + span] - top[c + span] - bottom[c] + top[c];
+                dest[c] = (T) ((W) sum / window);
+            }
+        }
+    }
+}
+
+#endif
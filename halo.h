@@ -0,0 +1,629 @@
+/***********************************************************************************
+ * FILENAME:        halo.h
+ *
+ * DESCRIPTION:     Moves halo rows between the processes of a distributed
+ *                  filter, for convdist. Each process, or rank, owns a band of
+ *                  rows and only ever talks to the ranks owning the bands
+ *                  above and below its own, which with a wrapped border
+ *                  include the last and first ranks for each other.
+ *
+ *                  A transport is named by a spec, one of
+ *                      unix:dir            sockets dir/rank-N.sock
+ *                      tcp:host:port       rank N listens on port + N
+ *                      tcp:host:port,...   rank N listens on the Nth address
+ *                      shm:name            a POSIX shared memory segment
+ *                  The socket transports link each rank to the rank below by
+ *                  connecting to it, so the rank above is the one that
+ *                  connected. Both halos of an exchange move at once, polling
+ *                  the two sockets, so neither side waits on the other to
+ *                  read. Shared memory holds one mailbox per rank and side,
+ *                  each taking a message at a time. Rank 0 makes the segment
+ *                  afresh and removes its name once every rank has mapped it.
+ *                  A rank that dies leaves its neighbours waiting on shared
+ *                  memory, where sockets would tell them it had gone.
+ ***********************************************************************************/
+
+#ifndef HALO_H
+#define HALO_H
+
+#include <errno.h>      // Used for EINTR
+#include <fcntl.h>      // Used for O_CREAT
+#include <poll.h>       // Used for exchanging on both sockets at once
+#include <sched.h>      // Used for sched_yield
+#include <stdio.h>      // Used for snprintf
+#include <stdlib.h>     // Used for atoi
+#include <string.h>     // Used for memcpy
+#include <time.h>       // Used for nanosleep
+#include <unistd.h>     // Used for close, unlink
+#include <netdb.h>      // Used for getaddrinfo
+#include <netinet/in.h> // Used for IPPROTO_TCP
+#include <netinet/tcp.h> // Used for TCP_NODELAY
+#include <sys/mman.h>   // Used for shared memory
+#include <sys/socket.h> // Sockets
+#include <sys/stat.h>   // Used for fstat
+#include <sys/un.h>     // Used for sockaddr_un
+#include <string>       // Strings
+#include <vector>       // Used for address lists
+#include "stats.h"      // Used for MonotonicSeconds
+#include "serve.h"      // Used for WriteAll
+
+// How long a rank waits for the others to start
+#define HALO_CONNECT_SECONDS 30
+
+// Written last when rank 0 has set up a shared memory segment
+#define HALO_SHM_READY 0x4f4c41484d485321ULL
+
+// The neighbours of a rank's band
+enum halo_side {
+    HALO_ABOVE,
+    HALO_BELOW,
+    HALO_SIDES
+};
+
+enum transport_kind {
+    TRANSPORT_UNIX,
+    TRANSPORT_TCP,
+    TRANSPORT_SHM,
+    TRANSPORT_KINDS
+};
+
+// The start of a shared memory segment, followed by 2 mailboxes per rank
+struct halo_segment {
+    uint64_t ready;                 // HALO_SHM_READY once set up
+    uint64_t ranks;
+    uint64_t capacity;              // Bytes a mailbox holds
+};
+
+// A mailbox, followed by its capacity in bytes
+struct halo_mailbox {
+    uint64_t full;                  // Whether it holds a message not yet taken
+    uint64_t size;
+};
+
+// One rank's links to its neighbours
+struct halo_transport {
+    int kind;
+    int rank;
+    int ranks;
+    int peers[HALO_SIDES];          // Rank on each side, -1 for none
+    int fds[HALO_SIDES];            // Sockets to them
+    std::string address;            // The spec without its kind
+    std::string listenPath;         // The unix socket to remove when done
+    char* shared;                   // The shared memory segment, or NULL
+    size_t sharedBytes;
+    size_t capacity;
+};
+
+/***********************************************************************************
+ * NAME:            TransportName
+ *
+ * DESCRIPTION:     Gets the name of a transport_kind, as used in specs
+ *
+ * PARAMETERS:      int     :   kind    -   the transport_kind
+ *
+ * RETURNS:         const char* - its name
+ **********************************************************************************/
+inline const char* TransportName (int kind) {
+    switch (kind) {
+        case TRANSPORT_UNIX:
+            return "unix";
+        case TRANSPORT_TCP:
+            return "tcp";
+        case TRANSPORT_SHM:
+            return "shm";
+        default:
+            return "unknown";
+    }
+}
+
+/***********************************************************************************
+ * NAME:            HaloPeers
+ *
+ * DESCRIPTION:     Finds the ranks above and below a rank. Only a wrapped
+ *                  border links the first and last ranks.
+ *
+ * PARAMETERS:      int     :   rank    -   the rank
+ *                  int     :   ranks   -   the number of ranks
+ *                  bool    :   wrap    -   whether the border wraps
+ *                  int*    :   peers   -   variable to store the HALO_SIDES
+ *                                          ranks, -1 for none
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void HaloPeers (int rank, int ranks, bool wrap, int* peers) {
+    bool cyclic = wrap && ranks > 1;
+
+    peers[HALO_ABOVE] = rank > 0 ? rank - 1 : cyclic ? ranks - 1 : -1;
+    peers[HALO_BELOW] = rank < ranks - 1 ? rank + 1 : cyclic ? 0 : -1;
+}
+
+/***********************************************************************************
+ * NAME:            PauseHalo
+ *
+ * DESCRIPTION:     Waits a little before trying something again
+ *
+ * PARAMETERS:      long    :   micros  -   microseconds to wait
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void PauseHalo (long micros) {
+    struct timespec pause = { micros / 1000000, (micros % 1000000) * 1000 };
+    nanosleep(&pause, NULL);
+}
+
+/***********************************************************************************
+ * NAME:            RankAddress
+ *
+ * DESCRIPTION:     Finds the address a rank listens on
+ *
+ * PARAMETERS:      const halo_transport&   :   t   -   the transport
+ *                  int     :   rank    -   the rank
+ *                  std::string*    :   host    -   variable to store the
+ *                                                  path or host name
+ *                  std::string*    :   port    -   variable to store the port
+ *
+ * RETURNS:         0 on success, -1 if the spec has no address for the rank
+ **********************************************************************************/
+inline int RankAddress (const halo_transport& t, int rank, std::string* host,
+                        std::string* port) {
+    if (t.kind == TRANSPORT_UNIX) {
+        char name[32];
+        snprintf(name, sizeof(name), "/rank-%d.sock", rank);
+        *host = t.address + name;
+        return 0;
+    }
+
+    std::vector<std::string> entries;
+    size_t start = 0, comma;
+    while ((comma = t.address.find(',', start)) != std::string::npos) {
+        entries.push_back(t.address.substr(start, comma - start));
+        start = comma + 1;
+    }
+    entries.push_back(t.address.substr(start));
+
+    if (entries.size() != 1 && (int) entries.size() != t.ranks) {
+        return -1;
+    }
+    std::string entry = entries[entries.size() == 1 ? 0 : rank];
+    size_t colon = entry.rfind(':');
+    if (colon == std::string::npos || atoi(entry.c_str() + colon + 1) <= 0) {
+        return -1;
+    }
+    *host = entry.substr(0, colon);
+    *port = std::to_string(atoi(entry.c_str() + colon + 1) +
+                           (entries.size() == 1 ? rank : 0));
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            OpenHaloSocket
+ *
+ * DESCRIPTION:     Makes a socket listening on, or connected to, a rank's
+ *                  address
+ *
+ * PARAMETERS:      const halo_transport&   :   t   -   the transport
+ *                  int     :   rank    -   the rank
+ *                  bool    :   listening   -   whether to listen rather than
+ *                                              connect
+ *
+ * RETURNS:         int - the socket, or -1 if it could not be made
+ **********************************************************************************/
+inline int OpenHaloSocket (const halo_transport& t, int rank, bool listening) {
+    std::string host, port;
+    int fd = -1;
+
+    if (RankAddress(t, rank, &host, &port) != 0) {
+        return -1;
+    }
+
+    if (t.kind == TRANSPORT_UNIX) {
+        struct sockaddr_un address;
+        if (host.size() >= sizeof(address.sun_path) ||
+            (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+            return -1;
+        }
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strcpy(address.sun_path, host.c_str());
+        if (listening) {
+            unlink(host.c_str());
+        }
+        if ((listening && (bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+                           listen(fd, 2) != 0)) ||
+            (!listening &&
+             connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    struct addrinfo hints, *found, *a;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    if (getaddrinfo(listening ? NULL : host.c_str(), port.c_str(), &hints, &found) != 0) {
+        return -1;
+    }
+    for (a = found; a != NULL; a = a->ai_next) {
+        int on = 1;
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(fd, a->ai_addr, a->ai_addrlen) == 0 && listen(fd, 2) == 0) {
+                break;
+            }
+        } else if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+
+    return fd;
+}
+
+/***********************************************************************************
+ * NAME:            ConnectHaloSockets
+ *
+ * DESCRIPTION:     Links a rank to its neighbours over sockets. It connects to
+ *                  the rank below, retrying until that rank is listening, and
+ *                  takes the connection of the rank above. Each connection
+ *                  starts with the connecting rank's number.
+ *
+ * PARAMETERS:      halo_transport* :   t   -   the transport, with its peers set
+ *
+ * RETURNS:         0 on success, -1 if the neighbours could not be reached
+ **********************************************************************************/
+inline int ConnectHaloSockets (halo_transport* t) {
+    double deadline = MonotonicSeconds() + HALO_CONNECT_SECONDS;
+    int listener = -1;
+    int32_t number = t->rank;
+
+    if (t->peers[HALO_ABOVE] != -1) {
+        if ((listener = OpenHaloSocket(*t, t->rank, true)) == -1) {
+            return -1;
+        }
+        if (t->kind == TRANSPORT_UNIX) {
+            std::string port;
+            RankAddress(*t, t->rank, &t->listenPath, &port);
+        }
+    }
+
+    if (t->peers[HALO_BELOW] != -1) {
+        int below = t->peers[HALO_BELOW];
+        while ((t->fds[HALO_BELOW] = OpenHaloSocket(*t, below, false)) == -1) {
+            if (MonotonicSeconds() > deadline) {
+                close(listener);
+                return -1;
+            }
+            PauseHalo(20000);
+        }
+        if (WriteAll(t->fds[HALO_BELOW], (const char*) &number, sizeof(number)) != 0) {
+            close(listener);
+            return -1;
+        }
+    }
+
+    if (listener != -1) {
+        struct pollfd waiting = { listener, POLLIN, 0 };
+        int ready = poll(&waiting, 1, HALO_CONNECT_SECONDS * 1000);
+        t->fds[HALO_ABOVE] = ready == 1 ? accept4(listener, NULL, NULL, SOCK_CLOEXEC) : -1;
+        close(listener);
+        if (t->fds[HALO_ABOVE] == -1 ||
+            recv(t->fds[HALO_ABOVE], &number, sizeof(number), MSG_WAITALL) !=
+                (ssize_t) sizeof(number) ||
+            number != t->peers[HALO_ABOVE]) {
+            return -1;
+        }
+        if (t->kind == TRANSPORT_TCP) {
+            int on = 1;
+            setsockopt(t->fds[HALO_ABOVE], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            HaloMailbox
+ *
+ * DESCRIPTION:     Finds the mailbox for messages reaching a rank from one side
+ *
+ * PARAMETERS:      const halo_transport&   :   t   -   the transport
+ *                  int     :   rank    -   the rank receiving
+ *                  int     :   side    -   the halo_side they come from
+ *
+ * RETURNS:         halo_mailbox* - the mailbox, its bytes follow it
+ **********************************************************************************/
+inline halo_mailbox* HaloMailbox (const halo_transport& t, int rank, int side) {
+    size_t stride = (sizeof(halo_mailbox) + t.capacity + 63) / 64 * 64;
+    size_t first = (sizeof(halo_segment) + 63) / 64 * 64;
+
+    return (halo_mailbox*) (t.shared + first + (2 * (size_t) rank + side) * stride);
+}
+
+/***********************************************************************************
+ * NAME:            AttachHaloSegment
+ *
+ * DESCRIPTION:     Maps the shared memory segment, which rank 0 makes. The
+ *                  other ranks retry until it is ready.
+ *
+ * PARAMETERS:      halo_transport* :   t   -   the transport, with its capacity
+ *
+ * RETURNS:         0 on success, -1 if the segment could not be mapped
+ **********************************************************************************/
+inline int AttachHaloSegment (halo_transport* t) {
+    std::string name = "/" + t->address;
+    double deadline = MonotonicSeconds() + HALO_CONNECT_SECONDS;
+    size_t stride = (sizeof(halo_mailbox) + t->capacity + 63) / 64 * 64;
+
+    t->sharedBytes = (sizeof(halo_segment) + 63) / 64 * 64 + 2 * (size_t) t->ranks * stride;
+
+    if (t->rank == 0) {
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd == -1 || ftruncate(fd, t->sharedBytes) != 0) {
+            return -1;
+        }
+        t->shared = (char*) mmap(NULL, t->sharedBytes, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                 fd, 0);
+        close(fd);
+        if (t->shared == MAP_FAILED) {
+            t->shared = NULL;
+            return -1;
+        }
+
+        // A new segment is all zeroes, so every mailbox starts empty
+        halo_segment* segment = (halo_segment*) t->shared;
+        segment->ranks = t->ranks;
+        segment->capacity = t->capacity;
+        __atomic_store_n(&segment->ready, HALO_SHM_READY, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    while (MonotonicSeconds() < deadline) {
+        int fd = shm_open(name.c_str(), O_RDWR, 0600);
+        struct stat st;
+
+        if (fd != -1 && fstat(fd, &st) == 0 && (size_t) st.st_size == t->sharedBytes) {
+            t->shared = (char*) mmap(NULL, t->sharedBytes, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, fd, 0);
+            close(fd);
+            if (t->shared == MAP_FAILED) {
+                t->shared = NULL;
+                return -1;
+            }
+
+            halo_segment* segment = (halo_segment*) t->shared;
+            if (__atomic_load_n(&segment->ready, __ATOMIC_ACQUIRE) == HALO_SHM_READY &&
+                segment->ranks == (uint64_t) t->ranks &&
+                segment->capacity == t->capacity) {
+                return 0;
+            }
+            munmap(t->shared, t->sharedBytes);
+            t->shared = NULL;
+        } else if (fd != -1) {
+            close(fd);
+        }
+        PauseHalo(20000);
+    }
+
+    return -1;
+}
+
+/***********************************************************************************
+ * NAME:            OpenTransport
+ *
+ * DESCRIPTION:     Links a rank to its neighbours. Every rank has to open the
+ *                  same spec with the same capacity.
+ *
+ * PARAMETERS:      halo_transport* :   t   -   variable to store the links
+ *                  const std::string&  :   spec    -   the transport's spec
+ *                  int     :   rank    -   this rank
+ *                  int     :   ranks   -   the number of ranks
+ *                  bool    :   wrap    -   whether the border wraps
+ *                  size_t  :   capacity    -   the largest message to send
+ *
+ * RETURNS:         0 on success, -1 if the spec is bad or the neighbours
+ *                  could not be reached
+ **********************************************************************************/
+inline int OpenTransport (halo_transport* t, const std::string& spec, int rank, int ranks,
+                          bool wrap, size_t capacity) {
+    size_t colon = spec.find(':');
+
+    t->kind = -1;
+    for (int k = 0; k < TRANSPORT_KINDS && colon != std::string::npos; k++) {
+        if (spec.compare(0, colon, TransportName(k)) == 0) {
+            t->kind = k;
+        }
+    }
+    t->rank = rank;
+    t->ranks = ranks;
+    t->fds[HALO_ABOVE] = t->fds[HALO_BELOW] = -1;
+    t->shared = NULL;
+    t->sharedBytes = 0;
+    t->capacity = capacity;
+    HaloPeers(rank, ranks, wrap, t->peers);
+    if (t->kind == -1 || colon + 1 >= spec.size()) {
+        return -1;
+    }
+    t->address = spec.substr(colon + 1);
+
+    if (t->kind == TRANSPORT_SHM) {
+        return t->address.find('/') == std::string::npos ? AttachHaloSegment(t) : -1;
+    }
+    return ConnectHaloSockets(t);
+}
+
+/***********************************************************************************
+ * NAME:            ExchangeSockets
+ *
+ * DESCRIPTION:     Sends and receives a message on each side's socket at once
+ *
+ * PARAMETERS:      halo_transport* :   t   -   the transport
+ *                  const void* const*  :   out -   what to send each side, or NULL
+ *                  void* const*    :   in      -   where to receive from each
+ *                                                  side, or NULL
+ *                  size_t  :   bytes   -   the size of every message
+ *
+ * RETURNS:         0 on success, -1 if a neighbour went away
+ **********************************************************************************/
+inline int ExchangeSockets (halo_transport* t, const void* const* out, void* const* in,
+                            size_t bytes) {
+    size_t sent[HALO_SIDES] = { 0, 0 };
+    size_t got[HALO_SIDES] = { 0, 0 };
+
+    while (true) {
+        struct pollfd fds[HALO_SIDES];
+        int count = 0;
+
+        for (int s = 0; s < HALO_SIDES; s++) {
+            short events = (out[s] != NULL && sent[s] < bytes ? POLLOUT : 0) |
+                           (in[s] != NULL && got[s] < bytes ? POLLIN : 0);
+            if (events != 0) {
+                fds[count].fd = t->fds[s];
+                fds[count].events = events;
+                fds[count].revents = 0;
+                count++;
+            }
+        }
+        if (count == 0) {
+            return 0;
+        }
+        if (poll(fds, count, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        for (int f = 0; f < count; f++) {
+            int s = fds[f].fd == t->fds[HALO_ABOVE] ? HALO_ABOVE : HALO_BELOW;
+            if ((fds[f].revents & (POLLERR | POLLNVAL)) != 0) {
+                return -1;
+            }
+            if ((fds[f].revents & POLLOUT) != 0) {
+                ssize_t n = send(t->fds[s], (const char*) out[s] + sent[s], bytes - sent[s],
+                                 MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (n == -1 && errno != EAGAIN && errno != EINTR) {
+                    return -1;
+                }
+                sent[s] += n > 0 ? n : 0;
+            }
+            if ((fds[f].revents & (POLLIN | POLLHUP)) != 0) {
+                ssize_t n = recv(t->fds[s], (char*) in[s] + got[s], bytes - got[s],
+                                 MSG_DONTWAIT);
+                if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR)) {
+                    return -1;
+                }
+                got[s] += n > 0 ? n : 0;
+            }
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            WaitMailbox
+ *
+ * DESCRIPTION:     Waits for a mailbox to become full or empty
+ *
+ * PARAMETERS:      halo_mailbox*   :   box     -   the mailbox
+ *                  uint64_t    :   full    -   the state to wait for
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void WaitMailbox (halo_mailbox* box, uint64_t full) {
+    for (long spins = 0; __atomic_load_n(&box->full, __ATOMIC_ACQUIRE) != full; spins++) {
+        if (spins < 1000) {
+            sched_yield();
+        } else {
+            PauseHalo(50);
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            ExchangeHalos
+ *
+ * DESCRIPTION:     Sends a message to each neighbour given one and receives
+ *                  one from each neighbour given a buffer. Messages on a side
+ *                  arrive in the order they were sent.
+ *
+ * PARAMETERS:      halo_transport* :   t   -   the transport
+ *                  const void* const*  :   out -   what to send each side, or NULL
+ *                  void* const*    :   in      -   where to receive from each
+ *                                                  side, or NULL
+ *                  size_t  :   bytes   -   the size of every message, at most
+ *                                          the transport's capacity
+ *
+ * RETURNS:         0 on success, -1 if a neighbour went away
+ **********************************************************************************/
+inline int ExchangeHalos (halo_transport* t, const void* const* out, void* const* in,
+                          size_t bytes) {
+    if (t->kind != TRANSPORT_SHM) {
+        return ExchangeSockets(t, out, in, bytes);
+    }
+    if (bytes > t->capacity) {
+        return -1;
+    }
+
+    // Sending on one side arrives from the other at the neighbour
+    for (int s = 0; s < HALO_SIDES; s++) {
+        if (out[s] != NULL) {
+            halo_mailbox* box = HaloMailbox(*t, t->peers[s], HALO_SIDES - 1 - s);
+            WaitMailbox(box, 0);
+            memcpy(box + 1, out[s], bytes);
+            box->size = bytes;
+            __atomic_store_n(&box->full, 1, __ATOMIC_RELEASE);
+        }
+    }
+    for (int s = 0; s < HALO_SIDES; s++) {
+        if (in[s] != NULL) {
+            halo_mailbox* box = HaloMailbox(*t, t->rank, s);
+            WaitMailbox(box, 1);
+            memcpy(in[s], box + 1, bytes);
+            __atomic_store_n(&box->full, 0, __ATOMIC_RELEASE);
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            CloseTransport
+ *
+ * DESCRIPTION:     Closes a rank's links. Rank 0 also removes the shared
+ *                  memory segment's name, as every rank has mapped it by the
+ *                  time rank 0 is done.
+ *
+ * PARAMETERS:      halo_transport* :   t   -   the transport
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void CloseTransport (halo_transport* t) {
+    for (int s = 0; s < HALO_SIDES; s++) {
+        if (t->fds[s] != -1) {
+            close(t->fds[s]);
+            t->fds[s] = -1;
+        }
+    }
+    if (!t->listenPath.empty()) {
+        unlink(t->listenPath.c_str());
+    }
+    if (t->shared != NULL) {
+        munmap(t->shared, t->sharedBytes);
+        t->shared = NULL;
+        if (t->rank == 0) {
+            shm_unlink(("/" + t->address).c_str());
+        }
+    }
+}
+
+#endif
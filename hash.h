@@ -0,0 +1,207 @@
+/***********************************************************************************
+ * FILENAME:        hash.h
+ *
+ * DESCRIPTION:     A fast 64 bit hash of matrix contents, fed a band at a time
+ *                  while a matrix is read so its data is hashed while still
+ *                  in cache.
+ *
+ *                  The loop follows XXH3's long input loop. Eight independent
+ *                  64 bit lanes each take one word of a 64 byte stripe, mixed
+ *                  with a key and folded in with a 32 x 32 -> 64 bit multiply.
+ *                  The lanes don't depend on each other, so the compiler turns
+ *                  a stripe into a few packed multiplies and adds. Every
+ *                  HASH_SCRAMBLE stripes the lanes are scrambled so that
+ *                  high bits reach the low ones. It is not a cryptographic
+ *                  hash and isn't compatible with XXH3 itself.
+ ***********************************************************************************/
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>     // Fixed width types
+#include <stddef.h>     // Used for size_t
+#include <string.h>     // Used for memcpy
+
+// Lanes, and the bytes a stripe gives them
+#define HASH_LANES 8
+#define HASH_STRIPE (HASH_LANES * 8)
+
+// Stripes between scrambles
+#define HASH_SCRAMBLE 16
+
+// Two lanes, held in one vector register. GCC and clang compile arithmetic
+// on it to packed instructions on any target with 128 bit vectors.
+typedef uint64_t hash_pair __attribute__((vector_size(16)));
+
+// Keys mixed into the lanes
+static const uint64_t HASH_KEYS[HASH_LANES + 2] = {
+    0xe220a8397b1dcdafULL, 0x3a34ce6380fc0bc5ULL, 0xf2686df75bf5b75bULL,
+    0x26687a0f5d616de9ULL, 0x36842408027821dfULL, 0xe9667bbd29f2be0dULL,
+    0xce60f88df2e681b1ULL, 0x6ee39b52a316ef11ULL, 0xeed769648ef4f652ULL,
+    0x2bd9dc4c906ef2d2ULL
+};
+
+// A hash being fed
+struct content_hash {
+    uint64_t lanes[HASH_LANES];
+    unsigned char pending[HASH_STRIPE]; // The start of a stripe not yet complete
+    size_t pendingBytes;
+    uint64_t length;                    // Bytes fed so far
+    unsigned stripes;                   // Stripes since the last scramble
+};
+
+/***********************************************************************************
+ * NAME:            InitHash
+ *
+ * DESCRIPTION:     Starts a hash
+ *
+ * PARAMETERS:      content_hash*   :   hash    -   the hash to start
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void InitHash (content_hash* hash) {
+    for (int i = 0; i < HASH_LANES; i++) {
+        hash->lanes[i] = HASH_KEYS[i + 2];
+    }
+    hash->pendingBytes = 0;
+    hash->length = 0;
+    hash->stripes = 0;
+}
+
+/***********************************************************************************
+ * NAME:            HashStripes
+ *
+ * DESCRIPTION:     Folds whole stripes into the lanes, scrambling them every
+ *                  HASH_SCRAMBLE stripes
+ *
+ * PARAMETERS:      content_hash*   :   hash    -   the hash to feed
+ *                  const unsigned char*    :   data    -   the stripes
+ *                  size_t  :   count   -   the number of stripes
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void HashStripes (content_hash* hash, const unsigned char* data, size_t count) {
+    const int pairs = HASH_LANES / 2;
+    hash_pair lanes[pairs];
+    hash_pair keys[pairs];
+    hash_pair scrambleKeys[pairs];
+    unsigned stripes = hash->stripes;
+
+    memcpy(lanes, hash->lanes, sizeof(lanes));
+    memcpy(keys, HASH_KEYS, sizeof(keys));
+    for (int p = 0; p < pairs; p++) {
+        scrambleKeys[p][0] = HASH_KEYS[(2 * p + 3) % HASH_LANES];
+        scrambleKeys[p][1] = HASH_KEYS[(2 * p + 4) % HASH_LANES];
+    }
+
+    for (size_t s = 0; s < count; s++, data += HASH_STRIPE) {
+        for (int p = 0; p < pairs; p++) {
+            hash_pair words;
+            memcpy(&words, data + sizeof(words) * p, sizeof(words));
+            hash_pair keyed = words ^ keys[p];
+
+            // Each lane also takes its neighbour's word unmixed, so no word
+            // is lost if its multiply is by 0
+            hash_pair swapped = { words[1], words[0] };
+            lanes[p] += swapped + (keyed & 0xffffffffULL) * (keyed >> 32);
+        }
+
+        if (++stripes == HASH_SCRAMBLE) {
+            for (int p = 0; p < pairs; p++) {
+                lanes[p] ^= lanes[p] >> 47;
+                lanes[p] ^= scrambleKeys[p];
+                lanes[p] *= 0x9E3779B1ULL;
+            }
+            stripes = 0;
+        }
+    }
+    memcpy(hash->lanes, lanes, sizeof(lanes));
+    hash->stripes = stripes;
+}
+
+/***********************************************************************************
+ * NAME:            UpdateHash
+ *
+ * DESCRIPTION:     Feeds some bytes to a hash. Feeding the same bytes in
+ *                  different pieces gives the same hash.
+ *
+ * PARAMETERS:      content_hash*   :   hash    -   the hash to feed
+ *                  const void* :   data    -   the bytes
+ *                  size_t  :   size    -   the number of bytes
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void UpdateHash (content_hash* hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*) data;
+
+    hash->length += size;
+
+    // Finish a stripe left over from before
+    if (hash->pendingBytes > 0) {
+        size_t take = HASH_STRIPE - hash->pendingBytes;
+        take = take < size ? take : size;
+        memcpy(hash->pending + hash->pendingBytes, bytes, take);
+        hash->pendingBytes += take;
+        bytes += take;
+        size -= take;
+        if (hash->pendingBytes < HASH_STRIPE) {
+            return;
+        }
+        HashStripes(hash, hash->pending, 1);
+        hash->pendingBytes = 0;
+    }
+
+    HashStripes(hash, bytes, size / HASH_STRIPE);
+    bytes += size - size % HASH_STRIPE;
+    memcpy(hash->pending, bytes, size % HASH_STRIPE);
+    hash->pendingBytes = size % HASH_STRIPE;
+}
+
+/***********************************************************************************
+ * NAME:            MixHash
+ *
+ * DESCRIPTION:     Mixes two words into one with a full 64 x 64 -> 128 bit
+ *                  multiply, folding the halves together
+ *
+ * PARAMETERS:      uint64_t    :   a   -   the first word
+ *                  uint64_t    :   b   -   the second word
+ *
+ * RETURNS:         uint64_t - the mixed word
+ **********************************************************************************/
+inline uint64_t MixHash (uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128) a * b;
+    return (uint64_t) product ^ (uint64_t) (product >> 64);
+}
+
+/***********************************************************************************
+ * NAME:            FinishHash
+ *
+ * DESCRIPTION:     Gets the hash of everything fed to a hash
+ *
+ * PARAMETERS:      content_hash*   :   hash    -   the hash to finish
+ *
+ * RETURNS:         uint64_t - the hash
+ **********************************************************************************/
+inline uint64_t FinishHash (content_hash* hash) {
+    // The last partial stripe is padded with zeroes, the length tells it apart
+    if (hash->pendingBytes > 0) {
+        memset(hash->pending + hash->pendingBytes, 0, HASH_STRIPE - hash->pendingBytes);
+        HashStripes(hash, hash->pending, 1);
+        hash->pendingBytes = 0;
+    }
+
+    uint64_t result = hash->length * 0x9E3779B185EBCA87ULL;
+    for (int i = 0; i < HASH_LANES; i += 2) {
+        result += MixHash(hash->lanes[i] ^ HASH_KEYS[i + 1],
+                          hash->lanes[i + 1] ^ HASH_KEYS[i + 2]);
+    }
+
+    // Avalanche, as in SplitMix64
+    result ^= result >> 30;
+    result *= 0xBF58476D1CE4E5B9ULL;
+    result ^= result >> 27;
+    result *= 0x94D049BB133111EBULL;
+    return result ^ (result >> 31);
+}
+
+#endif
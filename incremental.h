@@ -0,0 +1,547 @@
+/***********************************************************************************
+ * FILENAME:        incremental.h
+ *
+ * DESCRIPTION:     Keeps a filtered matrix up to date as a few of its input
+ *                  values change, refiltering only the outputs whose windows
+ *                  hold a changed value.
+ *
+ *                  An incremental_filter keeps the input, its filtered output
+ *                  and, for open and close, the result of their first pass.
+ *                  Each change records a dirty rectangle of input cells. A
+ *                  refresh dilates the rectangles by the depth of each pass,
+ *                  merges the ones that overlap and refilters each region on
+ *                  a tile just large enough to hold its windows. The tile is
+ *                  copied from the matrix with the border mode already
+ *                  applied, so every kernel gives the same values on it as on
+ *                  the whole matrix. Means use the integral table kernel, so
+ *                  a region costs about its own area whatever the depth.
+ *
+ *                  A wrapped border reaches round to the far side of the
+ *                  matrix, so regions are wrapped too. The other border
+ *                  modes only ever map a cell to windows closer to it. The
+ *                  recursive gaussian has no finite window, and a pass whose
+ *                  regions would cover half the matrix is cheaper to run in
+ *                  full, so those are refiltered whole on the threads.
+ *
+ *                  A filter can also be attached to an input and output kept
+ *                  elsewhere, such as mapped files. Its stage then only holds
+ *                  what refreshes write to it, so the first pass also covers
+ *                  every value the second pass's regions read.
+ ***********************************************************************************/
+
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include <vector>       // Used for the dirty rectangles
+#include <algorithm>    // Used for sort
+#include "engine.h"     // Used for the filter engine
+
+// Cells in rows [top, bottom) and columns [left, right)
+struct dirty_rect {
+    long top;
+    long left;
+    long bottom;
+    long right;
+};
+
+// The state kept between refreshes. The filter works on the caller's input
+// matrix, and owns the output and stage matrices.
+template <typename T>
+struct incremental_filter {
+    long rows;
+    long cols;
+    filter_settings settings;       // The filter, with ENGINE_AUTO resolved
+    int numThreads;                 // Threads for passes refiltered in full
+    double minValue;                // Range of every value the input has held
+    double maxValue;
+    T** input;
+    T** output;
+    T** stage;                      // First pass of open and close, or NULL
+    bool stageKept;                 // Whether all of stage is up to date
+    std::vector<dirty_rect> dirty;  // Input cells changed since the last refresh
+};
+
+// One pass of a filter, from one matrix into another
+template <typename T>
+struct incremental_pass {
+    filter_settings settings;
+    T** from;
+    T** to;
+};
+
+/***********************************************************************************
+ * NAME:            IncrementalPasses
+ *
+ * DESCRIPTION:     Splits a filter into the passes refreshed one after the
+ *                  other. Open and close become a min and a max through the
+ *                  stage matrix, every other mode is a single pass.
+ *
+ * PARAMETERS:      incremental_filter<T>*  :   inc     -   the filter
+ *                  incremental_pass<T>*    :   passes  -   space for 2 passes
+ *
+ * RETURNS:         int - the number of passes
+ **********************************************************************************/
+template <typename T>
+int IncrementalPasses (incremental_filter<T>* inc, incremental_pass<T>* passes) {
+    int mode = inc->settings.mode;
+
+    passes[0].settings = inc->settings;
+    passes[0].from = inc->input;
+    passes[0].to = inc->output;
+    if (mode != FILTER_OPEN && mode != FILTER_CLOSE) {
+        return 1;
+    }
+
+    passes[1] = passes[0];
+    passes[0].settings.mode = mode == FILTER_OPEN ? FILTER_MIN : FILTER_MAX;
+    passes[0].to = inc->stage;
+    passes[1].settings.mode = mode == FILTER_OPEN ? FILTER_MAX : FILTER_MIN;
+    passes[1].from = inc->stage;
+    return 2;
+}
+
+/***********************************************************************************
+ * NAME:            AttachIncremental
+ *
+ * DESCRIPTION:     Sets up refreshes of an output already filtered from a
+ *                  matrix, without filtering anything. The caller keeps all
+ *                  three matrices, so FreeIncremental must not be called.
+ *
+ * PARAMETERS:      incremental_filter<T>*  :   inc -   the filter to set up
+ *                  T**     :   matrix      -   the input
+ *                  T**     :   output      -   the input filtered by settings
+ *                  T**     :   stage       -   scratch for the first pass of
+ *                                              open and close, else NULL. Only
+ *                                              the rows are needed, not values.
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   threads for full passes
+ *                  double  :   minValue    -   no value will be smaller than this
+ *                  double  :   maxValue    -   no value will be larger than this
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void AttachIncremental (incremental_filter<T>* inc, T** matrix, T** output, T** stage,
+                        long rows, long cols, filter_settings settings, int numThreads,
+                        double minValue, double maxValue) {
+    // Resolve the engine once, so regions and full passes agree on it. Only
+    // the mean and median have a choice, and they need no scratch matrix.
+    if (settings.mode == FILTER_MEAN || settings.mode == FILTER_MEDIAN) {
+        filter_workspace<T> ws;
+        InitWorkspace(&ws, rows, cols, settings, numThreads, minValue, maxValue);
+        settings.engine = ws.args[0].settings.engine;
+        FreeWorkspace(&ws);
+    }
+
+    inc->rows = rows;
+    inc->cols = cols;
+    inc->settings = settings;
+    inc->numThreads = numThreads;
+    inc->minValue = minValue;
+    inc->maxValue = maxValue;
+    inc->input = matrix;
+    inc->output = output;
+    inc->stage = stage;
+    inc->stageKept = false;
+    inc->dirty.clear();
+}
+
+/***********************************************************************************
+ * NAME:            InitIncremental
+ *
+ * DESCRIPTION:     Filters a matrix in full and keeps what is needed to
+ *                  refresh the result as it changes
+ *
+ * PARAMETERS:      incremental_filter<T>*  :   inc -   the filter to set up
+ *                  T**     :   matrix      -   the input, which must outlive it
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   threads for full passes
+ *                  double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *
+ * RETURNS:         0 on success, -1 if a thread could not be started
+ **********************************************************************************/
+template <typename T>
+int InitIncremental (incremental_filter<T>* inc, T** matrix, long rows, long cols,
+                     filter_settings settings, int numThreads, double minValue,
+                     double maxValue) {
+    incremental_pass<T> passes[2];
+    T** stage = settings.mode == FILTER_OPEN || settings.mode == FILTER_CLOSE ?
+                AllocateMatrix<T>(rows, cols) : NULL;
+
+    AttachIncremental(inc, matrix, AllocateMatrix<T>(rows, cols), stage, rows, cols,
+                      settings, numThreads, minValue, maxValue);
+    inc->stageKept = true;
+
+    int count = IncrementalPasses(inc, passes);
+    for (int p = 0; p < count; p++) {
+        if (FilterMatrix(passes[p].from, passes[p].to, rows, cols, passes[p].settings,
+                         numThreads, minValue, maxValue, NULL, NULL, NULL) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            FreeIncremental
+ *
+ * DESCRIPTION:     Frees the output and stage matrices, but not the input
+ *
+ * PARAMETERS:      incremental_filter<T>*  :   inc -   the filter to free
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void FreeIncremental (incremental_filter<T>* inc) {
+    CleanupMatrix(inc->output, inc->rows);
+    if (inc->stage != NULL) {
+        CleanupMatrix(inc->stage, inc->rows);
+    }
+    inc->output = NULL;
+    inc->stage = NULL;
+    inc->dirty.clear();
+}
+
+/***********************************************************************************
+ * NAME:            MarkDirty
+ *
+ * DESCRIPTION:     Records that input cells have changed, for when the caller
+ *                  has written to the input itself, e.g. a whole row
+ *
+ * PARAMETERS:      incremental_filter<T>*  :   inc -   the filter
+ *                  long    :   top     -   first row changed
+ *                  long    :   left    -   first column changed
+ *                  long    :   bottom  -   one past the last row changed
+ *                  long    :   right   -   one past the last column changed
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void MarkDirty (incremental_filter<T>* inc, long top, long left, long bottom, long right) {
+    dirty_rect rect;
+
+    rect.top = top < 0 ? 0 : top;
+    rect.left = left < 0 ? 0 : left;
+    rect.bottom = bottom > inc->rows ? inc->rows : bottom;
+    rect.right = right > inc->cols ? inc->cols : right;
+    if (rect.top < rect.bottom && rect.left < rect.right) {
+        inc->dirty.push_back(rect);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            UpdateValue
+ *
+ * DESCRIPTION:     Changes one input value and records it as dirty. The
+ *                  output is not touched until the next refresh.
+ *
+ * PARAMETERS:      incremental_filter<T>*  :   inc -   the filter
+ *                  long    :   row     -   the value's row
+ *                  long    :   col     -   the value's column
+ *                  T       :   value   -   its new value
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void UpdateValue (incremental_filter<T>* inc, long row, long col, T value) {
+    if (inc->input[row][col] == value) {
+        return;
+    }
+
+    inc->input[row][col] = value;
+    inc->minValue = (double) value < inc->minValue ? (double) value : inc->minValue;
+    inc->maxValue = (double) value > inc->maxValue ? (double) value : inc->maxValue;
+    MarkDirty(inc, row, col, row + 1, col + 1);
+}
+
+/***********************************************************************************
+ * NAME:            WrapRange
+ *
+ * DESCRIPTION:     Maps the indices [first, last) of a line of n onto the
+ *                  line. A wrapped border splits a range that runs off one
+ *                  end into two, or gives the whole line when the range is
+ *                  at least as long as it, any other border clips it.
+ *
+ * PARAMETERS:      long    :   first   -   first index, may be negative
+ *                  long    :   last    -   one past the last index
+ *                  long    :   n       -   the length of the line
+ *                  int     :   border  -   a border_mode
+ *                  long*   :   ranges  -   space for two [start, end) pairs
+ *
+ * RETURNS:         int - the number of ranges stored
+ **********************************************************************************/
+inline int WrapRange (long first, long last, long n, int border, long* ranges) {
+    if (border != BORDER_WRAP) {
+        ranges[0] = first < 0 ? 0 : first;
+        ranges[1] = last > n ? n : last;
+        return 1;
+    }
+    if (last - first >= n) {
+        ranges[0] = 0;
+        ranges[1] = n;
+        return 1;
+    }
+
+    long start = ((first % n) + n) % n;
+    if (start + (last - first) <= n) {
+        ranges[0] = start;
+        ranges[1] = start + (last - first);
+        return 1;
+    }
+    ranges[0] = start;
+    ranges[1] = n;
+    ranges[2] = 0;
+    ranges[3] = start + (last - first) - n;
+    return 2;
+}
+
+/***********************************************************************************
+ * NAME:            DilateRect
+ *
+ * DESCRIPTION:     Adds the outputs whose windows reach a rectangle of inputs
+ *
+ * PARAMETERS:      const dirty_rect&   :   rect    -   the changed inputs
+ *                  long    :   reach   -   how far a window reaches
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *                  int     :   border  -   a border_mode
+ *                  std::vector<dirty_rect>*    :   regions -   where to add them
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void DilateRect (const dirty_rect& rect, long reach, long rows, long cols,
+                        int border, std::vector<dirty_rect>* regions) {
+    long rowRanges[4], colRanges[4];
+    int rowCount = WrapRange(rect.top - reach, rect.bottom + reach, rows, border,
+                             rowRanges);
+    int colCount = WrapRange(rect.left - reach, rect.right + reach, cols, border,
+                             colRanges);
+
+    for (int i = 0; i < rowCount; i++) {
+        for (int j = 0; j < colCount; j++) {
+            dirty_rect region;
+            region.top = rowRanges[2 * i];
+            region.bottom = rowRanges[2 * i + 1];
+            region.left = colRanges[2 * j];
+            region.right = colRanges[2 * j + 1];
+            regions->push_back(region);
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            MergeRects
+ *
+ * DESCRIPTION:     Replaces overlapping rectangles by their bounding box until
+ *                  none overlap, so no output is refiltered twice. Sorting by
+ *                  the top row means each rectangle is only compared with the
+ *                  ones starting above its bottom.
+ *
+ * PARAMETERS:      std::vector<dirty_rect>*    :   rects   -   the rectangles
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void MergeRects (std::vector<dirty_rect>* rects) {
+    bool merged = true;
+
+    while (merged) {
+        std::vector<dirty_rect> out;
+        std::vector<bool> used(rects->size(), false);
+
+        merged = false;
+        std::sort(rects->begin(), rects->end(),
+                  [](const dirty_rect& a, const dirty_rect& b) { return a.top < b.top; });
+        for (size_t i = 0; i < rects->size(); i++) {
+            if (used[i]) {
+                continue;
+            }
+            dirty_rect r = (*rects)[i];
+            for (size_t j = i + 1; j < rects->size() && (*rects)[j].top < r.bottom; j++) {
+                const dirty_rect& s = (*rects)[j];
+                if (used[j] || s.left >= r.right || r.left >= s.right) {
+                    continue;
+                }
+                r.left = s.left < r.left ? s.left : r.left;
+                r.right = s.right > r.right ? s.right : r.right;
+                r.bottom = s.bottom > r.bottom ? s.bottom : r.bottom;
+                used[j] = true;
+                merged = true;
+            }
+            out.push_back(r);
+        }
+        rects->swap(out);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            RefilterRegion
+ *
+ * DESCRIPTION:     Refilters one region of a pass's output. The region and
+ *                  the reach of its windows are copied into a tile through
+ *                  the border mode, the tile is filtered by the calling
+ *                  thread and the region's part of it copied back.
+ *
+ * PARAMETERS:      const incremental_pass<T>&  :   pass    -   the pass
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  const dirty_rect&   :   region  -   the outputs to refilter
+ *                  double  :   minValue    -   no value is smaller than this
+ *                  double  :   maxValue    -   no value is larger than this
+ *
+ * RETURNS:         0 on success, -1 if the filter failed
+ **********************************************************************************/
+template <typename T>
+int RefilterRegion (const incremental_pass<T>& pass, long rows, long cols,
+                    const dirty_rect& region, double minValue, double maxValue) {
+    filter_settings settings = pass.settings;
+    long reach = settings.depth;
+    long height = region.bottom - region.top + 2 * reach;
+    long width = region.right - region.left + 2 * reach;
+    std::vector<long> colMap(width);
+    T** tile = AllocateMatrix<T>(height, width);
+    T** filtered = AllocateMatrix<T>(height, width);
+
+    for (long j = 0; j < width; j++) {
+        colMap[j] = BorderIndex(region.left - reach + j, cols, settings.border);
+    }
+    for (long i = 0; i < height; i++) {
+        long src = BorderIndex(region.top - reach + i, rows, settings.border);
+        for (long j = 0; j < width; j++) {
+            tile[i][j] = src != -1 && colMap[j] != -1 ? pass.from[src][colMap[j]] : 0;
+        }
+    }
+
+    if (settings.mode == FILTER_MEAN) {
+        settings.engine = ENGINE_INTEGRAL;
+    }
+    int status = FilterMatrix(tile, filtered, height, width, settings, 1, minValue,
+                              maxValue, NULL, NULL, NULL);
+    if (status == 0) {
+        for (long i = region.top; i < region.bottom; i++) {
+            const T* line = filtered[i - region.top + reach] + reach;
+            std::copy(line, line + (region.right - region.left), pass.to[i] + region.left);
+        }
+    }
+
+    CleanupMatrix(tile, height);
+    CleanupMatrix(filtered, height);
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            RegionArea
+ *
+ * DESCRIPTION:     Counts the cells in a list of rectangles that don't overlap
+ *
+ * PARAMETERS:      const std::vector<dirty_rect>&  :   rects   -   the rectangles
+ *
+ * RETURNS:         double - the number of cells
+ **********************************************************************************/
+inline double RegionArea (const std::vector<dirty_rect>& rects) {
+    double area = 0;
+
+    for (size_t i = 0; i < rects.size(); i++) {
+        area += (double) (rects[i].bottom - rects[i].top) *
+                (rects[i].right - rects[i].left);
+    }
+    return area;
+}
+
+/***********************************************************************************
+ * NAME:            RefreshIncremental
+ *
+ * DESCRIPTION:     Brings the output up to date with every change recorded
+ *                  since the last refresh. Each pass refilters the outputs
+ *                  whose windows reach the regions the pass before it
+ *                  changed. A pass whose regions would cover half the matrix
+ *                  runs in full, as does the gaussian.
+ *
+ * PARAMETERS:      incremental_filter<T>*  :   inc -   the filter
+ *                  std::vector<dirty_rect>*    :   changed -   variable to store
+ *                                      the output regions refiltered, or NULL
+ *
+ * RETURNS:         0 on success, -1 if the filter failed
+ **********************************************************************************/
+template <typename T>
+int RefreshIncremental (incremental_filter<T>* inc, std::vector<dirty_rect>* changed) {
+    incremental_pass<T> passes[2];
+    std::vector<dirty_rect> regions[2];
+    bool full[2];
+    int count = IncrementalPasses(inc, passes);
+    double cells = (double) inc->rows * inc->cols;
+
+    if (inc->dirty.empty()) {
+        if (changed != NULL) {
+            changed->clear();
+        }
+        return 0;
+    }
+
+    for (int p = 0; p < count; p++) {
+        const std::vector<dirty_rect>& from = p == 0 ? inc->dirty : regions[p - 1];
+        for (size_t i = 0; i < from.size(); i++) {
+            DilateRect(from[i], passes[p].settings.depth, inc->rows, inc->cols,
+                       passes[p].settings.border, &regions[p]);
+        }
+        MergeRects(&regions[p]);
+    }
+
+    // Without the rest of the stage to read, the first pass also refilters
+    // everything the second pass's tiles will read
+    if (count == 2 && !inc->stageKept) {
+        std::vector<dirty_rect> read;
+        for (size_t i = 0; i < regions[1].size(); i++) {
+            DilateRect(regions[1][i], passes[1].settings.depth, inc->rows, inc->cols,
+                       passes[1].settings.border, &read);
+        }
+        regions[0].insert(regions[0].end(), read.begin(), read.end());
+        MergeRects(&regions[0]);
+    }
+
+    for (int p = 0; p < count; p++) {
+        full[p] = passes[p].settings.mode == FILTER_GAUSSIAN ||
+                  2 * RegionArea(regions[p]) >= cells;
+    }
+    if (count == 2 && full[1] && !inc->stageKept) {
+        full[0] = true;
+    }
+
+    inc->dirty.clear();
+    for (int p = 0; p < count; p++) {
+        if (full[p]) {
+            if (FilterMatrix(passes[p].from, passes[p].to, inc->rows, inc->cols,
+                             passes[p].settings, inc->numThreads, inc->minValue,
+                             inc->maxValue, NULL, NULL, NULL) != 0) {
+                return -1;
+            }
+            regions[p].assign(1, dirty_rect());
+            regions[p][0].top = 0;
+            regions[p][0].left = 0;
+            regions[p][0].bottom = inc->rows;
+            regions[p][0].right = inc->cols;
+            continue;
+        }
+        for (size_t i = 0; i < regions[p].size(); i++) {
+            if (RefilterRegion(passes[p], inc->rows, inc->cols, regions[p][i],
+                               inc->minValue, inc->maxValue) != 0) {
+                return -1;
+            }
+        }
+    }
+    if (full[0] && count == 2) {
+        inc->stageKept = true;
+    }
+
+    if (changed != NULL) {
+        changed->swap(regions[count - 1]);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,136 @@
+/***********************************************************************************
+ * FILENAME:        log.h
+ *
+ * DESCRIPTION:     Worker logging without shared streams. Every worker owns a
+ *                  log_ring, a fixed ring of preformatted lines with a single
+ *                  writer (the worker) and a single reader (the main thread).
+ *                  The two only share the head and tail counters, so writing
+ *                  a line is a vsnprintf into the next slot and one atomic
+ *                  store. A full ring drops the line and counts it rather
+ *                  than making the worker wait.
+ *
+ *                  Lines above the run's verbosity are never formatted, so at
+ *                  LOG_QUIET the workers do no logging work at all.
+ ***********************************************************************************/
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>      // Used for vsnprintf, fputs
+#include <stdarg.h>     // Used for the message arguments
+#include <atomic>       // Used for the ring counters
+
+// How much the workers say. LOG_LEVELS counts them.
+enum log_level { LOG_QUIET, LOG_INFO, LOG_DEBUG, LOG_LEVELS };
+
+// Lines each worker can hold before dropping them, and their longest length
+#define LOG_ENTRIES 64
+#define LOG_LINE 128
+
+// One worker's lines
+struct log_ring {
+    int level;                          // The most verbose log_level written
+    char lines[LOG_ENTRIES][LOG_LINE];
+    std::atomic<unsigned> head;         // Lines written, only the worker stores it
+    std::atomic<unsigned> tail;         // Lines read, only the main thread stores it
+    unsigned dropped;                   // Lines lost to a full ring
+};
+
+/***********************************************************************************
+ * NAME:            InitLogRing
+ *
+ * DESCRIPTION:     Empties a ring and sets its verbosity
+ *
+ * PARAMETERS:      log_ring*   :   ring    -   the ring to set up
+ *                  int         :   level   -   the most verbose log_level to keep
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void InitLogRing (log_ring* ring, int level) {
+    ring->level = level;
+    ring->head.store(0, std::memory_order_relaxed);
+    ring->tail.store(0, std::memory_order_relaxed);
+    ring->dropped = 0;
+}
+
+/***********************************************************************************
+ * NAME:            Log
+ *
+ * DESCRIPTION:     Formats a line into a worker's ring, if its level is wanted
+ *                  and there is room. Only the owning worker may call this.
+ *
+ * PARAMETERS:      log_ring*   :   ring    -   the worker's ring, may be NULL
+ *                  int         :   level   -   the line's log_level
+ *                  const char* :   format  -   printf format of the line
+ *                  ...                     -   its arguments
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void Log (log_ring* ring, int level, const char* format, ...) {
+    if (ring == NULL || level > ring->level) {
+        return;
+    }
+
+    unsigned head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= LOG_ENTRIES) {
+        ring->dropped++;
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(ring->lines[head % LOG_ENTRIES], LOG_LINE, format, args);
+    va_end(args);
+
+    // Publish the line only once it is fully written
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+/***********************************************************************************
+ * NAME:            DrainLogRing
+ *
+ * DESCRIPTION:     Writes out and frees every line waiting in a ring. Only
+ *                  the main thread may call this, while or after the worker
+ *                  runs.
+ *
+ * PARAMETERS:      log_ring*   :   ring    -   the worker's ring
+ *                  FILE*       :   out     -   where to write the lines
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void DrainLogRing (log_ring* ring, FILE* out) {
+    unsigned tail = ring->tail.load(std::memory_order_relaxed);
+    unsigned head = ring->head.load(std::memory_order_acquire);
+
+    while (tail != head) {
+        fputs(ring->lines[tail % LOG_ENTRIES], out);
+        fputc('\n', out);
+        tail++;
+        ring->tail.store(tail, std::memory_order_release);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            DrainLogs
+ *
+ * DESCRIPTION:     Writes out every worker's waiting lines, worker by worker,
+ *                  noting any that were dropped. Call once the workers have
+ *                  been joined so the dropped counts are final.
+ *
+ * PARAMETERS:      log_ring*   :   rings       -   numThreads rings
+ *                  int         :   numThreads  -   the number of workers
+ *                  FILE*       :   out         -   where to write the lines
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void DrainLogs (log_ring* rings, int numThreads, FILE* out) {
+    for (int i = 0; i < numThreads; i++) {
+        DrainLogRing(&rings[i], out);
+        if (rings[i].dropped > 0) {
+            fprintf(out, "[%u lines dropped from thread %d]\n", rings[i].dropped, i);
+        }
+    }
+    fflush(out);
+}
+
+#endif
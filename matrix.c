@@ -7,6 +7,10 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "matrix.h"
 int get_slot(int fd, int matrix_size, int row, int col, int *slot){
   if((row <= 0) ||
      (col <= 0) ||
@@ -15,7 +19,7 @@ int get_slot(int fd, int matrix_size, int row, int col, int *slot){
     fprintf(stderr,"indexes out of range");
     return -1; 
   } else {
-    off_t offset = (((row - 1)*matrix_size) + (col - 1))*sizeof(int);
+    off_t offset = (((off_t)(row - 1)*matrix_size) + (col - 1))*(off_t)sizeof(int);
     if(offset < 0){
       fprintf(stderr,"offset overflow");
       return -1; }
@@ -37,7 +41,7 @@ int set_slot(int fd, int matrix_size, int row, int col, int value){
     fprintf(stderr,"indexes out of range");
     return -1; 
   } else {
-    off_t offset = (((row - 1)*matrix_size) + (col - 1))*sizeof(int);
+    off_t offset = (((off_t)(row - 1)*matrix_size) + (col - 1))*(off_t)sizeof(int);
     if(offset < 0){
       fprintf(stderr,"offset overflow");
       return -1; }
@@ -57,7 +61,7 @@ int get_row(int fd, int matrix_size, int row, int matrix_row[]){
     fprintf(stderr,"index out of range");
     return -1; 
   } else {
-    off_t offset =  ((row - 1) * matrix_size)*sizeof(int);
+    off_t offset =  ((off_t)(row - 1) * matrix_size)*(off_t)sizeof(int);
     if(offset < 0){
       fprintf(stderr,"offset overflow");
       return -1; }
@@ -79,7 +83,7 @@ int set_row(int fd, int matrix_size, int row, int matrix_row[]){
   return -1; 
   } else {
     int column;
-    off_t offset = ((row - 1) * matrix_size)*sizeof(int);
+    off_t offset = ((off_t)(row - 1) * matrix_size)*(off_t)sizeof(int);
     if(offset < 0){
       fprintf(stderr,"offset overflow");
       return -1; }
@@ -103,7 +107,7 @@ int get_column(int fd, int matrix_size, int col, int matrix_col[]){
   } else {
     off_t offset;
     for(row = 1; row <= matrix_size; row++){
-      offset =  ((row - 1) * matrix_size + (col - 1)) * sizeof(int);
+      offset =  ((off_t)(row - 1) * matrix_size + (col - 1)) * (off_t)sizeof(int);
       if(offset < 0){
         fprintf(stderr,"offset overflow");
         return -1; }
@@ -117,4 +121,256 @@ int get_column(int fd, int matrix_size, int col, int matrix_col[]){
     }
     return 0;
   }
-}
\ No newline at end of file
+}
+
+/* full_pread & full_pwrite keep going until count bytes have   */
+/* moved, single calls stop short on large transfers            */
+static int full_pread(int fd, void *buffer, size_t count, off_t offset){
+  char *p = (char *)buffer;
+  while(count > 0){
+    ssize_t n = pread(fd, p, count, offset);
+    if(n < 0){
+      perror("read failed");
+      return -1; }
+    else if(n == 0){
+      fprintf(stderr,"read past end of file");
+      return -1; };
+    p += n; count -= n; offset += n;
+  }
+  return 0;
+}
+
+static int full_pwrite(int fd, const void *buffer, size_t count, off_t offset){
+  const char *p = (const char *)buffer;
+  while(count > 0){
+    ssize_t n = pwrite(fd, p, count, offset);
+    if(n < 0){
+      perror("write failed");
+      return -1; };
+    p += n; count -= n; offset += n;
+  }
+  return 0;
+}
+
+size_t matrix_type_size(uint32_t type){
+  switch(type){
+  case MATRIX_UINT8:  return 1;
+  case MATRIX_INT16:  return 2;
+  case MATRIX_INT32:  return 4;
+  case MATRIX_FLOAT:  return 4;
+  case MATRIX_DOUBLE: return 8;
+  default:            return 0;
+  }
+}
+
+const char *matrix_type_name(uint32_t type){
+  switch(type){
+  case MATRIX_UINT8:  return "uint8";
+  case MATRIX_INT16:  return "int16";
+  case MATRIX_INT32:  return "int32";
+  case MATRIX_FLOAT:  return "float";
+  case MATRIX_DOUBLE: return "double";
+  default:            return "unknown";
+  }
+}
+
+void make_header(struct matrix_header *header, uint32_t type,
+                 uint64_t rows, uint64_t cols){
+  memset(header, 0, sizeof(struct matrix_header));
+  strcpy(header->magic, MATRIX_MAGIC);
+  header->version = MATRIX_VERSION;
+  header->type = type;
+  header->rows = rows;
+  header->cols = cols;
+  header->stride = cols;
+  header->layout = MATRIX_ROW_MAJOR;
+  header->data_offset = MATRIX_HEADER_SIZE;
+}
+
+/* reads the header of a matrix file, or describes a headerless */
+/* file as the raw square matrix of ints it has always been     */
+int get_header(int fd, struct matrix_header *header){
+  struct stat st;
+  if(fstat(fd, &st) < 0){
+    perror("fstat failed");
+    return -1; };
+  if(st.st_size >= MATRIX_HEADER_SIZE &&
+     full_pread(fd, header, sizeof(struct matrix_header), 0) == 0 &&
+     memcmp(header->magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC)) == 0){
+    uint64_t lines = header->layout == MATRIX_COL_MAJOR ? header->cols : header->rows;
+    uint64_t length = header->layout == MATRIX_COL_MAJOR ? header->rows : header->cols;
+    size_t width = matrix_type_size(header->type);
+    if(header->version != MATRIX_VERSION){
+      fprintf(stderr,"unsupported matrix version %u", header->version);
+      return -1; }
+    else if(width == 0 ||
+            header->layout > MATRIX_COL_MAJOR ||
+            header->stride < length ||
+            header->data_offset < MATRIX_HEADER_SIZE){
+      fprintf(stderr,"corrupt matrix header");
+      return -1; }
+    else if(lines > 0 &&
+            (uint64_t)st.st_size < header->data_offset +
+            ((lines - 1) * header->stride + length) * width){
+      fprintf(stderr,"matrix file is shorter than its header says");
+      return -1; };
+    return 0;
+  } else {
+    uint64_t elements = st.st_size / sizeof(int);
+    uint64_t dimension = (uint64_t)sqrt((double)elements);
+    while(dimension * dimension > elements) dimension--;
+    while((dimension + 1) * (dimension + 1) <= elements) dimension++;
+    if(dimension * dimension * sizeof(int) != (uint64_t)st.st_size){
+      fprintf(stderr,"headerless matrix file is not a square matrix of ints");
+      return -1; };
+    make_header(header, MATRIX_INT32, dimension, dimension);
+    header->data_offset = 0;
+    memset(header->magic, 0, sizeof(header->magic));
+    return 0;
+  }
+}
+
+int set_header(int fd, const struct matrix_header *header){
+  if(header->data_offset < MATRIX_HEADER_SIZE){
+    fprintf(stderr,"header does not fit before the data");
+    return -1; };
+  return full_pwrite(fd, header, sizeof(struct matrix_header), 0);
+}
+
+/* get_rows & set_rows move count whole rows starting at row    */
+/* between the file and a packed row major buffer of cols       */
+/* elements per row, whatever the stride and layout on disk     */
+int get_rows(int fd, const struct matrix_header *header,
+             uint64_t row, uint64_t count, void *buffer){
+  size_t width = matrix_type_size(header->type);
+  if((row == 0) || (row + count - 1 > header->rows)){
+    fprintf(stderr,"index out of range");
+    return -1; }
+  else if(header->layout == MATRIX_ROW_MAJOR){
+    off_t offset = header->data_offset + (off_t)((row - 1) * header->stride * width);
+    if(header->stride == header->cols)
+      return full_pread(fd, buffer, count * header->cols * width, offset);
+    for(uint64_t r = 0; r < count; r++){
+      if(full_pread(fd, (char *)buffer + r * header->cols * width,
+                    header->cols * width,
+                    offset + (off_t)(r * header->stride * width)) < 0)
+        return -1; };
+    return 0;
+  } else {
+    char *column = (char *)malloc(count * width);
+    if(column == NULL){
+      fprintf(stderr,"out of memory");
+      return -1; };
+    for(uint64_t c = 0; c < header->cols; c++){
+      off_t offset = header->data_offset +
+        (off_t)((c * header->stride + (row - 1)) * width);
+      if(full_pread(fd, column, count * width, offset) < 0){
+        free(column);
+        return -1; };
+      for(uint64_t r = 0; r < count; r++)
+        memcpy((char *)buffer + (r * header->cols + c) * width,
+               column + r * width, width);
+    }
+    free(column);
+    return 0;
+  }
+}
+
+int set_rows(int fd, const struct matrix_header *header,
+             uint64_t row, uint64_t count, const void *buffer){
+  size_t width = matrix_type_size(header->type);
+  if((row == 0) || (row + count - 1 > header->rows)){
+    fprintf(stderr,"index out of range");
+    return -1; }
+  else if(header->layout == MATRIX_ROW_MAJOR){
+    off_t offset = header->data_offset + (off_t)((row - 1) * header->stride * width);
+    if(header->stride == header->cols)
+      return full_pwrite(fd, buffer, count * header->cols * width, offset);
+    for(uint64_t r = 0; r < count; r++){
+      if(full_pwrite(fd, (const char *)buffer + r * header->cols * width,
+                     header->cols * width,
+                     offset + (off_t)(r * header->stride * width)) < 0)
+        return -1; };
+    return 0;
+  } else {
+    char *column = (char *)malloc(count * width);
+    if(column == NULL){
+      fprintf(stderr,"out of memory");
+      return -1; };
+    for(uint64_t c = 0; c < header->cols; c++){
+      off_t offset = header->data_offset +
+        (off_t)((c * header->stride + (row - 1)) * width);
+      for(uint64_t r = 0; r < count; r++)
+        memcpy(column + r * width,
+               (const char *)buffer + (r * header->cols + c) * width, width);
+      if(full_pwrite(fd, column, count * width, offset) < 0){
+        free(column);
+        return -1; };
+    }
+    free(column);
+    return 0;
+  }
+}
+
+/* a slot's place in the file and in the caller's arrays        */
+struct slot_write {
+  off_t offset;
+  uint64_t index;
+};
+
+static int compare_slot_writes(const void *a, const void *b){
+  const struct slot_write *x = (const struct slot_write *)a;
+  const struct slot_write *y = (const struct slot_write *)b;
+  if(x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* set_slots writes count single values, value i going to row   */
+/* rows[i] and column cols[i], counting from 1. the slots are   */
+/* sorted into file order and each run of neighbouring slots    */
+/* goes out in one pwrite, so a scattered patch costs a write   */
+/* per run rather than a seek and a write per slot. when a slot */
+/* is given twice the later value wins                          */
+int set_slots(int fd, const struct matrix_header *header, uint64_t count,
+              const uint64_t *rows, const uint64_t *cols, const void *values){
+  size_t width = matrix_type_size(header->type);
+  struct slot_write *order;
+  char *run;
+  uint64_t i, length = 0;
+  off_t start = 0;
+  if(count == 0) return 0;
+  order = (struct slot_write *)malloc(count * sizeof(struct slot_write));
+  run = (char *)malloc(count * width);
+  if(order == NULL || run == NULL){
+    free(order); free(run);
+    fprintf(stderr,"out of memory");
+    return -1; };
+  for(i = 0; i < count; i++){
+    if((rows[i] == 0) || (cols[i] == 0) ||
+       (rows[i] > header->rows) || (cols[i] > header->cols)){
+      free(order); free(run);
+      fprintf(stderr,"index out of range");
+      return -1; };
+    order[i].offset = header->data_offset + (off_t)(width *
+      (header->layout == MATRIX_ROW_MAJOR ?
+       (rows[i] - 1) * header->stride + (cols[i] - 1) :
+       (cols[i] - 1) * header->stride + (rows[i] - 1)));
+    order[i].index = i;
+  }
+  qsort(order, count, sizeof(struct slot_write), compare_slot_writes);
+  for(i = 0; i < count; i++){
+    /* of a slot given twice only the last is kept              */
+    if(i + 1 < count && order[i + 1].offset == order[i].offset) continue;
+    if(length > 0 && order[i].offset != start + (off_t)(length * width)){
+      if(full_pwrite(fd, run, length * width, start) < 0){
+        free(order); free(run);
+        return -1; };
+      length = 0; };
+    if(length == 0) start = order[i].offset;
+    memcpy(run + length * width, (const char *)values + order[i].index * width, width);
+    length++;
+  }
+  int status = length > 0 ? full_pwrite(fd, run, length * width, start) : 0;
+  free(order); free(run);
+  return status;
+}
@@ -2,6 +2,12 @@
 /* written by ian a. mason @ une  march 15  '99                 */            
 /* added to easter '99                                          */  
 
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
 int get_slot(int fd, int matrix_size, int row, int col, int *slot);
 int set_slot(int fd, int matrix_size, int row, int col, int value);
 
@@ -10,3 +16,45 @@ int get_row(int fd, int matrix_size, int row, int matrix_row[]);
 int set_row(int fd, int matrix_size, int row, int matrix_row[]);
 
 int get_column(int fd, int matrix_size, int col, int matrix_col[]);
+
+/* self describing matrix files                                 */
+/* a file may start with a matrix_header, otherwise it is taken */
+/* to be a raw square matrix of ints with no header at all      */
+
+#define MATRIX_MAGIC        "CONVMTX"
+#define MATRIX_VERSION      1
+#define MATRIX_HEADER_SIZE  64
+
+enum matrix_type   { MATRIX_UINT8 = 1, MATRIX_INT16 = 2, MATRIX_INT32 = 3,
+                     MATRIX_FLOAT = 4, MATRIX_DOUBLE = 5 };
+enum matrix_layout { MATRIX_ROW_MAJOR = 0, MATRIX_COL_MAJOR = 1 };
+
+struct matrix_header {
+  char     magic[8];      /* MATRIX_MAGIC, nul terminated             */
+  uint32_t version;       /* MATRIX_VERSION                           */
+  uint32_t type;          /* a matrix_type                            */
+  uint64_t rows;
+  uint64_t cols;
+  uint64_t stride;        /* elements between the starts of rows, or  */
+                          /* of columns when the layout is col major  */
+  uint32_t layout;        /* a matrix_layout                          */
+  uint32_t data_offset;   /* bytes before the first element           */
+  uint64_t reserved[2];
+};
+
+size_t matrix_type_size(uint32_t type);
+const char *matrix_type_name(uint32_t type);
+
+int get_header(int fd, struct matrix_header *header);
+int set_header(int fd, const struct matrix_header *header);
+void make_header(struct matrix_header *header, uint32_t type,
+                 uint64_t rows, uint64_t cols);
+
+int get_rows(int fd, const struct matrix_header *header,
+             uint64_t row, uint64_t count, void *buffer);
+int set_rows(int fd, const struct matrix_header *header,
+             uint64_t row, uint64_t count, const void *buffer);
+int set_slots(int fd, const struct matrix_header *header, uint64_t count,
+              const uint64_t *rows, const uint64_t *cols, const void *values);
+
+#endif
@@ -0,0 +1,187 @@
+/***********************************************************************************
+ * FILENAME:        matrixfile.h
+ *
+ * DESCRIPTION:     Reading and writing whole binary matrix files for the
+ *                  programs that keep running after a file turns out to be
+ *                  bad, so failures are returned rather than exiting, and
+ *                  printing matrices as text. Files are read a band of a few
+ *                  MB at a time, so scanning and hashing each band finds it
+ *                  still in cache.
+ ***********************************************************************************/
+
+#ifndef MATRIXFILE_H
+#define MATRIXFILE_H
+
+#include <fcntl.h>      // Used for open
+#include <unistd.h>     // Used for close
+#include <iostream>     // Used for printing matrices
+#include <limits>       // Used for numeric_limits
+#include <string>       // Strings
+#include <algorithm>    // Used for copy
+#include "matrix.h"     // Used for the matrix file format
+#include "engine.h"     // Used for AllocateMatrix and ScanRange
+#include "hash.h"       // Used for hashing matrices as they are read
+
+/***********************************************************************************
+ * NAME:            BandRows
+ * 
+ * DESCRIPTION:     Gets how many rows to read per call so that each read moves
+ *                  a few MB, large enough to stream but small enough that the
+ *                  range scan finds the band still in cache
+ * 
+ * PARAMETERS:      matrix_header   :   header  -   description of the file
+ * 
+ * RETURNS:         long - number of rows per band, at least 1
+ **********************************************************************************/
+inline long BandRows (matrix_header header) {
+    size_t rowBytes = header.cols * matrix_type_size(header.type);
+    long band = rowBytes == 0 ? 1 : (4 << 20) / rowBytes;
+
+    return band < 1 ? 1 : band;
+}
+
+/***********************************************************************************
+ * NAME:            ReadMatrixRows
+ *
+ * DESCRIPTION:     Reads every row of an open matrix file into a new matrix
+ *                  and finds its smallest and largest values, feeding them to
+ *                  a hash as well if one is given
+ *
+ * PARAMETERS:      int     :   fd      -   the open matrix file
+ *                  const matrix_header&    :   header  -   the file's header
+ *                  double* :   minValue    -   variable to store the minimum
+ *                  double* :   maxValue    -   variable to store the maximum
+ *                  content_hash*   :   hash    -   hash to feed the values, or NULL
+ *
+ * RETURNS:         T** - the matrix, or NULL if it could not be read
+ **********************************************************************************/
+template <typename T>
+T** ReadMatrixRows (int fd, const matrix_header& header, double* minValue,
+                    double* maxValue, content_hash* hash = NULL) {
+    long rows = header.rows;
+    long cols = header.cols;
+    long band = BandRows(header);
+    T** matrix = AllocateMatrix<T>(rows, cols);
+    T low = std::numeric_limits<T>::max();
+    T high = std::numeric_limits<T>::lowest();
+
+    for (long row = 0; row < rows; row += band) {
+        long count = rows - row < band ? rows - row : band;
+        size_t values = (size_t) count * cols;
+
+        if (get_rows(fd, &header, row + 1, count, matrix[row]) != 0) {
+            CleanupMatrix(matrix, rows);
+            return NULL;
+        }
+        ScanRange(matrix[row], values, &low, &high);
+        if (hash != NULL) {
+            UpdateHash(hash, matrix[row], values * sizeof(T));
+        }
+    }
+
+    *minValue = (double) low;
+    *maxValue = (double) high;
+    return matrix;
+}
+
+/***********************************************************************************
+ * NAME:            WriteMatrixFile
+ *
+ * DESCRIPTION:     Writes a matrix to a binary matrix file
+ *
+ * PARAMETERS:      const std::string&  :   file    -   the file to write
+ *                  T**     :   matrix  -   the matrix to write
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *                  const uint64_t* :   reserved    -   words for the header's
+ *                                                      reserved field, or NULL
+ *
+ * RETURNS:         0 on success, -1 if the file could not be written
+ **********************************************************************************/
+template <typename T>
+int WriteMatrixFile (const std::string& file, T** matrix, long rows, long cols,
+                     const uint64_t* reserved = NULL) {
+    matrix_header header;
+    int fd;
+
+    if ((fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        return -1;
+    }
+    make_header(&header, ElementTraits<T>::type, rows, cols);
+    if (reserved != NULL) {
+        header.reserved[0] = reserved[0];
+        header.reserved[1] = reserved[1];
+    }
+    int status = set_header(fd, &header) == 0 &&
+                 (rows == 0 || set_rows(fd, &header, 1, rows, matrix[0]) == 0) ? 0 : -1;
+    if (close(fd) != 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            WriteMatrixFileAs
+ *
+ * DESCRIPTION:     Writes a matrix to a binary matrix file of element type W,
+ *                  converting a band at a time, for a matrix stored in a
+ *                  narrower type than its file
+ *
+ * PARAMETERS:      const std::string&  :   file    -   the file to write
+ *                  T**     :   matrix  -   the matrix to write
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *
+ * RETURNS:         0 on success, -1 if the file could not be written
+ **********************************************************************************/
+template <typename W, typename T>
+int WriteMatrixFileAs (const std::string& file, T** matrix, long rows, long cols) {
+    matrix_header header;
+    int fd;
+
+    if ((fd = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        return -1;
+    }
+    make_header(&header, ElementTraits<W>::type, rows, cols);
+    long band = BandRows(header);
+    W* buffer = new W[(size_t) (rows < band ? rows : band) * cols];
+    int status = set_header(fd, &header);
+
+    for (long row = 0; row < rows && status == 0; row += band) {
+        long count = rows - row < band ? rows - row : band;
+        std::copy(matrix[row], matrix[row] + (size_t) count * cols, buffer);
+        status = set_rows(fd, &header, row + 1, count, buffer);
+    }
+    delete[] buffer;
+    if (close(fd) != 0) {
+        status = -1;
+    }
+
+    return status == 0 ? 0 : -1;
+}
+
+/***********************************************************************************
+ * NAME:            PrettyPrintMatrix
+ *
+ * DESCRIPTION:     Pretty prints a given matrix (represented by a 2D array)
+ *                  out to the console
+ *
+ * PARAMETERS:      T**     :   matrix      -   the matrix to print
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void PrettyPrintMatrix (T** matrix, long rows, long cols) {
+    for (long i = 0; i < rows; i++) {
+        for (long j = 0; j < cols; j++) {
+            // Promote so 8 bit values print as numbers rather than characters
+            std::cout << +matrix[i][j] << "\t";
+        }
+        std::cout << std::endl;
+    }
+}
+
+#endif
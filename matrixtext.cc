@@ -0,0 +1,391 @@
+/***********************************************************************************
+ * FILENAME:        matrixtext.cc
+ *
+ * DESCRIPTION:     Parallel reader for matrices stored as text. The file is
+ *                  mapped into memory and cut into one chunk per thread, with
+ *                  every cut moved forward to the next newline so no row is
+ *                  split between threads. A first pass counts the rows in each
+ *                  chunk so every thread knows which matrix row it starts on,
+ *                  and a second pass parses the values with std::from_chars
+ *                  straight into one contiguous block of storage.
+ ***********************************************************************************/
+
+#include <iostream>     // Basic IO
+#include <pthread.h>    // Threads
+#include <string>       // Strings
+#include <string.h>     // Used for memchr
+#include <charconv>     // Used for from_chars
+#include <sys/mman.h>   // Used for mmap
+#include <sys/stat.h>   // Used for fstat
+#include <fcntl.h>      // Used for file reading
+#include <unistd.h>     // Used for O_RDONLY
+#include <stdint.h>     // Fixed width types
+#include <limits>       // Used for telling unsigned types apart
+#include "matrixtext.h"
+
+using namespace std;
+
+// Why a row failed to parse
+enum text_error { TEXT_OK, TEXT_BAD_VALUE, TEXT_OUT_OF_RANGE, TEXT_TOO_MANY, TEXT_TOO_FEW };
+
+// Structure used for passing arguments to the text parsing threads
+struct text_argument_structure {
+    const char* begin;      // First byte of this thread's chunk
+    const char* end;        // One past the last byte of this thread's chunk
+    void* matrix;           // Destination T** rows, only used by the parse pass
+    long cols;              // Expected number of values per row
+    long firstRow;          // Matrix row the chunk starts on
+    long rows;              // Rows found by the count pass
+    long badRow;            // Row that failed to parse, or -1
+    long badCol;            // Column of the value that failed, or values found
+    int error;              // A text_error, why badRow failed
+    const char* badText;    // The value that failed, while the file is mapped
+    size_t badLength;
+};
+
+/***********************************************************************************
+ * NAME:            IsSeparator
+ *
+ * DESCRIPTION:     Checks whether a character separates values on a line
+ *
+ * PARAMETERS:      char    :   c   -   the character to check
+ *
+ * RETURNS:         bool    - true for spaces, tabs, commas and carriage returns
+ **********************************************************************************/
+static inline bool IsSeparator (char c) {
+    return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+/***********************************************************************************
+ * NAME:            SkipSeparators
+ *
+ * DESCRIPTION:     Advances past any separators at the start of a line
+ *
+ * PARAMETERS:      const char* :   p       -   current position
+ *                  const char* :   end     -   end of the line
+ *
+ * RETURNS:         const char* - the first non-separator, or end
+ **********************************************************************************/
+static inline const char* SkipSeparators (const char* p, const char* end) {
+    while (p < end && IsSeparator(*p)) {
+        p++;
+    }
+    return p;
+}
+
+/***********************************************************************************
+ * NAME:            LineEnd
+ *
+ * DESCRIPTION:     Finds the end of the line starting at p
+ *
+ * PARAMETERS:      const char* :   p       -   start of the line
+ *                  const char* :   end     -   end of the chunk
+ *
+ * RETURNS:         const char* - the newline ending the line, or end
+ **********************************************************************************/
+static inline const char* LineEnd (const char* p, const char* end) {
+    const char* nl = (const char*) memchr(p, '\n', end - p);
+    return nl == NULL ? end : nl;
+}
+
+/***********************************************************************************
+ * NAME:            CountRows
+ *
+ * DESCRIPTION:     Thread entry point counting the non-blank lines in a chunk
+ *
+ * PARAMETERS:      void*   :   arguments   -   pointer to text_argument_structure
+ *
+ * RETURNS:         None
+ **********************************************************************************/
+static void* CountRows (void* arguments) {
+    struct text_argument_structure *args = (struct text_argument_structure *) arguments;
+    const char* p = args->begin;
+    long rows = 0;
+
+    while (p < args->end) {
+        const char* eol = LineEnd(p, args->end);
+        if (SkipSeparators(p, eol) != eol) {
+            rows++;
+        }
+        p = eol + 1;
+    }
+
+    args->rows = rows;
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            ParseRows
+ *
+ * DESCRIPTION:     Thread entry point parsing every non-blank line in a chunk
+ *                  into consecutive matrix rows, starting at firstRow. Lines
+ *                  that hold anything other than exactly cols values of
+ *                  type T are reported through badRow, with the column and
+ *                  text of the value at fault and why it failed.
+ *
+ * PARAMETERS:      void*   :   arguments   -   pointer to text_argument_structure
+ *
+ * RETURNS:         None
+ **********************************************************************************/
+template <typename T>
+static void* ParseRows (void* arguments) {
+    struct text_argument_structure *args = (struct text_argument_structure *) arguments;
+    T** matrix = (T**) args->matrix;
+    const char* p = args->begin;
+    long row = args->firstRow;
+
+    args->badRow = -1;
+    args->error = TEXT_OK;
+
+    while (p < args->end) {
+        const char* eol = LineEnd(p, args->end);
+        const char* q = SkipSeparators(p, eol);
+
+        if (q != eol) {
+            T* dest = matrix[row];
+            long col = 0;
+
+            while (q < eol) {
+                if (col == args->cols) {
+                    args->badRow = row;
+                    args->badCol = col;
+                    args->error = TEXT_TOO_MANY;
+                    return NULL;
+                }
+
+                from_chars_result res = from_chars(q, eol, dest[col]);
+                if (res.ec != errc() || (res.ptr < eol && !IsSeparator(*res.ptr))) {
+                    const char* token = q;
+                    while (q < eol && !IsSeparator(*q)) {
+                        q++;
+                    }
+
+                    // from_chars won't read a negative number into an unsigned type
+                    bool negative = !numeric_limits<T>::is_signed && *token == '-' &&
+                                    token + 1 < q && token[1] >= '0' && token[1] <= '9';
+                    args->badRow = row;
+                    args->badCol = col;
+                    args->error = res.ec == errc::result_out_of_range || negative ?
+                                  TEXT_OUT_OF_RANGE : TEXT_BAD_VALUE;
+                    args->badText = token;
+                    args->badLength = q - token;
+                    return NULL;
+                }
+
+                col++;
+                q = SkipSeparators(res.ptr, eol);
+            }
+
+            if (col != args->cols) {
+                args->badRow = row;
+                args->badCol = col;
+                args->error = TEXT_TOO_FEW;
+                return NULL;
+            }
+            row++;
+        }
+        p = eol + 1;
+    }
+
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            CountColumns
+ *
+ * DESCRIPTION:     Counts the values on the first non-blank line of the text
+ *
+ * PARAMETERS:      const char* :   p       -   start of the text
+ *                  const char* :   end     -   end of the text
+ *
+ * RETURNS:         long - the number of values on the line, 0 if there is none
+ **********************************************************************************/
+static long CountColumns (const char* p, const char* end) {
+    while (p < end) {
+        const char* eol = LineEnd(p, end);
+        const char* q = SkipSeparators(p, eol);
+        long cols = 0;
+
+        while (q < eol) {
+            while (q < eol && !IsSeparator(*q)) {
+                q++;
+            }
+            cols++;
+            q = SkipSeparators(q, eol);
+        }
+
+        if (cols > 0) {
+            return cols;
+        }
+        p = eol + 1;
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            RunTextThreads
+ *
+ * DESCRIPTION:     Runs a pass of the parser with one thread per chunk and
+ *                  waits for all of them to finish
+ *
+ * PARAMETERS:      text_argument_structure*    :   args    -   one per thread
+ *                  int                         :   numT    -   number of threads
+ *                  void* (*)(void*)            :   pass    -   thread entry point
+ *
+ * RETURNS:         Void, but exits the program if a thread can't be started
+ **********************************************************************************/
+static void RunTextThreads (text_argument_structure* args, int numT, void* (*pass)(void*)) {
+    pthread_t workers_tid[numT];
+
+    for (int i = 0; i < numT; i++) {
+        if (pthread_create(&workers_tid[i], NULL, pass, (void *) &args[i])) {
+            printf("Failed to create parser thread %d\n", i);
+            exit(1);
+        }
+    }
+
+    for (int i = 0; i < numT; i++) {
+        pthread_join(workers_tid[i], NULL);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            ReadMatrixTextFile
+ *
+ * DESCRIPTION:     Reads in a matrix from a text file, using numThreads
+ *                  threads to do the parsing. Values on a line may be separated
+ *                  by any mix of spaces, tabs and commas, and blank lines are
+ *                  ignored. The rows of the returned matrix all point into one
+ *                  contiguous block.
+ *
+ * PARAMETERS:      string  :   filenameStr -   the name of the matrix file
+ *                  int     :   numThreads  -   number of threads to parse with
+ *                  long*   :   matRows     -   variable to store the row count
+ *                  long*   :   matCols     -   variable to store the column count
+ *
+ * RETURNS:         T**     : matrix2D      -   a pointer to the 2D array, exits
+ *                                              the program if the rows are not
+ *                                              all the same length of values
+ **********************************************************************************/
+template <typename T>
+T** ReadMatrixTextFile (string filenameStr, int numThreads, long* matRows, long* matCols) {
+    int fd;
+    struct stat st;
+    const char* filename = filenameStr.c_str();
+
+    printf("Reading text matrix from file '%s'\n", filename);
+
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        printf("Failed to read file descriptor for %s\n", filename);
+        exit(1);
+    }
+
+    if (fstat(fd, &st) == -1) {
+        printf("[ERROR] Could not get size of file '%s'\n", filename);
+        exit(1);
+    }
+    if (st.st_size == 0) {
+        printf("[ERROR] '%s' is empty\n", filename);
+        exit(1);
+    }
+
+    size_t size = st.st_size;
+    const char* text = (const char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        printf("[ERROR] Could not map file '%s'\n", filename);
+        exit(1);
+    }
+    madvise((void*) text, size, MADV_SEQUENTIAL);
+
+    // Cut the text into one chunk per thread, moving every cut to just past a
+    // newline so that each row belongs to exactly one chunk
+    int numT = numThreads < 1 ? 1 : numThreads;
+    text_argument_structure args[numT];
+    const char* end = text + size;
+    const char* cut = text;
+
+    for (int i = 0; i < numT; i++) {
+        args[i].begin = cut;
+        if (i == numT - 1) {
+            cut = end;
+        } else {
+            const char* target = text + size / numT * (i + 1);
+            if (target < cut) {
+                target = cut;
+            }
+            cut = LineEnd(target, end);
+            if (cut < end) {
+                cut++;
+            }
+        }
+        args[i].end = cut;
+    }
+
+    RunTextThreads(args, numT, CountRows);
+
+    long totalRows = 0;
+    for (int i = 0; i < numT; i++) {
+        args[i].firstRow = totalRows;
+        totalRows += args[i].rows;
+    }
+
+    long cols = CountColumns(text, end);
+    if (cols == 0) {
+        printf("[ERROR] '%s' does not hold any values\n", filename);
+        exit(1);
+    }
+
+    T** matrix2D = new T*[totalRows];
+    matrix2D[0] = new T[(size_t) totalRows * cols];
+    for (long i = 1; i < totalRows; i++) {
+        matrix2D[i] = matrix2D[0] + (size_t) i * cols;
+    }
+
+    for (int i = 0; i < numT; i++) {
+        args[i].matrix = matrix2D;
+        args[i].cols = cols;
+    }
+
+    RunTextThreads(args, numT, ParseRows<T>);
+
+    // Reported while the text of a bad value is still mapped
+    for (int i = 0; i < numT; i++) {
+        text_argument_structure* a = &args[i];
+        int length = (int) a->badLength;
+
+        switch (a->error) {
+            case TEXT_BAD_VALUE:
+                printf("[ERROR] Row %ld column %ld of '%s' holds '%.*s', which can't be"
+                       " read as the element type\n", a->badRow + 1, a->badCol + 1,
+                       filename, length, a->badText);
+                exit(1);
+            case TEXT_OUT_OF_RANGE:
+                printf("[ERROR] Row %ld column %ld of '%s' holds '%.*s', which is out of"
+                       " range for the element type\n", a->badRow + 1, a->badCol + 1,
+                       filename, length, a->badText);
+                exit(1);
+            case TEXT_TOO_MANY:
+                printf("[ERROR] Row %ld of '%s' holds more than %ld values\n",
+                       a->badRow + 1, filename, cols);
+                exit(1);
+            case TEXT_TOO_FEW:
+                printf("[ERROR] Row %ld of '%s' holds %ld values, not %ld\n",
+                       a->badRow + 1, filename, a->badCol, cols);
+                exit(1);
+        }
+    }
+
+    munmap((void*) text, size);
+
+    *matRows = totalRows;
+    *matCols = cols;
+    return matrix2D;
+}
+
+template uint8_t** ReadMatrixTextFile<uint8_t> (string, int, long*, long*);
+template int16_t** ReadMatrixTextFile<int16_t> (string, int, long*, long*);
+template int32_t** ReadMatrixTextFile<int32_t> (string, int, long*, long*);
+template float** ReadMatrixTextFile<float> (string, int, long*, long*);
+template double** ReadMatrixTextFile<double> (string, int, long*, long*);
@@ -0,0 +1,18 @@
+/***********************************************************************************
+ * FILENAME:        matrixtext.h
+ *
+ * DESCRIPTION:     Parallel reader for matrices stored as text, one matrix row
+ *                  per line with values separated by whitespace and/or commas.
+ ***********************************************************************************/
+
+#ifndef MATRIXTEXT_H
+#define MATRIXTEXT_H
+
+#include <string>
+
+// Instantiated for uint8_t, int16_t, int32_t, float and double
+template <typename T>
+T** ReadMatrixTextFile (std::string filenameStr, int numThreads, long* matRows,
+                        long* matCols);
+
+#endif
@@ -0,0 +1,350 @@
+/***********************************************************************************
+ * FILENAME:        median.h
+ *
+ * DESCRIPTION:     Neighbourhood median kernels. Like the mean, the median
+ *                  looks at the (2*depth+1) x (2*depth+1) window around every
+ *                  value, with neighbours outside the matrix found by the
+ *                  border mode.
+ *
+ *                  Integer matrices whose values (and the 0 of the zero
+ *                  border) span at most
+ *                  MEDIAN_MAX_BINS levels use the Perreault-Hebert constant
+ *                  time algorithm. Every padded column keeps a histogram of
+ *                  the 2*depth+1 values above and below the current row,
+ *                  updated by one add and one remove as the row moves down.
+ *                  The window histogram is the sum of 2*depth+1 neighbouring
+ *                  column histograms, updated by one add and one remove as the
+ *                  window moves right. Histograms are split into a coarse and
+ *                  a fine level, and the fine level of the window is only
+ *                  brought up to date for the coarse bucket holding the
+ *                  median, so the cost per value does not depend on depth.
+ *
+ *                  Anything else falls back to selecting the median of each
+ *                  gathered window with nth_element.
+ ***********************************************************************************/
+
+#ifndef MEDIAN_H
+#define MEDIAN_H
+
+#include <stdint.h>     // Fixed width types
+#include <limits>       // Used for numeric_limits
+#include <vector>       // Used for histogram storage
+#include <algorithm>    // Used for nth_element
+#include "filter.h"     // Used for BorderIndex
+
+// Largest number of distinct levels the histogram median will handle, which
+// bounds its memory at (cols + 2*depth) * MEDIAN_MAX_BINS counters per thread
+#define MEDIAN_MAX_BINS 4096
+
+// Column histograms count at most 2*depth+1 values each
+#define MEDIAN_MAX_DEPTH 32767
+
+// Histograms used by one thread of the constant time median
+struct median_histograms {
+    long base;                      // Value counted by bin 0
+    int fineBits;                   // log2 of the fine bins per coarse bucket
+    long bins;                      // Fine bins in a histogram
+    long coarseBins;                // Coarse buckets in a histogram
+    std::vector<uint16_t> colFine;      // Fine histogram of each padded column
+    std::vector<uint16_t> colCoarse;    // Coarse histogram of each padded column
+    std::vector<uint32_t> kernelFine;   // Fine histogram of the window
+    std::vector<uint32_t> kernelCoarse; // Coarse histogram of the window
+    std::vector<long> updatedAt;        // Column each fine bucket is current for
+};
+
+/***********************************************************************************
+ * NAME:            UseHistogramMedian
+ *
+ * DESCRIPTION:     Decides whether the constant time median can handle values
+ *                  of type T that lie in [minValue, maxValue]
+ *
+ * PARAMETERS:      double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *
+ * RETURNS:         bool    - true if the histogram median can be used
+ **********************************************************************************/
+template <typename T>
+inline bool UseHistogramMedian (double minValue, double maxValue, int depth, int border) {
+    bool zero = border == BORDER_ZERO;
+    double low = zero && minValue > 0 ? 0 : minValue;
+    double high = zero && maxValue < 0 ? 0 : maxValue;
+
+    return std::numeric_limits<T>::is_integer && depth <= MEDIAN_MAX_DEPTH &&
+           high - low < MEDIAN_MAX_BINS;
+}
+
+/***********************************************************************************
+ * NAME:            MedianBins
+ *
+ * DESCRIPTION:     Gets how many values the histograms must count, which with
+ *                  the zero border includes 0
+ *
+ * PARAMETERS:      double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *                  int     :   border      -   a border_mode
+ *
+ * RETURNS:         long    - the number of distinct values to count
+ **********************************************************************************/
+inline long MedianBins (double minValue, double maxValue, int border) {
+    bool zero = border == BORDER_ZERO;
+    double low = zero && minValue > 0 ? 0 : minValue;
+    double high = zero && maxValue < 0 ? 0 : maxValue;
+
+    return (long) (high - low) + 1;
+}
+
+/***********************************************************************************
+ * NAME:            InitMedianHistograms
+ *
+ * DESCRIPTION:     Sizes a thread's histograms for values in [minValue,
+ *                  maxValue], plus the 0 of the zero border
+ *
+ * PARAMETERS:      median_histograms*  :   hist    -   histograms to size
+ *                  double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *                  long    :   cols        -   columns in the matrix
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void InitMedianHistograms (median_histograms* hist, double minValue,
+                                  double maxValue, long cols, int depth, int border) {
+    bool zero = border == BORDER_ZERO;
+    long low = (long) (zero && minValue > 0 ? 0 : minValue);
+    long high = (long) (zero && maxValue < 0 ? 0 : maxValue);
+    int bits = 1;
+
+    while ((1L << bits) < high - low + 1) {
+        bits++;
+    }
+
+    hist->base = low;
+    hist->fineBits = (bits + 1) / 2;
+    hist->bins = 1L << bits;
+    hist->coarseBins = hist->bins >> hist->fineBits;
+
+    long padded = cols + 2 * (long) depth;
+    hist->colFine.assign(padded * hist->bins, 0);
+    hist->colCoarse.assign(padded * hist->coarseBins, 0);
+    hist->kernelFine.assign(hist->bins, 0);
+    hist->kernelCoarse.assign(hist->coarseBins, 0);
+    hist->updatedAt.assign(hist->coarseBins, 0);
+}
+
+/***********************************************************************************
+ * NAME:            PaddedBin
+ *
+ * DESCRIPTION:     Gets the histogram bin of the value at (r, c), where places
+ *                  outside the matrix are found by the border mode
+ *
+ * PARAMETERS:      T**     :   in      -   the input matrix
+ *                  long    :   rows    -   rows in the matrix
+ *                  long    :   cols    -   columns in the matrix
+ *                  long    :   r       -   row, may be outside the matrix
+ *                  long    :   c       -   column, may be outside the matrix
+ *                  long    :   base    -   value counted by bin 0
+ *                  int     :   border  -   a border_mode
+ *
+ * RETURNS:         long    - the bin the value falls in
+ **********************************************************************************/
+template <typename T>
+inline long PaddedBin (T** in, long rows, long cols, long r, long c, long base,
+                       int border) {
+    if (r < 0 || r >= rows || c < 0 || c >= cols) {
+        r = BorderIndex(r, rows, border);
+        c = BorderIndex(c, cols, border);
+        if (r == -1 || c == -1) {
+            return -base;
+        }
+    }
+    return (long) in[r][c] - base;
+}
+
+/***********************************************************************************
+ * NAME:            HistogramMedianRows
+ *
+ * DESCRIPTION:     Perreault-Hebert median kernel for output rows [start, end).
+ *                  Padded column j covers matrix column j - depth, so the
+ *                  window for output column c is padded columns c..c+2*depth.
+ *
+ * PARAMETERS:      T**     :   in          -   the input matrix
+ *                  T**     :   out         -   the output matrix
+ *                  long    :   rows        -   rows in both matrices
+ *                  long    :   cols        -   columns in both matrices
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *                  long    :   start       -   first output row to compute
+ *                  long    :   end         -   one past the last output row
+ *                  median_histograms*  :   hist    -   this thread's histograms
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void HistogramMedianRows (T** in, T** out, long rows, long cols, int depth, int border,
+                          long start, long end, median_histograms* hist) {
+    long width = 2 * (long) depth + 1;
+    long padded = cols + 2 * (long) depth;
+    long rank = (width * width - 1) / 2;
+    long bins = hist->bins;
+    long coarseBins = hist->coarseBins;
+    int fineBits = hist->fineBits;
+    long fine = 1L << fineBits;
+    uint16_t* colFine = &hist->colFine[0];
+    uint16_t* colCoarse = &hist->colCoarse[0];
+    uint32_t* kernelFine = &hist->kernelFine[0];
+    uint32_t* kernelCoarse = &hist->kernelCoarse[0];
+    long* updatedAt = &hist->updatedAt[0];
+
+    // Fill the column histograms for the rows around the first output row
+    for (long j = 0; j < padded; j++) {
+        for (long r = start - depth; r <= start + depth; r++) {
+            long bin = PaddedBin(in, rows, cols, r, j - depth, hist->base, border);
+            colFine[j * bins + bin]++;
+            colCoarse[j * coarseBins + (bin >> fineBits)]++;
+        }
+    }
+
+    for (long row = start; row < end; row++) {
+        // Start the window over padded columns 0..2*depth, leaving every fine
+        // bucket to be rebuilt the first time it holds the median
+        for (long b = 0; b < coarseBins; b++) {
+            kernelCoarse[b] = 0;
+            updatedAt[b] = -width;
+        }
+        for (long j = 0; j < width; j++) {
+            const uint16_t* h = colCoarse + j * coarseBins;
+            for (long b = 0; b < coarseBins; b++) {
+                kernelCoarse[b] += h[b];
+            }
+        }
+
+        T* dest = out[row];
+        for (long c = 0; c < cols; c++) {
+            // Find the coarse bucket holding the median
+            long b = 0;
+            long seen = 0;
+            while (seen + (long) kernelCoarse[b] <= rank) {
+                seen += kernelCoarse[b];
+                b++;
+            }
+
+            // Bring that bucket's fine counts up to this window, either from
+            // scratch or by sliding, whichever touches fewer columns
+            uint32_t* seg = kernelFine + (b << fineBits);
+            long u = updatedAt[b];
+            if (c - u >= width / 2 + 1) {
+                for (long f = 0; f < fine; f++) {
+                    seg[f] = 0;
+                }
+                for (long j = c; j < c + width; j++) {
+                    const uint16_t* h = colFine + j * bins + (b << fineBits);
+                    for (long f = 0; f < fine; f++) {
+                        seg[f] += h[f];
+                    }
+                }
+            } else {
+                for (long p = u + 1; p <= c; p++) {
+                    const uint16_t* add = colFine + (p + width - 1) * bins +
+                                          (b << fineBits);
+                    const uint16_t* sub = colFine + (p - 1) * bins + (b << fineBits);
+                    for (long f = 0; f < fine; f++) {
+                        seg[f] += add[f] - sub[f];
+                    }
+                }
+            }
+            updatedAt[b] = c;
+
+            // Find the median within the bucket
+            long f = 0;
+            while (seen + (long) seg[f] <= rank) {
+                seen += seg[f];
+                f++;
+            }
+            dest[c] = (T) (hist->base + (b << fineBits) + f);
+
+            // Slide the coarse window one column right
+            if (c + 1 < cols) {
+                const uint16_t* add = colCoarse + (c + width) * coarseBins;
+                const uint16_t* sub = colCoarse + c * coarseBins;
+                for (long k = 0; k < coarseBins; k++) {
+                    kernelCoarse[k] += add[k] - sub[k];
+                }
+            }
+        }
+
+        // Move the column histograms down a row. With the zero border the
+        // padding columns only ever hold 0s, so they never change.
+        if (row + 1 < end) {
+            long first = border == BORDER_ZERO ? depth : 0;
+            long last = border == BORDER_ZERO ? depth + cols : padded;
+            for (long j = first; j < last; j++) {
+                long leaving = PaddedBin(in, rows, cols, row - depth, j - depth,
+                                         hist->base, border);
+                long entering = PaddedBin(in, rows, cols, row + depth + 1, j - depth,
+                                          hist->base, border);
+                colFine[j * bins + leaving]--;
+                colCoarse[j * coarseBins + (leaving >> fineBits)]--;
+                colFine[j * bins + entering]++;
+                colCoarse[j * coarseBins + (entering >> fineBits)]++;
+            }
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            DirectMedianRows
+ *
+ * DESCRIPTION:     Fallback median kernel for output rows [start, end), used
+ *                  for floating point values and integer ranges too wide for
+ *                  the histograms. Gathers each window and selects its middle.
+ *
+ * PARAMETERS:      T**     :   in          -   the input matrix
+ *                  T**     :   out         -   the output matrix
+ *                  long    :   rows        -   rows in both matrices
+ *                  long    :   cols        -   columns in both matrices
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *                  long    :   start       -   first output row to compute
+ *                  long    :   end         -   one past the last output row
+ *                  T*      :   window      -   scratch space for one window
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void DirectMedianRows (T** in, T** out, long rows, long cols, int depth, int border,
+                       long start, long end, T* window) {
+    long width = 2 * (long) depth + 1;
+    long middle = (width * width - 1) / 2;
+
+    for (long row = start; row < end; row++) {
+        for (long c = 0; c < cols; c++) {
+            long n = 0;
+            bool inside = row - depth >= 0 && row + depth < rows &&
+                          c - depth >= 0 && c + depth < cols;
+
+            if (inside) {
+                for (long r = row - depth; r <= row + depth; r++) {
+                    const T* src = in[r];
+                    for (long k = c - depth; k <= c + depth; k++) {
+                        window[n++] = src[k];
+                    }
+                }
+            } else {
+                for (long r = row - depth; r <= row + depth; r++) {
+                    long sr = BorderIndex(r, rows, border);
+                    for (long k = c - depth; k <= c + depth; k++) {
+                        long sk = BorderIndex(k, cols, border);
+                        window[n++] = sr == -1 || sk == -1 ? (T) 0 : in[sr][sk];
+                    }
+                }
+            }
+            std::nth_element(window, window + middle, window + n);
+            out[row][c] = window[middle];
+        }
+    }
+}
+
+#endif
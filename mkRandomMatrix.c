@@ -0,0 +1,248 @@
+/* makes matrix files of generated values for convolution      */
+/* usage: mkRandomMatrix [options] file rows [cols]             */
+/*   -t type     uint8, int16, int32 (the default), float, double */
+/*   -p pattern  uniform (the default), sparse, constant or     */
+/*               gradient                                       */
+/*   -l low      smallest value, 0 by default                   */
+/*   -h high     largest value, 99 by default                   */
+/*   -d density  fraction of sparse values that are not 0       */
+/*   -s seed     seed for the values, 1 by default              */
+/*   -j threads  threads to generate with, one per cpu by       */
+/*               default                                        */
+/*   -r          write a raw square int32 matrix with no header */
+/* every value is made from the seed and its position alone,    */
+/* so a seed gives the same file whatever the thread count      */
+/* threads fill bands of a few MB and write each with one       */
+/* positioned write, so nothing is shared but the descriptor    */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "matrix.h"
+#include "rng.h"
+
+#define BAND_BYTES (8 << 20)
+
+enum pattern { PATTERN_UNIFORM, PATTERN_SPARSE, PATTERN_CONSTANT,
+               PATTERN_GRADIENT, PATTERNS };
+
+static const char *pattern_names[PATTERNS] =
+  { "uniform", "sparse", "constant", "gradient" };
+
+struct generator {
+  struct matrix_header header;
+  int fd;
+  int pattern;
+  double low;
+  double high;
+  double density;
+  uint64_t seed;
+  uint64_t band;          /* rows per write                     */
+  int threads;
+  int tid;
+  int failed;
+};
+
+/* the value at (r, c), 0 based                                 */
+static inline double value_at(const struct generator *g, uint64_t r, uint64_t c){
+  uint64_t n = r * g->header.cols + c;
+  int integer = g->header.type != MATRIX_FLOAT && g->header.type != MATRIX_DOUBLE;
+  switch(g->pattern){
+  case PATTERN_SPARSE:
+    /* a second stream decides which values are set           */
+    if(rng_unit(~g->seed, n) >= g->density) return 0;
+    /* fall through */
+  case PATTERN_UNIFORM:
+    if(integer)
+      /* multiply and keep the high half rather than divide     */
+      return g->low + (double)(uint64_t)(((unsigned __int128)rng_hash(g->seed, n) *
+                                          (uint64_t)(g->high - g->low + 1)) >> 64);
+    return g->low + rng_unit(g->seed, n) * (g->high - g->low);
+  case PATTERN_GRADIENT: {
+    uint64_t span = g->header.rows + g->header.cols - 2;
+    double v = g->low + (g->high - g->low) * (span ? (double)(r + c) / span : 0);
+    return integer ? floor(v) : v; }
+  default:
+    return g->low;
+  }
+}
+
+#define FILL_BAND(T)                                            \
+  for(uint64_t r = 0; r < count; r++){                          \
+    T *dest = (T *)buffer + r * g->header.cols;                 \
+    for(uint64_t c = 0; c < g->header.cols; c++)                \
+      dest[c] = (T)value_at(g, first + r, c);                   \
+  }
+
+/* fills rows [first, first + count) into a packed buffer       */
+static void fill_band(const struct generator *g, uint64_t first, uint64_t count,
+                      void *buffer){
+  switch(g->header.type){
+  case MATRIX_UINT8:  FILL_BAND(uint8_t);  break;
+  case MATRIX_INT16:  FILL_BAND(int16_t);  break;
+  case MATRIX_INT32:  FILL_BAND(int32_t);  break;
+  case MATRIX_FLOAT:  FILL_BAND(float);    break;
+  case MATRIX_DOUBLE: FILL_BAND(double);   break;
+  }
+}
+
+/* thread tid takes every threads'th band, so the writes of all */
+/* the threads sweep through the file together                  */
+static void *generate(void *arg){
+  struct generator *g = (struct generator *)arg;
+  size_t row_bytes = g->header.cols * matrix_type_size(g->header.type);
+  void *buffer = malloc(g->band * row_bytes);
+  if(buffer == NULL){
+    fprintf(stderr,"out of memory\n");
+    g->failed = 1;
+    return NULL; };
+  for(uint64_t first = g->tid * g->band; first < g->header.rows;
+      first += g->threads * g->band){
+    uint64_t count = g->header.rows - first < g->band ? g->header.rows - first : g->band;
+    fill_band(g, first, count, buffer);
+    if(set_rows(g->fd, &g->header, first + 1, count, buffer) < 0){
+      g->failed = 1;
+      break; };
+  }
+  free(buffer);
+  return NULL;
+}
+
+static void usage(void){
+  fprintf(stderr,"usage: mkRandomMatrix [-t type] [-p pattern] [-l low] [-h high]\n");
+  fprintf(stderr,"         [-d density] [-s seed] [-j threads] [-r] file rows [cols]\n");
+  fprintf(stderr,"  type:    uint8, int16, int32, float or double\n");
+  fprintf(stderr,"  pattern: uniform, sparse, constant or gradient\n");
+  exit(1);
+}
+
+static double elapsed(const struct timespec *start){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+int main(int argc, char **argv){
+  struct generator g;
+  uint32_t type = MATRIX_INT32;
+  int raw = 0;
+  int opt;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  memset(&g, 0, sizeof(g));
+  g.pattern = PATTERN_UNIFORM;
+  g.low = 0;
+  g.high = 99;
+  g.density = 0.01;
+  g.seed = 1;
+  g.threads = cpus > 0 ? (int)cpus : 1;
+
+  while((opt = getopt(argc, argv, "t:p:l:h:d:s:j:r")) != -1){
+    switch(opt){
+    case 't':
+      type = 0;
+      for(uint32_t t = MATRIX_UINT8; t <= MATRIX_DOUBLE; t++)
+        if(strcmp(optarg, matrix_type_name(t)) == 0) type = t;
+      if(type == 0){
+        fprintf(stderr,"unknown type %s\n", optarg);
+        usage(); };
+      break;
+    case 'p':
+      g.pattern = -1;
+      for(int p = 0; p < PATTERNS; p++)
+        if(strcmp(optarg, pattern_names[p]) == 0) g.pattern = p;
+      if(g.pattern == -1){
+        fprintf(stderr,"unknown pattern %s\n", optarg);
+        usage(); };
+      break;
+    case 'l': g.low = atof(optarg); break;
+    case 'h': g.high = atof(optarg); break;
+    case 'd': g.density = atof(optarg); break;
+    case 's': g.seed = strtoull(optarg, NULL, 10); break;
+    case 'j': g.threads = atoi(optarg); break;
+    case 'r': raw = 1; break;
+    default: usage();
+    }
+  }
+  if(argc - optind != 2 && argc - optind != 3) usage();
+
+  const char *file = argv[optind];
+  long long rows = atoll(argv[optind + 1]);
+  long long cols = argc - optind == 3 ? atoll(argv[optind + 2]) : rows;
+  int integer = type != MATRIX_FLOAT && type != MATRIX_DOUBLE;
+  double lowest = type == MATRIX_UINT8 ? 0 : type == MATRIX_INT16 ? -32768 : -2147483648.0;
+  double highest = type == MATRIX_UINT8 ? 255 : type == MATRIX_INT16 ? 32767 : 2147483647.0;
+
+  if(rows <= 0 || cols <= 0){
+    fprintf(stderr,"rows and cols must be positive\n");
+    usage(); }
+  else if(g.threads <= 0){
+    fprintf(stderr,"threads must be positive\n");
+    usage(); }
+  else if(g.high < g.low){
+    fprintf(stderr,"high must not be below low\n");
+    usage(); }
+  else if(integer && (g.low < lowest || g.high > highest ||
+                      g.low != floor(g.low) || g.high != floor(g.high))){
+    fprintf(stderr,"low and high must be %s values\n", matrix_type_name(type));
+    usage(); }
+  else if(raw && (type != MATRIX_INT32 || rows != cols)){
+    fprintf(stderr,"raw matrices are square int32\n");
+    usage(); };
+
+  make_header(&g.header, type, rows, cols);
+  if(raw){
+    /* the headerless layout get_header falls back to           */
+    g.header.data_offset = 0;
+    memset(g.header.magic, 0, sizeof(g.header.magic)); };
+
+  size_t row_bytes = cols * matrix_type_size(type);
+  off_t size = g.header.data_offset + (off_t)rows * (off_t)row_bytes;
+  g.band = BAND_BYTES / row_bytes > 0 ? BAND_BYTES / row_bytes : 1;
+
+  if((g.fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0){
+    perror("open failed");
+    return 1; }
+  else if(ftruncate(g.fd, size) < 0){
+    perror("ftruncate failed");
+    return 1; }
+  else if(!raw && set_header(g.fd, &g.header) < 0){
+    return 1; };
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_t *tids = (pthread_t *)malloc(g.threads * sizeof(pthread_t));
+  struct generator *gens = (struct generator *)malloc(g.threads * sizeof(struct generator));
+  int started = 0;
+  for(int t = 0; t < g.threads; t++){
+    gens[t] = g;
+    gens[t].tid = t;
+    if(pthread_create(&tids[t], NULL, generate, &gens[t]) != 0){
+      fprintf(stderr,"could not start thread %d\n", t);
+      break; };
+    started++;
+  }
+  int failed = started < g.threads;
+  for(int t = 0; t < started; t++){
+    pthread_join(tids[t], NULL);
+    failed |= gens[t].failed;
+  }
+  free(tids);
+  free(gens);
+
+  if(close(g.fd) < 0){
+    perror("close failed");
+    failed = 1; };
+  if(failed) return 1;
+
+  double seconds = elapsed(&start);
+  printf("%s: %lldx%lld %s %s, %.3f GB in %.3fs (%.2f GB/s)\n", file, rows, cols,
+         matrix_type_name(type), pattern_names[g.pattern], size / 1e9, seconds,
+         seconds > 0 ? size / 1e9 / seconds : 0);
+  return 0;
+}
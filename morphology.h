@@ -0,0 +1,201 @@
+/***********************************************************************************
+ * FILENAME:        morphology.h
+ *
+ * DESCRIPTION:     Neighbourhood minimum and maximum (erosion and dilation)
+ *                  kernels using the van Herk/Gil-Werman algorithm. The window
+ *                  is square, so each filter is run as a pass along the rows
+ *                  followed by a pass down the columns.
+ *
+ *                  Each pass cuts the padded line into blocks of 2*depth+1
+ *                  values and takes running extremes forwards (g) and
+ *                  backwards (h) within every block. Any window then covers
+ *                  the tail of one block and the head of the next, so its
+ *                  extreme is op(h[start], g[end]). That is three comparisons
+ *                  per value whatever the depth. As with the mean, neighbours
+ *                  outside the matrix are found by the border mode.
+ ***********************************************************************************/
+
+#ifndef MORPHOLOGY_H
+#define MORPHOLOGY_H
+
+#include "filter.h"     // Used for BorderIndex
+
+// Columns handled at a time by the column pass, so its block buffers stay
+// in cache
+#define MORPHOLOGY_STRIP 256
+
+// Operation used by an erosion
+struct min_op {
+    template <typename T>
+    static inline T Apply (T a, T b) { return b < a ? b : a; }
+};
+
+// Operation used by a dilation
+struct max_op {
+    template <typename T>
+    static inline T Apply (T a, T b) { return b > a ? b : a; }
+};
+
+/***********************************************************************************
+ * NAME:            MorphologyScratch
+ *
+ * DESCRIPTION:     Gets how many values each of the g and h buffers needs for
+ *                  a thread filtering output rows [start, end)
+ *
+ * PARAMETERS:      long    :   cols        -   columns in the matrix
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  long    :   start       -   first output row
+ *                  long    :   end         -   one past the last output row
+ *
+ * RETURNS:         long    - number of values for each buffer
+ **********************************************************************************/
+inline long MorphologyScratch (long cols, int depth, long start, long end) {
+    long width = 2 * (long) depth + 1;
+    long rowPass = (cols + 2 * (long) depth + width - 1) / width * width;
+    long blocks = (end + width - 2) / width - start / width + 1;
+    long colPass = blocks * width * MORPHOLOGY_STRIP;
+
+    return rowPass > colPass ? rowPass : colPass;
+}
+
+/***********************************************************************************
+ * NAME:            MorphologyRows
+ *
+ * DESCRIPTION:     Row pass for output rows [start, end). Padded position p of
+ *                  a row holds column p - depth, so output column c is the
+ *                  extreme of padded positions c..c+2*depth.
+ *
+ * PARAMETERS:      T**     :   in          -   the input matrix
+ *                  T**     :   out         -   the output matrix
+ *                  long    :   cols        -   columns in both matrices
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *                  long    :   start       -   first output row to compute
+ *                  long    :   end         -   one past the last output row
+ *                  T*      :   g           -   scratch for forward extremes
+ *                  T*      :   h           -   scratch for backward extremes
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename Op, typename T>
+void MorphologyRows (T** in, T** out, long cols, int depth, int border, long start,
+                     long end, T* g, T* h) {
+    long width = 2 * (long) depth + 1;
+    long padded = (cols + 2 * (long) depth + width - 1) / width * width;
+
+    for (long row = start; row < end; row++) {
+        const T* src = in[row];
+
+        // Lay the row out in h, copying the interior straight across and
+        // mapping only the border strips either side of it
+        for (long p = 0; p < depth; p++) {
+            long c = BorderIndex(p - depth, cols, border);
+            h[p] = c == -1 ? (T) 0 : src[c];
+        }
+        for (long c = 0; c < cols; c++) {
+            h[c + depth] = src[c];
+        }
+        for (long p = cols + depth; p < padded; p++) {
+            long c = BorderIndex(p - depth, cols, border);
+            h[p] = c == -1 ? (T) 0 : src[c];
+        }
+
+        for (long b = 0; b < padded; b += width) {
+            g[b] = h[b];
+            for (long p = b + 1; p < b + width; p++) {
+                g[p] = Op::Apply(g[p - 1], h[p]);
+            }
+            for (long p = b + width - 2; p >= b; p--) {
+                h[p] = Op::Apply(h[p], h[p + 1]);
+            }
+        }
+
+        T* dest = out[row];
+        for (long c = 0; c < cols; c++) {
+            dest[c] = Op::Apply(h[c], g[c + width - 1]);
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            MorphologyColumns
+ *
+ * DESCRIPTION:     Column pass for output rows [start, end). Padded row p holds
+ *                  row p - depth, so output row r is the extreme of padded
+ *                  rows r..r+2*depth. Blocks are aligned on padded row 0 and
+ *                  only the blocks those windows touch are built. Work goes a
+ *                  strip of columns at a time and every inner loop runs along
+ *                  a row, so it vectorises.
+ *
+ * PARAMETERS:      T**     :   in          -   the input matrix
+ *                  T**     :   out         -   the output matrix
+ *                  long    :   rows        -   rows in both matrices
+ *                  long    :   cols        -   columns in both matrices
+ *                  int     :   depth       -   the neighbourhood depth
+ *                  int     :   border      -   a border_mode
+ *                  long    :   start       -   first output row to compute
+ *                  long    :   end         -   one past the last output row
+ *                  T*      :   g           -   scratch for forward extremes
+ *                  T*      :   h           -   scratch for backward extremes
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename Op, typename T>
+void MorphologyColumns (T** in, T** out, long rows, long cols, int depth, int border,
+                        long start, long end, T* g, T* h) {
+    long width = 2 * (long) depth + 1;
+    long first = start / width * width;
+    long last = ((end + width - 2) / width + 1) * width;
+
+    for (long c0 = 0; c0 < cols; c0 += MORPHOLOGY_STRIP) {
+        long n = cols - c0 < MORPHOLOGY_STRIP ? cols - c0 : MORPHOLOGY_STRIP;
+
+        for (long b = first; b < last; b += width) {
+            for (long p = b; p < b + width; p++) {
+                long r = BorderIndex(p - depth, rows, border);
+                T* gp = g + (p - first) * MORPHOLOGY_STRIP;
+                T* hp = h + (p - first) * MORPHOLOGY_STRIP;
+
+                if (r != -1) {
+                    const T* src = in[r] + c0;
+                    for (long k = 0; k < n; k++) {
+                        hp[k] = src[k];
+                    }
+                } else {
+                    for (long k = 0; k < n; k++) {
+                        hp[k] = 0;
+                    }
+                }
+
+                if (p == b) {
+                    for (long k = 0; k < n; k++) {
+                        gp[k] = hp[k];
+                    }
+                } else {
+                    const T* prev = gp - MORPHOLOGY_STRIP;
+                    for (long k = 0; k < n; k++) {
+                        gp[k] = Op::Apply(prev[k], hp[k]);
+                    }
+                }
+            }
+            for (long p = b + width - 2; p >= b; p--) {
+                T* hp = h + (p - first) * MORPHOLOGY_STRIP;
+                const T* next = hp + MORPHOLOGY_STRIP;
+                for (long k = 0; k < n; k++) {
+                    hp[k] = Op::Apply(hp[k], next[k]);
+                }
+            }
+        }
+
+        for (long r = start; r < end; r++) {
+            const T* hp = h + (r - first) * MORPHOLOGY_STRIP;
+            const T* gp = g + (r + width - 1 - first) * MORPHOLOGY_STRIP;
+            T* dest = out[r] + c0;
+            for (long k = 0; k < n; k++) {
+                dest[k] = Op::Apply(hp[k], gp[k]);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,198 @@
+/***********************************************************************************
+ * FILENAME:        pool.h
+ *
+ * DESCRIPTION:     A pool of worker threads that stay alive between runs, for
+ *                  programs that filter many matrices and shouldn't start a
+ *                  thread per worker each time.
+ *
+ *                  A run hands each of the first count threads one job and
+ *                  waits for them all. Every job of a run is running at once,
+ *                  so jobs may wait for each other on a barrier. One run may
+ *                  use the pool at a time.
+ ***********************************************************************************/
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>    // Threads, mutexes and conditions
+#include <stddef.h>     // Used for size_t
+#include <vector>       // Used for the threads
+
+struct worker_pool;
+
+// What a pool thread needs to find its job
+struct pool_member {
+    worker_pool* pool;
+    int index;
+};
+
+struct worker_pool {
+    int size;                           // Threads in the pool
+    std::vector<pthread_t> tids;
+    std::vector<pool_member> members;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;                // Signalled when a run starts or the pool stops
+    pthread_cond_t done;                // Signalled when a run's last job finishes
+    unsigned long generation;           // Runs started, threads wait for it to change
+    void* (*job)(void*);                // The run's job
+    char* args;                         // The run's first job argument
+    size_t argSize;                     // Bytes between job arguments
+    int count;                          // Threads given a job this run
+    int pending;                        // Jobs of this run still going
+    bool stopping;
+};
+
+/***********************************************************************************
+ * NAME:            PoolThread
+ *
+ * DESCRIPTION:     The body of a pool thread. Waits for each run, does its job
+ *                  if it was given one, and returns when the pool stops.
+ *
+ * PARAMETERS:      void*   :   arguments   -   the thread's pool_member
+ *
+ * RETURNS:         void* - NULL
+ **********************************************************************************/
+inline void* PoolThread (void* arguments) {
+    pool_member* member = (pool_member*) arguments;
+    worker_pool* pool = member->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (!pool->stopping && pool->generation == seen) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen = pool->generation;
+        if (member->index >= pool->count) {
+            continue;
+        }
+
+        void* (*job)(void*) = pool->job;
+        void* arg = pool->args + member->index * pool->argSize;
+        pthread_mutex_unlock(&pool->lock);
+        job(arg);
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            StopPool
+ *
+ * DESCRIPTION:     Stops and joins every thread of a pool. The pool must not
+ *                  be running.
+ *
+ * PARAMETERS:      worker_pool*    :   pool    -   the pool to stop
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void StopPool (worker_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < pool->tids.size(); i++) {
+        pthread_join(pool->tids[i], NULL);
+    }
+    pool->tids.clear();
+    pool->members.clear();
+    pool->size = 0;
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/***********************************************************************************
+ * NAME:            StartPool
+ *
+ * DESCRIPTION:     Starts the threads of a pool
+ *
+ * PARAMETERS:      worker_pool*    :   pool    -   the pool to start
+ *                  int     :   size    -   the number of threads
+ *
+ * RETURNS:         0 on success, -1 if a thread could not be started, in
+ *                  which case the pool is left stopped
+ **********************************************************************************/
+inline int StartPool (worker_pool* pool, int size) {
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pool->generation = 0;
+    pool->job = NULL;
+    pool->args = NULL;
+    pool->argSize = 0;
+    pool->count = 0;
+    pool->pending = 0;
+    pool->stopping = false;
+    pool->size = size;
+
+    // The members must not move once the threads have pointers to them
+    pool->members.resize(size);
+    pool->tids.reserve(size);
+    for (int i = 0; i < size; i++) {
+        pthread_t tid;
+
+        pool->members[i].pool = pool;
+        pool->members[i].index = i;
+        if (pthread_create(&tid, NULL, PoolThread, &pool->members[i])) {
+            StopPool(pool);
+            return -1;
+        }
+        pool->tids.push_back(tid);
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            RunPool
+ *
+ * DESCRIPTION:     Runs job on the first count threads of a pool, thread i
+ *                  with the argument argSize * i bytes past args, and waits
+ *                  for them all to return
+ *
+ * PARAMETERS:      worker_pool*    :   pool    -   the pool to run on
+ *                  void* (*)(void*)    :   job -   what each thread runs
+ *                  void*   :   args        -   the first thread's argument
+ *                  size_t  :   argSize     -   bytes between arguments
+ *                  int     :   count       -   the number of threads to use, no
+ *                                              more than the pool's size
+ *
+ * RETURNS:         0 on success, -1 if the pool is too small
+ **********************************************************************************/
+inline int RunPool (worker_pool* pool, void* (*job)(void*), void* args, size_t argSize,
+                    int count) {
+    if (count > pool->size) {
+        return -1;
+    }
+    if (count <= 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->args = (char*) args;
+    pool->argSize = argSize;
+    pool->count = count;
+    pool->pending = count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+#endif
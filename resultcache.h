@@ -0,0 +1,249 @@
+/***********************************************************************************
+ * FILENAME:        resultcache.h
+ *
+ * DESCRIPTION:     An on-disk cache of filtered matrices, so filtering a
+ *                  matrix that has been filtered the same way before only
+ *                  costs reading the result back.
+ *
+ *                  Results are addressed by their input's content, the hash
+ *                  of its values from hash.h, together with its shape and
+ *                  element type and the filter settings. Each result is a
+ *                  binary matrix file in the cache directory named after its
+ *                  key, with the key in the header's reserved words so a hit
+ *                  is checked against it. The requested engine is part of the
+ *                  key, the thread count is not.
+ *
+ *                  A hit touches the file, and storing a result evicts the
+ *                  files touched longest ago until the directory is within
+ *                  its size cap. Files are written under a temporary name and
+ *                  renamed into place, so processes can share a cache.
+ ***********************************************************************************/
+
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <stdio.h>      // Used for snprintf, rename
+#include <stdlib.h>     // Used for getenv
+#include <stdint.h>     // Fixed width types
+#include <dirent.h>     // Used for listing the cache
+#include <fcntl.h>      // Used for open
+#include <unistd.h>     // Used for close, unlink, getpid
+#include <pthread.h>    // Used for naming temporary files
+#include <sys/stat.h>   // Used for stat, mkdir, futimens
+#include <string>       // Strings
+#include <vector>       // Used for listing the cache
+#include <algorithm>    // Used for sort
+#include "matrix.h"     // Used for the matrix file format
+#include "filter.h"     // Used for filter_settings
+#include "hash.h"       // Used for hashing the key
+#include "matrixfile.h" // Used for writing results
+
+// Size cap of a cache when none is given
+#define RESULT_CACHE_MB 1024
+
+// Where results are cached, an empty dir turns caching off
+struct result_cache {
+    std::string dir;
+    size_t limit;               // Bytes the results may take
+};
+
+// What a result is filed under
+struct result_key {
+    uint64_t content;           // Hash of the input's values
+    uint64_t filter;            // Hash of its shape, type and the filter settings
+};
+
+// A cached file, for eviction
+struct cached_result {
+    std::string path;
+    size_t size;
+    struct timespec used;
+};
+
+/***********************************************************************************
+ * NAME:            DefaultResultCache
+ *
+ * DESCRIPTION:     Gets the cache directory to use when none is given,
+ *                  $CONVOLUTION_CACHE if it is set
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         std::string - the directory, empty for no caching
+ **********************************************************************************/
+inline std::string DefaultResultCache () {
+    const char* dir = getenv("CONVOLUTION_CACHE");
+    return dir != NULL ? dir : "";
+}
+
+/***********************************************************************************
+ * NAME:            MakeResultKey
+ *
+ * DESCRIPTION:     Makes the key of a result from its input's content hash,
+ *                  shape and type and the filter that made it
+ *
+ * PARAMETERS:      uint64_t    :   content -   FinishHash of the input's values
+ *                  uint32_t    :   type    -   the input's matrix_type
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *
+ * RETURNS:         result_key - the key
+ **********************************************************************************/
+inline result_key MakeResultKey (uint64_t content, uint32_t type, long rows, long cols,
+                                 filter_settings settings) {
+    // Hashed field by field, as the struct has padding
+    int64_t fields[7] = { type, rows, cols, settings.mode, settings.depth, settings.border,
+                          settings.engine };
+    double sigma = settings.mode == FILTER_GAUSSIAN ? settings.sigma : 0;
+    content_hash hash;
+    result_key key;
+
+    InitHash(&hash);
+    UpdateHash(&hash, fields, sizeof(fields));
+    UpdateHash(&hash, &sigma, sizeof(sigma));
+    key.content = content;
+    key.filter = FinishHash(&hash);
+    return key;
+}
+
+/***********************************************************************************
+ * NAME:            ResultPath
+ *
+ * DESCRIPTION:     Gets the file a result is cached in
+ *
+ * PARAMETERS:      const result_cache& :   cache   -   the cache
+ *                  const result_key&   :   key     -   the result's key
+ *
+ * RETURNS:         std::string - the path
+ **********************************************************************************/
+inline std::string ResultPath (const result_cache& cache, const result_key& key) {
+    char name[48];
+
+    snprintf(name, sizeof(name), "/%016llx%016llx.m", (unsigned long long) key.content,
+             (unsigned long long) key.filter);
+    return cache.dir + name;
+}
+
+/***********************************************************************************
+ * NAME:            FindResult
+ *
+ * DESCRIPTION:     Opens a cached result, marking it as just used
+ *
+ * PARAMETERS:      const result_cache& :   cache   -   the cache
+ *                  const result_key&   :   key     -   the result's key
+ *                  matrix_header*  :   header  -   variable to store its header
+ *
+ * RETURNS:         int - the open result file, or -1 if it isn't cached
+ **********************************************************************************/
+inline int FindResult (const result_cache& cache, const result_key& key,
+                       matrix_header* header) {
+    if (cache.dir.empty()) {
+        return -1;
+    }
+
+    int fd = open(ResultPath(cache, key).c_str(), O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    if (get_header(fd, header) != 0 || header->reserved[0] != key.content ||
+        header->reserved[1] != key.filter) {
+        close(fd);
+        return -1;
+    }
+
+    futimens(fd, NULL);
+    return fd;
+}
+
+/***********************************************************************************
+ * NAME:            EvictResults
+ *
+ * DESCRIPTION:     Deletes the results used longest ago until the cache is
+ *                  within its size cap
+ *
+ * PARAMETERS:      const result_cache& :   cache   -   the cache
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void EvictResults (const result_cache& cache) {
+    std::vector<cached_result> results;
+    size_t total = 0;
+    DIR* dir = opendir(cache.dir.c_str());
+    struct dirent* entry;
+
+    if (dir == NULL) {
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        std::string name = entry->d_name;
+        struct stat st;
+        cached_result result;
+
+        if (name.size() != 34 || name.compare(32, 2, ".m") != 0) {
+            continue;
+        }
+        result.path = cache.dir + "/" + name;
+        if (stat(result.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        result.size = st.st_size;
+        result.used = st.st_mtim;
+        total += result.size;
+        results.push_back(result);
+    }
+    closedir(dir);
+
+    if (total <= cache.limit) {
+        return;
+    }
+    std::sort(results.begin(), results.end(),
+              [](const cached_result& a, const cached_result& b) {
+                  return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec :
+                                                          a.used.tv_nsec < b.used.tv_nsec;
+              });
+    for (size_t i = 0; i < results.size() && total > cache.limit; i++) {
+        if (unlink(results[i].path.c_str()) == 0) {
+            total -= results[i].size;
+        }
+    }
+}
+
+/***********************************************************************************
+ * NAME:            StoreResult
+ *
+ * DESCRIPTION:     Caches a result, then evicts old ones if the cache has
+ *                  grown past its cap. The cache directory is made if needed.
+ *
+ * PARAMETERS:      const result_cache& :   cache   -   the cache
+ *                  const result_key&   :   key     -   the result's key
+ *                  T**     :   result  -   the filtered matrix
+ *                  long    :   rows    -   the number of rows in the matrix
+ *                  long    :   cols    -   the number of columns in the matrix
+ *
+ * RETURNS:         0 on success, -1 if the result could not be written
+ **********************************************************************************/
+template <typename T>
+int StoreResult (const result_cache& cache, const result_key& key, T** result, long rows,
+                 long cols) {
+    if (cache.dir.empty()) {
+        return 0;
+    }
+
+    char suffix[64];
+    uint64_t reserved[2] = { key.content, key.filter };
+    std::string path = ResultPath(cache, key);
+
+    snprintf(suffix, sizeof(suffix), ".%d.%lx.tmp", (int) getpid(),
+             (unsigned long) pthread_self());
+    mkdir(cache.dir.c_str(), 0755);
+    if (WriteMatrixFile(path + suffix, result, rows, cols, reserved) != 0 ||
+        rename((path + suffix).c_str(), path.c_str()) != 0) {
+        unlink((path + suffix).c_str());
+        return -1;
+    }
+
+    EvictResults(cache);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,28 @@
+/* counter based random numbers                                 */
+/* each value is a pure function of a seed and a counter, so    */
+/* any part of a stream can be made by any thread in any order  */
+/* and still come out the same                                  */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* the splitmix64 finaliser, a bijection on 64 bit values       */
+static inline uint64_t rng_mix(uint64_t z){
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+/* the counter'th value of the stream for seed                  */
+static inline uint64_t rng_hash(uint64_t seed, uint64_t counter){
+  return rng_mix(rng_mix(seed) + (counter + 1) * 0x9E3779B97F4A7C15ULL);
+}
+
+/* the counter'th value of the stream for seed, in [0, 1)       */
+static inline double rng_unit(uint64_t seed, uint64_t counter){
+  return (double)(rng_hash(seed, counter) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#endif
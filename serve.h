@@ -0,0 +1,305 @@
+/***********************************************************************************
+ * FILENAME:        serve.h
+ *
+ * DESCRIPTION:     The protocol between convserver and its clients, over a
+ *                  Unix domain stream socket. A client connects, sends one
+ *                  request line and reads the reply until the server closes
+ *                  the connection.
+ *
+ *                  A request is a line of tab separated words, the matrix
+ *                  file and the depth followed by any of
+ *                      mode=name border=name engine=name sigma=x threads=n
+ *                      output=file
+ *                  with names as for convolution's options. The file must
+ *                  be a binary matrix and is best given as an absolute path,
+ *                  as the server resolves it from its own directory.
+ *
+ *                  The reply starts with a line of tab separated words, either
+ *                      ok rows cols type source seconds
+ *                  where source is loaded, cached or shared (loaded for a
+ *                  request that arrived at the same time) and seconds is the
+ *                  filter time, or
+ *                      error message
+ *                  With output=file the filtered matrix is written there as a
+ *                  binary matrix. Otherwise it follows the ok line as text,
+ *                  one row per line with a tab after every value.
+ ***********************************************************************************/
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <errno.h>      // Used for EINTR
+#include <limits.h>     // Used for INT_MAX
+#include <stdio.h>      // Used for snprintf
+#include <stdlib.h>     // Used for strtol, strtod
+#include <string.h>     // Used for strlen
+#include <unistd.h>     // Used for read, write, close
+#include <sys/socket.h> // Sockets
+#include <sys/un.h>     // Used for sockaddr_un
+#include <string>       // Strings
+#include <vector>       // Used for splitting lines
+#include "filter.h"     // Used for the modes, borders and engines
+#include "gaussian.h"   // Used for GAUSSIAN_MIN_SIGMA
+
+// The longest request line a server reads
+#define SERVE_LINE 4096
+
+// What a client asks the server to do
+struct serve_request {
+    std::string file;
+    filter_settings settings;
+    int threads;            // Workers to use, 0 for all of the server's
+    std::string output;     // Where to write the result, empty to send it back
+};
+
+/***********************************************************************************
+ * NAME:            SplitLine
+ *
+ * DESCRIPTION:     Splits a line into its tab separated words
+ *
+ * PARAMETERS:      const std::string&  :   line    -   the line to split
+ *
+ * RETURNS:         std::vector<std::string> - the words, empty ones included
+ **********************************************************************************/
+inline std::vector<std::string> SplitLine (const std::string& line) {
+    std::vector<std::string> words;
+    size_t pos = 0;
+
+    while (true) {
+        size_t tab = line.find('\t', pos);
+        if (tab == std::string::npos) {
+            words.push_back(line.substr(pos));
+            return words;
+        }
+        words.push_back(line.substr(pos, tab - pos));
+        pos = tab + 1;
+    }
+}
+
+/***********************************************************************************
+ * NAME:            FormatRequest
+ *
+ * DESCRIPTION:     Writes a request as the line a server reads
+ *
+ * PARAMETERS:      const serve_request&    :   request -   the request
+ *
+ * RETURNS:         std::string - the line, newline included
+ **********************************************************************************/
+inline std::string FormatRequest (const serve_request& request) {
+    char numbers[64];
+    std::string line = request.file;
+
+    line += "\t" + std::to_string(request.settings.depth);
+    line += std::string("\tmode=") + FilterModeName(request.settings.mode);
+    line += std::string("\tborder=") + BorderModeName(request.settings.border);
+    line += std::string("\tengine=") + EngineName(request.settings.engine);
+    snprintf(numbers, sizeof(numbers), "\tsigma=%.17g\tthreads=%d", request.settings.sigma,
+             request.threads);
+    line += numbers;
+    if (!request.output.empty()) {
+        line += "\toutput=" + request.output;
+    }
+
+    return line + "\n";
+}
+
+/***********************************************************************************
+ * NAME:            ParseRequest
+ *
+ * DESCRIPTION:     Reads a request line, filling in the same defaults as
+ *                  convolution for anything it leaves out
+ *
+ * PARAMETERS:      const std::string&  :   line    -   the line, without its newline
+ *                  serve_request*  :   request -   variable to store the request
+ *                  std::string*    :   error   -   variable to store what was wrong
+ *
+ * RETURNS:         0 on success, -1 if the line isn't a valid request
+ **********************************************************************************/
+inline int ParseRequest (const std::string& line, serve_request* request,
+                         std::string* error) {
+    std::vector<std::string> words = SplitLine(line);
+    char* end;
+    long number;
+
+    if (words.size() < 2 || words[0].empty()) {
+        *error = "a request needs a file and a depth";
+        return -1;
+    }
+
+    request->file = words[0];
+    // Checked as a long, so a value too big for an int can't wrap round
+    number = strtol(words[1].c_str(), &end, 10);
+    if (*end != '\0' || number <= 0 || number > INT_MAX) {
+        *error = "depth must be an int > 0, not '" + words[1] + "'";
+        return -1;
+    }
+    request->settings.depth = (int) number;
+    request->settings.mode = FILTER_MEAN;
+    request->settings.border = BORDER_ZERO;
+    request->settings.engine = ENGINE_AUTO;
+    request->settings.sigma = request->settings.depth;
+    request->threads = 0;
+    request->output.clear();
+
+    for (size_t i = 2; i < words.size(); i++) {
+        size_t equals = words[i].find('=');
+        std::string key = words[i].substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : words[i].substr(equals + 1);
+        int found = -1;
+
+        if (key == "mode") {
+            found = request->settings.mode = ParseFilterMode(value.c_str());
+        } else if (key == "border") {
+            found = request->settings.border = ParseBorderMode(value.c_str());
+        } else if (key == "engine") {
+            found = request->settings.engine = ParseEngine(value.c_str());
+        } else if (key == "sigma") {
+            request->settings.sigma = strtod(value.c_str(), &end);
+            found = *end == '\0' && request->settings.sigma >= GAUSSIAN_MIN_SIGMA ? 0 : -1;
+        } else if (key == "threads") {
+            number = strtol(value.c_str(), &end, 10);
+            found = *end == '\0' && number >= 0 && number <= INT_MAX ? 0 : -1;
+            request->threads = (int) number;
+        } else if (key == "output") {
+            request->output = value;
+            found = value.empty() ? -1 : 0;
+        } else {
+            *error = "unknown request word '" + words[i] + "'";
+            return -1;
+        }
+
+        if (found == -1) {
+            *error = "bad value for " + key + ", '" + value + "'";
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            ResolveRequestPaths
+ *
+ * DESCRIPTION:     Makes the relative file and output paths of a request read
+ *                  from a manifest relative to the manifest's directory, so
+ *                  the manifest works from any working directory
+ *
+ * PARAMETERS:      serve_request*  :   request -   the request to change
+ *                  const std::string&  :   manifest    -   the manifest it came from
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void ResolveRequestPaths (serve_request* request, const std::string& manifest) {
+    size_t slash = manifest.rfind('/');
+
+    if (slash == std::string::npos) {
+        return;
+    }
+    std::string dir = manifest.substr(0, slash + 1);
+    if (!request->file.empty() && request->file[0] != '/') {
+        request->file = dir + request->file;
+    }
+    if (!request->output.empty() && request->output[0] != '/') {
+        request->output = dir + request->output;
+    }
+}
+
+/***********************************************************************************
+ * NAME:            WriteAll
+ *
+ * DESCRIPTION:     Writes every byte of a buffer to a socket or file
+ *
+ * PARAMETERS:      int     :   fd      -   where to write
+ *                  const char* :   data    -   the bytes to write
+ *                  size_t  :   length  -   the number of bytes
+ *
+ * RETURNS:         0 on success, -1 if the write failed
+ **********************************************************************************/
+inline int WriteAll (int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            ReadLine
+ *
+ * DESCRIPTION:     Reads from a socket up to the end of the first line.
+ *                  Whatever followed the line in the last read is kept.
+ *
+ * PARAMETERS:      int     :   fd      -   where to read
+ *                  std::string*    :   line    -   variable to store the line,
+ *                                                  without its newline
+ *                  std::string*    :   rest    -   variable to store the bytes
+ *                                                  read after the line
+ *
+ * RETURNS:         0 on success, -1 if the connection ended first or the
+ *                  line is longer than SERVE_LINE
+ **********************************************************************************/
+inline int ReadLine (int fd, std::string* line, std::string* rest) {
+    char buffer[512];
+
+    line->clear();
+    while (line->size() <= SERVE_LINE) {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return -1;
+        }
+        line->append(buffer, got);
+
+        size_t newline = line->find('\n');
+        if (newline != std::string::npos) {
+            *rest = line->substr(newline + 1);
+            line->resize(newline);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/***********************************************************************************
+ * NAME:            ConnectServer
+ *
+ * DESCRIPTION:     Connects to a server's socket
+ *
+ * PARAMETERS:      const std::string&  :   path    -   the socket's path
+ *
+ * RETURNS:         int - the connected socket, or -1 if there is no server
+ **********************************************************************************/
+inline int ConnectServer (const std::string& path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if (path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path.c_str());
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+#endif
@@ -0,0 +1,255 @@
+/***********************************************************************************
+ * FILENAME:        shard.h
+ *
+ * DESCRIPTION:     The manifest convshard writes for the shards it cuts a
+ *                  matrix into, and convstitch reads to put their filtered
+ *                  outputs back together.
+ *
+ *                  A shard is a band of rows of the matrix together with the
+ *                  rows its windows reach either side, its halo, so the band
+ *                  comes out of filtering the shard alone just as it would
+ *                  out of filtering the whole matrix. A halo stops at the top
+ *                  or bottom of the matrix, as the shard's border there is
+ *                  the matrix's own, except with a wrapped border, where it
+ *                  comes round from the far side of the matrix.
+ *
+ *                  The manifest is a convbatch manifest, one request line in
+ *                  the format of serve.h per shard, so it can be filtered by
+ *                  one convbatch or split between any number of them, or
+ *                  each line run as convolution --output in its directory.
+ *                  What convstitch needs is kept in comment lines, which
+ *                  convbatch skips:
+ *                      # matrix    rows cols type
+ *                  once at the top, and before each request line
+ *                      # shard     first rows above below
+ *                  giving the band's first row in the matrix, its rows and
+ *                  the halo rows above and below it in the shard. Words are
+ *                  tab separated, and the shards are named relative to the
+ *                  manifest's directory, so it can be moved with them.
+ ***********************************************************************************/
+
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdio.h>      // Used for snprintf
+#include <stdlib.h>     // Used for atol
+#include <fstream>      // Used for reading and writing manifests
+#include <string>       // Strings
+#include <vector>       // Used for the shards
+#include <algorithm>    // Used for sort
+#include "matrix.h"     // Used for the matrix file format
+#include "engine.h"     // Used for GetMatrixWork
+#include "serve.h"      // Used for the request line format
+
+// The manifest's name in the shard directory
+#define SHARD_MANIFEST "manifest"
+
+// One shard and the request that filters it
+struct shard_layout {
+    long first;                 // First row of the band in the matrix
+    long rows;                  // Rows in the band
+    long above;                 // Halo rows before the band in the shard
+    long below;                 // Halo rows after it
+    serve_request request;      // The shard file, the filter and its output
+};
+
+// A matrix cut into shards
+struct shard_plan {
+    long rows;
+    long cols;
+    uint32_t type;
+    std::vector<shard_layout> shards;
+};
+
+/***********************************************************************************
+ * NAME:            ShardReach
+ *
+ * DESCRIPTION:     Gets how many rows away from a band its outputs read, the
+ *                  depth of each pass of the filter added up
+ *
+ * PARAMETERS:      filter_settings :   settings    -   the filter
+ *
+ * RETURNS:         long - the halo rows needed on each side
+ **********************************************************************************/
+inline long ShardReach (filter_settings settings) {
+    bool twoPass = settings.mode == FILTER_OPEN || settings.mode == FILTER_CLOSE;
+    return (twoPass ? 2 : 1) * (long) settings.depth;
+}
+
+/***********************************************************************************
+ * NAME:            PlanShards
+ *
+ * DESCRIPTION:     Cuts a matrix into bands as GetMatrixWork splits rows
+ *                  between threads, and names each band's shard and output,
+ *                  relative to the directory they and the manifest go in
+ *
+ * PARAMETERS:      const matrix_header&    :   header  -   the matrix's header
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   count   -   the number of shards
+ *                  shard_plan* :   plan    -   variable to store the shards
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void PlanShards (const matrix_header& header, filter_settings settings, int count,
+                        shard_plan* plan) {
+    long reach = ShardReach(settings);
+    bool wrap = settings.border == BORDER_WRAP && count > 1;
+
+    plan->rows = header.rows;
+    plan->cols = header.cols;
+    plan->type = header.type;
+    plan->shards.clear();
+
+    for (int i = 0; i < count; i++) {
+        shard_layout shard;
+        long start, end;
+        char name[32];
+
+        GetMatrixWork(plan->rows, count, i, &start, &end);
+        shard.first = start;
+        shard.rows = end - start;
+        shard.above = wrap ? reach : std::min(reach, start);
+        shard.below = wrap ? reach : std::min(reach, plan->rows - end);
+
+        snprintf(name, sizeof(name), "shard-%04d", i);
+        shard.request.file = std::string(name) + ".m";
+        shard.request.output = std::string(name) + ".out.m";
+        shard.request.settings = settings;
+        shard.request.threads = 0;
+        plan->shards.push_back(shard);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            WriteShardManifest
+ *
+ * DESCRIPTION:     Writes the manifest of a matrix's shards
+ *
+ * PARAMETERS:      const std::string&  :   file    -   the manifest to write
+ *                  const shard_plan&   :   plan    -   the shards
+ *                  const std::string&  :   source  -   the matrix they came from
+ *
+ * RETURNS:         0 on success, -1 if the manifest could not be written
+ **********************************************************************************/
+inline int WriteShardManifest (const std::string& file, const shard_plan& plan,
+                               const std::string& source) {
+    std::ofstream out(file.c_str());
+
+    out << "# " << plan.shards.size() << " shards of '" << source << "', for convbatch,";
+    out << " then convstitch" << std::endl;
+    out << "# matrix\t" << plan.rows << "\t" << plan.cols << "\t";
+    out << matrix_type_name(plan.type) << std::endl;
+    for (size_t i = 0; i < plan.shards.size(); i++) {
+        const shard_layout& shard = plan.shards[i];
+        out << "# shard\t" << shard.first << "\t" << shard.rows << "\t" << shard.above;
+        out << "\t" << shard.below << std::endl;
+        out << FormatRequest(shard.request);
+    }
+
+    out.close();
+    return out.fail() ? -1 : 0;
+}
+
+/***********************************************************************************
+ * NAME:            ReadShardManifest
+ *
+ * DESCRIPTION:     Reads the manifest of a matrix's shards, checking that the
+ *                  bands cover the matrix once
+ *
+ * PARAMETERS:      const std::string&  :   file    -   the manifest
+ *                  shard_plan* :   plan    -   variable to store the shards
+ *                  std::string*    :   error   -   variable to store what was wrong
+ *
+ * RETURNS:         0 on success, -1 if the manifest can't be read or is bad
+ **********************************************************************************/
+inline int ReadShardManifest (const std::string& file, shard_plan* plan,
+                              std::string* error) {
+    std::ifstream in(file.c_str());
+    std::string line;
+    shard_layout pending;
+    bool havePending = false;
+    int number = 0;
+
+    plan->rows = -1;
+    plan->shards.clear();
+    if (!in) {
+        *error = "could not open '" + file + "'";
+        return -1;
+    }
+
+    while (getline(in, line)) {
+        std::string prefix = "line " + std::to_string(++number) + ": ";
+
+        if (line.compare(0, 2, "# ") == 0) {
+            std::vector<std::string> words = SplitLine(line.substr(2));
+            if (words[0] == "matrix" && words.size() == 4) {
+                plan->rows = atol(words[1].c_str());
+                plan->cols = atol(words[2].c_str());
+                plan->type = 0;
+                for (uint32_t t = MATRIX_UINT8; t <= MATRIX_DOUBLE; t++) {
+                    plan->type = words[3] == matrix_type_name(t) ? t : plan->type;
+                }
+                if (plan->rows <= 0 || plan->cols <= 0 || plan->type == 0) {
+                    *error = prefix + "bad matrix line";
+                    return -1;
+                }
+            } else if (words[0] == "shard" && words.size() == 5) {
+                pending.first = atol(words[1].c_str());
+                pending.rows = atol(words[2].c_str());
+                pending.above = atol(words[3].c_str());
+                pending.below = atol(words[4].c_str());
+                havePending = true;
+            }
+            continue;
+        }
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        if (!havePending) {
+            *error = prefix + "a request needs a shard line before it";
+            return -1;
+        }
+        if (ParseRequest(line, &pending.request, error) != 0) {
+            *error = prefix + *error;
+            return -1;
+        }
+        if (pending.request.output.empty()) {
+            *error = prefix + "a shard needs an output file";
+            return -1;
+        }
+        ResolveRequestPaths(&pending.request, file);
+        plan->shards.push_back(pending);
+        havePending = false;
+    }
+
+    if (plan->rows == -1) {
+        *error = "no matrix line";
+        return -1;
+    }
+
+    // The bands have to follow on from each other, from the first row to the last
+    std::vector<shard_layout> sorted = plan->shards;
+    long next = 0;
+    std::sort(sorted.begin(), sorted.end(), [](const shard_layout& a,
+                                               const shard_layout& b) {
+        return a.first < b.first;
+    });
+    for (size_t i = 0; i < sorted.size(); i++) {
+        if (sorted[i].first != next || sorted[i].rows <= 0 || sorted[i].above < 0 ||
+            sorted[i].below < 0) {
+            *error = "the shards don't cover row " + std::to_string(next) + " once";
+            return -1;
+        }
+        next += sorted[i].rows;
+    }
+    if (next != plan->rows) {
+        *error = "the shards end at row " + std::to_string(next) + " of " +
+                 std::to_string(plan->rows);
+        return -1;
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,345 @@
+/***********************************************************************************
+ * FILENAME:        stats.h
+ *
+ * DESCRIPTION:     Timing records for --stats. A run is split into phases
+ *                  (reading the header, reading the matrix, tuning for
+ *                  --tune, filtering and printing), each timed by the
+ *                  monotonic wall clock and the process CPU clock. Every
+ *                  worker also times its own band by the wall clock and its
+ *                  thread CPU clock, which shows how evenly GetMatrixWork
+ *                  spread the rows. With --counters each worker also reads
+ *                  the hardware counters in counters.h over its band.
+ *
+ *                  Nothing is recorded unless stats are enabled, and workers
+ *                  only ever write their own worker_stats, so the filter
+ *                  itself takes no locks for them.
+ ***********************************************************************************/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>      // Used for printf
+#include <stddef.h>     // Used for size_t
+#include <time.h>       // Used for clock_gettime
+#include <vector>       // Used for the worker records
+#include "counters.h"   // Used for the hardware counter events
+#include "trace.h"      // Used for tracing the phases
+
+// The phases of a run. STATS_PHASES counts them.
+enum stats_phase { PHASE_HEADER, PHASE_READ, PHASE_TUNE, PHASE_COMPUTE, PHASE_PRINT,
+                   STATS_PHASES };
+
+// Timings of one worker's band
+struct worker_stats {
+    long start;         // First row, or -1 when the worker had no rows
+    long end;           // One past the last row
+    double wall;        // Seconds from the start to the end of the band
+    double cpu;         // Thread CPU seconds over the same span
+    bool counting;      // Whether to read the hardware counters
+    long long counters[COUNTER_EVENTS];     // Counts over the band, -1 if unavailable
+};
+
+// Everything recorded over a run
+struct run_stats {
+    bool enabled;
+    bool json;                      // Print as JSON rather than text
+    bool counters;                  // Read hardware counters in the workers
+    double wall[STATS_PHASES];      // Seconds in each phase
+    double cpu[STATS_PHASES];       // Process CPU seconds in each phase
+    double phaseWall;               // When the current phase began
+    double phaseCpu;
+    long rows;
+    long cols;
+    size_t bytesRead;               // Bytes of the matrix file read
+    size_t bytesWritten;            // Bytes of filtered matrix produced
+    std::vector<worker_stats> workers;
+    trace_log* trace;               // Where to trace the phases, or NULL
+};
+
+/***********************************************************************************
+ * NAME:            MonotonicSeconds
+ *
+ * DESCRIPTION:     Reads the monotonic wall clock
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         double - the time in seconds
+ **********************************************************************************/
+inline double MonotonicSeconds () {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/***********************************************************************************
+ * NAME:            CpuSeconds
+ *
+ * DESCRIPTION:     Reads a CPU time clock
+ *
+ * PARAMETERS:      clockid_t   :   clock   -   CLOCK_PROCESS_CPUTIME_ID or
+ *                                              CLOCK_THREAD_CPUTIME_ID
+ *
+ * RETURNS:         double - the CPU time in seconds
+ **********************************************************************************/
+inline double CpuSeconds (clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+/***********************************************************************************
+ * NAME:            InitStats
+ *
+ * DESCRIPTION:     Clears a run's records
+ *
+ * PARAMETERS:      run_stats*  :   stats   -   the records to clear
+ *                  bool        :   enabled -   whether to record anything
+ *                  bool        :   json    -   whether to print them as JSON
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void InitStats (run_stats* stats, bool enabled, bool json) {
+    stats->enabled = enabled;
+    stats->json = json;
+    stats->counters = false;
+    for (int p = 0; p < STATS_PHASES; p++) {
+        stats->wall[p] = 0;
+        stats->cpu[p] = 0;
+    }
+    stats->phaseWall = 0;
+    stats->phaseCpu = 0;
+    stats->rows = 0;
+    stats->cols = 0;
+    stats->bytesRead = 0;
+    stats->bytesWritten = 0;
+    stats->workers.clear();
+    stats->trace = NULL;
+}
+
+/***********************************************************************************
+ * NAME:            PhaseName
+ *
+ * DESCRIPTION:     Gets the printed name of a phase
+ *
+ * PARAMETERS:      int     :   phase   -   a stats_phase
+ *
+ * RETURNS:         const char* - the name, or "unknown"
+ **********************************************************************************/
+inline const char* PhaseName (int phase) {
+    switch (phase) {
+        case PHASE_HEADER:  return "header";
+        case PHASE_READ:    return "read";
+        case PHASE_TUNE:    return "tune";
+        case PHASE_COMPUTE: return "compute";
+        case PHASE_PRINT:   return "print";
+        default:            return "unknown";
+    }
+}
+
+/***********************************************************************************
+ * NAME:            BeginPhase
+ *
+ * DESCRIPTION:     Notes the start of a phase, when stats or tracing are on
+ *
+ * PARAMETERS:      run_stats*  :   stats   -   the run's records
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void BeginPhase (run_stats* stats) {
+    if (stats->enabled || stats->trace != NULL) {
+        stats->phaseWall = MonotonicSeconds();
+        stats->phaseCpu = CpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            EndPhase
+ *
+ * DESCRIPTION:     Adds the time since BeginPhase to a phase, and traces it
+ *                  as a span of the main thread
+ *
+ * PARAMETERS:      run_stats*  :   stats   -   the run's records
+ *                  int         :   phase   -   a stats_phase
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void EndPhase (run_stats* stats, int phase) {
+    if (stats->enabled) {
+        stats->wall[phase] += MonotonicSeconds() - stats->phaseWall;
+        stats->cpu[phase] += CpuSeconds(CLOCK_PROCESS_CPUTIME_ID) - stats->phaseCpu;
+    }
+    if (stats->trace != NULL) {
+        TraceSpan(&stats->trace->main, PhaseName(phase), stats->phaseWall,
+                  MonotonicSeconds(), -1, -1);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            PrintCounterRow
+ *
+ * DESCRIPTION:     Prints one set of counter values as a row of the text
+ *                  report, with unavailable counters shown as "-"
+ *
+ * PARAMETERS:      const long long*    :   values  -   COUNTER_EVENTS values
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void PrintCounterRow (const long long* values) {
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        if (values[e] == -1) {
+            printf(" %15s", "-");
+        } else {
+            printf(" %15lld", values[e]);
+        }
+    }
+    printf("\n");
+}
+
+/***********************************************************************************
+ * NAME:            PrintCountersJson
+ *
+ * DESCRIPTION:     Prints one set of counter values as a JSON "counters" member,
+ *                  with unavailable counters as null
+ *
+ * PARAMETERS:      const long long*    :   values  -   COUNTER_EVENTS values, or
+ *                                                      NULL if none were read
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void PrintCountersJson (const long long* values) {
+    printf(", \"counters\": {");
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        if (values == NULL || values[e] == -1) {
+            printf("%s\"%s\": null", e ? ", " : "", CounterName(e));
+        } else {
+            printf("%s\"%s\": %lld", e ? ", " : "", CounterName(e), values[e]);
+        }
+    }
+    printf("}");
+}
+
+/***********************************************************************************
+ * NAME:            PrintStats
+ *
+ * DESCRIPTION:     Prints a run's records, as text or as one JSON object.
+ *                  Throughput is worked out over the compute phase, counting
+ *                  one read of the matrix and one write of the result. Load
+ *                  imbalance is the slowest worker's wall time over the mean
+ *                  of the workers that had rows, so 1 is a perfect split.
+ *
+ * PARAMETERS:      const run_stats*    :   stats   -   the run's records
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void PrintStats (const run_stats* stats) {
+    double compute = stats->wall[PHASE_COMPUTE];
+    double cells = (double) stats->rows * stats->cols;
+    double moved = (double) stats->bytesRead + (double) stats->bytesWritten;
+    double cellsPerSec = compute > 0 ? cells / compute : 0;
+    double gbPerSec = compute > 0 ? moved / compute / 1e9 : 0;
+    double slowest = 0, total = 0;
+    int busy = 0;
+
+    for (size_t i = 0; i < stats->workers.size(); i++) {
+        if (stats->workers[i].start != -1) {
+            double wall = stats->workers[i].wall;
+            slowest = wall > slowest ? wall : slowest;
+            total += wall;
+            busy++;
+        }
+    }
+    double imbalance = busy > 0 && total > 0 ? slowest / (total / busy) : 1;
+
+    // Sum each counter over the workers that had rows, -1 if any couldn't
+    // count it
+    long long totals[COUNTER_EVENTS];
+    for (int e = 0; e < COUNTER_EVENTS; e++) {
+        totals[e] = stats->counters && busy > 0 ? 0 : -1;
+        for (size_t i = 0; i < stats->workers.size() && totals[e] != -1; i++) {
+            const worker_stats* w = &stats->workers[i];
+            if (w->start != -1) {
+                totals[e] = w->counters[e] == -1 ? -1 : totals[e] + w->counters[e];
+            }
+        }
+    }
+
+    if (stats->json) {
+        printf("{\"rows\": %ld, \"cols\": %ld, ", stats->rows, stats->cols);
+        printf("\"bytes_read\": %zu, \"bytes_written\": %zu, ", stats->bytesRead,
+               stats->bytesWritten);
+        printf("\"phases\": {");
+        for (int p = 0; p < STATS_PHASES; p++) {
+            printf("%s\"%s\": {\"wall_s\": %.9f, \"cpu_s\": %.9f}", p ? ", " : "",
+                   PhaseName(p), stats->wall[p], stats->cpu[p]);
+        }
+        printf("}, \"workers\": [");
+        for (size_t i = 0; i < stats->workers.size(); i++) {
+            const worker_stats* w = &stats->workers[i];
+            printf("%s{\"tid\": %zu, \"start\": %ld, \"end\": %ld, \"wall_s\": %.9f, "
+                   "\"cpu_s\": %.9f", i ? ", " : "", i, w->start, w->end, w->wall,
+                   w->cpu);
+            if (stats->counters) {
+                PrintCountersJson(w->start != -1 ? w->counters : NULL);
+            }
+            printf("}");
+        }
+        printf("], \"cells_per_s\": %.6e, \"gb_per_s\": %.4f, \"load_imbalance\": %.4f",
+               cellsPerSec, gbPerSec, imbalance);
+        if (stats->counters) {
+            PrintCountersJson(totals);
+        }
+        printf("}\n");
+        return;
+    }
+
+    printf("\nStats for %ldx%ld, %zu bytes read, %zu bytes written\n", stats->rows,
+           stats->cols, stats->bytesRead, stats->bytesWritten);
+    printf("  %-8s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+    for (int p = 0; p < STATS_PHASES; p++) {
+        printf("  %-8s %12.6f %12.6f\n", PhaseName(p), stats->wall[p], stats->cpu[p]);
+    }
+    printf("  %-8s %12s %12s %12s %12s\n", "worker", "start", "end", "wall (s)", "cpu (s)");
+    for (size_t i = 0; i < stats->workers.size(); i++) {
+        const worker_stats* w = &stats->workers[i];
+        if (w->start == -1) {
+            printf("  %-8zu %12s\n", i, "no rows");
+        } else {
+            printf("  %-8zu %12ld %12ld %12.6f %12.6f\n", i, w->start, w->end, w->wall,
+                   w->cpu);
+        }
+    }
+    printf("  %.3e cells/s, %.3f GB/s, load imbalance %.3f\n", cellsPerSec, gbPerSec,
+           imbalance);
+
+    if (stats->counters) {
+        printf("  %-8s", "worker");
+        for (int e = 0; e < COUNTER_EVENTS; e++) {
+            printf(" %15s", CounterName(e));
+        }
+        printf("\n");
+        for (size_t i = 0; i < stats->workers.size(); i++) {
+            if (stats->workers[i].start != -1) {
+                printf("  %-8zu", i);
+                PrintCounterRow(stats->workers[i].counters);
+            }
+        }
+        printf("  %-8s", "total");
+        PrintCounterRow(totals);
+        if (totals[COUNTER_CYCLES] > 0 && totals[COUNTER_INSTRUCTIONS] != -1) {
+            printf("  %.3f instructions per cycle\n",
+                   (double) totals[COUNTER_INSTRUCTIONS] / totals[COUNTER_CYCLES]);
+        }
+        bool missing = false;
+        for (int e = 0; e < COUNTER_EVENTS; e++) {
+            missing = missing || totals[e] == -1;
+        }
+        if (missing) {
+            printf("  Some counters were unavailable, perf_event_paranoid or the\n");
+            printf("  CPU may not allow them\n");
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,66 @@
+#!/bin/sh
+# convbatch has to give the same results as convolution, and running the
+# same manifest again has to take every result from the result cache, byte
+# for byte the same as the first run. Changing any filter parameter has to
+# miss the cache and filter the matrix again.
+
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d /tmp/convtest.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+
+./mkRandomMatrix -s 8 -h 1000 "$dir/a.m" 53 71 > /dev/null 2>&1 || exit 1
+./mkRandomMatrix -s 9 -t uint8 "$dir/b.m" 80 33 > /dev/null 2>&1 || exit 1
+
+# Writes a manifest filtering a.m with the options $1 and b.m with $2, the
+# options split on spaces into the manifest's tab separated fields
+manifest () {
+    printf 'a.m\t2\t%s\toutput=a.out.m\n' "$1" | tr ' ' '\t' > "$dir/manifest"
+    printf 'b.m\t3\t%s\toutput=b.out.m\n' "$2" | tr ' ' '\t' >> "$dir/manifest"
+}
+
+# Runs the manifest, keeping the outputs with the suffix $1
+batch () {
+    ./convbatch --cache "$dir/cache" "$dir/manifest" 2 > "$dir/log.$1" 2>&1 || return 1
+    mv "$dir/a.out.m" "$dir/a.$1.m" && mv "$dir/b.out.m" "$dir/b.$1.m"
+}
+
+manifest mode=median border=wrap
+batch first || echo "FAIL: the first run failed"
+./convolution --quiet --mode median --output "$dir/a.local.m" -- "$dir/a.m" 2 2 > /dev/null
+./convolution --quiet --border wrap --output "$dir/b.local.m" -- "$dir/b.m" 3 2 > /dev/null
+if ! cmp -s "$dir/a.first.m" "$dir/a.local.m" || \
+   ! cmp -s "$dir/b.first.m" "$dir/b.local.m"; then
+    echo "FAIL: convbatch doesn't match convolution"
+    status=1
+fi
+if grep -q " cached" "$dir/log.first"; then
+    echo "FAIL: the first run found results in an empty cache"
+    status=1
+fi
+
+batch second || echo "FAIL: the second run failed"
+if [ "$(grep -c " cached$" "$dir/log.second")" -ne 2 ]; then
+    echo "FAIL: the second run didn't take both results from the cache"
+    status=1
+fi
+if ! cmp -s "$dir/a.first.m" "$dir/a.second.m" || \
+   ! cmp -s "$dir/b.first.m" "$dir/b.second.m"; then
+    echo "FAIL: the cached results differ from the first run's"
+    status=1
+fi
+
+# Each change to a.m's filter has to miss, while b.m's is still cached
+for change in mode=mean "mode=median border=clamp" "mode=median engine=direct" \
+              "mode=gaussian sigma=1.5" "mode=gaussian sigma=2.5"; do
+    manifest "$change" border=wrap
+    batch changed || echo "FAIL: the run with $change failed"
+    if grep "a.m' depth" "$dir/log.changed" | grep -q " cached$" || \
+       ! grep "b.m' depth" "$dir/log.changed" | grep -q " cached$"; then
+        echo "FAIL: $change didn't miss the cache for a.m alone"
+        status=1
+    fi
+done
+
+[ $status -eq 0 ] && echo "PASS: batch_cache"
+exit $status
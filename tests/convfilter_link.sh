@@ -0,0 +1,31 @@
+#!/bin/sh
+# libconvfilter has to be usable from C, linked statically and dynamically.
+# convfilter_smoke.c is built as C99 against each library and run. The static
+# archive holds C++ objects, so it also needs the C++ runtime linked in.
+
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d /tmp/convtest.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+cc=${CC:-cc}
+
+if ! $cc -std=c99 -Wall -pedantic -I. tests/convfilter_smoke.c libconvfilter.a \
+        -lstdc++ -pthread -lm -o "$dir/static"; then
+    echo "FAIL: a C program doesn't link against libconvfilter.a"
+    status=1
+elif ! "$dir/static"; then
+    echo "FAIL: the program linked against libconvfilter.a failed"
+    status=1
+fi
+
+if ! $cc -std=c99 -Wall -pedantic -I. tests/convfilter_smoke.c -L. -lconvfilter \
+        -pthread -o "$dir/shared"; then
+    echo "FAIL: a C program doesn't link against libconvfilter.so"
+    status=1
+elif ! LD_LIBRARY_PATH=. "$dir/shared"; then
+    echo "FAIL: the program linked against libconvfilter.so failed"
+    status=1
+fi
+
+[ $status -eq 0 ] && echo "PASS: convfilter_link"
+exit $status
@@ -0,0 +1,101 @@
+/***********************************************************************************
+ * FILENAME:        convfilter_smoke.c
+ *
+ * DESCRIPTION:     A C caller of libconvfilter, built by convfilter_link.sh
+ *                  against both the static archive and the shared library.
+ *                  It filters a single spike with a mean and a max, each
+ *                  into a padded output, and checks that bad options are
+ *                  refused. Compiled as C99 so nothing C++ can leak into
+ *                  convfilter.h's C half unnoticed.
+ ***********************************************************************************/
+
+#include <stdio.h>
+#include "convfilter.h"
+
+#define ROWS 5
+#define COLS 6
+#define STRIDE 8
+
+/***********************************************************************************
+ * NAME:            Check
+ *
+ * DESCRIPTION:     Filters the spike with mode and checks every value
+ *
+ * PARAMETERS:      int     :   mode    -   a convfilter_mode
+ *                  int32_t :   near    -   the value expected next to the spike
+ *
+ * RETURNS:         int - 0 if the output is right, -1 otherwise
+ **********************************************************************************/
+static int Check (int mode, int32_t near) {
+    struct convfilter_options options;
+    convfilter_plan *plan;
+    int32_t in[ROWS][COLS] = {{0}};
+    int32_t out[ROWS][STRIDE];
+    int status, r, c;
+
+    in[2][3] = 900;
+    for (r = 0; r < ROWS; r++) {
+        for (c = 0; c < STRIDE; c++) {
+            out[r][c] = -1;
+        }
+    }
+
+    convfilter_default_options(&options);
+    options.rows = ROWS;
+    options.cols = COLS;
+    options.mode = mode;
+    options.threads = 2;
+    status = convfilter_plan_create(&options, &plan);
+    if (status != CONVFILTER_OK) {
+        printf("FAIL: making a plan gave %s\n", convfilter_status_name(status));
+        return -1;
+    }
+    status = convfilter_execute(plan, in, 0, out, STRIDE);
+    convfilter_plan_destroy(plan);
+    if (status != CONVFILTER_OK) {
+        printf("FAIL: executing a plan gave %s\n", convfilter_status_name(status));
+        return -1;
+    }
+
+    for (r = 0; r < ROWS; r++) {
+        for (c = 0; c < STRIDE; c++) {
+            int spread = r >= 1 && r <= 3 && c >= 2 && c <= 4;
+            int32_t expected = c >= COLS ? -1 : spread ? near : 0;
+            if (out[r][c] != expected) {
+                printf("FAIL: mode %d gave %d at %d,%d, not %d\n", mode, (int) out[r][c],
+                       r, c, (int) expected);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            main
+ *
+ * DESCRIPTION:     Entrypoint for the program.
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         0 on success, an error status otherwise.
+ **********************************************************************************/
+int main (void) {
+    struct convfilter_options options;
+    convfilter_plan *plan = NULL;
+
+    if (Check(CONVFILTER_MEAN, 100) != 0 || Check(CONVFILTER_MAX, 900) != 0) {
+        return 1;
+    }
+
+    convfilter_default_options(&options);
+    options.rows = ROWS;
+    options.cols = COLS;
+    options.depth = 0;
+    if (convfilter_plan_create(&options, &plan) != CONVFILTER_BAD_OPTIONS) {
+        printf("FAIL: a depth of 0 was not refused\n");
+        convfilter_plan_destroy(plan);
+        return 1;
+    }
+    return 0;
+}
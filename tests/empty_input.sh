@@ -0,0 +1,39 @@
+#!/bin/sh
+# Filtering a matrix with no values has to succeed quietly, or be refused
+# with an error, never crash. A matrix file with a 0 row header and an empty
+# headerless file are run through every mode of convolution and convbatch.
+
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d /tmp/convtest.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+
+# A 0x5 int32 header: magic, version 1, type 3, rows, cols, stride, row
+# major, data at byte 64
+printf 'CONVMTX\000\001\000\000\000\003\000\000\000' > "$dir/rows0.m"
+printf '\000\000\000\000\000\000\000\000\005\000\000\000\000\000\000\000' >> "$dir/rows0.m"
+printf '\005\000\000\000\000\000\000\000\000\000\000\000\100\000\000\000' >> "$dir/rows0.m"
+printf '\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000' >> "$dir/rows0.m"
+: > "$dir/empty.bin"
+
+for file in rows0.m empty.bin; do
+    for mode in mean median min max open close gaussian; do
+        ./convolution --quiet --mode $mode "$dir/$file" 1 3 > /dev/null 2>&1
+        rc=$?
+        if [ $rc -ne 0 ]; then
+            echo "FAIL: convolution --mode $mode $file exited with $rc"
+            status=1
+        fi
+
+        printf '%s\t1\tmode=%s\n' "$dir/$file" $mode > "$dir/manifest"
+        ./convbatch "$dir/manifest" 3 > /dev/null 2>&1
+        rc=$?
+        if [ $rc -gt 1 ] && [ $rc -ne 255 ]; then
+            echo "FAIL: convbatch --mode $mode $file exited with $rc"
+            status=1
+        fi
+    done
+done
+
+[ $status -eq 0 ] && echo "PASS: empty_input"
+exit $status
@@ -0,0 +1,150 @@
+#!/bin/sh
+# The gaussian mode has to stay close to a true Gaussian at every sigma, the
+# small ones run as a direct kernel as well as the larger recursive ones. A
+# random matrix is filtered with each border and compared with a direct
+# separable Gaussian worked out here by awk, out to 6 sigma. The largest
+# difference has to be within a fraction of the matrix's range of values,
+# one a direct kernel meets easily and the wider one gaussian.h documents
+# for the recursive filter. The int32 matrices sit just under 2^31, where a
+# float has nowhere near enough bits, and a constant one has to come back
+# unchanged.
+
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d /tmp/convtest.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+
+# Rows, columns and the largest differences allowed, as a part of the range
+rows=37
+cols=41
+direct=0.001
+recursive=0.02
+
+# Writes a matrix of $1 plus random values below $2 to matrix.txt
+make_matrix () {
+    awk -v rows=$rows -v cols=$cols -v base=$1 -v spread=$2 'BEGIN {
+        srand(7)
+        for (r = 0; r < rows; r++) {
+            line = ""
+            for (c = 0; c < cols; c++) {
+                line = line (c ? " " : "") sprintf("%d", base + int(rand() * spread))
+            }
+            print line
+        }
+    }' > "$dir/matrix.txt"
+}
+
+# Filters matrix.txt as type $1 with sigma $2 and border $3 into filtered.txt
+filter () {
+    ./convolution --quiet --text --type $1 --mode gaussian --sigma $2 --border $3 \
+        "$dir/matrix.txt" 1 3 > "$dir/out.txt" 2>&1 || return 1
+    sed -n '/^Filtered Matrix$/,$p' "$dir/out.txt" | sed 1d > "$dir/filtered.txt"
+}
+
+# Prints the largest difference between filtered.txt and a direct Gaussian of
+# matrix.txt with sigma $1 and border $2, as a part of the matrix's range
+reference_error () {
+    awk -v sigma=$1 -v border=$2 -v rows=$rows -v cols=$cols '
+        function index_of(i, n,    p, m) {
+            if (i >= 0 && i < n) return i
+            if (border == "clamp") return i < 0 ? 0 : n - 1
+            if (border == "reflect") {
+                p = 2 * n
+                m = ((i % p) + p) % p
+                return m < n ? m : p - 1 - m
+            }
+            if (border == "wrap") return ((i % n) + n) % n
+            return -1
+        }
+        NR == FNR {
+            for (c = 1; c <= NF; c++) in_[FNR - 1, c - 1] = $c
+            next
+        }
+        {
+            for (c = 1; c <= NF; c++) got[FNR - 1, c - 1] = $c
+            got_rows = FNR
+        }
+        END {
+            radius = int(6 * sigma) + 1
+            sum = 0
+            for (j = -radius; j <= radius; j++) {
+                w[j] = exp(-j * j / (2 * sigma * sigma))
+                sum += w[j]
+            }
+            lo = hi = in_[0, 0]
+            for (r = 0; r < rows; r++) {
+                for (c = 0; c < cols; c++) {
+                    v = 0
+                    for (j = -radius; j <= radius; j++) {
+                        m = index_of(c + j, cols)
+                        if (m != -1) v += w[j] / sum * in_[r, m]
+                    }
+                    tmp[r, c] = v
+                    lo = in_[r, c] < lo ? in_[r, c] : lo
+                    hi = in_[r, c] > hi ? in_[r, c] : hi
+                }
+            }
+            if (got_rows != rows) {
+                print "missing"
+                exit
+            }
+            worst = 0
+            for (r = 0; r < rows; r++) {
+                for (c = 0; c < cols; c++) {
+                    v = 0
+                    for (j = -radius; j <= radius; j++) {
+                        m = index_of(r + j, rows)
+                        if (m != -1) v += w[j] / sum * tmp[m, c]
+                    }
+                    d = got[r, c] - v
+                    d = d < 0 ? -d : d
+                    worst = d > worst ? d : worst
+                }
+            }
+            printf "%.6f\n", worst / (hi - lo)
+        }' "$dir/matrix.txt" "$dir/filtered.txt"
+}
+
+# A constant matrix has to pass through exactly
+make_matrix 2000000001 1
+for sigma in 1 3; do
+    for border in clamp reflect wrap; do
+        if ! filter int32 $sigma $border || \
+           [ "$(tr -s ' \t' '\n\n' < "$dir/filtered.txt" | sed '/^$/d' | sort -u)" != \
+             2000000001 ]; then
+            echo "FAIL: gaussian sigma $sigma $border changed a constant int32 matrix"
+            status=1
+        fi
+    done
+done
+
+# A step of 2^31 at a zero border dwarfs the range, so int32 leaves it out
+for test in "double 0 zero clamp reflect wrap" "int32 2000000000 clamp reflect wrap"; do
+    set -- $test
+    type=$1
+    make_matrix $2 1000
+    shift 2
+    borders="$*"
+
+    for sigma in 0.5 0.8 1 1.5 1.9 2 2.5 3 4; do
+        tolerance=$(awk -v s=$sigma -v d=$direct -v r=$recursive \
+                        'BEGIN { print s < 2.5 ? d : r }')
+        for border in $borders; do
+            if ! filter $type $sigma $border; then
+                echo "FAIL: gaussian $type sigma $sigma $border did not run"
+                status=1
+                continue
+            fi
+
+            error=$(reference_error $sigma $border)
+            if [ "$error" = "missing" ] || \
+               awk -v e="$error" -v t=$tolerance 'BEGIN { exit !(e > t) }'; then
+                echo "FAIL: gaussian $type sigma $sigma $border is off by $error"
+                status=1
+            fi
+        done
+    done
+done
+
+[ $status -eq 0 ] && echo "PASS: gaussian_accuracy"
+exit $status
@@ -0,0 +1,57 @@
+#!/bin/sh
+# An output refreshed by convpatch has to match filtering the patched matrix
+# whole. The windows here are as tall as a wide matrix or as wide as a tall
+# one, so with a wrapped border every change reaches round the whole of its
+# columns or rows, while its region stays small enough to be refiltered on
+# its own rather than in full. The headers differ only in convpatch's stamp,
+# so just the values after the 64 byte header are compared.
+
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d /tmp/convtest.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+
+for shape in "15 300" "300 15"; do
+    set -- $shape
+    rows=$1
+    cols=$2
+    ./mkRandomMatrix -s 11 -h 1000 "$dir/a.m" $rows $cols > /dev/null 2>&1 || exit 1
+
+    for test in "mean 7" "mean 11" "median 8" "max 9" "open 4" "close 6"; do
+        set -- $test
+        mode=$1
+        depth=$2
+        for border in wrap zero reflect; do
+            cp "$dir/a.m" "$dir/p.m"
+            ./convolution --quiet --mode $mode --border $border --output "$dir/out.m" \
+                -- "$dir/p.m" $depth 2 > /dev/null
+
+            for seed in 1 2; do
+                awk -v seed=$seed -v rows=$rows -v cols=$cols 'BEGIN {
+                    srand(seed)
+                    for (i = 0; i < 3; i++) {
+                        print int(rand() * rows), int(rand() * cols), int(rand() * 1000)
+                    }
+                }' > "$dir/patch.txt"
+                ./convpatch --mode $mode --border $border "$dir/p.m" "$dir/patch.txt" \
+                    "$dir/out.m" $depth 2 > /dev/null
+                if [ $? -ne 0 ]; then
+                    echo "FAIL: convpatch $mode $depth $border exited with an error"
+                    status=1
+                fi
+            done
+
+            ./convolution --quiet --mode $mode --border $border --output "$dir/whole.m" \
+                -- "$dir/p.m" $depth 2 > /dev/null
+            tail -c +65 "$dir/out.m" > "$dir/out.values"
+            tail -c +65 "$dir/whole.m" > "$dir/whole.values"
+            if ! cmp -s "$dir/out.values" "$dir/whole.values"; then
+                echo "FAIL: refreshed ${rows}x$cols $mode $depth $border doesn't match"
+                status=1
+            fi
+        done
+    done
+done
+
+[ $status -eq 0 ] && echo "PASS: incremental_wrap"
+exit $status
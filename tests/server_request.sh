@@ -0,0 +1,58 @@
+#!/bin/sh
+# A convserver has to give the same result as filtering the matrix locally,
+# both written to an --output file and sent back to be printed. A request
+# line with a depth too big for an int has to be refused, not wrapped round.
+
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d /tmp/convtest.XXXXXX) || exit 1
+server=
+trap '[ -n "$server" ] && kill $server; rm -rf "$dir"' EXIT
+status=0
+
+./mkRandomMatrix -s 3 -h 1000 "$dir/a.m" 61 47 > /dev/null 2>&1 || exit 1
+
+./convserver "$dir/socket" 3 > "$dir/server.log" 2>&1 &
+server=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$dir/socket" ] && break
+    sleep 0.2
+done
+if [ ! -S "$dir/socket" ]; then
+    echo "FAIL: convserver did not start"
+    exit 1
+fi
+
+for test in "mean zero" "median clamp" "open wrap" "gaussian reflect"; do
+    set -- $test
+    mode=$1
+    border=$2
+    rm -f "$dir/served.m" "$dir/local.m"
+
+    ./convolution --quiet --mode $mode --border $border --output "$dir/local.m" \
+        -- "$dir/a.m" 2 2 > /dev/null
+    ./convolution --quiet --mode $mode --border $border --server "$dir/socket" \
+        --output "$dir/served.m" -- "$dir/a.m" 2 2 > /dev/null
+    if ! cmp -s "$dir/local.m" "$dir/served.m"; then
+        echo "FAIL: served $mode $border --output doesn't match filtering it locally"
+        status=1
+    fi
+
+    ./convolution --quiet --mode $mode --border $border -- "$dir/a.m" 2 2 | \
+        sed -n '/^Filtered Matrix$/,$p' > "$dir/local.txt"
+    ./convolution --quiet --mode $mode --border $border --server "$dir/socket" \
+        -- "$dir/a.m" 2 2 | sed -n '/^Filtered Matrix$/,$p' > "$dir/served.txt"
+    if [ ! -s "$dir/served.txt" ] || ! cmp -s "$dir/local.txt" "$dir/served.txt"; then
+        echo "FAIL: served $mode $border reply doesn't match filtering it locally"
+        status=1
+    fi
+done
+
+printf '%s\t4294967297\n' "$dir/a.m" > "$dir/manifest"
+if ./convbatch "$dir/manifest" 2 > "$dir/batch.txt" 2>&1 || \
+   ! grep -q "depth must be an int > 0" "$dir/batch.txt"; then
+    echo "FAIL: a depth of 4294967297 was not refused"
+    status=1
+fi
+
+[ $status -eq 0 ] && echo "PASS: server_request"
+exit $status
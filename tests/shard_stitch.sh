@@ -0,0 +1,33 @@
+#!/bin/sh
+# A matrix cut up by convshard, filtered by convbatch and put back together
+# by convstitch has to match filtering it whole, with convbatch and
+# convstitch run from directories other than the one convshard ran in.
+
+cd "$(dirname "$0")/.." || exit 1
+bin=$(pwd)
+dir=$(mktemp -d /tmp/convtest.XXXXXX) || exit 1
+trap 'rm -rf "$dir"' EXIT
+status=0
+
+./mkRandomMatrix -s 5 "$dir/a.m" 97 41 > /dev/null 2>&1 || exit 1
+mkdir "$dir/elsewhere"
+
+for mode in mean median open; do
+    for border in zero reflect wrap; do
+        rm -rf "$dir/shards" "$dir/out.m" "$dir/whole.m"
+        ./convolution --quiet --mode $mode --border $border --output "$dir/whole.m" \
+            "$dir/a.m" 2 2 > /dev/null
+        (cd "$dir" && "$bin/convshard" --mode $mode --border $border a.m 2 5 shards 2) \
+            > /dev/null
+        (cd "$dir/shards" && "$bin/convbatch" manifest 2) > /dev/null 2>&1
+        (cd "$dir/elsewhere" && "$bin/convstitch" ../shards/manifest ../out.m 2) > /dev/null
+
+        if ! cmp -s "$dir/whole.m" "$dir/out.m"; then
+            echo "FAIL: stitched $mode $border shards don't match the whole matrix"
+            status=1
+        fi
+    done
+done
+
+[ $status -eq 0 ] && echo "PASS: shard_stitch"
+exit $status
@@ -0,0 +1,177 @@
+/***********************************************************************************
+ * FILENAME:        trace.h
+ *
+ * DESCRIPTION:     Span recording for --trace. Every thread records into a
+ *                  trace_buffer of its own, allocated up front with a fixed
+ *                  capacity, so recording a span is a bounds check and a store
+ *                  with no locks and no allocation. Spans past the capacity
+ *                  are counted and dropped. The main thread only reads the
+ *                  worker buffers after joining the workers, then writes the
+ *                  lot out in the Chrome trace event format, which loads into
+ *                  chrome://tracing or Perfetto.
+ ***********************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>      // Used for writing the trace file
+#include <vector>       // Used for the worker buffers
+
+// Spans each thread can record before dropping them
+#define TRACE_CAPACITY 4096
+
+// One timed span. first and last are shown as arguments unless -1.
+struct trace_span {
+    const char* name;   // A string literal, never freed
+    double start;       // Monotonic seconds
+    double end;
+    long first;
+    long last;
+};
+
+// The spans of one thread
+struct trace_buffer {
+    std::vector<trace_span> spans;  // Reserved up front, never grown
+    long dropped;                   // Spans that didn't fit
+};
+
+// Every thread's spans over a run
+struct trace_log {
+    double origin;                      // Monotonic seconds of time 0
+    trace_buffer main;                  // Spans of the main thread
+    std::vector<trace_buffer> workers;  // Spans of each worker, by tid
+};
+
+/***********************************************************************************
+ * NAME:            InitTraceBuffer
+ *
+ * DESCRIPTION:     Empties a thread's buffer and reserves its capacity
+ *
+ * PARAMETERS:      trace_buffer*   :   buffer  -   the buffer to set up
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void InitTraceBuffer (trace_buffer* buffer) {
+    buffer->spans.clear();
+    buffer->spans.reserve(TRACE_CAPACITY);
+    buffer->dropped = 0;
+}
+
+/***********************************************************************************
+ * NAME:            InitTraceWorkers
+ *
+ * DESCRIPTION:     Sets up a buffer for each of numThreads workers
+ *
+ * PARAMETERS:      trace_log*  :   log         -   the run's trace
+ *                  int         :   numThreads  -   the number of workers
+ *
+ * RETURNS:         trace_buffer* - the first of the numThreads buffers
+ **********************************************************************************/
+inline trace_buffer* InitTraceWorkers (trace_log* log, int numThreads) {
+    log->workers.resize(numThreads);
+    for (int i = 0; i < numThreads; i++) {
+        InitTraceBuffer(&log->workers[i]);
+    }
+    return numThreads > 0 ? &log->workers[0] : NULL;
+}
+
+/***********************************************************************************
+ * NAME:            TraceSpan
+ *
+ * DESCRIPTION:     Records a span in a thread's own buffer
+ *
+ * PARAMETERS:      trace_buffer*   :   buffer  -   the calling thread's buffer
+ *                  const char*     :   name    -   a string literal naming it
+ *                  double          :   start   -   monotonic start in seconds
+ *                  double          :   end     -   monotonic end in seconds
+ *                  long            :   first   -   first argument, or -1
+ *                  long            :   last    -   second argument, or -1
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void TraceSpan (trace_buffer* buffer, const char* name, double start, double end,
+                       long first, long last) {
+    if (buffer->spans.size() >= TRACE_CAPACITY) {
+        buffer->dropped++;
+        return;
+    }
+    trace_span span = { name, start, end, first, last };
+    buffer->spans.push_back(span);
+}
+
+/***********************************************************************************
+ * NAME:            WriteTraceBuffer
+ *
+ * DESCRIPTION:     Writes one thread's spans as complete ("X") trace events,
+ *                  after a metadata event naming the thread
+ *
+ * PARAMETERS:      FILE*   :   out     -   the trace file
+ *                  const trace_buffer* :   buffer  -   the thread's spans
+ *                  int     :   tid     -   the thread's id in the trace
+ *                  const char*     :   thread  -   the thread's name
+ *                  long    :   number  -   the worker number, or -1 for main
+ *                  double  :   origin  -   monotonic seconds of time 0
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void WriteTraceBuffer (FILE* out, const trace_buffer* buffer, int tid,
+                              const char* thread, long number, double origin) {
+    fprintf(out, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+            "\"args\": {\"name\": \"%s", tid, thread);
+    if (number != -1) {
+        fprintf(out, " %ld", number);
+    }
+    fprintf(out, "\"}}");
+
+    for (size_t i = 0; i < buffer->spans.size(); i++) {
+        const trace_span* s = &buffer->spans[i];
+        fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                "\"ts\": %.3f, \"dur\": %.3f", s->name, tid, (s->start - origin) * 1e6,
+                (s->end - s->start) * 1e6);
+        if (s->first != -1) {
+            fprintf(out, ", \"args\": {\"first\": %ld, \"last\": %ld}", s->first, s->last);
+        }
+        fprintf(out, "}");
+    }
+    if (buffer->dropped > 0) {
+        fprintf(out, ",\n{\"name\": \"dropped %ld spans\", \"ph\": \"i\", \"s\": \"t\", "
+                "\"pid\": 1, \"tid\": %d, \"ts\": 0}", buffer->dropped, tid);
+    }
+}
+
+/***********************************************************************************
+ * NAME:            WriteTrace
+ *
+ * DESCRIPTION:     Writes every thread's spans to a Chrome trace event file
+ *
+ * PARAMETERS:      const trace_log*    :   log     -   the run's trace
+ *                  const char*         :   file    -   the file to write
+ *
+ * RETURNS:         int - 0 on success, -1 if the file couldn't be written
+ **********************************************************************************/
+inline int WriteTrace (const trace_log* log, const char* file) {
+    FILE* out = fopen(file, "w");
+
+    if (out == NULL) {
+        printf("[ERROR] Could not open trace file '%s'\n", file);
+        return -1;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"args\": {\"name\": \"convolution\"}}");
+    WriteTraceBuffer(out, &log->main, 0, "main", -1, log->origin);
+    for (size_t i = 0; i < log->workers.size(); i++) {
+        WriteTraceBuffer(out, &log->workers[i], (int) i + 1, "worker", (long) i,
+                         log->origin);
+    }
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0) {
+        printf("[ERROR] Could not write trace file '%s'\n", file);
+        return -1;
+    }
+    return 0;
+}
+
+#endif
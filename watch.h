@@ -0,0 +1,384 @@
+/***********************************************************************************
+ * FILENAME:        watch.h
+ *
+ * DESCRIPTION:     Keeps a filtered copy of a binary matrix file up to date as
+ *                  the file is rewritten, for convolution's watch mode.
+ *
+ *                  The matrix is kept in memory along with a checksum of each
+ *                  band of WATCH_BAND_BYTES, from hash.h. When the file
+ *                  changes, each band is read straight back over the old
+ *                  values and hashed while still in cache. A band whose
+ *                  checksum differs is marked dirty in an incremental_filter,
+ *                  which refilters only the rows within the depth of it. Only
+ *                  the refiltered rows of the output file are rewritten, in
+ *                  place, so readers of the output never see it missing or
+ *                  with the whole matrix rewritten. A file that changes shape
+ *                  or type is filtered again from scratch.
+ ***********************************************************************************/
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdio.h>      // Used for rename
+#include <string.h>     // Used for memcmp
+#include <fcntl.h>      // Used for open
+#include <unistd.h>     // Used for close
+#include <stdint.h>     // Fixed width types
+#include <string>       // Strings
+#include <vector>       // Used for the checksums
+#include "matrix.h"     // Used for the matrix file format
+#include "engine.h"     // Used for AllocateMatrix and ScanRange
+#include "hash.h"       // Used for the band checksums
+#include "matrixfile.h" // Used for writing the output
+#include "incremental.h" // Used for refiltering changed bands
+
+// Bytes of input under each checksum, at least a row
+#define WATCH_BAND_BYTES (64 << 10)
+
+// A file being watched, of one element type
+template <typename T>
+struct watched_matrix {
+    matrix_header header;
+    long bandRows;                  // Rows under each checksum
+    std::vector<uint64_t> sums;     // Checksum of each band as last read
+    T** matrix;
+    incremental_filter<T> inc;
+};
+
+// A file being watched, of any element type
+struct watched_file {
+    std::string input;
+    std::string output;
+    uint32_t type;                  // matrix_type of the state
+    void* state;                    // Its watched_matrix, NULL until started
+};
+
+/***********************************************************************************
+ * NAME:            ReadBands
+ *
+ * DESCRIPTION:     Reads every band of an open matrix file into a watched
+ *                  matrix, checksumming each one. Bands whose checksum has
+ *                  changed, or that had none yet, are marked dirty and widen
+ *                  the filter's range.
+ *
+ * PARAMETERS:      watched_matrix<T>*  :   watched -   the matrix
+ *                  int     :   fd      -   the open matrix file
+ *
+ * RETURNS:         long - the number of bands changed, or -1 if the file
+ *                         could not be read
+ **********************************************************************************/
+template <typename T>
+long ReadBands (watched_matrix<T>* watched, int fd) {
+    long rows = watched->header.rows;
+    long cols = watched->header.cols;
+    long changed = 0;
+
+    for (long row = 0, band = 0; row < rows; row += watched->bandRows, band++) {
+        long count = rows - row < watched->bandRows ? rows - row : watched->bandRows;
+        size_t values = (size_t) count * cols;
+        content_hash hash;
+        T low = std::numeric_limits<T>::max();
+        T high = std::numeric_limits<T>::lowest();
+
+        if (get_rows(fd, &watched->header, row + 1, count, watched->matrix[row]) != 0) {
+            return -1;
+        }
+        InitHash(&hash);
+        UpdateHash(&hash, watched->matrix[row], values * sizeof(T));
+        uint64_t sum = FinishHash(&hash);
+        if (band < (long) watched->sums.size() && sum == watched->sums[band]) {
+            continue;
+        }
+
+        if (band < (long) watched->sums.size()) {
+            watched->sums[band] = sum;
+        } else {
+            watched->sums.push_back(sum);
+        }
+        ScanRange(watched->matrix[row], values, &low, &high);
+        watched->inc.minValue = (double) low < watched->inc.minValue ? (double) low :
+                                watched->inc.minValue;
+        watched->inc.maxValue = (double) high > watched->inc.maxValue ? (double) high :
+                                watched->inc.maxValue;
+        MarkDirty(&watched->inc, row, 0, row + count, cols);
+        changed++;
+    }
+
+    return changed;
+}
+
+/***********************************************************************************
+ * NAME:            StartWatch
+ *
+ * DESCRIPTION:     Reads a matrix file, filters it in full and writes the
+ *                  output. The output is written under a temporary name and
+ *                  renamed into place.
+ *
+ * PARAMETERS:      watched_matrix<T>*  :   watched -   variable to store the state
+ *                  const watched_file& :   file    -   the input and output files
+ *                  int     :   fd      -   the open input file
+ *                  const matrix_header&    :   header  -   the input's header
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *
+ * RETURNS:         0 on success, -1 if the files could not be read or written
+ **********************************************************************************/
+template <typename T>
+int StartWatch (watched_matrix<T>* watched, const watched_file& file, int fd,
+                const matrix_header& header, filter_settings settings, int numThreads) {
+    long rows = header.rows;
+    long cols = header.cols;
+    size_t rowBytes = cols * sizeof(T);
+
+    watched->header = header;
+    watched->bandRows = rowBytes == 0 || WATCH_BAND_BYTES / rowBytes < 1 ? 1 :
+                        WATCH_BAND_BYTES / rowBytes;
+    watched->sums.clear();
+    watched->matrix = AllocateMatrix<T>(rows, cols);
+
+    // The first read finds the range, the dirty bands it marks are all of
+    // them and are filtered in full below
+    watched->inc.rows = rows;
+    watched->inc.cols = cols;
+    watched->inc.minValue = std::numeric_limits<double>::max();
+    watched->inc.maxValue = -std::numeric_limits<double>::max();
+    watched->inc.output = NULL;
+    if (ReadBands(watched, fd) < 0) {
+        return -1;
+    }
+    if (InitIncremental(&watched->inc, watched->matrix, rows, cols, settings, numThreads,
+                        watched->inc.minValue, watched->inc.maxValue) != 0) {
+        return -1;
+    }
+
+    std::string temporary = file.output + ".tmp";
+    if (WriteMatrixFile(temporary, watched->inc.output, rows, cols) != 0 ||
+        rename(temporary.c_str(), file.output.c_str()) != 0) {
+        unlink(temporary.c_str());
+        return -1;
+    }
+
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            RefreshWatch
+ *
+ * DESCRIPTION:     Rereads a matrix file that has changed, refilters the rows
+ *                  its changed bands reach and rewrites them in the output
+ *
+ * PARAMETERS:      watched_matrix<T>*  :   watched -   the matrix
+ *                  const watched_file& :   file    -   the input and output files
+ *                  int     :   fd      -   the open input file
+ *                  long*   :   bands   -   variable to store the bands changed
+ *                  long*   :   written -   variable to store the rows rewritten
+ *
+ * RETURNS:         0 on success, -1 if the files could not be read or written
+ **********************************************************************************/
+template <typename T>
+int RefreshWatch (watched_matrix<T>* watched, const watched_file& file, int fd,
+                  long* bands, long* written) {
+    std::vector<dirty_rect> changed;
+    matrix_header header;
+    int outFd;
+
+    *written = 0;
+    if ((*bands = ReadBands(watched, fd)) <= 0) {
+        return *bands < 0 ? -1 : 0;
+    }
+    if (RefreshIncremental(&watched->inc, &changed) != 0) {
+        return -1;
+    }
+
+    // Whole rows are rewritten, so overlapping row spans are merged first
+    for (size_t i = 0; i < changed.size(); i++) {
+        changed[i].left = 0;
+        changed[i].right = watched->header.cols;
+    }
+    MergeRects(&changed);
+
+    if ((outFd = open(file.output.c_str(), O_WRONLY)) == -1) {
+        return -1;
+    }
+    make_header(&header, ElementTraits<T>::type, watched->header.rows,
+                watched->header.cols);
+    int status = 0;
+    for (size_t i = 0; i < changed.size() && status == 0; i++) {
+        long count = changed[i].bottom - changed[i].top;
+        status = set_rows(outFd, &header, changed[i].top + 1, count,
+                          watched->inc.output[changed[i].top]);
+        *written += count;
+    }
+    if (close(outFd) != 0) {
+        status = -1;
+    }
+
+    return status;
+}
+
+/***********************************************************************************
+ * NAME:            StopWatch
+ *
+ * DESCRIPTION:     Frees a watched matrix
+ *
+ * PARAMETERS:      watched_matrix<T>*  :   watched -   the matrix
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+template <typename T>
+void StopWatch (watched_matrix<T>* watched) {
+    if (watched->inc.output != NULL) {
+        FreeIncremental(&watched->inc);
+    }
+    CleanupMatrix(watched->matrix, watched->header.rows);
+}
+
+/***********************************************************************************
+ * NAME:            UpdateWatchedMatrix
+ *
+ * DESCRIPTION:     Brings the output of a watched file of element type T up to
+ *                  date, starting it over if it is new or changed shape
+ *
+ * PARAMETERS:      watched_file*   :   file    -   the file
+ *                  int     :   fd      -   the open input file
+ *                  const matrix_header&    :   header  -   the input's header
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *
+ * RETURNS:         0 on success, -1 if the files could not be read or written
+ **********************************************************************************/
+template <typename T>
+int UpdateWatchedMatrix (watched_file* file, int fd, const matrix_header& header,
+                         filter_settings settings, int numThreads) {
+    watched_matrix<T>* watched = (watched_matrix<T>*) file->state;
+    double start = MonotonicSeconds();
+    long bands, written;
+
+    if (watched != NULL && watched->header.rows == header.rows &&
+        watched->header.cols == header.cols) {
+        // The values may have moved within the file, so it is read by its new header
+        watched->header = header;
+        if (RefreshWatch(watched, *file, fd, &bands, &written) != 0) {
+            return -1;
+        }
+        printf("'%s': %ld of %zu bands changed, rewrote %ld rows of '%s' in %.6fs\n",
+               file->input.c_str(), bands, watched->sums.size(), written,
+               file->output.c_str(), MonotonicSeconds() - start);
+        return 0;
+    }
+
+    if (watched != NULL) {
+        StopWatch(watched);
+        delete watched;
+    }
+    watched = new watched_matrix<T>;
+    file->state = watched;
+    if (StartWatch(watched, *file, fd, header, settings, numThreads) != 0) {
+        return -1;
+    }
+    printf("'%s': %ldx%ld %s, filtered into '%s' in %.6fs\n", file->input.c_str(),
+           (long) header.rows, (long) header.cols, matrix_type_name(header.type),
+           file->output.c_str(), MonotonicSeconds() - start);
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            ForgetWatchedFile
+ *
+ * DESCRIPTION:     Frees the state of a watched file
+ *
+ * PARAMETERS:      watched_file*   :   file    -   the file
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void ForgetWatchedFile (watched_file* file) {
+    if (file->state == NULL) {
+        return;
+    }
+
+    switch (file->type) {
+        case MATRIX_UINT8:
+            StopWatch((watched_matrix<uint8_t>*) file->state);
+            delete (watched_matrix<uint8_t>*) file->state;
+            break;
+        case MATRIX_INT16:
+            StopWatch((watched_matrix<int16_t>*) file->state);
+            delete (watched_matrix<int16_t>*) file->state;
+            break;
+        case MATRIX_INT32:
+            StopWatch((watched_matrix<int32_t>*) file->state);
+            delete (watched_matrix<int32_t>*) file->state;
+            break;
+        case MATRIX_FLOAT:
+            StopWatch((watched_matrix<float>*) file->state);
+            delete (watched_matrix<float>*) file->state;
+            break;
+        case MATRIX_DOUBLE:
+            StopWatch((watched_matrix<double>*) file->state);
+            delete (watched_matrix<double>*) file->state;
+            break;
+    }
+    file->state = NULL;
+}
+
+/***********************************************************************************
+ * NAME:            UpdateWatchedFile
+ *
+ * DESCRIPTION:     Brings the output of a watched file up to date after its
+ *                  input has been written. Files that aren't binary matrices
+ *                  with a header are skipped.
+ *
+ * PARAMETERS:      watched_file*   :   file    -   the file
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   numThreads  -   the number of threads to use
+ *
+ * RETURNS:         0 on success, 1 if the file was skipped, -1 if the files
+ *                  could not be read or written
+ **********************************************************************************/
+inline int UpdateWatchedFile (watched_file* file, filter_settings settings,
+                              int numThreads) {
+    matrix_header header;
+    int fd = open(file->input.c_str(), O_RDONLY);
+    int status = 1;
+
+    if (fd == -1 || get_header(fd, &header) != 0 ||
+        memcmp(header.magic, MATRIX_MAGIC, sizeof(MATRIX_MAGIC)) != 0) {
+        if (fd != -1) {
+            close(fd);
+        }
+        ForgetWatchedFile(file);
+        return 1;
+    }
+
+    // A file of a new element type starts over
+    if (header.type != file->type) {
+        ForgetWatchedFile(file);
+        file->type = header.type;
+    }
+    switch (header.type) {
+        case MATRIX_UINT8:
+            status = UpdateWatchedMatrix<uint8_t>(file, fd, header, settings, numThreads);
+            break;
+        case MATRIX_INT16:
+            status = UpdateWatchedMatrix<int16_t>(file, fd, header, settings, numThreads);
+            break;
+        case MATRIX_INT32:
+            status = UpdateWatchedMatrix<int32_t>(file, fd, header, settings, numThreads);
+            break;
+        case MATRIX_FLOAT:
+            status = UpdateWatchedMatrix<float>(file, fd, header, settings, numThreads);
+            break;
+        case MATRIX_DOUBLE:
+            status = UpdateWatchedMatrix<double>(file, fd, header, settings, numThreads);
+            break;
+    }
+    close(fd);
+
+    // A file that failed part way is started over the next time it changes
+    if (status != 0) {
+        ForgetWatchedFile(file);
+    }
+    return status;
+}
+
+#endif
@@ -0,0 +1,374 @@
+/***********************************************************************************
+ * FILENAME:        wisdom.h
+ *
+ * DESCRIPTION:     Autotuning for --tune and the wisdom file it keeps. Tuning
+ *                  times every engine that can run the filter at every thread
+ *                  count up to the one asked for, on the matrix about to be
+ *                  filtered, and remembers the fastest. Later runs of the
+ *                  same problem on the same CPU look the winner up before
+ *                  filtering and use it instead of the defaults.
+ *
+ *                  A problem is the CPU model, element type, filter mode,
+ *                  border mode and depth, with the rows and columns each
+ *                  rounded down to a power of two, so wisdom for one shape
+ *                  also serves shapes close to it.
+ *
+ *                  The wisdom file is text with one problem per line and tab
+ *                  separated fields:
+ *                      cpu type mode border depth rowsClass colsClass
+ *                      engine threads seconds
+ *                  where rowsClass and colsClass are floor(log2) of the rows
+ *                  and columns. Lines starting with '#' are ignored.
+ ***********************************************************************************/
+
+#ifndef WISDOM_H
+#define WISDOM_H
+
+#include <stdio.h>      // Used for reading and writing the wisdom file
+#include <stdlib.h>     // Used for getenv and mkstemp
+#include <string.h>     // Used for strncmp
+#include <unistd.h>     // Used for unlink
+#include <sys/stat.h>   // Used for fchmod
+#include <string>       // Strings
+#include <vector>       // Used for the wisdom entries
+#include "engine.h"     // Used for timing the candidates
+
+// Timed runs of each candidate, the fastest of which is kept
+#define TUNE_REPS 3
+
+// What a run asks of the wisdom file
+struct wisdom_options {
+    std::string file;   // The wisdom file, empty for none
+    bool tune;          // Whether to tune and store the winner
+};
+
+// The problem a wisdom entry is for
+struct wisdom_key {
+    std::string cpu;    // The CPU model name
+    uint32_t type;      // A matrix_type
+    int mode;           // A filter_mode
+    int border;         // A border_mode
+    int depth;
+    int rowsClass;      // floor(log2(rows))
+    int colsClass;      // floor(log2(cols))
+};
+
+// The fastest configuration found for a problem
+struct wisdom_entry {
+    wisdom_key key;
+    int engine;         // A filter_engine
+    int threads;
+    double seconds;     // The time it took when tuned
+};
+
+/***********************************************************************************
+ * NAME:            CpuModel
+ *
+ * DESCRIPTION:     Gets the model name of this machine's CPU
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         std::string - the model name, or "unknown"
+ **********************************************************************************/
+inline std::string CpuModel () {
+    FILE* in = fopen("/proc/cpuinfo", "r");
+    char line[256];
+    std::string model = "unknown";
+
+    if (in == NULL) {
+        return model;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        if (strncmp(line, "model name", 10) == 0 && strchr(line, ':') != NULL) {
+            model = strchr(line, ':') + 1;
+            break;
+        }
+    }
+    fclose(in);
+
+    // Trim the spacing around it, tabs would break the wisdom file
+    size_t first = model.find_first_not_of(" \t");
+    size_t last = model.find_last_not_of(" \t\n");
+    model = first == std::string::npos ? "unknown" : model.substr(first, last - first + 1);
+    for (size_t i = 0; i < model.size(); i++) {
+        model[i] = model[i] == '\t' ? ' ' : model[i];
+    }
+    return model;
+}
+
+/***********************************************************************************
+ * NAME:            DefaultWisdomFile
+ *
+ * DESCRIPTION:     Gets the wisdom file used when none is given: the one named
+ *                  by CONVOLUTION_WISDOM, else .convolution_wisdom in the home
+ *                  directory
+ *
+ * PARAMETERS:      None
+ *
+ * RETURNS:         std::string - the file, or empty if there is no home
+ **********************************************************************************/
+inline std::string DefaultWisdomFile () {
+    const char* file = getenv("CONVOLUTION_WISDOM");
+    const char* home = getenv("HOME");
+
+    if (file != NULL) {
+        return file;
+    }
+    return home != NULL ? std::string(home) + "/.convolution_wisdom" : "";
+}
+
+/***********************************************************************************
+ * NAME:            SizeClass
+ *
+ * DESCRIPTION:     Rounds a dimension down to a power of two
+ *
+ * PARAMETERS:      long    :   n   -   the dimension, at least 1
+ *
+ * RETURNS:         int - floor(log2(n))
+ **********************************************************************************/
+inline int SizeClass (long n) {
+    int size = 0;
+
+    while (n > 1) {
+        n >>= 1;
+        size++;
+    }
+    return size;
+}
+
+/***********************************************************************************
+ * NAME:            MakeWisdomKey
+ *
+ * DESCRIPTION:     Describes the problem of filtering a matrix on this CPU
+ *
+ * PARAMETERS:      uint32_t    :   type    -   the matrix_type filtered
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *
+ * RETURNS:         wisdom_key - the problem
+ **********************************************************************************/
+inline wisdom_key MakeWisdomKey (uint32_t type, long rows, long cols,
+                                 filter_settings settings) {
+    wisdom_key key;
+
+    key.cpu = CpuModel();
+    key.type = type;
+    key.mode = settings.mode;
+    key.border = settings.border;
+    key.depth = settings.depth;
+    key.rowsClass = SizeClass(rows);
+    key.colsClass = SizeClass(cols);
+    return key;
+}
+
+/***********************************************************************************
+ * NAME:            SameProblem
+ *
+ * DESCRIPTION:     Checks two keys describe the same problem
+ *
+ * PARAMETERS:      const wisdom_key&   :   a   -   one key
+ *                  const wisdom_key&   :   b   -   the other
+ *
+ * RETURNS:         bool - true if they match in every field
+ **********************************************************************************/
+inline bool SameProblem (const wisdom_key& a, const wisdom_key& b) {
+    return a.cpu == b.cpu && a.type == b.type && a.mode == b.mode &&
+           a.border == b.border && a.depth == b.depth && a.rowsClass == b.rowsClass &&
+           a.colsClass == b.colsClass;
+}
+
+/***********************************************************************************
+ * NAME:            ReadWisdom
+ *
+ * DESCRIPTION:     Reads every entry of a wisdom file. Lines that don't parse
+ *                  are skipped, so a damaged file only loses those entries.
+ *
+ * PARAMETERS:      const std::string&  :   file    -   the wisdom file
+ *                  std::vector<wisdom_entry>*  :   entries -   where to put them
+ *
+ * RETURNS:         int - the number of entries, 0 if the file doesn't exist
+ **********************************************************************************/
+inline int ReadWisdom (const std::string& file, std::vector<wisdom_entry>* entries) {
+    FILE* in = fopen(file.c_str(), "r");
+    char line[512];
+
+    entries->clear();
+    if (in == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char* tab = strchr(line, '\t');
+        wisdom_entry e;
+
+        if (line[0] == '#' || tab == NULL) {
+            continue;
+        }
+        e.key.cpu.assign(line, tab - line);
+        if (sscanf(tab + 1, "%u %d %d %d %d %d %d %d %lf", &e.key.type, &e.key.mode,
+                   &e.key.border, &e.key.depth, &e.key.rowsClass, &e.key.colsClass,
+                   &e.engine, &e.threads, &e.seconds) != 9 ||
+            e.engine < 0 || e.engine >= FILTER_ENGINES || e.threads <= 0) {
+            continue;
+        }
+        entries->push_back(e);
+    }
+    fclose(in);
+    return (int) entries->size();
+}
+
+/***********************************************************************************
+ * NAME:            WriteWisdom
+ *
+ * DESCRIPTION:     Replaces a wisdom file with some entries. They are written
+ *                  to a temporary file of a unique name next to it first and
+ *                  renamed over it, so a reader never sees half a file and
+ *                  two runs writing at once don't write into each other's.
+ *
+ * PARAMETERS:      const std::string&  :   file    -   the wisdom file
+ *                  const std::vector<wisdom_entry>&    :   entries -   the entries
+ *
+ * RETURNS:         int - 0 on success, -1 if the file couldn't be written
+ **********************************************************************************/
+inline int WriteWisdom (const std::string& file, const std::vector<wisdom_entry>& entries) {
+    std::string temporary = file + ".XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    FILE* out = fd == -1 || fchmod(fd, 0644) != 0 ? NULL : fdopen(fd, "w");
+
+    if (out == NULL) {
+        printf("[ERROR] Could not open a temporary file for wisdom file '%s'\n",
+               file.c_str());
+        if (fd != -1) {
+            close(fd);
+            unlink(temporary.c_str());
+        }
+        return -1;
+    }
+
+    fprintf(out, "# convolution wisdom: cpu type mode border depth rowsClass colsClass "
+            "engine threads seconds\n");
+    for (size_t i = 0; i < entries.size(); i++) {
+        const wisdom_entry* e = &entries[i];
+        fprintf(out, "%s\t%u\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%.9f\n", e->key.cpu.c_str(),
+                e->key.type, e->key.mode, e->key.border, e->key.depth, e->key.rowsClass,
+                e->key.colsClass, e->engine, e->threads, e->seconds);
+    }
+
+    if (fclose(out) != 0 || rename(temporary.c_str(), file.c_str()) != 0) {
+        printf("[ERROR] Could not write wisdom file '%s'\n", file.c_str());
+        unlink(temporary.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/***********************************************************************************
+ * NAME:            FindWisdom
+ *
+ * DESCRIPTION:     Finds the entry for a problem
+ *
+ * PARAMETERS:      const std::vector<wisdom_entry>&    :   entries -   the entries
+ *                  const wisdom_key&   :   key     -   the problem
+ *
+ * RETURNS:         const wisdom_entry* - the entry, or NULL if there is none
+ **********************************************************************************/
+inline const wisdom_entry* FindWisdom (const std::vector<wisdom_entry>& entries,
+                                       const wisdom_key& key) {
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (SameProblem(entries[i].key, key)) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+/***********************************************************************************
+ * NAME:            StoreWisdom
+ *
+ * DESCRIPTION:     Adds an entry, replacing any for the same problem
+ *
+ * PARAMETERS:      std::vector<wisdom_entry>*  :   entries -   the entries
+ *                  const wisdom_entry& :   entry   -   the entry to add
+ *
+ * RETURNS:         Void
+ **********************************************************************************/
+inline void StoreWisdom (std::vector<wisdom_entry>* entries, const wisdom_entry& entry) {
+    for (size_t i = 0; i < entries->size(); i++) {
+        if (SameProblem((*entries)[i].key, entry.key)) {
+            (*entries)[i] = entry;
+            return;
+        }
+    }
+    entries->push_back(entry);
+}
+
+/***********************************************************************************
+ * NAME:            TuneFilter
+ *
+ * DESCRIPTION:     Times the filter over a matrix with every engine that can
+ *                  run it and 1, 2, 4, ... up to maxThreads threads, each
+ *                  with a workspace set up before the clock starts. Each
+ *                  candidate is run once to warm up and then TUNE_REPS times,
+ *                  keeping its fastest run. When settings names an engine
+ *                  only the thread count is tuned.
+ *
+ * PARAMETERS:      T**     :   matrix      -   the matrix to filter
+ *                  long    :   rows        -   the number of rows in the matrix
+ *                  long    :   cols        -   the number of columns in the matrix
+ *                  filter_settings :   settings    -   the filter to run
+ *                  int     :   maxThreads  -   the most threads to try
+ *                  double  :   minValue    -   the smallest value in the matrix
+ *                  double  :   maxValue    -   the largest value in the matrix
+ *                  wisdom_entry*   :   best    -   where to store the winner;
+ *                                                  its key is left alone
+ *
+ * RETURNS:         int - 0 on success, -1 if a thread could not be started
+ **********************************************************************************/
+template <typename T>
+int TuneFilter (T** matrix, long rows, long cols, filter_settings settings, int maxThreads,
+                double minValue, double maxValue, wisdom_entry* best) {
+    T** result = AllocateMatrix<T>(rows, cols);
+    int status = 0;
+
+    best->seconds = -1;
+    for (int engine = ENGINE_DIRECT; engine < FILTER_ENGINES && status == 0; engine++) {
+        if ((settings.engine != ENGINE_AUTO && engine != settings.engine) ||
+            !EngineApplies(engine, settings.mode)) {
+            continue;
+        }
+
+        for (int threads = 1; status == 0; threads *= 2) {
+            threads = threads > maxThreads ? maxThreads : threads;
+
+            filter_settings candidate = settings;
+            candidate.engine = engine;
+            filter_workspace<T> ws;
+            InitWorkspace(&ws, rows, cols, candidate, threads, minValue, maxValue);
+
+            double fastest = -1;
+            for (int rep = 0; rep <= TUNE_REPS && status == 0; rep++) {
+                double start = MonotonicSeconds();
+                status = FilterWithWorkspace(&ws, matrix, result, NULL, NULL, NULL);
+                double seconds = MonotonicSeconds() - start;
+                if (rep > 0 && (fastest < 0 || seconds < fastest)) {
+                    fastest = seconds;
+                }
+            }
+            FreeWorkspace(&ws);
+
+            if (status == 0 && (best->seconds < 0 || fastest < best->seconds)) {
+                best->engine = engine;
+                best->threads = threads;
+                best->seconds = fastest;
+            }
+            if (threads == maxThreads) {
+                break;
+            }
+        }
+    }
+
+    CleanupMatrix(result, rows);
+    return status;
+}
+
+#endif